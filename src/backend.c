@@ -0,0 +1,311 @@
+/**
+ * @file backend.c
+ *
+ * Implementation of the compute backends of the matrix library.
+ *
+ * The cpu backend calls the CBLAS library which the system is
+ * linked with, such as the reference BLAS, OpenBLAS or MKL (see
+ * BLAS in the Makefile). The number of threads of OpenBLAS and
+ * MKL can be set at runtime.
+ *
+ * The cuda backend, which is compiled with CUDA=yes, computes
+ * large products with cuBLAS and small products on the CPU. The
+ * matrices of the library are in host memory, so the operands of
+ * each product are copied to device buffers, which are kept
+ * between products so that they are only allocated when a product
+ * is larger than every previous product. The products are
+ * serialized on a single cuBLAS handle.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cblas.h>
+#ifdef USE_CUDA
+#include <cublas_v2.h>
+#include <cuda_runtime.h>
+#endif
+#include "backend.h"
+
+#ifdef PRECISION_FLOAT
+#define cblas_xgemm cblas_sgemm
+#define cblas_xsyrk cblas_ssyrk
+#define cublas_xgemm cublasSgemm
+#define cublas_xsyrk cublasSsyrk
+#else
+#define cblas_xgemm cblas_dgemm
+#define cblas_xsyrk cblas_dsyrk
+#define cublas_xgemm cublasDgemm
+#define cublas_xsyrk cublasDsyrk
+#endif
+
+typedef struct {
+	const char *name;
+	int (*init)(void);
+	void (*gemm)(int trans_A, int trans_B, int m, int n, int k,
+		precision_t alpha, const precision_t *A, int lda, const precision_t *B, int ldb,
+		precision_t beta, precision_t *C, int ldc);
+	void (*syrk)(int trans_A, int n, int k,
+		precision_t alpha, const precision_t *A, int lda,
+		precision_t beta, precision_t *C, int ldc);
+} backend_t;
+
+static void cpu_gemm(int trans_A, int trans_B, int m, int n, int k,
+	precision_t alpha, const precision_t *A, int lda, const precision_t *B, int ldb,
+	precision_t beta, precision_t *C, int ldc)
+{
+	cblas_xgemm(CblasColMajor,
+		trans_A ? CblasTrans : CblasNoTrans,
+		trans_B ? CblasTrans : CblasNoTrans,
+		m, n, k,
+		alpha, A, lda, B, ldb,
+		beta, C, ldc);
+}
+
+static void cpu_syrk(int trans_A, int n, int k,
+	precision_t alpha, const precision_t *A, int lda,
+	precision_t beta, precision_t *C, int ldc)
+{
+	cblas_xsyrk(CblasColMajor, CblasLower,
+		trans_A ? CblasTrans : CblasNoTrans,
+		n, k,
+		alpha, A, lda,
+		beta, C, ldc);
+}
+
+#ifdef USE_CUDA
+/**
+ * Minimum number of multiply-adds of a product on the GPU. Smaller
+ * products take less time on the CPU than the transfers would.
+ */
+#define CUDA_MIN_MADDS (1 << 24)
+
+typedef struct {
+	void *data;
+	size_t size;
+} cuda_buffer_t;
+
+static cublasHandle_t cuda_handle;
+static pthread_mutex_t cuda_lock = PTHREAD_MUTEX_INITIALIZER;
+static cuda_buffer_t cuda_buffers[3];
+
+static void cuda_check(cudaError_t error, const char *name)
+{
+	if ( error != cudaSuccess ) {
+		fprintf(stderr, "error: %s: %s\n", name, cudaGetErrorString(error));
+		exit(1);
+	}
+}
+
+static void cublas_check(cublasStatus_t status, const char *name)
+{
+	if ( status != CUBLAS_STATUS_SUCCESS ) {
+		fprintf(stderr, "error: %s failed with status %d\n", name, (int)status);
+		exit(1);
+	}
+}
+
+static int cuda_init(void)
+{
+	int num_devices;
+
+	if ( cudaGetDeviceCount(&num_devices) != cudaSuccess || num_devices == 0 ) {
+		return -1;
+	}
+
+	if ( cublasCreate(&cuda_handle) != CUBLAS_STATUS_SUCCESS ) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Get a device buffer of at least num elements.
+ *
+ * @param i    index of buffer
+ * @param num  number of elements
+ * @return pointer to device memory
+ */
+static precision_t * cuda_buffer(int i, size_t num)
+{
+	cuda_buffer_t *buffer = &cuda_buffers[i];
+	size_t size = num * sizeof(precision_t);
+
+	if ( buffer->size < size ) {
+		cuda_check(cudaFree(buffer->data), "cudaFree");
+		cuda_check(cudaMalloc(&buffer->data, size), "cudaMalloc");
+		buffer->size = size;
+	}
+
+	return (precision_t *)buffer->data;
+}
+
+/**
+ * Copy a host matrix to a device buffer.
+ *
+ * @param i     index of buffer
+ * @param M     pointer to host matrix
+ * @param rows  number of rows
+ * @param cols  number of columns
+ * @param ld    leading dimension of M
+ * @return pointer to device matrix, with leading dimension rows
+ */
+static precision_t * cuda_upload(int i, const precision_t *M, int rows, int cols, int ld)
+{
+	precision_t *d_M = cuda_buffer(i, (size_t)rows * cols);
+
+	cublas_check(cublasSetMatrix(rows, cols, sizeof(precision_t), M, ld, d_M, rows), "cublasSetMatrix");
+
+	return d_M;
+}
+
+static void cuda_gemm(int trans_A, int trans_B, int m, int n, int k,
+	precision_t alpha, const precision_t *A, int lda, const precision_t *B, int ldb,
+	precision_t beta, precision_t *C, int ldc)
+{
+	if ( (double)m * n * k < CUDA_MIN_MADDS ) {
+		cpu_gemm(trans_A, trans_B, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc);
+		return;
+	}
+
+	int rows_A = trans_A ? k : m;
+	int rows_B = trans_B ? n : k;
+
+	pthread_mutex_lock(&cuda_lock);
+
+	precision_t *d_A = cuda_upload(0, A, rows_A, trans_A ? m : k, lda);
+	precision_t *d_B = cuda_upload(1, B, rows_B, trans_B ? k : n, ldb);
+	precision_t *d_C = (beta != 0)
+		? cuda_upload(2, C, m, n, ldc)
+		: cuda_buffer(2, (size_t)m * n);
+
+	cublas_check(cublas_xgemm(cuda_handle,
+		trans_A ? CUBLAS_OP_T : CUBLAS_OP_N,
+		trans_B ? CUBLAS_OP_T : CUBLAS_OP_N,
+		m, n, k,
+		&alpha, d_A, rows_A, d_B, rows_B,
+		&beta, d_C, m), "cublas gemm");
+
+	cublas_check(cublasGetMatrix(m, n, sizeof(precision_t), d_C, m, C, ldc), "cublasGetMatrix");
+
+	pthread_mutex_unlock(&cuda_lock);
+}
+
+static void cuda_syrk(int trans_A, int n, int k,
+	precision_t alpha, const precision_t *A, int lda,
+	precision_t beta, precision_t *C, int ldc)
+{
+	if ( (double)n * n * k / 2 < CUDA_MIN_MADDS ) {
+		cpu_syrk(trans_A, n, k, alpha, A, lda, beta, C, ldc);
+		return;
+	}
+
+	int rows_A = trans_A ? k : n;
+
+	pthread_mutex_lock(&cuda_lock);
+
+	precision_t *d_A = cuda_upload(0, A, rows_A, trans_A ? n : k, lda);
+	precision_t *d_C = (beta != 0)
+		? cuda_upload(2, C, n, n, ldc)
+		: cuda_buffer(2, (size_t)n * n);
+
+	cublas_check(cublas_xsyrk(cuda_handle, CUBLAS_FILL_MODE_LOWER,
+		trans_A ? CUBLAS_OP_T : CUBLAS_OP_N,
+		n, k,
+		&alpha, d_A, rows_A,
+		&beta, d_C, n), "cublas syrk");
+
+	cublas_check(cublasGetMatrix(n, n, sizeof(precision_t), d_C, n, C, ldc), "cublasGetMatrix");
+
+	pthread_mutex_unlock(&cuda_lock);
+}
+#endif
+
+static const backend_t BACKENDS[] = {
+	{ "cpu", NULL, cpu_gemm, cpu_syrk },
+#ifdef USE_CUDA
+	{ "cuda", cuda_init, cuda_gemm, cuda_syrk },
+#endif
+};
+
+static const backend_t *backend = &BACKENDS[0];
+
+/**
+ * Select the backend of the matrix library. The backend should
+ * be selected before any other matrix function is called.
+ *
+ * @param name  name of backend (cpu, or cuda if it is compiled)
+ * @return 0 on success, or -1 if the backend is unknown or
+ *         cannot be initialized
+ */
+int m_backend_select (const char *name)
+{
+	int i;
+	for ( i = 0; i < (int)(sizeof(BACKENDS) / sizeof(BACKENDS[0])); i++ ) {
+		if ( strcmp(BACKENDS[i].name, name) == 0 ) {
+			if ( BACKENDS[i].init != NULL && BACKENDS[i].init() != 0 ) {
+				return -1;
+			}
+
+			backend = &BACKENDS[i];
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Get the name of the selected backend.
+ *
+ * @return name of backend
+ */
+const char * m_backend_name (void)
+{
+	return backend->name;
+}
+
+/**
+ * Set the number of threads of the BLAS library, if it is a
+ * library whose number of threads can be set at runtime.
+ *
+ * @param num_threads  number of threads
+ * @return 0 on success, or -1 if the BLAS library has no such setting
+ */
+int m_backend_set_threads (int num_threads)
+{
+	const char *FUNCS[] = {
+		"openblas_set_num_threads",
+		"MKL_Set_Num_Threads"
+	};
+
+	int i;
+	for ( i = 0; i < (int)(sizeof(FUNCS) / sizeof(FUNCS[0])); i++ ) {
+		void (*set_num_threads)(int) = (void (*)(int))dlsym(RTLD_DEFAULT, FUNCS[i]);
+
+		if ( set_num_threads != NULL ) {
+			set_num_threads(num_threads);
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+void backend_gemm(int trans_A, int trans_B, int m, int n, int k,
+	precision_t alpha, const precision_t *A, int lda, const precision_t *B, int ldb,
+	precision_t beta, precision_t *C, int ldc)
+{
+	backend->gemm(trans_A, trans_B, m, n, k, alpha, A, lda, B, ldb, beta, C, ldc);
+}
+
+void backend_syrk(int trans_A, int n, int k,
+	precision_t alpha, const precision_t *A, int lda,
+	precision_t beta, precision_t *C, int ldc)
+{
+	backend->syrk(trans_A, n, k, alpha, A, lda, beta, C, ldc);
+}
@@ -0,0 +1,24 @@
+/**
+ * @file backend.h
+ *
+ * Interface definitions for the compute backends of the matrix
+ * library.
+ *
+ * The matrix library computes its matrix products through the
+ * selected backend. Each function takes column-major operands in
+ * the convention of BLAS, where op(M) is M' if the transpose flag
+ * for M is set and M otherwise.
+ */
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include "matrix.h"
+
+void backend_gemm(int trans_A, int trans_B, int m, int n, int k,
+	precision_t alpha, const precision_t *A, int lda, const precision_t *B, int ldb,
+	precision_t beta, precision_t *C, int ldc);
+void backend_syrk(int trans_A, int n, int k,
+	precision_t alpha, const precision_t *A, int lda,
+	precision_t beta, precision_t *C, int ldc);
+
+#endif
@@ -0,0 +1,681 @@
+/**
+ * @file benchmark.c
+ *
+ * Benchmark suite for the face recognition system.
+ *
+ * Each benchmark runs on synthetic data and prints one line of
+ * JSON with the percentiles of its running time and the number
+ * of items processed per second, so that the results of two
+ * builds can be compared with a script. Messages printed by the
+ * library during a benchmark are discarded.
+ */
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "database.h"
+#include "image.h"
+
+typedef struct {
+	int width;
+	int height;
+	int gallery;
+	int classes;
+	int threads;
+	int reps;
+	const char *filter;
+	FILE *output;
+} bench_config_t;
+
+typedef void (*bench_run_t)(void *arg);
+
+typedef void (*bench_func_t)(bench_config_t *config);
+
+/**
+ * Get the current time in seconds.
+ *
+ * @return time in seconds
+ */
+double bench_time()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Compare two times for qsort().
+ */
+int bench_compare(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Get a percentile of a sorted list of times by the
+ * nearest-rank method.
+ *
+ * @param times  pointer to sorted times
+ * @param n      number of times
+ * @param p      percentile between 0 and 100
+ * @return percentile
+ */
+double bench_percentile(double *times, int n, double p)
+{
+	int k = (int)ceil(p / 100 * n) - 1;
+
+	return times[(k > 0) ? k : 0];
+}
+
+/**
+ * Run a benchmark once to warm up and then config->reps times,
+ * and print the results.
+ *
+ * @param config  pointer to configuration
+ * @param name    name of benchmark
+ * @param size    description of problem size
+ * @param items   number of items processed by each run
+ * @param run     function to benchmark
+ * @param arg     argument of run
+ */
+void bench_run(bench_config_t *config, const char *name, const char *size, double items, bench_run_t run, void *arg)
+{
+	double *times = (double *)malloc(config->reps * sizeof(double));
+	double total = 0;
+
+	run(arg);
+
+	int i;
+	for ( i = 0; i < config->reps; i++ ) {
+		double start = bench_time();
+		run(arg);
+		times[i] = bench_time() - start;
+		total += times[i];
+	}
+
+	qsort(times, config->reps, sizeof(double), bench_compare);
+
+	double mean = total / config->reps;
+
+	fprintf(config->output,
+		"{\"name\": \"%s\", \"size\": \"%s\", \"backend\": \"%s\", \"threads\": %d, \"reps\": %d, "
+		"\"mean_ms\": %.6f, \"min_ms\": %.6f, \"p50_ms\": %.6f, \"p90_ms\": %.6f, \"p99_ms\": %.6f, "
+		"\"items_per_sec\": %.3f}\n",
+		name, size, m_backend_name(), config->threads, config->reps,
+		1e3 * mean, 1e3 * times[0],
+		1e3 * bench_percentile(times, config->reps, 50),
+		1e3 * bench_percentile(times, config->reps, 90),
+		1e3 * bench_percentile(times, config->reps, 99),
+		items / mean);
+	fflush(config->output);
+
+	free(times);
+}
+
+/**
+ * Get whether a benchmark is selected by the filter.
+ *
+ * @param config  pointer to configuration
+ * @param name    name of benchmark
+ * @return 1 if benchmark should run, 0 otherwise
+ */
+int bench_selected(bench_config_t *config, const char *name)
+{
+	return config->filter == NULL || strstr(name, config->filter) != NULL;
+}
+
+/**
+ * Construct a matrix of uniform random numbers in [-1, 1].
+ *
+ * @param rows
+ * @param cols
+ * @return pointer to new matrix
+ */
+matrix_t * bench_random(int rows, int cols)
+{
+	matrix_t *M = m_initialize(rows, cols);
+
+	size_t i;
+	for ( i = 0; i < (size_t)rows * cols; i++ ) {
+		M->data[i] = 2.0 * rand() / RAND_MAX - 1;
+	}
+
+	return M;
+}
+
+/**
+ * Get the class of a synthetic image. The images of each
+ * class are contiguous, as required by LDA.
+ *
+ * @param config  pointer to configuration
+ * @param j       index of image
+ * @return class of image j
+ */
+int bench_class(bench_config_t *config, int j)
+{
+	return (long)j * config->classes / config->gallery;
+}
+
+/**
+ * Construct a matrix of synthetic mean-subtracted images, in
+ * which each class is a random face plus noise.
+ *
+ * @param config  pointer to configuration
+ * @return pointer to new image matrix
+ */
+matrix_t * bench_images(bench_config_t *config)
+{
+	int m = config->width * config->height;
+	matrix_t *C = bench_random(m, config->classes);
+	matrix_t *X = bench_random(m, config->gallery);
+
+	int i, j;
+	for ( j = 0; j < X->cols; j++ ) {
+		for ( i = 0; i < m; i++ ) {
+			elem(X, i, j) = 100 * elem(C, i, bench_class(config, j)) + 10 * elem(X, i, j);
+		}
+	}
+
+	matrix_t *mean = m_mean_column(X);
+	m_subtract_columns(X, mean);
+
+	m_free(C);
+	m_free(mean);
+
+	return X;
+}
+
+/**
+ * Construct the image entries of the synthetic images.
+ *
+ * @param config  pointer to configuration
+ * @return pointer to list of entries
+ */
+database_entry_t * bench_entries(bench_config_t *config)
+{
+	database_entry_t *entries = (database_entry_t *)malloc(config->gallery * sizeof(database_entry_t));
+
+	int j;
+	for ( j = 0; j < config->gallery; j++ ) {
+		entries[j].class = bench_class(config, j);
+		entries[j].name = "synthetic";
+	}
+
+	return entries;
+}
+
+typedef struct {
+	matrix_t *A;
+	matrix_t *B;
+	matrix_t *C;
+	int i;
+} bench_matrix_args_t;
+
+void run_m_product(void *arg)
+{
+	bench_matrix_args_t *args = (bench_matrix_args_t *)arg;
+
+	m_free(m_product(args->A, args->B));
+}
+
+void run_m_covariance(void *arg)
+{
+	bench_matrix_args_t *args = (bench_matrix_args_t *)arg;
+
+	m_free(m_covariance(args->A));
+}
+
+void run_m_sqrtm(void *arg)
+{
+	bench_matrix_args_t *args = (bench_matrix_args_t *)arg;
+
+	m_free(m_sqrtm(args->C));
+}
+
+void run_m_eigen(void *arg)
+{
+	bench_matrix_args_t *args = (bench_matrix_args_t *)arg;
+	matrix_t *M_eval = m_initialize(args->C->rows, 1);
+	matrix_t *M_evec = m_initialize(args->C->rows, args->C->cols);
+
+	m_eigen(args->C, M_eval, M_evec);
+
+	m_free(M_eval);
+	m_free(M_evec);
+}
+
+void run_m_eigen_sym(void *arg)
+{
+	bench_matrix_args_t *args = (bench_matrix_args_t *)arg;
+	matrix_t *M_eval = m_initialize(args->C->rows, 1);
+	matrix_t *M_evec = m_initialize(args->C->rows, args->C->cols);
+
+	m_eigen_sym(args->C, M_eval, M_evec);
+
+	m_free(M_eval);
+	m_free(M_evec);
+}
+
+void run_m_dist_L2(void *arg)
+{
+	bench_matrix_args_t *args = (bench_matrix_args_t *)arg;
+	volatile precision_t sum = 0;
+
+	int j;
+	for ( j = 0; j < args->A->cols; j++ ) {
+		sum += m_dist_L2(args->B, 0, args->A, j);
+	}
+}
+
+void run_m_dist_COS(void *arg)
+{
+	bench_matrix_args_t *args = (bench_matrix_args_t *)arg;
+	volatile precision_t sum = 0;
+
+	int j;
+	for ( j = 0; j < args->A->cols; j++ ) {
+		sum += m_dist_COS(args->B, 0, args->A, j);
+	}
+}
+
+/**
+ * Benchmark the matrix library with n-by-n matrices, where
+ * n is the gallery size.
+ *
+ * @param config  pointer to configuration
+ */
+void bench_matrix(bench_config_t *config)
+{
+	int n = config->gallery;
+	char size[64];
+
+	bench_matrix_args_t args;
+	args.A = bench_random(n, n);
+	args.B = bench_random(n, n);
+	args.C = m_covariance(args.A);
+
+	sprintf(size, "%dx%d", n, n);
+
+	if ( bench_selected(config, "m_product") ) {
+		bench_run(config, "m_product", size, 2.0 * n * n * n, run_m_product, &args);
+	}
+	if ( bench_selected(config, "m_covariance") ) {
+		bench_run(config, "m_covariance", size, 1, run_m_covariance, &args);
+	}
+	if ( bench_selected(config, "m_sqrtm") ) {
+		bench_run(config, "m_sqrtm", size, 1, run_m_sqrtm, &args);
+	}
+	if ( bench_selected(config, "m_eigen") ) {
+		bench_run(config, "m_eigen", size, 1, run_m_eigen, &args);
+	}
+	if ( bench_selected(config, "m_eigen_sym") ) {
+		bench_run(config, "m_eigen_sym", size, 1, run_m_eigen_sym, &args);
+	}
+	if ( bench_selected(config, "m_dist_L2") ) {
+		bench_run(config, "m_dist_L2", size, n, run_m_dist_L2, &args);
+	}
+	if ( bench_selected(config, "m_dist_COS") ) {
+		bench_run(config, "m_dist_COS", size, n, run_m_dist_COS, &args);
+	}
+
+	m_free(args.A);
+	m_free(args.B);
+	m_free(args.C);
+}
+
+typedef struct {
+	database_t *db;
+	matrix_t *T;
+	db_match_t *matches;
+} bench_nn_args_t;
+
+void run_nearest_neighbor(void *arg)
+{
+	bench_nn_args_t *args = (bench_nn_args_t *)arg;
+
+	db_recognize_block(args->db, args->T, args->matches, NULL, NULL);
+}
+
+/**
+ * Benchmark the nearest-neighbor search of a block of test
+ * images against a PCA gallery, with exact search, batch mode,
+ * a cascaded search over a quarter of the components, and the
+ * HNSW index.
+ *
+ * @param config  pointer to configuration
+ */
+void bench_nearest_neighbor(bench_config_t *config)
+{
+	int m = config->width * config->height;
+	int n = config->gallery;
+	int d = (n - 1 < m) ? n - 1 : m;
+	int num_test = config->threads;
+	char size[64];
+
+	database_t *db = db_construct(0, 0);
+	db->num_images = n;
+	db->num_classes = config->classes;
+	db->num_dimensions = m;
+	db->entries = bench_entries(config);
+	db->mean_face = m_zeros(m, 1);
+	db->W_pca_tr = bench_random(d, m);
+	db->P_pca = bench_random(d, n);
+	db->P_pca_norm = m_norm_columns(db->P_pca);
+	db->num_threads = config->threads;
+	db_fuse_projections(db);
+
+	bench_nn_args_t args;
+	args.db = db;
+	args.T = bench_random(m, num_test);
+	args.matches = (db_match_t *)malloc(num_test * sizeof(db_match_t));
+
+	sprintf(size, "%dx%d", d, n);
+
+	if ( bench_selected(config, "nearest_neighbor") ) {
+		bench_run(config, "nearest_neighbor", size, num_test, run_nearest_neighbor, &args);
+	}
+
+	if ( bench_selected(config, "nearest_neighbor_batch") ) {
+		db->batch_size = num_test;
+		bench_run(config, "nearest_neighbor_batch", size, num_test, run_nearest_neighbor, &args);
+		db->batch_size = 1;
+	}
+
+	if ( bench_selected(config, "nearest_neighbor_cascade") ) {
+		db->cascade = 32;
+		db->cascade_dims = (d + 3) / 4;
+		bench_run(config, "nearest_neighbor_cascade", size, num_test, run_nearest_neighbor, &args);
+		db->cascade = 0;
+		db->cascade_dims = 0;
+	}
+
+	if ( bench_selected(config, "nearest_neighbor_ann") ) {
+		db->H_pca = hnsw_build(db->P_pca, db->P_pca_norm, DIST_L2, HNSW_DEFAULT_M, HNSW_DEFAULT_EF_CONSTRUCTION);
+		bench_run(config, "nearest_neighbor_ann", size, num_test, run_nearest_neighbor, &args);
+	}
+
+	m_free(args.T);
+	free(args.matches);
+	free(db->entries);
+	db->entries = NULL;
+	db->num_images = 0;
+	db_destruct(db);
+}
+
+typedef struct {
+	matrix_t *X;
+	matrix_t *W;
+	sep96_workspace_t *ws;
+} bench_sep96_args_t;
+
+void run_sep96(void *arg)
+{
+	bench_sep96_args_t *args = (bench_sep96_args_t *)arg;
+
+	sep96(args->X, args->W, 50, 0.0001, args->X->cols, args->ws);
+}
+
+typedef struct {
+	bench_config_t *config;
+	matrix_t *X;
+	database_entry_t *entries;
+	matrix_t *W_pca_tr;
+	matrix_t *P_pca;
+	ica_params_t ica_params;
+} bench_train_args_t;
+
+void run_PCA(void *arg)
+{
+	bench_train_args_t *args = (bench_train_args_t *)arg;
+
+	m_free(PCA(args->X, 0, 0));
+}
+
+void run_LDA(void *arg)
+{
+	bench_train_args_t *args = (bench_train_args_t *)arg;
+
+	m_free(LDA(args->W_pca_tr, args->P_pca, args->config->classes, args->entries, args->config->threads, NULL));
+}
+
+void run_ICA2(void *arg)
+{
+	bench_train_args_t *args = (bench_train_args_t *)arg;
+
+	m_free(ICA2(args->W_pca_tr, args->P_pca, &args->ica_params, NULL));
+}
+
+/**
+ * Benchmark one sweep of sep96 and the training of PCA, LDA and
+ * ICA2 on a gallery of synthetic images. ICA2 runs a fixed
+ * number of sweeps so that its running time does not depend on
+ * convergence.
+ *
+ * @param config  pointer to configuration
+ */
+void bench_train(bench_config_t *config)
+{
+	int m = config->width * config->height;
+	int n = config->gallery;
+	char size[64];
+
+	bench_train_args_t args;
+	args.config = config;
+	args.X = bench_images(config);
+	args.entries = bench_entries(config);
+	args.W_pca_tr = PCA(args.X, 0, 0);
+	args.P_pca = m_product(args.W_pca_tr, args.X);
+	args.ica_params.engine = ICA_ENGINE_INFOMAX;
+	args.ica_params.tolerance = 0;
+	args.ica_params.max_sweeps = 10;
+	args.ica_params.num_threads = config->threads;
+	args.ica_params.progress = NULL;
+
+	if ( bench_selected(config, "sep96") ) {
+		bench_sep96_args_t sep96_args;
+		sep96_args.X = bench_random(args.P_pca->rows, n);
+		sep96_args.W = m_identity(args.P_pca->rows);
+		sep96_args.ws = sep96_workspace_alloc(args.P_pca->rows, 50);
+
+		sprintf(size, "%dx%d", args.P_pca->rows, n);
+		bench_run(config, "sep96", size, n, run_sep96, &sep96_args);
+
+		m_free(sep96_args.X);
+		m_free(sep96_args.W);
+		sep96_workspace_free(sep96_args.ws);
+	}
+
+	sprintf(size, "%dx%d", m, n);
+
+	if ( bench_selected(config, "PCA") ) {
+		bench_run(config, "PCA", size, n, run_PCA, &args);
+	}
+	if ( bench_selected(config, "LDA") ) {
+		bench_run(config, "LDA", size, n, run_LDA, &args);
+	}
+	if ( bench_selected(config, "ICA2") ) {
+		sprintf(size, "%dx%d/%d", m, n, args.ica_params.max_sweeps);
+		bench_run(config, "ICA2", size, n, run_ICA2, &args);
+	}
+
+	m_free(args.X);
+	m_free(args.W_pca_tr);
+	m_free(args.P_pca);
+	free(args.entries);
+}
+
+typedef struct {
+	const char *path;
+	image_t *image;
+} bench_image_args_t;
+
+void run_image_read(void *arg)
+{
+	bench_image_args_t *args = (bench_image_args_t *)arg;
+
+	image_read(args->image, args->path);
+}
+
+/**
+ * Benchmark reading a PGM image.
+ *
+ * @param config  pointer to configuration
+ */
+void bench_image(bench_config_t *config)
+{
+	if ( !bench_selected(config, "image_read") ) {
+		return;
+	}
+
+	char path[] = "/tmp/face-rec-bench-XXXXXX";
+	int fd = mkstemp(path);
+
+	if ( fd == -1 ) {
+		perror("mkstemp");
+		exit(1);
+	}
+	close(fd);
+
+	image_t *image = image_construct();
+	image->channels = 1;
+	image->width = config->width;
+	image->height = config->height;
+	image->max_value = 255;
+	image->pixels = (unsigned char *)malloc(image->width * image->height);
+
+	int i;
+	for ( i = 0; i < image->width * image->height; i++ ) {
+		image->pixels[i] = rand() % 256;
+	}
+
+	image_write(image, path);
+
+	char size[64];
+	sprintf(size, "%dx%d", config->width, config->height);
+
+	bench_image_args_t args = { path, image };
+	bench_run(config, "image_read", size, 1, run_image_read, &args);
+
+	image_destruct(image);
+	unlink(path);
+}
+
+void print_usage()
+{
+	fprintf(stderr,
+		"Usage: ./benchmark [options]\n"
+		"Options:\n"
+		"  --width W        width of synthetic images (default 32)\n"
+		"  --height H       height of synthetic images (default 32)\n"
+		"  --gallery N      number of gallery images (default 400)\n"
+		"  --classes C      number of classes (default 40)\n"
+		"  --threads N      use N threads\n"
+		"  --backend NAME   compute matrix products with NAME (cpu, cuda)\n"
+		"  --reps R         time R runs of each benchmark (default 10)\n"
+		"  --filter NAME    run the benchmarks whose names contain NAME\n"
+	);
+}
+
+int main(int argc, char **argv)
+{
+	bench_config_t config = {
+		.width = 32,
+		.height = 32,
+		.gallery = 400,
+		.classes = 40,
+		.threads = 1,
+		.reps = 10,
+		.filter = NULL,
+		.output = NULL
+	};
+
+	struct option long_options[] = {
+		{ "width", required_argument, 0, 'W' },
+		{ "height", required_argument, 0, 'H' },
+		{ "gallery", required_argument, 0, 'n' },
+		{ "classes", required_argument, 0, 'c' },
+		{ "threads", required_argument, 0, 't' },
+		{ "reps", required_argument, 0, 'r' },
+		{ "filter", required_argument, 0, 'f' },
+		{ "backend", required_argument, 0, 'b' },
+		{ 0, 0, 0, 0 }
+	};
+
+	int opt;
+	while ( (opt = getopt_long_only(argc, argv, "", long_options, NULL)) != -1 ) {
+		switch ( opt ) {
+		case 'W':
+			config.width = atoi(optarg);
+			break;
+		case 'H':
+			config.height = atoi(optarg);
+			break;
+		case 'n':
+			config.gallery = atoi(optarg);
+			break;
+		case 'c':
+			config.classes = atoi(optarg);
+			break;
+		case 't':
+			config.threads = atoi(optarg);
+			break;
+		case 'r':
+			config.reps = atoi(optarg);
+			break;
+		case 'f':
+			config.filter = optarg;
+			break;
+		case 'b':
+			if ( m_backend_select(optarg) != 0 ) {
+				fprintf(stderr, "error: backend \'%s\' is not available\n", optarg);
+				exit(1);
+			}
+			break;
+		case '?':
+			print_usage();
+			exit(1);
+		}
+	}
+
+	if ( config.width < 1 || config.height < 1 || config.reps < 1 || config.threads < 1
+	  || config.classes < 1 || config.gallery < 2 * config.classes ) {
+		fprintf(stderr, "error: invalid benchmark configuration\n");
+		exit(1);
+	}
+
+	// write the results to the original stdout, and discard
+	// the messages of the library
+	fflush(stdout);
+	config.output = fdopen(dup(STDOUT_FILENO), "w");
+
+	if ( config.output == NULL || freopen("/dev/null", "w", stdout) == NULL ) {
+		perror("freopen");
+		exit(1);
+	}
+
+	srand(1);
+
+	bench_func_t benchmarks[] = {
+		bench_matrix,
+		bench_nearest_neighbor,
+		bench_train,
+		bench_image
+	};
+	int num_benchmarks = sizeof(benchmarks) / sizeof(bench_func_t);
+
+	int i;
+	for ( i = 0; i < num_benchmarks; i++ ) {
+		benchmarks[i](&config);
+	}
+
+	fclose(config.output);
+
+	return 0;
+}
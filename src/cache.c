@@ -0,0 +1,280 @@
+/**
+ * @file cache.c
+ *
+ * Implementation of the training cache.
+ *
+ * The training cache stores the mean-subtracted image matrix,
+ * the mean face and the PCA representation of a training set in
+ * a directory, so that training the same set again, for example
+ * with LDA after PCA or with other ICA parameters, reads them
+ * instead of decoding the images and computing PCA. Each entry
+ * is a file in the database file format, whose name is a hash of
+ * the training images, their sizes and modification times, and
+ * the parameters which determine the entry, so that an entry is
+ * never reused after an image or a parameter has changed.
+ *
+ * The cache directory also stores the ICA checkpoints of each
+ * training set (see infomax() in ica.c), whose names add the ICA
+ * parameters to the hash.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "database.h"
+
+/**
+ * Version of the cache entries, which is part of each hash so
+ * that a change to the entries invalidates the previous ones.
+ */
+#define CACHE_VERSION 1
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/**
+ * Section ids of a cache entry.
+ */
+typedef enum {
+	CACHE_MEAN_FACE = 1,
+	CACHE_W_PCA = 2,
+	CACHE_P_PCA = 3,
+	CACHE_X = 4
+} cache_section_t;
+
+/**
+ * Add a value to a hash with the 64-bit FNV-1a hash function.
+ *
+ * @param hash  hash value
+ * @param data  pointer to value
+ * @param size  size of value in bytes
+ * @return new hash value
+ */
+uint64_t cache_hash(uint64_t hash, const void *data, size_t size)
+{
+	const unsigned char *bytes = (const unsigned char *)data;
+
+	size_t i;
+	for ( i = 0; i < size; i++ ) {
+		hash ^= bytes[i];
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+/**
+ * Compute the hash of the training set of a database, which
+ * covers the name, size and modification time of each image,
+ * the preprocessing and PCA parameters and the precision.
+ *
+ * @param db  pointer to database
+ * @return hash value
+ */
+uint64_t cache_key(database_t *db)
+{
+	uint64_t hash = FNV_OFFSET;
+	int32_t version = CACHE_VERSION;
+	int32_t precision = sizeof(precision_t);
+
+	hash = cache_hash(hash, &version, sizeof(version));
+	hash = cache_hash(hash, &precision, sizeof(precision));
+
+	int i;
+	for ( i = 0; i < db->num_images; i++ ) {
+		struct stat st;
+
+		if ( stat(db->entries[i].name, &st) != 0 ) {
+			perror("stat");
+			exit(1);
+		}
+
+		int64_t stamp[3] = {
+			st.st_size,
+			st.st_mtim.tv_sec,
+			st.st_mtim.tv_nsec
+		};
+
+		hash = cache_hash(hash, db->entries[i].name, strlen(db->entries[i].name) + 1);
+		hash = cache_hash(hash, &db->entries[i].class, sizeof(db->entries[i].class));
+		hash = cache_hash(hash, stamp, sizeof(stamp));
+	}
+
+	int32_t params[7] = {
+		db->prep.grayscale,
+		db->prep.width,
+		db->prep.height,
+		db->prep.equalize,
+		db->pca_components,
+		db->pca_randomized,
+		db->low_memory
+	};
+	double energy = db->pca_energy;
+
+	hash = cache_hash(hash, params, sizeof(params));
+	hash = cache_hash(hash, &energy, sizeof(energy));
+
+	return hash;
+}
+
+/**
+ * Get the path of a file in the cache directory of a database.
+ *
+ * @param db         pointer to database
+ * @param hash       hash of the file
+ * @param extension  extension of the file
+ * @return pointer to new string
+ */
+char * cache_path(database_t *db, uint64_t hash, const char *extension)
+{
+	char *path = (char *)malloc(strlen(db->cache_dir) + strlen(extension) + 20);
+
+	sprintf(path, "%s/%016llx%s", db->cache_dir, (unsigned long long)hash, extension);
+
+	return path;
+}
+
+/**
+ * Read a matrix from a cache entry into a new matrix.
+ *
+ * @param file  pointer to cache entry
+ * @param id    section id
+ * @return pointer to new matrix, or NULL if the section is missing
+ */
+matrix_t * cache_read_matrix(dbfile_t *file, int id)
+{
+	matrix_t *M = dbfile_read_matrix(file, id);
+
+	if ( M == NULL ) {
+		return NULL;
+	}
+
+	// the entries are stored in precision_t, so M is a view of the file
+	matrix_t *C = m_copy(M);
+	free(M);
+
+	return C;
+}
+
+/**
+ * Load the mean face, PCA representation and mean-subtracted
+ * image matrix of a database from its training cache.
+ *
+ * @param db  pointer to database with entries
+ * @param X   pointer to store image matrix
+ * @return 1 if the cache has an entry for the training set, 0 otherwise
+ */
+int db_cache_load(database_t *db, matrix_t **X)
+{
+	char *path = cache_path(db, cache_key(db), ".dat");
+
+	if ( access(path, R_OK) != 0 ) {
+		free(path);
+		return 0;
+	}
+
+	dbfile_t *file = dbfile_open(path);
+
+	if ( file->header->precision != DBFILE_PRECISION
+	  || file->header->num_images != db->num_images ) {
+		fprintf(stderr, "warning: ignoring invalid cache entry \'%s\'\n", path);
+		dbfile_close(file);
+		free(path);
+		return 0;
+	}
+
+	printf("Reading cached PCA representation from \'%s\'...\n", path);
+
+	db->num_dimensions = file->header->num_dimensions;
+	db->mean_face = cache_read_matrix(file, CACHE_MEAN_FACE);
+	db->W_pca_tr = cache_read_matrix(file, CACHE_W_PCA);
+	db->P_pca = cache_read_matrix(file, CACHE_P_PCA);
+	*X = cache_read_matrix(file, CACHE_X);
+
+	if ( db->mean_face == NULL || db->W_pca_tr == NULL || db->P_pca == NULL || *X == NULL ) {
+		fprintf(stderr, "error: cache entry \'%s\' is incomplete\n", path);
+		exit(1);
+	}
+
+	dbfile_close(file);
+	free(path);
+
+	return 1;
+}
+
+/**
+ * Save the mean face, PCA representation and mean-subtracted
+ * image matrix of a database to its training cache. The entry
+ * is written to a temporary file which is then renamed, so that
+ * an interrupted save leaves no partial entry.
+ *
+ * @param db  pointer to database
+ * @param X   pointer to mean-subtracted image matrix
+ */
+void db_cache_save(database_t *db, matrix_t *X)
+{
+	if ( mkdir(db->cache_dir, 0777) != 0 && errno != EEXIST ) {
+		perror("mkdir");
+		exit(1);
+	}
+
+	char *path = cache_path(db, cache_key(db), ".dat");
+	char *path_temp = cache_path(db, cache_key(db), ".dat.tmp");
+
+	dbfile_header_t header = {
+		.num_classes = db->num_classes,
+		.num_images = db->num_images,
+		.num_dimensions = db->num_dimensions,
+		.precision = DBFILE_PRECISION
+	};
+
+	dbfile_writer_t writer;
+	dbfile_create(&writer, path_temp, &header);
+
+	dbfile_write_matrix(&writer, CACHE_MEAN_FACE, db->mean_face);
+	dbfile_write_matrix(&writer, CACHE_W_PCA, db->W_pca_tr);
+	dbfile_write_matrix(&writer, CACHE_P_PCA, db->P_pca);
+	dbfile_write_matrix(&writer, CACHE_X, X);
+
+	dbfile_close_writer(&writer);
+
+	if ( rename(path_temp, path) != 0 ) {
+		perror("rename");
+		exit(1);
+	}
+
+	free(path);
+	free(path_temp);
+}
+
+/**
+ * Get the path of the ICA checkpoint of a database in its
+ * training cache, which depends on the training set and the
+ * ICA parameters which determine the training of W.
+ *
+ * @param db  pointer to database with entries
+ * @return pointer to new string
+ */
+char * db_cache_checkpoint(database_t *db)
+{
+	if ( mkdir(db->cache_dir, 0777) != 0 && errno != EEXIST ) {
+		perror("mkdir");
+		exit(1);
+	}
+
+	ica_params_t *params = &db->ica_params;
+	int32_t values[3] = {
+		params->architecture,
+		params->engine,
+		params->num_threads
+	};
+	double tolerance = params->tolerance;
+
+	uint64_t hash = cache_key(db);
+	hash = cache_hash(hash, values, sizeof(values));
+	hash = cache_hash(hash, &tolerance, sizeof(tolerance));
+
+	return cache_path(db, hash, ".ica");
+}
@@ -0,0 +1,335 @@
+/**
+ * @file crossval.c
+ *
+ * Implementation of k-fold cross-validation.
+ *
+ * The images of a data set are read once into an image matrix
+ * which is shared by every fold. The i-th image of each class,
+ * in the order of get_image_entries(), is a test image of fold
+ * i mod k and a training image of every other fold, so that each
+ * fold tests every class, as cross-validate.sh does by removing
+ * one index from each class. The folds are trained and tested
+ * concurrently on db->num_threads threads, each fold with a
+ * single thread.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "database.h"
+#include "parallel.h"
+
+typedef struct {
+	int num_test;
+	int num_correct[3];
+	double train_time;
+	double test_time;
+} cv_result_t;
+
+typedef struct {
+	database_t *db;
+	matrix_t *X;
+	database_entry_t *entries;
+	int num_images;
+	int *folds;
+	cv_result_t *results;
+} cv_args_t;
+
+/**
+ * Get the current time in seconds.
+ *
+ * @return time in seconds
+ */
+static double cv_time()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Construct the database of a fold with the parameters of
+ * a database. The fold does not print its training progress,
+ * since the folds are trained concurrently.
+ *
+ * @param db  pointer to database
+ * @return pointer to new database
+ */
+database_t * cv_construct_fold(database_t *db)
+{
+	database_t *fold = db_construct(db->lda, db->ica);
+	fold->pca_randomized = db->pca_randomized;
+	fold->low_memory = db->low_memory;
+	fold->memory_budget = db->memory_budget;
+	fold->pca_components = db->pca_components;
+	fold->pca_energy = db->pca_energy;
+	fold->ica_params = db->ica_params;
+	fold->ica_params.progress = NULL;
+	fold->ica_params.num_threads = 1;
+	fold->ica_params.quiet = 1;
+	fold->batch_size = db->batch_size;
+	fold->num_threads = 1;
+	fold->io_threads = 1;
+	fold->quiet = 1;
+	fold->quantize = db->quantize;
+	fold->rerank = db->rerank;
+	fold->ann = db->ann;
+	fold->ef = db->ef;
+	fold->exact = db->exact;
+	fold->cascade = db->cascade;
+	fold->cascade_dims = db->cascade_dims;
+	fold->top_k = db->top_k;
+	fold->aggregate = db->aggregate;
+	fold->threshold_pca = db->threshold_pca;
+	fold->threshold_lda = db->threshold_lda;
+	fold->threshold_ica = db->threshold_ica;
+	fold->num_classes = db->num_classes;
+	fold->prep = db->prep;
+
+	return fold;
+}
+
+/**
+ * Count the test images whose best match has the right class.
+ *
+ * @param matches  pointer to top_k matches for each test image
+ * @param top_k    number of matches for each test image
+ * @param classes  pointer to class of each test image
+ * @param num      number of test images
+ * @return number of correct matches
+ */
+int cv_count_correct(db_match_t *matches, int top_k, int *classes, int num)
+{
+	int num_correct = 0;
+
+	int j;
+	for ( j = 0; j < num; j++ ) {
+		if ( matches[j * top_k].index != -1 && matches[j * top_k].class == classes[j] ) {
+			num_correct++;
+		}
+	}
+
+	return num_correct;
+}
+
+/**
+ * Train and test a fold.
+ *
+ * @param args  pointer to cross-validation arguments
+ * @param f     index of fold
+ */
+void cv_run_fold(cv_args_t *args, int f)
+{
+	matrix_t *X = args->X;
+	cv_result_t *result = &args->results[f];
+
+	int num_test = 0;
+
+	int i;
+	for ( i = 0; i < args->num_images; i++ ) {
+		if ( args->folds[i] == f ) {
+			num_test++;
+		}
+	}
+
+	int num_train = args->num_images - num_test;
+
+	// copy the training images and test images of the fold
+	database_t *db = cv_construct_fold(args->db);
+	db->num_images = num_train;
+	db->entries = (database_entry_t *)malloc(num_train * sizeof(database_entry_t));
+
+	// randomized PCA reads the training images from their files
+	matrix_t *X_train = db->pca_randomized
+		? NULL
+		: m_initialize(X->rows, num_train);
+	matrix_t *T = m_initialize(X->rows, num_test);
+	int *classes = (int *)malloc(num_test * sizeof(int));
+
+	int j, k;
+	for ( i = 0, j = 0, k = 0; i < args->num_images; i++ ) {
+		if ( args->folds[i] == f ) {
+			memcpy(&elem(T, 0, k), &elem(X, 0, i), X->rows * sizeof(precision_t));
+			classes[k] = args->entries[i].class;
+			k++;
+		}
+		else {
+			if ( X_train != NULL ) {
+				memcpy(&elem(X_train, 0, j), &elem(X, 0, i), X->rows * sizeof(precision_t));
+			}
+			db->entries[j].class = args->entries[i].class;
+			db->entries[j].name = strdup(args->entries[i].name);
+			j++;
+		}
+	}
+
+	// train the fold
+	double start = cv_time();
+
+	if ( db->pca_randomized ) {
+		db_train_randomized(db);
+		db_train_index(db);
+	}
+	else {
+		db_train_matrix(db, X_train);
+	}
+
+	double middle = cv_time();
+
+	// test the fold
+	db_match_t *match_pca = (db_match_t *)malloc(num_test * db->top_k * sizeof(db_match_t));
+	db_match_t *match_lda = (db_match_t *)malloc(num_test * db->top_k * sizeof(db_match_t));
+	db_match_t *match_ica = (db_match_t *)malloc(num_test * db->top_k * sizeof(db_match_t));
+
+	db_recognize_block(db, T, match_pca, match_lda, match_ica);
+
+	result->num_test = num_test;
+	result->num_correct[0] = cv_count_correct(match_pca, db->top_k, classes, num_test);
+	result->num_correct[1] = db->lda ? cv_count_correct(match_lda, db->top_k, classes, num_test) : 0;
+	result->num_correct[2] = db->ica ? cv_count_correct(match_ica, db->top_k, classes, num_test) : 0;
+	result->train_time = middle - start;
+	result->test_time = cv_time() - middle;
+
+	// cleanup
+	m_free(T);
+	free(classes);
+	free(match_pca);
+	free(match_lda);
+	free(match_ica);
+	db_destruct(db);
+}
+
+/**
+ * Train and test a range [begin, end) of folds.
+ *
+ * @param arg    pointer to cv_args_t
+ * @param begin  begin index
+ * @param end    end index
+ * @param id     thread index
+ */
+void cv_run_folds(void *arg, int begin, int end, int id)
+{
+	cv_args_t *args = (cv_args_t *)arg;
+
+	int f;
+	for ( f = begin; f < end; f++ ) {
+		cv_run_fold(args, f);
+	}
+}
+
+/**
+ * Print the accuracy of an algorithm.
+ *
+ * @param label        label of algorithm
+ * @param num_correct  number of correct matches
+ * @param num          number of test images
+ */
+void cv_print_accuracy(const char *label, int num_correct, int num)
+{
+	printf(" %s %d (%.2f%%)", label, num_correct, 100.0 * num_correct / num);
+}
+
+/**
+ * Run k-fold cross-validation on a set of images, with the
+ * parameters of a database, and print the accuracy of each
+ * algorithm and the time of each fold.
+ *
+ * @param db         pointer to database with training parameters
+ * @param path       directory of images, with a subdirectory for each class
+ * @param num_folds  number of folds
+ */
+void db_cross_validate(database_t *db, const char *path, int num_folds)
+{
+	double start = cv_time();
+
+	// read the data set once
+	database_entry_t *entries;
+	int num_images = get_image_entries(path, &entries, &db->num_classes);
+	matrix_t *X = get_image_matrix(entries, num_images, &db->prep, db->io_threads);
+
+	// assign the i-th image of each class to fold i mod k
+	int *folds = (int *)malloc(num_images * sizeof(int));
+	int max_class_size = 0;
+
+	int i, j;
+	for ( i = 0; i < num_images; i = j ) {
+		for ( j = i; j < num_images && entries[j].class == entries[i].class; j++ ) {
+			folds[j] = (j - i) % num_folds;
+		}
+
+		if ( j - i < 2 ) {
+			fprintf(stderr, "error: class of \'%s\' has fewer than 2 images\n", entries[i].name);
+			exit(1);
+		}
+
+		if ( max_class_size < j - i ) {
+			max_class_size = j - i;
+		}
+	}
+
+	if ( num_folds > max_class_size ) {
+		fprintf(stderr, "error: number of folds exceeds the size of every class\n");
+		exit(1);
+	}
+
+	double read_time = cv_time() - start;
+
+	// train and test the folds
+	cv_result_t *results = (cv_result_t *)calloc(num_folds, sizeof(cv_result_t));
+
+	cv_args_t args = {
+		.db = db,
+		.X = X,
+		.entries = entries,
+		.num_images = num_images,
+		.folds = folds,
+		.results = results
+	};
+
+	parallel_for(db->num_threads, num_folds, cv_run_folds, &args);
+
+	// print results
+	int num_test = 0;
+	int num_correct[3] = { 0, 0, 0 };
+	double train_time = 0;
+	double test_time = 0;
+
+	printf("Cross-validation with %d folds of %d images in %d classes:\n", num_folds, num_images, db->num_classes);
+
+	int f;
+	for ( f = 0; f < num_folds; f++ ) {
+		cv_result_t *result = &results[f];
+
+		printf("fold %d: %d test images, train %.3f s, test %.3f s,", f + 1, result->num_test, result->train_time, result->test_time);
+		cv_print_accuracy("PCA", result->num_correct[0], result->num_test);
+		if ( db->lda ) cv_print_accuracy("LDA", result->num_correct[1], result->num_test);
+		if ( db->ica ) cv_print_accuracy(db_ica_label(db), result->num_correct[2], result->num_test);
+		putchar('\n');
+
+		num_test += result->num_test;
+		num_correct[0] += result->num_correct[0];
+		num_correct[1] += result->num_correct[1];
+		num_correct[2] += result->num_correct[2];
+		train_time += result->train_time;
+		test_time += result->test_time;
+	}
+
+	printf("total: %d test images, train %.3f s, test %.3f s,", num_test, train_time, test_time);
+	cv_print_accuracy("PCA", num_correct[0], num_test);
+	if ( db->lda ) cv_print_accuracy("LDA", num_correct[1], num_test);
+	if ( db->ica ) cv_print_accuracy(db_ica_label(db), num_correct[2], num_test);
+	putchar('\n');
+
+	printf("read %.3f s, elapsed %.3f s\n", read_time, cv_time() - start);
+
+	// cleanup
+	m_free(X);
+	free(folds);
+	free(results);
+
+	for ( i = 0; i < num_images; i++ ) {
+		free(entries[i].name);
+	}
+	free(entries);
+}
@@ -4,11 +4,47 @@
  * Implementation of the face database.
  */
 #include <dirent.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "database.h"
 #include "image.h"
+#include "parallel.h"
+#include "profile.h"
+
+/**
+ * Section ids of the database file.
+ */
+typedef enum {
+	SECTION_ENTRIES = 1,
+	SECTION_NAMES = 2,
+	SECTION_MEAN_FACE = 3,
+	SECTION_W_PCA = 4,
+	SECTION_P_PCA = 5,
+	SECTION_P_PCA_NORM = 6,
+	SECTION_W_LDA = 7,
+	SECTION_P_LDA = 8,
+	SECTION_P_LDA_NORM = 9,
+	SECTION_W_ICA = 10,
+	SECTION_P_ICA = 11,
+	SECTION_P_ICA_NORM = 12,
+	SECTION_Q_PCA = 13,
+	SECTION_Q_LDA = 16,
+	SECTION_Q_ICA = 19,
+	SECTION_H_PCA = 22,
+	SECTION_H_LDA = 26,
+	SECTION_H_ICA = 30,
+	SECTION_PREPROCESS = 34,
+	SECTION_ICA_ARCHITECTURE = 35
+} db_section_t;
+
+/**
+ * Default number of candidates from a quantized gallery
+ * which are re-ranked with exact distances.
+ */
+#define DEFAULT_RERANK 32
 
 /**
  * Get whether an entry is a PGM or PPM image based
@@ -141,36 +177,112 @@ int get_image_entries(const char *path, database_entry_t **image_entries, int *n
 	return num_images;
 }
 
+typedef struct {
+	matrix_t *T;
+	char **names;
+	image_t *ref;
+	const image_prep_t *prep;
+	int skip;
+} read_images_args_t;
+
+/**
+ * Read a slice of images into the columns of an image matrix.
+ *
+ * Each image is preprocessed and then checked against the
+ * dimensions of a reference image, so that a mismatched image
+ * is reported by name.
+ *
+ * @param arg    pointer to read_images_args_t
+ * @param begin  begin index
+ * @param end    end index
+ * @param id     thread index
+ */
+void read_images_slice(void *arg, int begin, int end, int id)
+{
+	read_images_args_t *args = (read_images_args_t *)arg;
+	image_t *ref = args->ref;
+	image_t *image = image_construct();
+
+	int j;
+	for ( j = args->skip + begin; j < args->skip + end; j++ ) {
+		image_read(image, args->names[j]);
+		image_preprocess(image, args->prep);
+
+		if ( image->channels != ref->channels || image->height != ref->height || image->width != ref->width ) {
+			fprintf(stderr, "error: image \'%s\' has size %dx%dx%d, expected %dx%dx%d\n",
+				args->names[j],
+				image->width, image->height, image->channels,
+				ref->width, ref->height, ref->channels);
+			exit(1);
+		}
+
+		m_image_read(args->T, j, image);
+	}
+
+	image_destruct(image);
+}
+
+/**
+ * Read a list of images into the columns of an image matrix
+ * with several threads.
+ *
+ * @param T            pointer to image matrix
+ * @param names        pointer to list of T->cols image names
+ * @param ref          pointer to preprocessed reference image
+ * @param prep         pointer to preprocessing parameters
+ * @param skip         number of columns which have already been read
+ * @param num_threads  number of threads
+ */
+void read_images(matrix_t *T, char **names, image_t *ref, const image_prep_t *prep, int skip, int num_threads)
+{
+	read_images_args_t args = {
+		.T = T,
+		.names = names,
+		.ref = ref,
+		.prep = prep,
+		.skip = skip
+	};
+
+	parallel_for(num_threads, T->cols - skip, read_images_slice, &args);
+}
+
 /**
  * Map a collection of images to column vectors.
  *
  * The image matrix has size m x n, where m is the number of
- * pixels in each image and n is the number of images. The
- * images must all have the same size.
+ * pixels in each preprocessed image and n is the number of
+ * images. The images must all have the same size as the first
+ * image after preprocessing.
  *
- * @param entries     pointer to list of image entries
- * @param num_images  number of images
+ * @param entries      pointer to list of image entries
+ * @param num_images   number of images
+ * @param prep         pointer to preprocessing parameters
+ * @param num_threads  number of threads for reading images
  * @return pointer to image matrix
  */
-matrix_t * get_image_matrix(database_entry_t *entries, int num_images)
+matrix_t * get_image_matrix(database_entry_t *entries, int num_images, const image_prep_t *prep, int num_threads)
 {
 	// get the image size from the first image
 	image_t *image = image_construct();
 
 	image_read(image, entries[0].name);
+	image_preprocess(image, prep);
 
 	matrix_t *T = m_initialize(image->channels * image->height * image->width, num_images);
 
 	// map each image to a column vector
-	m_image_read(T, 0, image);
+	char **names = (char **)malloc(num_images * sizeof(char *));
 
 	int i;
-	for ( i = 1; i < num_images; i++ ) {
-		image_read(image, entries[i].name);
-		m_image_read(T, i, image);
+	for ( i = 0; i < num_images; i++ ) {
+		names[i] = entries[i].name;
 	}
 
+	m_image_read(T, 0, image);
+	read_images(T, names, image, prep, 1, num_threads);
+
 	image_destruct(image);
+	free(names);
 
 	return T;
 }
@@ -187,10 +299,99 @@ database_t * db_construct(int lda, int ica)
 	database_t *db = (database_t *)calloc(1, sizeof(database_t));
 	db->lda = lda;
 	db->ica = ica;
+	db->batch_size = 1;
+	db->num_threads = 1;
+	db->io_threads = 1;
+	db->ica_params.architecture = 2;
+	db->ica_params.num_threads = 1;
+	db->rerank = DEFAULT_RERANK;
+	db->ef = HNSW_DEFAULT_EF;
+	db->top_k = 1;
+	db->threshold_pca = INFINITY;
+	db->threshold_lda = INFINITY;
+	db->threshold_ica = INFINITY;
+	db->precision = DBFILE_PRECISION;
 
 	return db;
 }
 
+/**
+ * Get the label of the ICA representation of a database,
+ * which depends on its architecture.
+ *
+ * @param db  pointer to database
+ * @return "ICA1" or "ICA2"
+ */
+const char * db_ica_label(database_t *db)
+{
+	return (db->ica_params.architecture == 1)
+		? "ICA1"
+		: "ICA2";
+}
+
+/**
+ * Free a matrix of a database, which may be NULL or may have
+ * been read from the database file.
+ *
+ * @param db  pointer to database
+ * @param M   pointer to matrix
+ */
+void db_free_matrix(database_t *db, matrix_t *M)
+{
+	if ( M == NULL ) {
+		return;
+	}
+
+	if ( dbfile_contains(db->file, M->data) ) {
+		free(M);
+	}
+	else {
+		m_free(M);
+	}
+}
+
+/**
+ * Free a quantized matrix of a database, which may be NULL
+ * or may have been read from the database file.
+ *
+ * @param db  pointer to database
+ * @param Q   pointer to quantized matrix
+ */
+void db_free_qmatrix(database_t *db, qmatrix_t *Q)
+{
+	if ( Q == NULL ) {
+		return;
+	}
+
+	if ( dbfile_contains(db->file, Q->data) ) {
+		free(Q);
+	}
+	else {
+		q_free(Q);
+	}
+}
+
+/**
+ * Free an HNSW graph of a database, which may be NULL or
+ * may have been read from the database file.
+ *
+ * @param db  pointer to database
+ * @param H   pointer to graph
+ */
+void db_free_hnsw(database_t *db, hnsw_t *H)
+{
+	if ( H == NULL ) {
+		return;
+	}
+
+	if ( dbfile_contains(db->file, H->offsets) ) {
+		free(H);
+	}
+	else {
+		hnsw_free(H);
+	}
+}
+
 /**
  * Destruct a database.
  *
@@ -200,240 +401,2478 @@ void db_destruct(database_t *db)
 {
 	int i;
 	for ( i = 0; i < db->num_images; i++ ) {
-		free(db->entries[i].name);
+		if ( !dbfile_contains(db->file, db->entries[i].name) ) {
+			free(db->entries[i].name);
+		}
 	}
 	free(db->entries);
 
-	m_free(db->mean_face);
-	m_free(db->W_pca_tr);
-	m_free(db->P_pca);
+	db_free_matrix(db, db->mean_face);
+	db_free_matrix(db, db->W_pca_tr);
+	db_free_matrix(db, db->P_pca);
+	db_free_matrix(db, db->P_pca_norm);
+	db_free_qmatrix(db, db->Q_pca);
+	db_free_hnsw(db, db->H_pca);
 
 	if ( db->lda ) {
-		m_free(db->W_lda_tr);
-		m_free(db->P_lda);
+		db_free_matrix(db, db->W_lda_tr);
+		db_free_matrix(db, db->P_lda);
+		db_free_matrix(db, db->P_lda_norm);
+		db_free_qmatrix(db, db->Q_lda);
+		db_free_hnsw(db, db->H_lda);
 	}
 
 	if ( db->ica ) {
-		m_free(db->W_ica_tr);
-		m_free(db->P_ica);
+		db_free_matrix(db, db->W_ica_tr);
+		db_free_matrix(db, db->P_ica);
+		db_free_matrix(db, db->P_ica_norm);
+		db_free_qmatrix(db, db->Q_ica);
+		db_free_hnsw(db, db->H_ica);
+	}
+
+	if ( db->W_fused_tr != NULL ) {
+		m_free(db->W_fused_tr);
+	}
+
+	if ( db->fused_bias != NULL ) {
+		m_free(db->fused_bias);
+	}
+
+	if ( db->file != NULL ) {
+		dbfile_close(db->file);
 	}
 
 	free(db);
 }
 
 /**
- * Train a database with a set of images.
+ * Compute the column norms of each projected image matrix
+ * in a database, so that they are not recomputed for every
+ * test image.
  *
- * @param db	pointer to database
- * @param path  directory of training images
+ * @param db  pointer to database
  */
-void db_train(database_t *db, const char *path)
+void db_compute_norms(database_t *db)
 {
-	db->num_images = get_image_entries(path, &db->entries, &db->num_classes);
+	db->P_pca_norm = m_norm_columns(db->P_pca);
 
-	// compute mean-subtracted image matrix X
-	matrix_t *X = get_image_matrix(db->entries, db->num_images);
+	if ( db->lda ) {
+		db->P_lda_norm = m_norm_columns(db->P_lda);
+	}
 
-	db->num_dimensions = X->rows;
-	db->mean_face = m_mean_column(X);
+	if ( db->ica ) {
+		db->P_ica_norm = m_norm_columns(db->P_ica);
+	}
+}
 
-	m_subtract_columns(X, db->mean_face);
+/**
+ * Compute the fused projection matrix of a database, which
+ * stacks the projection matrices of every algorithm, and the
+ * projection of the mean face as its bias. Since
+ * W * (x - mean_face) = W * x - W * mean_face, a block of test
+ * images is projected without subtracting the mean face from
+ * it, and the bias of every algorithm is computed by a single
+ * matrix product when the database is loaded. The fused matrix
+ * of a database with only PCA is W_pca_tr itself.
+ *
+ * @param db  pointer to database
+ */
+void db_fuse_projections(database_t *db)
+{
+	if ( db->W_fused_tr != NULL ) {
+		m_free(db->W_fused_tr);
+		db->W_fused_tr = NULL;
+	}
 
-	// compute PCA representation
-	printf("Computing PCA representation...\n");
+	if ( db->fused_bias != NULL ) {
+		m_free(db->fused_bias);
+	}
 
-	db->W_pca_tr = PCA(X);
-	db->P_pca = m_product(db->W_pca_tr, X);
+	matrix_t *W_tr[] = {
+		db->W_pca_tr,
+		db->lda ? db->W_lda_tr : NULL,
+		db->ica ? db->W_ica_tr : NULL
+	};
 
-	// compute LDA representation
-	if ( db->lda ) {
-		printf("Computing LDA representation...\n");
+	if ( db->lda || db->ica ) {
+		int rows = 0;
 
-		db->W_lda_tr = LDA(db->W_pca_tr, db->P_pca, db->num_classes, db->entries);
-		db->P_lda = m_product(db->W_lda_tr, X);
+		int a, j;
+		for ( a = 0; a < 3; a++ ) {
+			rows += (W_tr[a] != NULL) ? W_tr[a]->rows : 0;
+		}
+
+		db->W_fused_tr = m_initialize(rows, db->W_pca_tr->cols);
+
+		// copy each column of every projection matrix into
+		// one contiguous column of the fused matrix
+		for ( j = 0; j < db->W_fused_tr->cols; j++ ) {
+			int begin = 0;
+
+			for ( a = 0; a < 3; a++ ) {
+				if ( W_tr[a] != NULL ) {
+					memcpy(&elem(db->W_fused_tr, begin, j), &elem(W_tr[a], 0, j), W_tr[a]->rows * sizeof(precision_t));
+					begin += W_tr[a]->rows;
+				}
+			}
+		}
 	}
 
-	// compute ICA2 representation
-	if ( db->ica ) {
-		printf("Computing ICA2 representation...\n");
+	db->fused_bias = m_product((db->W_fused_tr != NULL) ? db->W_fused_tr : db->W_pca_tr, db->mean_face);
+}
+
+/**
+ * Compute the quantized representation of each projected
+ * image matrix in a database.
+ *
+ * @param db  pointer to database
+ */
+void db_quantize(database_t *db)
+{
+	db->Q_pca = q_quantize(db->P_pca);
 
-		db->W_ica_tr = ICA2(db->W_pca_tr, db->P_pca);
-		db->P_ica = m_product(db->W_ica_tr, X);
+	if ( db->lda ) {
+		db->Q_lda = q_quantize(db->P_lda);
 	}
 
-	m_free(X);
+	if ( db->ica ) {
+		db->Q_ica = q_quantize(db->P_ica);
+	}
 }
 
 /**
- * Save a database to the file system.
+ * Build or extend the HNSW graph of a projected image matrix.
+ *
+ * If the previous columns of P are unchanged, the new columns
+ * are added to the previous graph, which is copied if it was
+ * read from the database file. Otherwise a new graph is built.
  *
- * @param db		  pointer to database
- * @param path_tset   path to save image filenames
- * @param path_tdata  path to save matrix data
+ * @param db         pointer to database
+ * @param H          pointer to previous graph, or NULL
+ * @param P          pointer to projected image matrix
+ * @param P_norm     pointer to column norms of P
+ * @param dist_type  distance function
+ * @param rebuild    whether the previous columns of P have changed
+ * @return pointer to graph of P
  */
-void db_save(database_t *db, const char *path_tset, const char *path_tdata)
+hnsw_t * db_index_projection(database_t *db, hnsw_t *H, matrix_t *P, matrix_t *P_norm, dist_t dist_type, int rebuild)
 {
-	// save the image filenames
-	FILE *tset = fopen(path_tset, "w");
+	if ( H == NULL || rebuild ) {
+		db_free_hnsw(db, H);
+		return hnsw_build(P, P_norm, dist_type, HNSW_DEFAULT_M, HNSW_DEFAULT_EF_CONSTRUCTION);
+	}
 
-	int i;
-	for ( i = 0; i < db->num_images; i++ ) {
-		fprintf(tset, "%d %s\n", db->entries[i].class, db->entries[i].name);
+	if ( dbfile_contains(db->file, H->offsets) ) {
+		hnsw_t *H_copy = hnsw_copy(H);
+
+		free(H);
+		H = H_copy;
 	}
-	fclose(tset);
 
-	// save the mean face and PCA/LDA/ICA representations
-	FILE *tdata = fopen(path_tdata, "w");
+	while ( H->num_nodes < P->cols ) {
+		hnsw_add(H, P, P_norm, dist_type);
+	}
 
-	m_fwrite(tdata, db->mean_face);
-	m_fwrite(tdata, db->W_pca_tr);
-	m_fwrite(tdata, db->P_pca);
+	return H;
+}
+
+/**
+ * Build or extend the HNSW graph of each projected image
+ * matrix in a database, after the column norms have been
+ * computed.
+ *
+ * @param db       pointer to database
+ * @param rebuild  whether the previous columns of each
+ *                 projected image matrix have changed
+ */
+void db_index(database_t *db, int rebuild)
+{
+	if ( !db->quiet ) printf("Building ANN index...\n");
+
+	db->H_pca = db_index_projection(db, db->H_pca, db->P_pca, db->P_pca_norm, DIST_L2, rebuild);
 
 	if ( db->lda ) {
-		m_fwrite(tdata, db->W_lda_tr);
-		m_fwrite(tdata, db->P_lda);
+		db->H_lda = db_index_projection(db, db->H_lda, db->P_lda, db->P_lda_norm, DIST_L2, rebuild);
 	}
 
 	if ( db->ica ) {
-		m_fwrite(tdata, db->W_ica_tr);
-		m_fwrite(tdata, db->P_ica);
+		db->H_ica = db_index_projection(db, db->H_ica, db->P_ica, db->P_ica_norm, DIST_COS, rebuild);
+	}
+}
+
+/**
+ * Compute the mean of a collection of images, reading the
+ * images in blocks.
+ *
+ * @param entries      pointer to list of image entries
+ * @param num_images   number of images
+ * @param prep         pointer to preprocessing parameters
+ * @param num_threads  number of threads for reading images
+ * @return pointer to mean column vector
+ */
+matrix_t * get_mean_image(database_entry_t *entries, int num_images, const image_prep_t *prep, int num_threads)
+{
+	matrix_t *mean = NULL;
+
+	int i, j, k;
+	for ( i = 0; i < num_images; i += TRAIN_BLOCK_SIZE ) {
+		int end = (i + TRAIN_BLOCK_SIZE < num_images) ? i + TRAIN_BLOCK_SIZE : num_images;
+
+		matrix_t *X_b = get_image_matrix(entries + i, end - i, prep, num_threads);
+
+		if ( mean == NULL ) {
+			mean = m_zeros(X_b->rows, 1);
+		}
+		else if ( X_b->rows != mean->rows ) {
+			fprintf(stderr, "error: training images must all have the same size\n");
+			exit(1);
+		}
+
+		for ( j = 0; j < X_b->cols; j++ ) {
+			for ( k = 0; k < X_b->rows; k++ ) {
+				elem(mean, k, 0) += elem(X_b, k, j);
+			}
+		}
+
+		m_free(X_b);
+	}
+
+	for ( k = 0; k < mean->rows; k++ ) {
+		elem(mean, k, 0) /= num_images;
 	}
 
-	fclose(tdata);
+	return mean;
 }
 
 /**
- * Load a database from the file system.
+ * Project the training images of a database with a projection
+ * matrix, reading the images in blocks.
+ *
+ * @param db    pointer to database
+ * @param W_tr  pointer to projection matrix
+ * @return pointer to projected image matrix W_tr * X
+ */
+matrix_t * db_project_images(database_t *db, matrix_t *W_tr)
+{
+	matrix_t *P = m_initialize(W_tr->rows, db->num_images);
+
+	int i;
+	for ( i = 0; i < db->num_images; i += TRAIN_BLOCK_SIZE ) {
+		int end = (i + TRAIN_BLOCK_SIZE < db->num_images) ? i + TRAIN_BLOCK_SIZE : db->num_images;
+
+		matrix_t *X_b = get_image_matrix(db->entries + i, end - i, &db->prep, db->io_threads);
+		m_subtract_columns(X_b, db->mean_face);
+
+		matrix_t *P_b = m_product(W_tr, X_b);
+
+		memcpy(&elem(P, 0, i), P_b->data, P_b->rows * P_b->cols * sizeof(precision_t));
+
+		m_free(X_b);
+		m_free(P_b);
+	}
+
+	return P;
+}
+
+/**
+ * Train a database with randomized PCA, without storing
+ * the image matrix X.
+ *
+ * The training images are read in blocks several times, once
+ * to compute the mean face, a few times for randomized PCA, and
+ * once for each projection.
  *
  * @param db  pointer to database
- * @param path_tset   path to read image filenames
- * @param path_tdata  path to read matrix data
  */
-void db_load(database_t *db, const char *path_tset, const char *path_tdata)
+void db_train_randomized(database_t *db)
 {
-	// get mean face, PDA output, and LDA output
-	FILE *tdata = fopen(path_tdata, "r");
+	PROF_BEGIN(load);
+
+	db->mean_face = get_mean_image(db->entries, db->num_images, &db->prep, db->io_threads);
+	db->num_dimensions = db->mean_face->rows;
+
+	PROF_END(load, PROF_TRAIN_LOAD);
 
-	db->mean_face = m_fread(tdata);
-	db->W_pca_tr = m_fread(tdata);
-	db->P_pca = m_fread(tdata);
+	// compute PCA representation
+	if ( !db->quiet ) printf("Computing PCA representation...\n");
+
+	PROF_BEGIN(pca);
+	db->W_pca_tr = PCA_randomized(db->entries, db->num_images, db->mean_face, db->pca_components, db->pca_energy, &db->prep, db->io_threads);
+	PROF_END(pca, PROF_TRAIN_PCA);
 
+	PROF_BEGIN(project_pca);
+	db->P_pca = db_project_images(db, db->W_pca_tr);
+	PROF_END(project_pca, PROF_TRAIN_PROJECT);
+
+	// compute LDA representation
 	if ( db->lda ) {
-		db->W_lda_tr = m_fread(tdata);
-		db->P_lda = m_fread(tdata);
+		if ( !db->quiet ) printf("Computing LDA representation...\n");
+
+		PROF_BEGIN(lda);
+		db->W_lda_tr = LDA(db->W_pca_tr, db->P_pca, db->num_classes, db->entries, db->num_threads, NULL);
+		PROF_END(lda, PROF_TRAIN_LDA);
+
+		PROF_BEGIN(project_lda);
+		db->P_lda = db_project_images(db, db->W_lda_tr);
+		PROF_END(project_lda, PROF_TRAIN_PROJECT);
 	}
 
+	// compute ICA representation
 	if ( db->ica ) {
-		db->W_ica_tr = m_fread(tdata);
-		db->P_ica = m_fread(tdata);
+		if ( !db->quiet ) printf("Computing %s representation...\n", db_ica_label(db));
+
+		PROF_BEGIN(ica);
+		db->W_ica_tr = ICA(db->W_pca_tr, db->P_pca, &db->ica_params, NULL);
+		PROF_END(ica, PROF_TRAIN_ICA);
+
+		PROF_BEGIN(project_ica);
+		db->P_ica = db_project_images(db, db->W_ica_tr);
+		PROF_END(project_ica, PROF_TRAIN_PROJECT);
 	}
+}
 
-	db->num_images = db->P_pca->cols;
-	db->num_dimensions = db->mean_face->rows;
+/**
+ * Estimate the peak memory of training a database in memory.
+ *
+ * The estimate counts the image matrix and every matrix with as
+ * many elements as an image, and bounds the remaining matrices,
+ * which are at most n-by-n, by a multiple of n^2 elements.
+ *
+ * @param db          pointer to database
+ * @param low_memory  whether to estimate the low-memory mode
+ * @return estimated peak memory in bytes
+ */
+size_t db_train_peak_memory(database_t *db, int low_memory)
+{
+	size_t m = db->num_dimensions;
+	size_t n = db->num_images;
+	size_t k = (n > 1) ? n - 1 : n;
+	size_t c = db->num_classes;
 
-	fclose(tdata);
+	if ( 0 < db->pca_components && (size_t)db->pca_components < k ) {
+		k = db->pca_components;
+	}
 
-	// get image filenames
-	FILE *tset = fopen(path_tset, "r");
+	// X, or W_pca' in place of X in the low-memory mode
+	size_t size = m * n;
 
-	db->entries = (database_entry_t *)malloc(db->num_images * sizeof(database_entry_t));
+	if ( !low_memory ) {
+		size += m * k;
+	}
 
-	int i;
-	for ( i = 0; i < db->num_images; i++ ) {
-		db->entries[i].name = (char *)malloc(64 * sizeof(char));
-		fscanf(tset, "%d %s", &db->entries[i].class, db->entries[i].name);
+	// W_lda' and W_ica'
+	if ( db->lda ) {
+		size += m * (c - 1);
+	}
+
+	if ( db->ica ) {
+		size += m * k;
 	}
 
-	fclose(tset);
+	// n-by-n matrices, and the row blocks and the bit vector of in-place PCA
+	size = (size + 8 * n * n + (low_memory ? 512 * n : 0)) * sizeof(precision_t);
+
+	if ( low_memory ) {
+		size += m * k / 8;
+	}
+
+	return size;
 }
 
 /**
- * Find the column vector in a matrix P with minimum distance from
- * a test vector P_test.
+ * Determine whether to train a database in the low-memory mode,
+ * which is selected by db->low_memory or by the memory budget.
  *
- * @param P          pointer to matrix
- * @param P_test     pointer to column vector
- * @param dist_func  pointer to distance function
- * @return index of matching column in P
+ * @param db  pointer to database with db->num_dimensions
+ * @return 1 for the low-memory mode, 0 otherwise
  */
-int nearest_neighbor(matrix_t *P, matrix_t *P_test, dist_func_t dist_func)
+int db_train_low_memory(database_t *db)
 {
-	int min_index = -1;
-	precision_t min_dist = -1;
+	return db->low_memory
+		|| (db->memory_budget > 0 && db_train_peak_memory(db, 0) > db->memory_budget);
+}
 
-	int j;
-	for ( j = 0; j < P->cols; j++ ) {
-		// compute the distance between the two images
-		precision_t dist = dist_func(P_test, 0, P, j);
+/**
+ * Compute the LDA and ICA representations of a database from
+ * its PCA representation.
+ *
+ * @param db          pointer to database
+ * @param X           pointer to mean-subtracted image matrix, which is freed,
+ *                    or NULL in the low-memory mode
+ * @param low_memory  whether to compute the projections from P_pca
+ */
+void db_train_projections(database_t *db, matrix_t *X, int low_memory)
+{
+	// compute LDA representation
+	if ( db->lda ) {
+		if ( !db->quiet ) printf("Computing LDA representation...\n");
+
+		if ( low_memory ) {
+			PROF_BEGIN(lda);
+			db->W_lda_tr = LDA(db->W_pca_tr, db->P_pca, db->num_classes, db->entries, db->num_threads, &db->P_lda);
+			PROF_END(lda, PROF_TRAIN_LDA);
+		}
+		else {
+			PROF_BEGIN(lda);
+			db->W_lda_tr = LDA(db->W_pca_tr, db->P_pca, db->num_classes, db->entries, db->num_threads, NULL);
+			PROF_END(lda, PROF_TRAIN_LDA);
+
+			PROF_BEGIN(project);
+			db->P_lda = m_product(db->W_lda_tr, X);
+			PROF_END(project, PROF_TRAIN_PROJECT);
+		}
+	}
+
+	// compute ICA representation
+	if ( db->ica ) {
+		if ( !db->quiet ) printf("Computing %s representation...\n", db_ica_label(db));
 
-		// update the running minimum
-		if ( min_dist == -1 || dist < min_dist ) {
-			min_index = j;
-			min_dist = dist;
+		if ( low_memory ) {
+			PROF_BEGIN(ica);
+			db->W_ica_tr = ICA(db->W_pca_tr, db->P_pca, &db->ica_params, &db->P_ica);
+			PROF_END(ica, PROF_TRAIN_ICA);
+		}
+		else {
+			PROF_BEGIN(ica);
+			db->W_ica_tr = ICA(db->W_pca_tr, db->P_pca, &db->ica_params, NULL);
+			PROF_END(ica, PROF_TRAIN_ICA);
+
+			PROF_BEGIN(project);
+			db->P_ica = m_product(db->W_ica_tr, X);
+			PROF_END(project, PROF_TRAIN_PROJECT);
 		}
 	}
 
-	return min_index;
+	if ( X != NULL ) {
+		m_free(X);
+	}
 }
 
 /**
- * Test a set of images against a database.
+ * Train a database with the image matrix X in memory.
  *
- * @param db    pointer to database
- * @param path  directory of test images
+ * In the low-memory mode, X is replaced by W_pca' and the
+ * LDA and ICA2 projections are computed from P_pca, so that
+ * the image matrix is never duplicated. Otherwise, if the
+ * database has a cache directory, the mean-subtracted image
+ * matrix and the PCA representation are saved to the cache.
+ *
+ * @param db  pointer to database
+ * @param X   pointer to image matrix, which is freed
  */
-void db_recognize(database_t *db, const char *path)
+void db_train_exact(database_t *db, matrix_t *X)
 {
-	// get test images
-	char **image_names;
-	int num_test_images = get_image_names(path, &image_names);
-	int index_pca, index_lda, index_ica;
-	matrix_t *P_test_pca, *P_test_lda, *P_test_ica;
+	// compute mean-subtracted image matrix X
+	PROF_BEGIN(load);
 
-	// test each image against the database
-	image_t *image = image_construct();
-	matrix_t *T_i = m_initialize(db->num_dimensions, 1);
+	db->num_dimensions = X->rows;
+	db->mean_face = m_mean_column(X);
 
-	int i;
-	for ( i = 0; i < num_test_images; i++ ) {
-		// read the test image T_i
-		image_read(image, image_names[i]);
-		m_image_read(T_i, 0, image);
-		m_subtract(T_i, db->mean_face);
+	m_subtract_columns(X, db->mean_face);
 
-		// find the nearest neighbor of P_test for PCA
-		P_test_pca = m_product(db->W_pca_tr, T_i);
-		index_pca = nearest_neighbor(db->P_pca, P_test_pca, m_dist_L2);
+	PROF_END(load, PROF_TRAIN_LOAD);
 
-		m_free(P_test_pca);
+	// select the low-memory mode if the budget requires it
+	int low_memory = db_train_low_memory(db);
 
-		// find the nearest neighbor of P_test for LCA
-		if ( db->lda ) {
-			P_test_lda = m_product(db->W_lda_tr, T_i);
-			index_lda = nearest_neighbor(db->P_lda, P_test_lda, m_dist_L2);
+	if ( low_memory ) {
+		size_t peak = db_train_peak_memory(db, 1);
 
-			m_free(P_test_lda);
+		if ( db->memory_budget > 0 && peak > db->memory_budget ) {
+			fprintf(stderr, "error: training requires about %zu MB, which exceeds the memory budget\n", peak >> 20);
+			exit(1);
 		}
 
-		// find the nearest neighbor of P_test for ICA2
-		if ( db->ica ) {
-			P_test_ica = m_product(db->W_ica_tr, T_i);
-			index_ica = nearest_neighbor(db->P_ica, P_test_ica, m_dist_COS);
+		if ( !db->quiet ) printf("Training in low-memory mode (about %zu MB)...\n", peak >> 20);
+	}
+
+	// compute PCA representation
+	if ( !db->quiet ) printf("Computing PCA representation...\n");
+
+	if ( low_memory ) {
+		PROF_BEGIN(pca);
+		db->W_pca_tr = PCA_in_place(X, db->pca_components, db->pca_energy, &db->P_pca);
+		X = NULL;
+		PROF_END(pca, PROF_TRAIN_PCA);
+	}
+	else {
+		PROF_BEGIN(pca);
+		db->W_pca_tr = PCA(X, db->pca_components, db->pca_energy);
+		PROF_END(pca, PROF_TRAIN_PCA);
 
-			m_free(P_test_ica);
+		PROF_BEGIN(project);
+		db->P_pca = m_product(db->W_pca_tr, X);
+		PROF_END(project, PROF_TRAIN_PROJECT);
+
+		if ( db->cache_dir != NULL ) {
+			db_cache_save(db, X);
 		}
+	}
 
-		// print results
-		printf("test image: \'%s\'\n", image_names[i]);
-		printf("\tPCA:  (class %d) \'%s\'\n", db->entries[index_pca].class, db->entries[index_pca].name);
-		if ( db->lda ) printf("\tLDA:  (class %d) \'%s\'\n", db->entries[index_lda].class, db->entries[index_lda].name);
-		if ( db->ica ) printf("\tICA2: (class %d) \'%s\'\n", db->entries[index_ica].class, db->entries[index_ica].name);
-		putchar('\n');
+	db_train_projections(db, X, low_memory);
+}
+
+/**
+ * Compute the column norms, fused projection matrix, quantized
+ * matrices and HNSW graphs of a trained database.
+ *
+ * @param db  pointer to database
+ */
+void db_train_index(database_t *db)
+{
+	PROF_BEGIN(index);
+
+	db_compute_norms(db);
+	db_fuse_projections(db);
+
+	if ( db->quantize ) {
+		db_quantize(db);
 	}
 
-	// cleanup
-	image_destruct(image);
-	m_free(T_i);
+	if ( db->ann ) {
+		db_index(db, 1);
+	}
+
+	PROF_END(index, PROF_TRAIN_INDEX);
+}
+
+/**
+ * Train a database with an image matrix in memory, whose
+ * columns are the images of db->entries.
+ *
+ * @param db  pointer to database
+ * @param X   pointer to image matrix, which is freed
+ */
+void db_train_matrix(database_t *db, matrix_t *X)
+{
+	db_train_exact(db, X);
+	db_train_index(db);
+}
+
+/**
+ * Set the image geometry of a database from a preprocessed
+ * image, so that images from other sources, such as cropped
+ * faces, can be resized to match the training images.
+ *
+ * @param db    pointer to database
+ * @param path  image filename
+ */
+void db_set_geometry(database_t *db, const char *path)
+{
+	image_t *image = image_construct();
+
+	image_read(image, path);
+	image_preprocess(image, &db->prep);
+
+	db->image_width = image->width;
+	db->image_height = image->height;
+	db->image_channels = image->channels;
+
+	image_destruct(image);
+}
+
+/**
+ * Train a database with a set of images.
+ *
+ * If the database has a cache directory, the image matrix and
+ * the PCA representation are read from the training cache when
+ * it has an entry for the training set, and Infomax resumes from
+ * the last checkpoint of the training set (see cache.c).
+ *
+ * @param db	pointer to database
+ * @param path  directory of training images
+ */
+void db_train(database_t *db, const char *path)
+{
+	db->num_images = get_image_entries(path, &db->entries, &db->num_classes);
+
+	db_set_geometry(db, db->entries[0].name);
+
+	db->num_dimensions = db->image_channels * db->image_height * db->image_width;
+
+	// resume the training of ICA from a checkpoint in the cache
+	if ( db->cache_dir != NULL && db->ica && db->ica_params.engine == ICA_ENGINE_INFOMAX ) {
+		db->ica_params.checkpoint = db_cache_checkpoint(db);
+	}
+
+	matrix_t *X;
+
+	if ( db->pca_randomized ) {
+		db_train_randomized(db);
+		db_train_index(db);
+	}
+	else if ( db->cache_dir != NULL && !db_train_low_memory(db) && db_cache_load(db, &X) ) {
+		db_train_projections(db, X, 0);
+		db_train_index(db);
+	}
+	else {
+		PROF_BEGIN(load);
+		X = get_image_matrix(db->entries, db->num_images, &db->prep, db->io_threads);
+		PROF_END(load, PROF_TRAIN_LOAD);
+
+		db_train_matrix(db, X);
+	}
+
+	free(db->ica_params.checkpoint);
+	db->ica_params.checkpoint = NULL;
+}
+
+/**
+ * Save a database to the file system.
+ *
+ * The database is written to a temporary file which then
+ * replaces the file at path, so that processes which have
+ * mapped the previous file are not affected.
+ *
+ * @param db    pointer to database
+ * @param path  path to save database file
+ */
+void db_save(database_t *db, const char *path)
+{
+	char *path_temp = (char *)malloc(strlen(path) + 5);
+	sprintf(path_temp, "%s.tmp", path);
+
+	dbfile_header_t header = {
+		.num_classes = db->num_classes,
+		.num_images = db->num_images,
+		.num_dimensions = db->num_dimensions,
+		.precision = db->precision,
+		.image_width = db->image_width,
+		.image_height = db->image_height,
+		.image_channels = db->image_channels
+	};
+
+	dbfile_writer_t writer;
+	dbfile_create(&writer, path_temp, &header);
+
+	// save the image entries as (class, name offset) pairs
+	// and the image filenames as a string table
+	int32_t *entries = (int32_t *)malloc(2 * db->num_images * sizeof(int32_t));
+	size_t names_size = 0;
+
+	int i;
+	for ( i = 0; i < db->num_images; i++ ) {
+		entries[2 * i] = db->entries[i].class;
+		entries[2 * i + 1] = names_size;
+		names_size += strlen(db->entries[i].name) + 1;
+	}
+
+	char *names = (char *)malloc(names_size);
+
+	for ( i = 0; i < db->num_images; i++ ) {
+		strcpy(names + entries[2 * i + 1], db->entries[i].name);
+	}
+
+	dbfile_write(&writer, SECTION_ENTRIES, DBFILE_INT32, 2, db->num_images, entries, 2 * db->num_images * sizeof(int32_t));
+	dbfile_write(&writer, SECTION_NAMES, DBFILE_BYTES, 1, names_size, names, names_size);
+
+	free(entries);
+	free(names);
+
+	// save the preprocessing parameters
+	int32_t prep[4] = {
+		db->prep.grayscale,
+		db->prep.width,
+		db->prep.height,
+		db->prep.equalize
+	};
+
+	dbfile_write(&writer, SECTION_PREPROCESS, DBFILE_INT32, 4, 1, prep, sizeof(prep));
+
+	// save the mean face and PCA/LDA/ICA representations
+	dbfile_write_matrix(&writer, SECTION_MEAN_FACE, db->mean_face);
+	dbfile_write_matrix(&writer, SECTION_W_PCA, db->W_pca_tr);
+	dbfile_write_matrix(&writer, SECTION_P_PCA, db->P_pca);
+	dbfile_write_matrix(&writer, SECTION_P_PCA_NORM, db->P_pca_norm);
+
+	if ( db->Q_pca != NULL ) {
+		dbfile_write_qmatrix(&writer, SECTION_Q_PCA, db->Q_pca);
+	}
+
+	if ( db->H_pca != NULL ) {
+		dbfile_write_hnsw(&writer, SECTION_H_PCA, db->H_pca);
+	}
+
+	if ( db->lda ) {
+		dbfile_write_matrix(&writer, SECTION_W_LDA, db->W_lda_tr);
+		dbfile_write_matrix(&writer, SECTION_P_LDA, db->P_lda);
+		dbfile_write_matrix(&writer, SECTION_P_LDA_NORM, db->P_lda_norm);
+
+		if ( db->Q_lda != NULL ) {
+			dbfile_write_qmatrix(&writer, SECTION_Q_LDA, db->Q_lda);
+		}
+
+		if ( db->H_lda != NULL ) {
+			dbfile_write_hnsw(&writer, SECTION_H_LDA, db->H_lda);
+		}
+	}
+
+	if ( db->ica ) {
+		int32_t architecture = db->ica_params.architecture;
+
+		dbfile_write(&writer, SECTION_ICA_ARCHITECTURE, DBFILE_INT32, 1, 1, &architecture, sizeof(architecture));
+		dbfile_write_matrix(&writer, SECTION_W_ICA, db->W_ica_tr);
+		dbfile_write_matrix(&writer, SECTION_P_ICA, db->P_ica);
+		dbfile_write_matrix(&writer, SECTION_P_ICA_NORM, db->P_ica_norm);
+
+		if ( db->Q_ica != NULL ) {
+			dbfile_write_qmatrix(&writer, SECTION_Q_ICA, db->Q_ica);
+		}
+
+		if ( db->H_ica != NULL ) {
+			dbfile_write_hnsw(&writer, SECTION_H_ICA, db->H_ica);
+		}
+	}
+
+	dbfile_close_writer(&writer);
+
+	if ( rename(path_temp, path) != 0 ) {
+		perror("rename");
+		exit(1);
+	}
+
+	free(path_temp);
+}
+
+/**
+ * Read the ICA architecture of a database file. Databases which
+ * were saved before Architecture I was added use Architecture II.
+ *
+ * @param file  pointer to database file
+ * @return 1 or 2
+ */
+int db_read_ica_architecture(dbfile_t *file)
+{
+	dbfile_section_t *section = dbfile_find(file, SECTION_ICA_ARCHITECTURE);
+
+	if ( section == NULL ) {
+		return 2;
+	}
+
+	const int32_t *architecture = (const int32_t *)dbfile_data(file, section);
+
+	if ( section->rows != 1 || section->cols != 1 || (*architecture != 1 && *architecture != 2) ) {
+		fprintf(stderr, "error: database file has an invalid ICA architecture\n");
+		exit(1);
+	}
+
+	return *architecture;
+}
+
+/**
+ * Read a required matrix section from the database file.
+ *
+ * @param db  pointer to database
+ * @param id  section id
+ * @return pointer to matrix
+ */
+matrix_t * db_read_matrix(database_t *db, int id)
+{
+	matrix_t *M = dbfile_read_matrix(db->file, id);
+
+	if ( M == NULL ) {
+		fprintf(stderr, "error: database file is missing section %d\n", id);
+		exit(1);
+	}
+
+	return M;
+}
+
+/**
+ * Get whether a quantized matrix has the same shape as
+ * the matrix that it represents.
+ *
+ * @param Q  pointer to quantized matrix
+ * @param P  pointer to matrix
+ * @return 1 if Q and P have the same shape, 0 otherwise
+ */
+int db_qmatrix_matches(qmatrix_t *Q, matrix_t *P)
+{
+	return Q->rows == P->rows && Q->cols == P->cols;
+}
+
+/**
+ * Load a database from the file system.
+ *
+ * The database file is mapped into memory, and the matrices
+ * and image filenames of the database refer directly to the
+ * mapping, so that nothing is copied when the database is
+ * loaded.
+ *
+ * @param db    pointer to database
+ * @param path  path to read database file
+ */
+void db_load(database_t *db, const char *path)
+{
+	db->file = dbfile_open(path);
+	db->num_classes = db->file->header->num_classes;
+	db->num_images = db->file->header->num_images;
+	db->num_dimensions = db->file->header->num_dimensions;
+	db->image_width = db->file->header->image_width;
+	db->image_height = db->file->header->image_height;
+	db->image_channels = db->file->header->image_channels;
+
+	// get the preprocessing parameters, which are absent from
+	// databases that were trained without preprocessing
+	dbfile_section_t *section_prep = dbfile_find(db->file, SECTION_PREPROCESS);
+
+	if ( section_prep != NULL ) {
+		const int32_t *prep = (const int32_t *)dbfile_data(db->file, section_prep);
+
+		if ( section_prep->type != DBFILE_INT32
+		  || section_prep->rows != 4 || section_prep->cols != 1
+		  || section_prep->size != 4 * sizeof(int32_t)
+		  || (prep[0] != 0 && prep[0] != 1)
+		  || prep[1] < 0 || prep[2] < 0
+		  || (prep[3] != 0 && prep[3] != 1) ) {
+			fprintf(stderr, "error: database file has invalid preprocessing parameters\n");
+			exit(1);
+		}
+
+		db->prep.grayscale = prep[0];
+		db->prep.width = prep[1];
+		db->prep.height = prep[2];
+		db->prep.equalize = prep[3];
+	}
+
+	if ( db->lda && dbfile_find(db->file, SECTION_W_LDA) == NULL ) {
+		fprintf(stderr, "error: database was not trained with LDA\n");
+		exit(1);
+	}
+
+	if ( db->ica && dbfile_find(db->file, SECTION_W_ICA) == NULL ) {
+		fprintf(stderr, "error: database was not trained with %s\n", db_ica_label(db));
+		exit(1);
+	}
+
+	if ( db->ica && db_read_ica_architecture(db->file) != db->ica_params.architecture ) {
+		fprintf(stderr, "error: database was trained with ICA%d, not %s\n", db_read_ica_architecture(db->file), db_ica_label(db));
+		exit(1);
+	}
+
+	// get mean face, PCA output, LDA output, and ICA output
+	db->mean_face = db_read_matrix(db, SECTION_MEAN_FACE);
+	db->W_pca_tr = db_read_matrix(db, SECTION_W_PCA);
+	db->P_pca = db_read_matrix(db, SECTION_P_PCA);
+	db->P_pca_norm = db_read_matrix(db, SECTION_P_PCA_NORM);
+	db->Q_pca = dbfile_read_qmatrix(db->file, SECTION_Q_PCA);
+	db->H_pca = dbfile_read_hnsw(db->file, SECTION_H_PCA);
+
+	if ( db->lda ) {
+		db->W_lda_tr = db_read_matrix(db, SECTION_W_LDA);
+		db->P_lda = db_read_matrix(db, SECTION_P_LDA);
+		db->P_lda_norm = db_read_matrix(db, SECTION_P_LDA_NORM);
+		db->Q_lda = dbfile_read_qmatrix(db->file, SECTION_Q_LDA);
+		db->H_lda = dbfile_read_hnsw(db->file, SECTION_H_LDA);
+	}
+
+	if ( db->ica ) {
+		db->W_ica_tr = db_read_matrix(db, SECTION_W_ICA);
+		db->P_ica = db_read_matrix(db, SECTION_P_ICA);
+		db->P_ica_norm = db_read_matrix(db, SECTION_P_ICA_NORM);
+		db->Q_ica = dbfile_read_qmatrix(db->file, SECTION_Q_ICA);
+		db->H_ica = dbfile_read_hnsw(db->file, SECTION_H_ICA);
+	}
+
+	if ( db->mean_face->rows != db->num_dimensions || db->P_pca->cols != db->num_images ) {
+		fprintf(stderr, "error: database file is inconsistent\n");
+		exit(1);
+	}
+
+	if ( (db->Q_pca && !db_qmatrix_matches(db->Q_pca, db->P_pca))
+	  || (db->lda && db->Q_lda && !db_qmatrix_matches(db->Q_lda, db->P_lda))
+	  || (db->ica && db->Q_ica && !db_qmatrix_matches(db->Q_ica, db->P_ica)) ) {
+		fprintf(stderr, "error: database file has inconsistent quantized matrices\n");
+		exit(1);
+	}
+
+	if ( (db->H_pca && db->H_pca->num_nodes != db->P_pca->cols)
+	  || (db->lda && db->H_lda && db->H_lda->num_nodes != db->P_lda->cols)
+	  || (db->ica && db->H_ica && db->H_ica->num_nodes != db->P_ica->cols) ) {
+		fprintf(stderr, "error: database file has inconsistent ANN indices\n");
+		exit(1);
+	}
+
+	// get image entries
+	dbfile_section_t *section_entries = dbfile_find(db->file, SECTION_ENTRIES);
+	dbfile_section_t *section_names = dbfile_find(db->file, SECTION_NAMES);
+
+	if ( section_entries == NULL || section_names == NULL || section_entries->cols != db->num_images ) {
+		fprintf(stderr, "error: database file is missing image entries\n");
+		exit(1);
+	}
+
+	const int32_t *entries = (const int32_t *)dbfile_data(db->file, section_entries);
+	const char *names = (const char *)dbfile_data(db->file, section_names);
+
+	// each name must start within the names section and end with
+	// a null terminator before the end of the section
+	if ( section_entries->type != DBFILE_INT32
+	  || section_entries->rows != 2
+	  || section_entries->size != 2 * (uint64_t)db->num_images * sizeof(int32_t)
+	  || (db->num_images > 0 && (section_names->size == 0 || names[section_names->size - 1] != '\0')) ) {
+		fprintf(stderr, "error: database file has invalid image entries\n");
+		exit(1);
+	}
+
+	int i;
+	for ( i = 0; i < db->num_images; i++ ) {
+		if ( entries[2 * i + 1] < 0 || (uint64_t)entries[2 * i + 1] >= section_names->size ) {
+			fprintf(stderr, "error: database file has invalid image entries\n");
+			exit(1);
+		}
+	}
+
+	db->entries = (database_entry_t *)malloc(db->num_images * sizeof(database_entry_t));
+
+	for ( i = 0; i < db->num_images; i++ ) {
+		db->entries[i].class = entries[2 * i];
+		db->entries[i].name = (char *)names + entries[2 * i + 1];
+	}
+
+	db_fuse_projections(db);
+}
+
+/**
+ * Load a database from the file system with every
+ * representation that it contains.
+ *
+ * @param db    pointer to database
+ * @param path  path to read database file
+ */
+void db_load_all(database_t *db, const char *path)
+{
+	dbfile_t *file = dbfile_open(path);
+
+	db->lda = (dbfile_find(file, SECTION_W_LDA) != NULL);
+	db->ica = (dbfile_find(file, SECTION_W_ICA) != NULL);
+	db->ica_params.architecture = db_read_ica_architecture(file);
+
+	dbfile_close(file);
+
+	db_load(db, path);
+}
+
+/**
+ * Get the class name of an image, which is the name of
+ * the directory that contains the image.
+ *
+ * @param name    image filename
+ * @param length  pointer to store length of class name
+ * @return pointer to class name within name
+ */
+const char * get_class_name(const char *name, int *length)
+{
+	const char *end = strrchr(name, '/');
+
+	if ( end == NULL ) {
+		*length = 0;
+		return name;
+	}
+
+	const char *begin = end;
+
+	while ( begin > name && begin[-1] != '/' ) {
+		begin--;
+	}
+
+	*length = end - begin;
+
+	return begin;
+}
+
+/**
+ * Find the class of a database which has the same class
+ * name as an image.
+ *
+ * @param db    pointer to database
+ * @param name  image filename
+ * @return class index, or -1 if no class has that name
+ */
+int db_find_class(database_t *db, const char *name)
+{
+	int length;
+	const char *class_name = get_class_name(name, &length);
+
+	int i;
+	for ( i = 0; i < db->num_images; i++ ) {
+		int length_i;
+		const char *class_name_i = get_class_name(db->entries[i].name, &length_i);
+
+		if ( length_i == length && strncmp(class_name_i, class_name, length) == 0 ) {
+			return db->entries[i].class;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Append the projections of a set of new images to a projected
+ * image matrix P of a database.
+ *
+ * Since P = W_tr * (X - mean_face), if the mean face has moved by
+ * delta then every previous column of P is shifted by -W_tr * delta.
+ *
+ * @param db     pointer to database
+ * @param W_tr   pointer to projection matrix
+ * @param P      pointer to projected image matrix
+ * @param delta  pointer to change in mean face, or NULL
+ * @param X_new  pointer to mean-subtracted image matrix of new images
+ * @return pointer to new projected image matrix, which replaces P
+ */
+matrix_t * db_append_projection(database_t *db, matrix_t *W_tr, matrix_t *P, matrix_t *delta, matrix_t *X_new)
+{
+	matrix_t *P_new = m_product(W_tr, X_new);
+	matrix_t *C = m_initialize(P->rows, P->cols + P_new->cols);
+
+	memcpy(C->data, P->data, (size_t)P->rows * P->cols * sizeof(precision_t));
+	memcpy(&elem(C, 0, P->cols), P_new->data, (size_t)P_new->rows * P_new->cols * sizeof(precision_t));
+
+	if ( delta != NULL ) {
+		matrix_t *shift = m_product(W_tr, delta);
+
+		int i, j;
+		for ( j = 0; j < P->cols; j++ ) {
+			for ( i = 0; i < P->rows; i++ ) {
+				elem(C, i, j) -= elem(shift, i, 0);
+			}
+		}
+
+		m_free(shift);
+	}
+
+	m_free(P_new);
+	db_free_matrix(db, P);
+
+	return C;
+}
+
+/**
+ * Update the PCA representation of a database with a set of
+ * new images, using incremental PCA.
+ *
+ * The previous images are not read again. Instead, their PCA
+ * coefficients are mapped into the new basis, which is exact for
+ * the part of each image that lies in the previous basis. The
+ * new images are not added to P_pca.
+ *
+ * @param db     pointer to database
+ * @param X_new  pointer to image matrix of new images
+ * @return pointer to change in mean face
+ */
+matrix_t * db_update_pca(database_t *db, matrix_t *X_new)
+{
+	matrix_t *W_pca_tr = db->W_pca_tr;
+	matrix_t *mean_face = db->mean_face;
+	int n = db->num_images;
+
+	// update the basis and the mean face with each block of new images
+	int i, j;
+	for ( i = 0; i < X_new->cols; i += TRAIN_BLOCK_SIZE ) {
+		int end = (i + TRAIN_BLOCK_SIZE < X_new->cols) ? i + TRAIN_BLOCK_SIZE : X_new->cols;
+		matrix_t *B = m_copy_columns(X_new, i, end);
+
+		matrix_t *W_pca_tr_next = PCA_incremental(W_pca_tr, mean_face, n, B);
+		matrix_t *mean_B = m_mean_column(B);
+		matrix_t *mean_face_next = m_initialize(mean_face->rows, 1);
+
+		for ( j = 0; j < mean_face->rows; j++ ) {
+			elem(mean_face_next, j, 0) = (n * elem(mean_face, j, 0) + B->cols * elem(mean_B, j, 0)) / (n + B->cols);
+		}
+
+		if ( W_pca_tr != db->W_pca_tr ) {
+			m_free(W_pca_tr);
+			m_free(mean_face);
+		}
+
+		W_pca_tr = W_pca_tr_next;
+		mean_face = mean_face_next;
+		n += B->cols;
+
+		m_free(B);
+		m_free(mean_B);
+	}
+
+	// map the previous coefficients into the new basis,
+	//   P_pca = W_pca' * (W_pca_0 * S_0^-2 * P_pca_0 + mean_face_0 - mean_face)
+	matrix_t *W_pca_0 = m_transpose(db->W_pca_tr);
+	matrix_t *S_0 = m_norm_columns(W_pca_0);
+
+	for ( j = 0; j < W_pca_0->cols; j++ ) {
+		precision_t s = elem(S_0, j, 0);
+		precision_t c = (s > 0) ? 1 / (s * s) : 0;
+
+		for ( i = 0; i < W_pca_0->rows; i++ ) {
+			elem(W_pca_0, i, j) *= c;
+		}
+	}
+
+	matrix_t *M = m_product(W_pca_tr, W_pca_0);
+	matrix_t *P_pca_0 = m_product(M, db->P_pca);
+	matrix_t *delta = m_copy(mean_face);
+
+	m_subtract(delta, db->mean_face);
+
+	matrix_t *shift = m_product(W_pca_tr, delta);
+
+	m_subtract_columns(P_pca_0, shift);
+
+	// replace the PCA representation
+	db_free_matrix(db, db->P_pca);
+	db_free_matrix(db, db->W_pca_tr);
+	db_free_matrix(db, db->mean_face);
+	db->W_pca_tr = W_pca_tr;
+	db->mean_face = mean_face;
+
+	m_free(W_pca_0);
+	m_free(S_0);
+	m_free(M);
+	m_free(shift);
+
+	db->P_pca = P_pca_0;
+
+	return delta;
+}
+
+/**
+ * Enroll a set of images into a database without retraining.
+ *
+ * The directory should contain a subdirectory for each class, as
+ * with db_train(). A subdirectory with the same name as a class in
+ * the database adds images to that class, and any other subdirectory
+ * adds a new class. The new images are projected with the existing
+ * projection matrices, unless db->update_pca is set, in which case
+ * the mean face and the PCA basis are updated as well. The new
+ * images are added to the ANN index of the database, if any.
+ *
+ * @param db    pointer to database
+ * @param path  directory of images to enroll
+ */
+void db_enroll(database_t *db, const char *path)
+{
+	database_entry_t *entries;
+	int num_classes;
+	int num_images = get_image_entries(path, &entries, &num_classes);
+
+	if ( !db->quiet ) printf("Enrolling %d images...\n", num_images);
+
+	// map each class to a class of the database by name
+	int *classes = (int *)malloc(num_classes * sizeof(int));
+
+	int i, j;
+	for ( i = 0; i < num_classes; i++ ) {
+		classes[i] = -1;
+	}
+
+	for ( i = 0; i < num_images; i++ ) {
+		int class = entries[i].class;
+
+		if ( classes[class] == -1 ) {
+			classes[class] = db_find_class(db, entries[i].name);
+
+			if ( classes[class] == -1 ) {
+				classes[class] = db->num_classes++;
+			}
+		}
+
+		entries[i].class = classes[class];
+	}
+
+	// compute the image matrix X_new of the new images
+	matrix_t *X_new = get_image_matrix(entries, num_images, &db->prep, db->io_threads);
+
+	if ( X_new->rows != db->num_dimensions ) {
+		fprintf(stderr, "error: enrolled images must have the same size as the training images\n");
+		exit(1);
+	}
+
+	// update the PCA representation, or use the existing representation
+	matrix_t *delta = NULL;
+
+	if ( db->update_pca ) {
+		delta = db_update_pca(db, X_new);
+	}
+
+	// project the new images
+	m_subtract_columns(X_new, db->mean_face);
+
+	db->P_pca = db_append_projection(db, db->W_pca_tr, db->P_pca, NULL, X_new);
+
+	if ( db->lda ) {
+		db->P_lda = db_append_projection(db, db->W_lda_tr, db->P_lda, delta, X_new);
+	}
+
+	if ( db->ica ) {
+		db->P_ica = db_append_projection(db, db->W_ica_tr, db->P_ica, delta, X_new);
+	}
+
+	// append the new entries
+	db->entries = (database_entry_t *)realloc(db->entries, (db->num_images + num_images) * sizeof(database_entry_t));
+
+	for ( j = 0; j < num_images; j++ ) {
+		db->entries[db->num_images + j] = entries[j];
+	}
+
+	db->num_images += num_images;
+
+	// recompute the column norms and quantized matrices
+	db_free_matrix(db, db->P_pca_norm);
+	db->quantize |= (db->Q_pca != NULL);
+	db_free_qmatrix(db, db->Q_pca);
+	db->Q_pca = NULL;
+
+	if ( db->lda ) {
+		db_free_matrix(db, db->P_lda_norm);
+		db_free_qmatrix(db, db->Q_lda);
+		db->Q_lda = NULL;
+	}
+
+	if ( db->ica ) {
+		db_free_matrix(db, db->P_ica_norm);
+		db_free_qmatrix(db, db->Q_ica);
+		db->Q_ica = NULL;
+	}
+
+	db_compute_norms(db);
+
+	if ( db->update_pca ) {
+		db_fuse_projections(db);
+	}
+
+	if ( db->quantize ) {
+		db_quantize(db);
+	}
+
+	db->ann |= (db->H_pca != NULL);
+
+	if ( db->ann ) {
+		db_index(db, db->update_pca);
+	}
+
+	if ( delta != NULL ) {
+		m_free(delta);
+	}
+	m_free(X_new);
+	free(entries);
+	free(classes);
+}
+
+/**
+ * Minimum number of columns of P for each thread when a single
+ * nearest-neighbor search is split across threads.
+ */
+#define MIN_SLICE_SIZE 256
+
+/**
+ * Compute the distance between a column of a matrix P and
+ * a column of a test matrix P_test.
+ *
+ * @param P          pointer to matrix
+ * @param P_norm     pointer to column norms of P
+ * @param j          column index of P
+ * @param P_test     pointer to matrix of test vectors
+ * @param i          column index of P_test
+ * @param test_norm  norm of column i of P_test
+ * @param dist_type  distance function
+ * @return distance between P_j and P_test_i
+ */
+precision_t nn_distance(matrix_t *P, matrix_t *P_norm, int j, matrix_t *P_test, int i, precision_t test_norm, dist_t dist_type)
+{
+	return (dist_type == DIST_COS)
+		? -m_dot(P_test, i, P, j) / (test_norm * elem(P_norm, j, 0))
+		: m_dist_L2(P_test, i, P, j);
+}
+
+typedef struct {
+	int k;
+	int num;
+	db_match_t *heap;
+	aggregate_t aggregate;
+	database_entry_t *entries;
+	int num_classes;
+	precision_t *class_min;
+	precision_t *class_sum;
+	int *class_count;
+	int *class_index;
+} nn_collector_t;
+
+/**
+ * Get whether a match precedes another match, by distance
+ * and then by index.
+ *
+ * @param a
+ * @param b
+ * @return 1 if a precedes b, 0 otherwise
+ */
+int nn_less(db_match_t a, db_match_t b)
+{
+	return a.dist < b.dist || (a.dist == b.dist && a.index < b.index);
+}
+
+/**
+ * Restore the order of a bounded max-heap of matches from
+ * a position downward.
+ *
+ * @param heap  pointer to heap
+ * @param num   size of heap
+ * @param k     position
+ */
+void nn_heap_sift_down(db_match_t *heap, int num, int k)
+{
+	db_match_t m = heap[k];
+
+	while ( 2 * k + 1 < num ) {
+		int child = 2 * k + 1;
+
+		if ( child + 1 < num && nn_less(heap[child], heap[child + 1]) ) {
+			child++;
+		}
+
+		if ( !nn_less(m, heap[child]) ) {
+			break;
+		}
+
+		heap[k] = heap[child];
+		k = child;
+	}
+
+	heap[k] = m;
+}
+
+/**
+ * Add a match to a bounded max-heap of the k best matches,
+ * which replaces the worst match when the heap is full.
+ *
+ * @param c  pointer to collector
+ * @param m  match
+ */
+void nn_heap_push(nn_collector_t *c, db_match_t m)
+{
+	if ( c->num == c->k ) {
+		if ( nn_less(m, c->heap[0]) ) {
+			c->heap[0] = m;
+			nn_heap_sift_down(c->heap, c->num, 0);
+		}
+		return;
+	}
+
+	int k = c->num++;
+
+	while ( k > 0 && nn_less(c->heap[(k - 1) / 2], m) ) {
+		c->heap[k] = c->heap[(k - 1) / 2];
+		k = (k - 1) / 2;
+	}
+
+	c->heap[k] = m;
+}
+
+/**
+ * Initialize a collector of the best matches of a test image.
+ *
+ * Each candidate is added to a bounded heap of the db->top_k best
+ * matches, so that the matches are found without sorting every
+ * candidate. If db->aggregate is set, the candidates are instead
+ * aggregated by class, and the heap holds the best classes.
+ *
+ * @param c   pointer to collector
+ * @param db  pointer to database
+ */
+void nn_collector_init(nn_collector_t *c, database_t *db)
+{
+	c->k = db->top_k;
+	c->num = 0;
+	c->heap = (db_match_t *)malloc(c->k * sizeof(db_match_t));
+	c->aggregate = db->aggregate;
+	c->entries = db->entries;
+	c->num_classes = db->num_classes;
+
+	if ( c->aggregate != AGGREGATE_NONE ) {
+		c->class_min = (precision_t *)malloc(c->num_classes * sizeof(precision_t));
+		c->class_sum = (precision_t *)calloc(c->num_classes, sizeof(precision_t));
+		c->class_count = (int *)calloc(c->num_classes, sizeof(int));
+		c->class_index = (int *)malloc(c->num_classes * sizeof(int));
+	}
+}
+
+/**
+ * Free a collector.
+ *
+ * @param c  pointer to collector
+ */
+void nn_collector_free(nn_collector_t *c)
+{
+	free(c->heap);
+
+	if ( c->aggregate != AGGREGATE_NONE ) {
+		free(c->class_min);
+		free(c->class_sum);
+		free(c->class_count);
+		free(c->class_index);
+	}
+}
+
+/**
+ * Add a candidate to a collector.
+ *
+ * @param c      pointer to collector
+ * @param index  column index of candidate
+ * @param dist   distance of candidate
+ */
+void nn_collector_add(nn_collector_t *c, int index, precision_t dist)
+{
+	int class = c->entries[index].class;
+
+	if ( c->aggregate == AGGREGATE_NONE ) {
+		db_match_t m = { index, class, dist };
+
+		nn_heap_push(c, m);
+		return;
+	}
+
+	if ( c->class_count[class] == 0 || dist < c->class_min[class] || (dist == c->class_min[class] && index < c->class_index[class]) ) {
+		c->class_min[class] = dist;
+		c->class_index[class] = index;
+	}
+
+	c->class_sum[class] += dist;
+	c->class_count[class]++;
+}
+
+/**
+ * Merge the candidates of a collector into another collector.
+ *
+ * @param c      pointer to collector
+ * @param other  pointer to collector to merge
+ */
+void nn_collector_merge(nn_collector_t *c, nn_collector_t *other)
+{
+	int j;
+
+	if ( c->aggregate == AGGREGATE_NONE ) {
+		for ( j = 0; j < other->num; j++ ) {
+			nn_heap_push(c, other->heap[j]);
+		}
+		return;
+	}
+
+	for ( j = 0; j < c->num_classes; j++ ) {
+		if ( other->class_count[j] == 0 ) {
+			continue;
+		}
+
+		if ( c->class_count[j] == 0 || other->class_min[j] < c->class_min[j]
+		  || (other->class_min[j] == c->class_min[j] && other->class_index[j] < c->class_index[j]) ) {
+			c->class_min[j] = other->class_min[j];
+			c->class_index[j] = other->class_index[j];
+		}
+
+		c->class_sum[j] += other->class_sum[j];
+		c->class_count[j] += other->class_count[j];
+	}
+}
+
+/**
+ * Store the best matches of a collector in order of increasing
+ * distance. Matches with a distance greater than the threshold
+ * are rejected, and the remaining entries of matches are filled
+ * with an index of -1.
+ *
+ * @param c          pointer to collector
+ * @param threshold  rejection threshold
+ * @param matches    pointer to store c->k matches
+ */
+void nn_collector_finish(nn_collector_t *c, precision_t threshold, db_match_t *matches)
+{
+	int j;
+
+	// find the best classes
+	if ( c->aggregate != AGGREGATE_NONE ) {
+		for ( j = 0; j < c->num_classes; j++ ) {
+			if ( c->class_count[j] > 0 ) {
+				db_match_t m = {
+					c->class_index[j],
+					j,
+					(c->aggregate == AGGREGATE_BEST)
+						? c->class_min[j]
+						: c->class_sum[j] / c->class_count[j]
+				};
+
+				nn_heap_push(c, m);
+			}
+		}
+	}
+
+	// sort the heap in place
+	int num = c->num;
+
+	for ( j = num - 1; j > 0; j-- ) {
+		db_match_t m = c->heap[0];
+
+		c->heap[0] = c->heap[j];
+		c->heap[j] = m;
+		nn_heap_sift_down(c->heap, j, 0);
+	}
+
+	// store the matches within the threshold
+	int num_matches = 0;
+
+	for ( j = 0; j < num; j++ ) {
+		if ( c->heap[j].dist <= threshold ) {
+			matches[num_matches++] = c->heap[j];
+		}
+	}
+
+	for ( j = num_matches; j < c->k; j++ ) {
+		matches[j].index = -1;
+		matches[j].class = -1;
+		matches[j].dist = 0;
+	}
+}
+
+typedef struct {
+	matrix_t *P;
+	matrix_t *P_norm;
+	matrix_t *P_test;
+	int i;
+	dist_t dist_type;
+	nn_collector_t *collectors;
+} nn_slice_args_t;
+
+/**
+ * Add the distance of each column vector in a slice [begin, end)
+ * of a matrix P from a test vector to a collector.
+ *
+ * @param arg    pointer to nn_slice_args_t
+ * @param begin  begin index
+ * @param end    end index
+ * @param id     slice index
+ */
+void nearest_neighbor_slice(void *arg, int begin, int end, int id)
+{
+	nn_slice_args_t *args = (nn_slice_args_t *)arg;
+	matrix_t *P_test = args->P_test;
+	int i = args->i;
+
+	precision_t test_norm = sqrt(m_dot(P_test, i, P_test, i));
+
+	int j;
+	for ( j = begin; j < end; j++ ) {
+		precision_t dist = nn_distance(args->P, args->P_norm, j, P_test, i, test_norm, args->dist_type);
+
+		nn_collector_add(&args->collectors[id], j, dist);
+	}
+}
+
+/**
+ * Find the best matches in a matrix P for a column of a test
+ * matrix P_test.
+ *
+ * The columns of P are split into slices which are searched in
+ * parallel, each with its own collector, and the collectors are
+ * merged, so that ties are broken by the lowest index just as in
+ * a serial search.
+ *
+ * @param db           pointer to database
+ * @param P            pointer to matrix
+ * @param P_norm       pointer to column norms of P
+ * @param P_test       pointer to matrix of test vectors
+ * @param i            column index of P_test
+ * @param dist_type    distance function
+ * @param num_threads  number of threads
+ * @param threshold    rejection threshold
+ * @param matches      pointer to store db->top_k matches
+ */
+void nearest_neighbor(database_t *db, matrix_t *P, matrix_t *P_norm, matrix_t *P_test, int i, dist_t dist_type, int num_threads, precision_t threshold, db_match_t *matches)
+{
+	int num_slices = P->cols / MIN_SLICE_SIZE;
+
+	if ( num_slices > num_threads ) {
+		num_slices = num_threads;
+	}
+	if ( num_slices < 1 ) {
+		num_slices = 1;
+	}
+
+	nn_collector_t *collectors = (nn_collector_t *)malloc(num_slices * sizeof(nn_collector_t));
+
+	int j;
+	for ( j = 0; j < num_slices; j++ ) {
+		nn_collector_init(&collectors[j], db);
+	}
+
+	nn_slice_args_t args = {
+		.P = P,
+		.P_norm = P_norm,
+		.P_test = P_test,
+		.i = i,
+		.dist_type = dist_type,
+		.collectors = collectors
+	};
+
+	parallel_for(num_slices, P->cols, nearest_neighbor_slice, &args);
+
+	// merge the collector of each slice
+	for ( j = 1; j < num_slices; j++ ) {
+		nn_collector_merge(&collectors[0], &collectors[j]);
+	}
+
+	nn_collector_finish(&collectors[0], threshold, matches);
+
+	for ( j = 0; j < num_slices; j++ ) {
+		nn_collector_free(&collectors[j]);
+	}
+	free(collectors);
+}
+
+/**
+ * Find the best matches in a matrix P for a column of a test
+ * matrix P_test, using a quantized copy Q of P.
+ *
+ * The distance to every column of Q is approximated with integer
+ * dot products, and the rerank columns with the smallest
+ * approximate distances are compared again with P using exact
+ * distances. Only those columns of P are accessed, so P may
+ * remain on disk in a mapped database file. Classes are
+ * aggregated over the re-ranked columns.
+ *
+ * @param db         pointer to database
+ * @param P          pointer to matrix
+ * @param P_norm     pointer to column norms of P
+ * @param Q          pointer to quantized matrix of P
+ * @param P_test     pointer to matrix of test vectors
+ * @param i          column index of P_test
+ * @param dist_type  distance function
+ * @param threshold  rejection threshold
+ * @param matches    pointer to store db->top_k matches
+ */
+void nearest_neighbor_quantized(database_t *db, matrix_t *P, matrix_t *P_norm, qmatrix_t *Q, matrix_t *P_test, int i, dist_t dist_type, precision_t threshold, db_match_t *matches)
+{
+	int rerank = (db->rerank > db->top_k) ? db->rerank : db->top_k;
+
+	if ( rerank > P->cols ) {
+		rerank = P->cols;
+	}
+
+	int8_t *x = (int8_t *)malloc(Q->rows * sizeof(int8_t));
+	int *candidates = (int *)malloc(rerank * sizeof(int));
+	precision_t *candidate_dists = (precision_t *)malloc(rerank * sizeof(precision_t));
+	int num_candidates = 0;
+
+	int32_t offset;
+	precision_t t = q_quantize_vector(Q, P_test, i, x, &offset);
+	precision_t test_norm = sqrt(m_dot(P_test, i, P_test, i));
+
+	// find the candidates with the smallest approximate distances
+	int j, k;
+	for ( j = 0; j < Q->cols; j++ ) {
+		precision_t dot = t * (q_dot(x, q_column(Q, j), Q->rows) - offset);
+		precision_t norm = elem(P_norm, j, 0);
+		precision_t dist = (dist_type == DIST_COS)
+			? -dot / (test_norm * norm)
+			: test_norm * test_norm - 2 * dot + norm * norm;
+
+		if ( num_candidates == rerank && dist >= candidate_dists[rerank - 1] ) {
+			continue;
+		}
+
+		// insert the column into the sorted list of candidates
+		k = (num_candidates < rerank)
+			? num_candidates++
+			: rerank - 1;
+
+		while ( k > 0 && candidate_dists[k - 1] > dist ) {
+			candidates[k] = candidates[k - 1];
+			candidate_dists[k] = candidate_dists[k - 1];
+			k--;
+		}
+
+		candidates[k] = j;
+		candidate_dists[k] = dist;
+	}
+
+	// re-rank the candidates with exact distances
+	nn_collector_t c;
+	nn_collector_init(&c, db);
+
+	for ( k = 0; k < num_candidates; k++ ) {
+		j = candidates[k];
+
+		nn_collector_add(&c, j, nn_distance(P, P_norm, j, P_test, i, test_norm, dist_type));
+	}
+
+	nn_collector_finish(&c, threshold, matches);
+	nn_collector_free(&c);
+
+	free(x);
+	free(candidates);
+	free(candidate_dists);
+}
+
+/**
+ * Find the best matches in a matrix P for a column of a test
+ * matrix P_test, using an HNSW graph H of P. At least db->ef
+ * candidates are searched, and classes are aggregated over the
+ * candidates.
+ *
+ * @param db         pointer to database
+ * @param P          pointer to matrix
+ * @param P_norm     pointer to column norms of P
+ * @param H          pointer to HNSW graph of P
+ * @param P_test     pointer to matrix of test vectors
+ * @param i          column index of P_test
+ * @param dist_type  distance function
+ * @param threshold  rejection threshold
+ * @param matches    pointer to store db->top_k matches
+ */
+void nearest_neighbor_ann(database_t *db, matrix_t *P, matrix_t *P_norm, hnsw_t *H, matrix_t *P_test, int i, dist_t dist_type, precision_t threshold, db_match_t *matches)
+{
+	int ef = (db->ef > db->top_k) ? db->ef : db->top_k;
+	int num = (db->aggregate != AGGREGATE_NONE) ? ef : db->top_k;
+	int *indices = (int *)malloc(num * sizeof(int));
+	precision_t *dists = (precision_t *)malloc(num * sizeof(precision_t));
+
+	num = hnsw_search(H, P, P_norm, dist_type, P_test, i, ef, num, indices, dists);
+
+	nn_collector_t c;
+	nn_collector_init(&c, db);
+
+	int j;
+	for ( j = 0; j < num; j++ ) {
+		nn_collector_add(&c, indices[j], dists[j]);
+	}
+
+	nn_collector_finish(&c, threshold, matches);
+	nn_collector_free(&c);
+
+	free(indices);
+	free(dists);
+}
+
+typedef struct {
+	database_t *db;
+	matrix_t *P;
+	matrix_t *P_norm;
+	qmatrix_t *Q;
+	hnsw_t *H;
+	matrix_t *P_test;
+	matrix_t *D;
+	dist_t dist_type;
+	int num_threads;
+	precision_t threshold;
+	db_match_t *matches;
+} nn_args_t;
+
+/**
+ * Find the best matches of each projected test image in
+ * a range [begin, end) of columns of P_test, using the quantized
+ * matrix args->Q.
+ *
+ * @param arg    pointer to nn_args_t
+ * @param begin  begin index
+ * @param end    end index
+ * @param id     thread index
+ */
+void nearest_neighbor_quantized_columns(void *arg, int begin, int end, int id)
+{
+	nn_args_t *args = (nn_args_t *)arg;
+	int k = args->db->top_k;
+
+	int j;
+	for ( j = begin; j < end; j++ ) {
+		nearest_neighbor_quantized(args->db, args->P, args->P_norm, args->Q, args->P_test, j, args->dist_type, args->threshold, args->matches + j * k);
+	}
+}
+
+/**
+ * Find the best matches of each projected test image in
+ * a range [begin, end) of columns of P_test, using the HNSW
+ * graph args->H.
+ *
+ * @param arg    pointer to nn_args_t
+ * @param begin  begin index
+ * @param end    end index
+ * @param id     thread index
+ */
+void nearest_neighbor_ann_columns(void *arg, int begin, int end, int id)
+{
+	nn_args_t *args = (nn_args_t *)arg;
+	int k = args->db->top_k;
+
+	int j;
+	for ( j = begin; j < end; j++ ) {
+		nearest_neighbor_ann(args->db, args->P, args->P_norm, args->H, args->P_test, j, args->dist_type, args->threshold, args->matches + j * k);
+	}
+}
+
+/**
+ * Find the best matches for each column in a range [begin, end)
+ * of columns of a distance matrix D.
+ *
+ * @param arg    pointer to nn_args_t
+ * @param begin  begin index
+ * @param end    end index
+ * @param id     thread index
+ */
+void nearest_neighbor_distances(void *arg, int begin, int end, int id)
+{
+	nn_args_t *args = (nn_args_t *)arg;
+	matrix_t *D = args->D;
+	int k = args->db->top_k;
+
+	int i, j;
+	for ( j = begin; j < end; j++ ) {
+		nn_collector_t c;
+		nn_collector_init(&c, args->db);
+
+		for ( i = 0; i < D->rows; i++ ) {
+			nn_collector_add(&c, i, elem(D, i, j));
+		}
+
+		nn_collector_finish(&c, args->threshold, args->matches + j * k);
+		nn_collector_free(&c);
+	}
+}
+
+/**
+ * Find the best matches of each projected test image in
+ * a range [begin, end) of columns of P_test, comparing each
+ * image with each column of P.
+ *
+ * The search for each image uses args->num_threads threads.
+ *
+ * @param arg    pointer to nn_args_t
+ * @param begin  begin index
+ * @param end    end index
+ * @param id     thread index
+ */
+void nearest_neighbor_test_columns(void *arg, int begin, int end, int id)
+{
+	nn_args_t *args = (nn_args_t *)arg;
+	int k = args->db->top_k;
+
+	int j;
+	for ( j = begin; j < end; j++ ) {
+		nearest_neighbor(args->db, args->P, args->P_norm, args->P_test, j, args->dist_type, args->num_threads, args->threshold, args->matches + j * k);
+	}
+}
+
+/**
+ * Find the best matches in a projected image matrix P for
+ * each projected test image in a block P_test.
+ *
+ * If P has an HNSW graph H, each test image is searched with H,
+ * in parallel, unless db->exact is set. Otherwise, if P has a
+ * quantized matrix Q, each test image is searched with Q in the
+ * same way. Otherwise, in batch mode, the distances between every
+ * column of P and every test image are computed at once as a
+ * matrix product; without batch mode, each test image is compared
+ * with each column of P individually, and the test images are
+ * processed in parallel, or if there are fewer test images than
+ * threads, each search is split across threads.
+ *
+ * @param db         pointer to database
+ * @param P          pointer to projected image matrix
+ * @param P_norm     pointer to column norms of P
+ * @param Q          pointer to quantized matrix of P, or NULL
+ * @param H          pointer to HNSW graph of P, or NULL
+ * @param P_test     pointer to block of projected test images
+ * @param dist_type  distance function
+ * @param threshold  rejection threshold
+ * @param matches    pointer to store db->top_k matches for each test image
+ */
+void nearest_neighbors(database_t *db, matrix_t *P, matrix_t *P_norm, qmatrix_t *Q, hnsw_t *H, matrix_t *P_test, dist_t dist_type, precision_t threshold, db_match_t *matches)
+{
+	nn_args_t args = {
+		.db = db,
+		.P = P,
+		.P_norm = P_norm,
+		.Q = Q,
+		.H = H,
+		.P_test = P_test,
+		.D = NULL,
+		.dist_type = dist_type,
+		.num_threads = 1,
+		.threshold = threshold,
+		.matches = matches
+	};
+
+	PROF_BEGIN(search);
+
+	if ( H != NULL && !db->exact ) {
+		parallel_for(db->num_threads, P_test->cols, nearest_neighbor_ann_columns, &args);
+	}
+	else if ( Q != NULL ) {
+		parallel_for(db->num_threads, P_test->cols, nearest_neighbor_quantized_columns, &args);
+	}
+	else if ( db->batch_size == 1 ) {
+		if ( P_test->cols < db->num_threads ) {
+			args.num_threads = db->num_threads;
+			nearest_neighbor_test_columns(&args, 0, P_test->cols, 0);
+		}
+		else {
+			parallel_for(db->num_threads, P_test->cols, nearest_neighbor_test_columns, &args);
+		}
+	}
+	else {
+		// compute the distance matrix D, D_ij = d(P_i, P_test_j)
+		matrix_t *P_test_norm = m_norm_columns(P_test);
+
+		args.D = (dist_type == DIST_COS)
+			? m_dist_COS_matrix(P, P_norm, P_test, P_test_norm)
+			: m_dist_L2_matrix(P, P_norm, P_test, P_test_norm);
+
+		// find the best matches for each column of D
+		parallel_for(db->num_threads, P_test->cols, nearest_neighbor_distances, &args);
+
+		m_free(P_test_norm);
+		m_free(args.D);
+	}
+
+	PROF_END(search, PROF_REC_SEARCH);
+}
+
+/**
+ * Get the largest distance of a candidate which a collector
+ * could still accept as one of its best matches within the
+ * threshold. With aggregation, every candidate is accepted.
+ *
+ * @param c          pointer to collector
+ * @param threshold  rejection threshold
+ * @return bound of distance
+ */
+precision_t nn_collector_bound(nn_collector_t *c, precision_t threshold)
+{
+	if ( c->aggregate != AGGREGATE_NONE ) {
+		return INFINITY;
+	}
+
+	return (c->num == c->k && c->heap[0].dist < threshold)
+		? c->heap[0].dist
+		: threshold;
+}
+
+/**
+ * Compare two column indices for qsort().
+ *
+ * @param a  pointer to index
+ * @param b  pointer to index
+ * @return difference of the indices
+ */
+int nn_compare_index(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/**
+ * Find the candidates of a cascaded search for a column of
+ * the PCA projection of a block of test images, which are the
+ * db->cascade columns of P_pca with the smallest L2 distances
+ * over the first db->cascade_dims principal components.
+ *
+ * Each distance is abandoned once it exceeds the distance of
+ * the last candidate. Since the principal components are in
+ * order of decreasing eigenvalue, most of the distance of a
+ * distant image is in the first components.
+ *
+ * @param db          pointer to database
+ * @param P_test      pointer to PCA projection of test images
+ * @param i           column index of P_test
+ * @param candidates  pointer to store column indices of candidates
+ * @param dists       pointer to db->cascade distances for the search
+ * @return number of candidates, which are in order of increasing index
+ */
+int nn_cascade_candidates(database_t *db, matrix_t *P_test, int i, int *candidates, precision_t *dists)
+{
+	matrix_t *P = db->P_pca;
+	int num = (db->cascade < P->cols) ? db->cascade : P->cols;
+	int dims = (db->cascade_dims > 0 && db->cascade_dims < P->rows)
+		? db->cascade_dims
+		: P->rows;
+	int num_candidates = 0;
+
+	int j, k;
+	for ( j = 0; j < P->cols; j++ ) {
+		precision_t bound = (num_candidates == num)
+			? dists[num - 1]
+			: INFINITY;
+		precision_t dist = m_dist_L2_bounded(P_test, i, P, j, dims, bound);
+
+		if ( num_candidates == num && dist >= bound ) {
+			continue;
+		}
+
+		// insert the column into the sorted list of candidates
+		k = (num_candidates < num)
+			? num_candidates++
+			: num - 1;
+
+		while ( k > 0 && dists[k - 1] > dist ) {
+			candidates[k] = candidates[k - 1];
+			dists[k] = dists[k - 1];
+			k--;
+		}
+
+		candidates[k] = j;
+		dists[k] = dist;
+	}
+
+	qsort(candidates, num_candidates, sizeof(int), nn_compare_index);
+
+	return num_candidates;
+}
+
+/**
+ * Find the best matches among the candidates of a cascaded
+ * search in a projected image matrix P for a column of a test
+ * matrix P_test. L2 distances are abandoned once they exceed the
+ * distance of the last of the best matches.
+ *
+ * @param db              pointer to database
+ * @param P               pointer to projected image matrix
+ * @param P_norm          pointer to column norms of P
+ * @param P_test          pointer to projected test images
+ * @param i               column index of P_test
+ * @param dist_type       distance function
+ * @param candidates      pointer to column indices of candidates
+ * @param num_candidates  number of candidates
+ * @param threshold       rejection threshold
+ * @param matches         pointer to store db->top_k matches
+ */
+void nearest_neighbor_candidates(database_t *db, matrix_t *P, matrix_t *P_norm, matrix_t *P_test, int i, dist_t dist_type, int *candidates, int num_candidates, precision_t threshold, db_match_t *matches)
+{
+	nn_collector_t c;
+	nn_collector_init(&c, db);
+
+	precision_t test_norm = (dist_type == DIST_COS)
+		? sqrt(m_dot(P_test, i, P_test, i))
+		: 0;
+
+	int k;
+	for ( k = 0; k < num_candidates; k++ ) {
+		int j = candidates[k];
+
+		if ( dist_type == DIST_L2 ) {
+			precision_t bound = nn_collector_bound(&c, threshold);
+			precision_t dist = m_dist_L2_bounded(P_test, i, P, j, P->rows, bound);
+
+			if ( dist <= bound ) {
+				nn_collector_add(&c, j, dist);
+			}
+		}
+		else {
+			nn_collector_add(&c, j, nn_distance(P, P_norm, j, P_test, i, test_norm, dist_type));
+		}
+	}
+
+	nn_collector_finish(&c, threshold, matches);
+	nn_collector_free(&c);
+}
+
+typedef struct {
+	database_t *db;
+	matrix_t *P_pca;
+	matrix_t *P_lda;
+	matrix_t *P_ica;
+	db_match_t *match_pca;
+	db_match_t *match_lda;
+	db_match_t *match_ica;
+} nn_cascade_args_t;
+
+/**
+ * Find the best matches of each test image in a range [begin, end)
+ * of a block with a cascaded search.
+ *
+ * @param arg    pointer to nn_cascade_args_t
+ * @param begin  begin index
+ * @param end    end index
+ * @param id     thread index
+ */
+void nearest_neighbor_cascade_columns(void *arg, int begin, int end, int id)
+{
+	nn_cascade_args_t *args = (nn_cascade_args_t *)arg;
+	database_t *db = args->db;
+	int k = db->top_k;
+	int *candidates = (int *)malloc(db->cascade * sizeof(int));
+	precision_t *dists = (precision_t *)malloc(db->cascade * sizeof(precision_t));
+
+	int j;
+	for ( j = begin; j < end; j++ ) {
+		int num = nn_cascade_candidates(db, args->P_pca, j, candidates, dists);
+
+		nearest_neighbor_candidates(db, db->P_pca, db->P_pca_norm, args->P_pca, j, DIST_L2, candidates, num, db->threshold_pca, args->match_pca + j * k);
+
+		if ( db->lda ) {
+			nearest_neighbor_candidates(db, db->P_lda, db->P_lda_norm, args->P_lda, j, DIST_L2, candidates, num, db->threshold_lda, args->match_lda + j * k);
+		}
+
+		if ( db->ica ) {
+			nearest_neighbor_candidates(db, db->P_ica, db->P_ica_norm, args->P_ica, j, DIST_COS, candidates, num, db->threshold_ica, args->match_ica + j * k);
+		}
+	}
+
+	free(candidates);
+	free(dists);
+}
+
+/**
+ * Find the best matches of each image in a block of projected
+ * test images with a cascaded search.
+ *
+ * A cheap PCA distance over the first db->cascade_dims principal
+ * components selects db->cascade candidates from the gallery, and
+ * each algorithm finds its best matches among the candidates, so
+ * that LDA and ICA compare each test image with the candidates
+ * instead of every image. Classes are aggregated over the
+ * candidates. The test images are processed in parallel.
+ *
+ * @param db         pointer to database
+ * @param P_pca      pointer to PCA projection of test images
+ * @param P_lda      pointer to LDA projection, if db->lda
+ * @param P_ica      pointer to ICA projection, if db->ica
+ * @param match_pca  pointer to store db->top_k PCA matches for each image
+ * @param match_lda  pointer to store LDA matches, if db->lda
+ * @param match_ica  pointer to store ICA matches, if db->ica
+ */
+void nearest_neighbors_cascade(database_t *db, matrix_t *P_pca, matrix_t *P_lda, matrix_t *P_ica, db_match_t *match_pca, db_match_t *match_lda, db_match_t *match_ica)
+{
+	nn_cascade_args_t args = {
+		.db = db,
+		.P_pca = P_pca,
+		.P_lda = P_lda,
+		.P_ica = P_ica,
+		.match_pca = match_pca,
+		.match_lda = match_lda,
+		.match_ica = match_ica
+	};
+
+	PROF_BEGIN(search);
+
+	parallel_for(db->num_threads, P_pca->cols, nearest_neighbor_cascade_columns, &args);
+
+	PROF_END(search, PROF_REC_SEARCH);
+}
+
+typedef struct {
+	pthread_t thread;
+	matrix_t *T;
+	char **names;
+	image_t *ref;
+	const image_prep_t *prep;
+	int num_threads;
+} prefetch_t;
+
+/**
+ * Read a block of test images in the background.
+ *
+ * @param arg  pointer to prefetch_t
+ * @return NULL
+ */
+void * prefetch_thread(void *arg)
+{
+	prefetch_t *prefetch = (prefetch_t *)arg;
+
+	PROF_BEGIN(decode);
+	read_images(prefetch->T, prefetch->names, prefetch->ref, prefetch->prep, 0, prefetch->num_threads);
+	PROF_END(decode, PROF_REC_DECODE);
+
+	return NULL;
+}
+
+/**
+ * Start reading a block of test images in the background.
+ *
+ * @param prefetch     pointer to prefetch state
+ * @param m            number of dimensions
+ * @param names        pointer to list of image names
+ * @param num          number of images
+ * @param ref          pointer to preprocessed reference image
+ * @param prep         pointer to preprocessing parameters
+ * @param num_threads  number of threads for reading images
+ */
+void prefetch_start(prefetch_t *prefetch, int m, char **names, int num, image_t *ref, const image_prep_t *prep, int num_threads)
+{
+	prefetch->T = m_initialize(m, num);
+	prefetch->names = names;
+	prefetch->ref = ref;
+	prefetch->prep = prep;
+	prefetch->num_threads = num_threads;
+
+	if ( pthread_create(&prefetch->thread, NULL, prefetch_thread, prefetch) != 0 ) {
+		perror("pthread_create");
+		exit(1);
+	}
+}
+
+/**
+ * Wait for a block of test images which is being read
+ * in the background.
+ *
+ * @param prefetch  pointer to prefetch state
+ * @return pointer to image matrix of the block
+ */
+matrix_t * prefetch_finish(prefetch_t *prefetch)
+{
+	pthread_join(prefetch->thread, NULL);
+
+	return prefetch->T;
+}
+
+/**
+ * Project a block of test images with each algorithm of
+ * a database.
+ *
+ * The block is projected with the rows of the fused projection
+ * matrix which belong to each algorithm, straight into the
+ * projection of that algorithm, so that nothing is copied out
+ * of a stacked projection. The test images are not
+ * mean-subtracted, and the projection of the mean face is
+ * subtracted from the projected images instead.
+ *
+ * @param db     pointer to database
+ * @param T      pointer to block of test images
+ * @param P_pca  pointer to store PCA projection of T
+ * @param P_lda  pointer to store LDA projection of T, if db->lda
+ * @param P_ica  pointer to store ICA2 projection of T, if db->ica
+ */
+void db_project_block(database_t *db, matrix_t *T, matrix_t **P_pca, matrix_t **P_lda, matrix_t **P_ica)
+{
+	matrix_t *W_fused_tr = (db->W_fused_tr != NULL)
+		? db->W_fused_tr
+		: db->W_pca_tr;
+	matrix_t *W_tr[] = {
+		db->W_pca_tr,
+		db->lda ? db->W_lda_tr : NULL,
+		db->ica ? db->W_ica_tr : NULL
+	};
+	matrix_t **P[] = { P_pca, P_lda, P_ica };
+	int begin = 0;
+
+	int a;
+	for ( a = 0; a < 3; a++ ) {
+		if ( W_tr[a] == NULL ) {
+			*P[a] = NULL;
+			continue;
+		}
+
+		int end = begin + W_tr[a]->rows;
+
+		PROF_BEGIN(project);
+		*P[a] = m_product_rows(W_fused_tr, begin, end, T);
+		PROF_END(project, PROF_REC_PROJECT);
+
+		// subtract the rows of the bias which belong to the algorithm
+		matrix_t bias = {
+			.data = &elem(db->fused_bias, begin, 0),
+			.rows = end - begin,
+			.cols = 1
+		};
+
+		PROF_BEGIN(subtract);
+		m_subtract_columns(*P[a], &bias);
+		PROF_END(subtract, PROF_REC_SUBTRACT);
+
+		begin = end;
+	}
+}
+
+/**
+ * Find the best matches of each image in a block of projected
+ * test images with each algorithm of a database, such as a
+ * block from db_project_block() with the same basis.
+ *
+ * If db->cascade is set, the search is cascaded, unless the
+ * database has a quantized copy or an ANN index which is used.
+ *
+ * @param db         pointer to database
+ * @param P_pca      pointer to PCA projection of test images
+ * @param P_lda      pointer to LDA projection, if db->lda
+ * @param P_ica      pointer to ICA2 projection, if db->ica
+ * @param match_pca  pointer to store db->top_k PCA matches for each image
+ * @param match_lda  pointer to store LDA matches, if db->lda
+ * @param match_ica  pointer to store ICA2 matches, if db->ica
+ */
+void db_search_block(database_t *db, matrix_t *P_pca, matrix_t *P_lda, matrix_t *P_ica, db_match_t *match_pca, db_match_t *match_lda, db_match_t *match_ica)
+{
+	if ( db->cascade > 0 && db->Q_pca == NULL && (db->H_pca == NULL || db->exact) ) {
+		nearest_neighbors_cascade(db, P_pca, P_lda, P_ica, match_pca, match_lda, match_ica);
+		return;
+	}
+
+	// find the nearest neighbors for PCA
+	nearest_neighbors(db, db->P_pca, db->P_pca_norm, db->Q_pca, db->H_pca, P_pca, DIST_L2, db->threshold_pca, match_pca);
+
+	// find the nearest neighbors for LDA
+	if ( db->lda ) {
+		nearest_neighbors(db, db->P_lda, db->P_lda_norm, db->Q_lda, db->H_lda, P_lda, DIST_L2, db->threshold_lda, match_lda);
+	}
+
+	// find the nearest neighbors for ICA2
+	if ( db->ica ) {
+		nearest_neighbors(db, db->P_ica, db->P_ica_norm, db->Q_ica, db->H_ica, P_ica, DIST_COS, db->threshold_ica, match_ica);
+	}
+}
+
+/**
+ * Find the best matches of each image in a block of test
+ * images with each algorithm of a database.
+ *
+ * @param db         pointer to database
+ * @param T          pointer to block of test images
+ * @param match_pca  pointer to store db->top_k PCA matches for each image
+ * @param match_lda  pointer to store LDA matches, if db->lda
+ * @param match_ica  pointer to store ICA2 matches, if db->ica
+ */
+void db_recognize_block(database_t *db, matrix_t *T, db_match_t *match_pca, db_match_t *match_lda, db_match_t *match_ica)
+{
+	matrix_t *P_pca;
+	matrix_t *P_lda;
+	matrix_t *P_ica;
+
+	db_project_block(db, T, &P_pca, &P_lda, &P_ica);
+	db_search_block(db, P_pca, P_lda, P_ica, match_pca, match_lda, match_ica);
+
+	m_free(P_pca);
+
+	if ( P_lda != NULL ) {
+		m_free(P_lda);
+	}
+
+	if ( P_ica != NULL ) {
+		m_free(P_ica);
+	}
+}
+
+/**
+ * Print the matches of a test image with an algorithm.
+ *
+ * Only the best match is printed, in the original format, unless
+ * top-k results, class aggregation or a rejection threshold were
+ * requested, in which case each match is printed with its distance.
+ * A test image without any match within the threshold is printed
+ * as rejected.
+ *
+ * @param db       pointer to database
+ * @param label    label of algorithm
+ * @param matches  pointer to db->top_k matches
+ */
+void db_print_matches(database_t *db, const char *label, db_match_t *matches)
+{
+	int scores = db->top_k > 1
+		|| db->aggregate != AGGREGATE_NONE
+		|| isfinite(db->threshold_pca)
+		|| isfinite(db->threshold_lda)
+		|| isfinite(db->threshold_ica);
+
+	if ( matches[0].index == -1 ) {
+		printf("\t%s(rejected)\n", label);
+		return;
+	}
+
+	int j;
+	for ( j = 0; j < db->top_k && matches[j].index != -1; j++ ) {
+		if ( scores ) {
+			printf("\t%s(class %d) \'%s\' %g\n", label, matches[j].class, db->entries[matches[j].index].name, (double) matches[j].dist);
+		}
+		else {
+			printf("\t%s(class %d) \'%s\'\n", label, matches[j].class, db->entries[matches[j].index].name);
+		}
+	}
+}
+
+/**
+ * Test a set of images against a database.
+ *
+ * The test images are processed in blocks of db->batch_size
+ * images in batch mode, so that each block is projected with a
+ * single matrix product for each algorithm, or else in blocks of
+ * db->num_threads images which are processed in parallel.
+ * Each block is read with db->io_threads threads while the
+ * previous block is being processed.
+ *
+ * @param db    pointer to database
+ * @param path  directory of test images
+ */
+void db_recognize(database_t *db, const char *path)
+{
+	// get test images
+	char **image_names;
+	int num_test_images = get_image_names(path, &image_names);
+	int block_size = (db->batch_size > 1)
+		? db->batch_size
+		: db->num_threads;
+	db_match_t *match_pca = (db_match_t *)malloc(block_size * db->top_k * sizeof(db_match_t));
+	db_match_t *match_lda = (db_match_t *)malloc(block_size * db->top_k * sizeof(db_match_t));
+	db_match_t *match_ica = (db_match_t *)malloc(block_size * db->top_k * sizeof(db_match_t));
+	char label_ica[8];
+
+	sprintf(label_ica, "%s: ", db_ica_label(db));
+
+	// get the image size from the first test image
+	image_t *ref = image_construct();
+	prefetch_t prefetch;
+
+	if ( num_test_images > 0 ) {
+		image_read(ref, image_names[0]);
+		image_preprocess(ref, &db->prep);
+
+		if ( ref->channels * ref->height * ref->width != db->num_dimensions ) {
+			fprintf(stderr, "error: test images must have the same size as the training images\n");
+			exit(1);
+		}
+
+		int num = (block_size < num_test_images)
+			? block_size
+			: num_test_images;
+
+		prefetch_start(&prefetch, db->num_dimensions, image_names, num, ref, &db->prep, db->io_threads);
+	}
+
+	// test each block of images against the database
+	int i, j;
+	for ( i = 0; i < num_test_images; i += block_size ) {
+		int num = (i + block_size < num_test_images)
+			? block_size
+			: num_test_images - i;
+
+		// read the test images T = [T_i ... T_(i + num - 1)]
+		PROF_BEGIN(probe);
+
+		matrix_t *T = prefetch_finish(&prefetch);
+
+		// start reading the next block
+		int next = i + block_size;
+
+		if ( next < num_test_images ) {
+			int num_next = (next + block_size < num_test_images)
+				? block_size
+				: num_test_images - next;
+
+			prefetch_start(&prefetch, db->num_dimensions, image_names + next, num_next, ref, &db->prep, db->io_threads);
+		}
+
+		// find the nearest neighbors of T
+		db_recognize_block(db, T, match_pca, match_lda, match_ica);
+
+		PROF_LATENCY(probe, num);
+
+		// print results
+		for ( j = 0; j < num; j++ ) {
+			printf("test image: \'%s\'\n", image_names[i + j]);
+			db_print_matches(db, "PCA:  ", match_pca + j * db->top_k);
+			if ( db->lda ) db_print_matches(db, "LDA:  ", match_lda + j * db->top_k);
+			if ( db->ica ) db_print_matches(db, label_ica, match_ica + j * db->top_k);
+			putchar('\n');
+		}
+
+		m_free(T);
+	}
+
+	// cleanup
+	image_destruct(ref);
+	free(match_pca);
+	free(match_lda);
+	free(match_ica);
 
 	for ( i = 0; i < num_test_images; i++ ) {
 		free(image_names[i]);
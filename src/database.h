@@ -7,44 +7,157 @@
 #ifndef DATABASE_H
 #define DATABASE_H
 
+#include "dbfile.h"
+#include "hnsw.h"
 #include "matrix.h"
+#include "quantize.h"
 
-typedef precision_t (*dist_func_t)(matrix_t *, int, matrix_t *, int);
+/**
+ * Number of images read at a time by streaming training.
+ */
+#define TRAIN_BLOCK_SIZE 256
 
 typedef struct {
 	int class;
 	char *name;
 } database_entry_t;
 
+typedef enum {
+	AGGREGATE_NONE,
+	AGGREGATE_BEST,
+	AGGREGATE_MEAN
+} aggregate_t;
+
+typedef struct {
+	int index;
+	int class;
+	precision_t dist;
+} db_match_t;
+
+typedef enum {
+	ICA_ENGINE_INFOMAX,
+	ICA_ENGINE_FASTICA,
+	ICA_ENGINE_FASTICA_CUBE
+} ica_engine_t;
+
+typedef struct {
+	int architecture;
+	ica_engine_t engine;
+	precision_t tolerance;
+	int max_sweeps;
+	int num_threads;
+	FILE *progress;
+	char *checkpoint;
+	int quiet;
+} ica_params_t;
+
 typedef struct {
 	int num_classes;
 	int num_images;
 	int num_dimensions;
+	int image_width;
+	int image_height;
+	int image_channels;
+	image_prep_t prep;
 	database_entry_t *entries;
 	matrix_t *mean_face;
+
+	int pca_randomized;
+	int low_memory;
+	size_t memory_budget;
+	const char *cache_dir;
+	int pca_components;
+	precision_t pca_energy;
 	matrix_t *W_pca_tr;
 	matrix_t *P_pca;
+	matrix_t *P_pca_norm;
+	qmatrix_t *Q_pca;
+	hnsw_t *H_pca;
 
 	int lda;
 	matrix_t *W_lda_tr;
 	matrix_t *P_lda;
+	matrix_t *P_lda_norm;
+	qmatrix_t *Q_lda;
+	hnsw_t *H_lda;
 
 	int ica;
+	ica_params_t ica_params;
 	matrix_t *W_ica_tr;
 	matrix_t *P_ica;
+	matrix_t *P_ica_norm;
+	qmatrix_t *Q_ica;
+	hnsw_t *H_ica;
+
+	matrix_t *W_fused_tr;
+	matrix_t *fused_bias;
+
+	int batch_size;
+	int num_threads;
+	int io_threads;
+	int quiet;
+	int update_pca;
+	int quantize;
+	int rerank;
+	int ann;
+	int ef;
+	int exact;
+	int cascade;
+	int cascade_dims;
+	int top_k;
+	aggregate_t aggregate;
+	precision_t threshold_pca;
+	precision_t threshold_lda;
+	precision_t threshold_ica;
+
+	dbfile_type_t precision;
+	dbfile_t *file;
 } database_t;
 
-database_t * db_construct();
+database_t * db_construct(int lda, int ica);
+const char * db_ica_label(database_t *db);
 void db_destruct(database_t *db);
 
 void db_train(database_t *db, const char *path);
-void db_save(database_t *db, const char *path_tset, const char *path_tdata);
+void db_train_matrix(database_t *db, matrix_t *X);
+void db_train_randomized(database_t *db);
+void db_train_index(database_t *db);
+void db_fuse_projections(database_t *db);
+void db_save(database_t *db, const char *path);
+
+int db_cache_load(database_t *db, matrix_t **X);
+void db_cache_save(database_t *db, matrix_t *X);
+char * db_cache_checkpoint(database_t *db);
 
-void db_load(database_t *db, const char *path_tset, const char *path_tdata);
+void db_load(database_t *db, const char *path);
+void db_load_all(database_t *db, const char *path);
+int db_read_ica_architecture(dbfile_t *file);
+void db_enroll(database_t *db, const char *path);
 void db_recognize(database_t *db, const char *path);
+void db_recognize_block(database_t *db, matrix_t *T, db_match_t *match_pca, db_match_t *match_lda, db_match_t *match_ica);
+void db_project_block(database_t *db, matrix_t *T, matrix_t **P_pca, matrix_t **P_lda, matrix_t **P_ica);
+void db_search_block(database_t *db, matrix_t *P_pca, matrix_t *P_lda, matrix_t *P_ica, db_match_t *match_pca, db_match_t *match_lda, db_match_t *match_ica);
+void db_cross_validate(database_t *db, const char *path, int num_folds);
+void db_split(database_t *db, const char *path, int num_shards);
+
+int get_image_entries(const char *path, database_entry_t **image_entries, int *num_classes);
+
+matrix_t * get_image_matrix(database_entry_t *entries, int num_images, const image_prep_t *prep, int num_threads);
+
+matrix_t * PCA(matrix_t *X, int num_components, precision_t energy);
+matrix_t * PCA_in_place(matrix_t *X, int num_components, precision_t energy, matrix_t **P_pca);
+matrix_t * PCA_incremental(matrix_t *W_pca_tr, matrix_t *mean_face, int num_images, matrix_t *B);
+matrix_t * PCA_randomized(database_entry_t *entries, int num_images, matrix_t *mean_face, int num_components, precision_t energy, const image_prep_t *prep, int num_threads);
+matrix_t * LDA(matrix_t *W_pca_tr, matrix_t *P_pca, int c, database_entry_t *entries, int num_threads, matrix_t **P_lda);
+matrix_t * ICA1(matrix_t *W_pca_tr, matrix_t *P_pca, ica_params_t *params, matrix_t **P_ica);
+matrix_t * ICA2(matrix_t *W_pca_tr, matrix_t *P_pca, ica_params_t *params, matrix_t **P_ica);
+matrix_t * ICA(matrix_t *W_pca_tr, matrix_t *P_pca, ica_params_t *params, matrix_t **P_ica);
+
+typedef struct sep96_workspace sep96_workspace_t;
 
-matrix_t * PCA(matrix_t *X);
-matrix_t * LDA(matrix_t *W_pca_tr, matrix_t *P_pca, int c, database_entry_t *entries);
-matrix_t * ICA2(matrix_t *W_pca_tr, matrix_t *P_pca);
+sep96_workspace_t * sep96_workspace_alloc(int n, int B);
+void sep96_workspace_free(sep96_workspace_t *ws);
+void sep96(matrix_t *X, matrix_t *W, int B, precision_t L, int F, sep96_workspace_t *ws);
+void sep96_parallel(matrix_t *X, matrix_t *W, int B, precision_t L, int F, sep96_workspace_t **ws, int num_threads);
 
 #endif
@@ -0,0 +1,500 @@
+/**
+ * @file dbfile.c
+ *
+ * Implementation of the database file format.
+ */
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "dbfile.h"
+
+/**
+ * Get the size of an element of a section type.
+ *
+ * @param type
+ * @return size of each element in bytes
+ */
+size_t dbfile_type_size(dbfile_type_t type)
+{
+	switch ( type ) {
+	case DBFILE_BYTES:
+	case DBFILE_INT8:
+		return 1;
+	case DBFILE_INT32:
+		return sizeof(int32_t);
+	case DBFILE_FLOAT64:
+		return sizeof(double);
+	case DBFILE_FLOAT32:
+		return sizeof(float);
+	}
+
+	return 0;
+}
+
+/**
+ * Pad a stream with zeros to the next aligned offset.
+ *
+ * @param stream  pointer to file stream
+ */
+void dbfile_align(FILE *stream)
+{
+	static const char zeros[DBFILE_ALIGN] = { 0 };
+
+	long offset = ftell(stream);
+	long padding = (DBFILE_ALIGN - offset % DBFILE_ALIGN) % DBFILE_ALIGN;
+
+	fwrite(zeros, 1, padding, stream);
+}
+
+/**
+ * Create a database file for writing.
+ *
+ * @param writer  pointer to writer
+ * @param path    filename
+ * @param header  pointer to header fields (magic, version and
+ *                section table are set by the writer); the
+ *                precision field selects the element type of
+ *                matrix sections, or 0 for precision_t
+ */
+void dbfile_create(dbfile_writer_t *writer, const char *path, dbfile_header_t *header)
+{
+	writer->stream = fopen(path, "w");
+
+	if ( writer->stream == NULL ) {
+		perror("fopen");
+		exit(1);
+	}
+
+	writer->header = *header;
+	memcpy(writer->header.magic, DBFILE_MAGIC, sizeof(writer->header.magic));
+	writer->header.version = DBFILE_VERSION;
+	writer->header.num_sections = 0;
+	writer->header.table_offset = 0;
+
+	if ( writer->header.precision == 0 ) {
+		writer->header.precision = DBFILE_PRECISION;
+	}
+
+	// reserve space for the header, which is written last
+	fwrite(&writer->header, sizeof(dbfile_header_t), 1, writer->stream);
+}
+
+/**
+ * Write a section to a database file.
+ *
+ * @param writer  pointer to writer
+ * @param id      section id
+ * @param type    element type
+ * @param rows    number of rows
+ * @param cols    number of columns
+ * @param data    pointer to payload
+ * @param size    size of payload in bytes
+ */
+void dbfile_write(dbfile_writer_t *writer, int id, dbfile_type_t type, int rows, int cols, const void *data, size_t size)
+{
+	if ( writer->header.num_sections == DBFILE_MAX_SECTIONS ) {
+		fprintf(stderr, "error: too many sections in database file\n");
+		exit(1);
+	}
+
+	dbfile_align(writer->stream);
+
+	writer->sections[writer->header.num_sections++] = (dbfile_section_t) {
+		.id = id,
+		.type = type,
+		.rows = rows,
+		.cols = cols,
+		.offset = ftell(writer->stream),
+		.size = size
+	};
+
+	if ( fwrite(data, 1, size, writer->stream) != size ) {
+		perror("fwrite");
+		exit(1);
+	}
+}
+
+/**
+ * Write a matrix section to a database file.
+ *
+ * The matrix is converted to the precision of the file
+ * if it differs from precision_t.
+ *
+ * @param writer  pointer to writer
+ * @param id      section id
+ * @param M       pointer to matrix
+ */
+void dbfile_write_matrix(dbfile_writer_t *writer, int id, matrix_t *M)
+{
+	dbfile_type_t type = writer->header.precision;
+	size_t n = (size_t)M->rows * M->cols;
+
+	if ( type == DBFILE_PRECISION ) {
+		dbfile_write(writer, id, type, M->rows, M->cols, M->data, n * sizeof(precision_t));
+		return;
+	}
+
+	void *data = malloc(n * dbfile_type_size(type));
+
+	size_t i;
+	for ( i = 0; i < n; i++ ) {
+		if ( type == DBFILE_FLOAT32 ) {
+			((float *)data)[i] = M->data[i];
+		}
+		else {
+			((double *)data)[i] = M->data[i];
+		}
+	}
+
+	dbfile_write(writer, id, type, M->rows, M->cols, data, n * dbfile_type_size(type));
+	free(data);
+}
+
+/**
+ * Write a quantized matrix to a database file.
+ *
+ * The quantized values, scales and zero points are written
+ * as the sections id, id + 1 and id + 2.
+ *
+ * @param writer  pointer to writer
+ * @param id      section id of quantized values
+ * @param Q       pointer to quantized matrix
+ */
+void dbfile_write_qmatrix(dbfile_writer_t *writer, int id, qmatrix_t *Q)
+{
+	dbfile_write(writer, id, DBFILE_INT8, Q->rows, Q->cols, Q->data, (size_t)Q->rows * Q->cols * sizeof(int8_t));
+	dbfile_write(writer, id + 1, DBFILE_FLOAT32, Q->rows, 1, Q->scale, Q->rows * sizeof(float));
+	dbfile_write(writer, id + 2, DBFILE_INT32, Q->rows, 1, Q->zero, Q->rows * sizeof(int32_t));
+}
+
+/**
+ * Write an HNSW graph to a database file.
+ *
+ * The parameters of the graph (M, ef_construction, entry,
+ * max_level, num_nodes), the offsets of the upper links, the
+ * links of layer 0 and the upper links are written as the
+ * sections id, id + 1, id + 2 and id + 3.
+ *
+ * @param writer  pointer to writer
+ * @param id      section id of graph parameters
+ * @param H       pointer to graph
+ */
+void dbfile_write_hnsw(dbfile_writer_t *writer, int id, hnsw_t *H)
+{
+	int32_t params[] = { H->M, H->ef_construction, H->entry, H->max_level, H->num_nodes };
+	int n = H->num_nodes;
+
+	dbfile_write(writer, id, DBFILE_INT32, 5, 1, params, sizeof(params));
+	dbfile_write(writer, id + 1, DBFILE_INT32, n + 1, 1, H->offsets, (n + 1) * sizeof(int32_t));
+	dbfile_write(writer, id + 2, DBFILE_INT32, 2 * H->M, n, H->links, (size_t)2 * H->M * n * sizeof(int32_t));
+	dbfile_write(writer, id + 3, DBFILE_INT32, H->offsets[n], 1, H->upper, H->offsets[n] * sizeof(int32_t));
+}
+
+/**
+ * Write the section table and header of a database file
+ * and close the file.
+ *
+ * @param writer  pointer to writer
+ */
+void dbfile_close_writer(dbfile_writer_t *writer)
+{
+	dbfile_align(writer->stream);
+
+	writer->header.table_offset = ftell(writer->stream);
+	fwrite(writer->sections, sizeof(dbfile_section_t), writer->header.num_sections, writer->stream);
+
+	fseek(writer->stream, 0, SEEK_SET);
+	fwrite(&writer->header, sizeof(dbfile_header_t), 1, writer->stream);
+
+	if ( fclose(writer->stream) != 0 ) {
+		perror("fclose");
+		exit(1);
+	}
+}
+
+/**
+ * Open a database file by mapping it into memory.
+ *
+ * @param path  filename
+ * @return pointer to database file
+ */
+dbfile_t * dbfile_open(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+
+	if ( fd == -1 ) {
+		perror("open");
+		exit(1);
+	}
+
+	struct stat st;
+
+	if ( fstat(fd, &st) != 0 ) {
+		perror("fstat");
+		exit(1);
+	}
+
+	if ( st.st_size < (off_t)sizeof(dbfile_header_t) ) {
+		fprintf(stderr, "error: \'%s\' is not a database file\n", path);
+		exit(1);
+	}
+
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if ( data == MAP_FAILED ) {
+		perror("mmap");
+		exit(1);
+	}
+
+	dbfile_t *file = (dbfile_t *)malloc(sizeof(dbfile_t));
+	file->data = data;
+	file->size = st.st_size;
+	file->header = (dbfile_header_t *)data;
+
+	// validate the header before the section table, and compare
+	// each offset with the remaining size so that the sums of
+	// offsets and sizes cannot overflow
+	if ( memcmp(file->header->magic, DBFILE_MAGIC, sizeof(file->header->magic)) != 0 ) {
+		fprintf(stderr, "error: \'%s\' is not a database file\n", path);
+		exit(1);
+	}
+
+	if ( file->header->version != DBFILE_VERSION ) {
+		fprintf(stderr, "error: \'%s\' has unsupported version %u\n", path, file->header->version);
+		exit(1);
+	}
+
+	if ( file->header->table_offset > file->size
+	  || file->header->num_sections > (file->size - file->header->table_offset) / sizeof(dbfile_section_t) ) {
+		fprintf(stderr, "error: \'%s\' is truncated\n", path);
+		exit(1);
+	}
+
+	file->sections = (dbfile_section_t *)((char *)data + file->header->table_offset);
+
+	uint32_t i;
+	for ( i = 0; i < file->header->num_sections; i++ ) {
+		if ( file->sections[i].offset > file->size || file->sections[i].size > file->size - file->sections[i].offset ) {
+			fprintf(stderr, "error: \'%s\' is truncated\n", path);
+			exit(1);
+		}
+	}
+
+	return file;
+}
+
+/**
+ * Close a database file.
+ *
+ * Matrices which were read from the file are no longer
+ * valid after the file is closed.
+ *
+ * @param file  pointer to database file
+ */
+void dbfile_close(dbfile_t *file)
+{
+	munmap(file->data, file->size);
+	free(file);
+}
+
+/**
+ * Find a section in a database file.
+ *
+ * @param file  pointer to database file
+ * @param id    section id
+ * @return pointer to section, or NULL if the section does not exist
+ */
+dbfile_section_t * dbfile_find(dbfile_t *file, int id)
+{
+	uint32_t i;
+	for ( i = 0; i < file->header->num_sections; i++ ) {
+		if ( file->sections[i].id == (uint32_t)id ) {
+			return &file->sections[i];
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Get the payload of a section in a database file.
+ *
+ * @param file     pointer to database file
+ * @param section  pointer to section
+ * @return pointer to payload
+ */
+const void * dbfile_data(dbfile_t *file, dbfile_section_t *section)
+{
+	return (const char *)file->data + section->offset;
+}
+
+/**
+ * Read a matrix section from a database file.
+ *
+ * If the matrix is stored with the precision of precision_t,
+ * the matrix data is not copied; it points directly into the
+ * memory mapping of the file, so the matrix must not be modified,
+ * and it should be released with free() instead of m_free().
+ * Otherwise the matrix is converted into a new matrix, which
+ * should be released with m_free(). Use dbfile_contains() to
+ * tell the two cases apart.
+ *
+ * @param file  pointer to database file
+ * @param id    section id
+ * @return pointer to matrix, or NULL if the section does not exist
+ */
+matrix_t * dbfile_read_matrix(dbfile_t *file, int id)
+{
+	dbfile_section_t *section = dbfile_find(file, id);
+
+	if ( section == NULL ) {
+		return NULL;
+	}
+
+	size_t n = (size_t)section->rows * section->cols;
+
+	if ( (section->type != DBFILE_FLOAT32 && section->type != DBFILE_FLOAT64)
+	  || section->size != n * dbfile_type_size(section->type) ) {
+		fprintf(stderr, "error: invalid matrix section %d in database file\n", id);
+		exit(1);
+	}
+
+	if ( section->type == DBFILE_PRECISION ) {
+		matrix_t *M = (matrix_t *)malloc(sizeof(matrix_t));
+		M->rows = section->rows;
+		M->cols = section->cols;
+		M->data = (precision_t *)dbfile_data(file, section);
+
+		return M;
+	}
+
+	matrix_t *M = m_initialize(section->rows, section->cols);
+	const void *data = dbfile_data(file, section);
+
+	size_t i;
+	for ( i = 0; i < n; i++ ) {
+		if ( section->type == DBFILE_FLOAT32 ) {
+			M->data[i] = ((const float *)data)[i];
+		}
+		else {
+			M->data[i] = ((const double *)data)[i];
+		}
+	}
+
+	return M;
+}
+
+/**
+ * Read a quantized matrix from a database file.
+ *
+ * As with dbfile_read_matrix(), nothing is copied, and the
+ * quantized matrix should be released with free().
+ *
+ * @param file  pointer to database file
+ * @param id    section id of quantized values
+ * @return pointer to quantized matrix, or NULL if the section does not exist
+ */
+qmatrix_t * dbfile_read_qmatrix(dbfile_t *file, int id)
+{
+	dbfile_section_t *section_data = dbfile_find(file, id);
+	dbfile_section_t *section_scale = dbfile_find(file, id + 1);
+	dbfile_section_t *section_zero = dbfile_find(file, id + 2);
+
+	if ( section_data == NULL ) {
+		return NULL;
+	}
+
+	if ( section_data->type != DBFILE_INT8
+	  || section_data->size != (uint64_t)section_data->rows * section_data->cols * sizeof(int8_t)
+	  || section_scale == NULL || section_scale->type != DBFILE_FLOAT32
+	  || section_scale->size != section_data->rows * sizeof(float)
+	  || section_zero == NULL || section_zero->type != DBFILE_INT32
+	  || section_zero->size != section_data->rows * sizeof(int32_t) ) {
+		fprintf(stderr, "error: invalid quantized matrix section %d in database file\n", id);
+		exit(1);
+	}
+
+	qmatrix_t *Q = (qmatrix_t *)malloc(sizeof(qmatrix_t));
+	Q->data = (int8_t *)dbfile_data(file, section_data);
+	Q->scale = (float *)dbfile_data(file, section_scale);
+	Q->zero = (int32_t *)dbfile_data(file, section_zero);
+	Q->rows = section_data->rows;
+	Q->cols = section_data->cols;
+
+	return Q;
+}
+
+/**
+ * Read an HNSW graph from a database file.
+ *
+ * The graph refers directly to the mapping of the file, so
+ * it must be copied with hnsw_copy() before nodes are added.
+ *
+ * @param file  pointer to database file
+ * @param id    section id of graph parameters
+ * @return pointer to graph, or NULL if the section does not exist
+ */
+hnsw_t * dbfile_read_hnsw(dbfile_t *file, int id)
+{
+	dbfile_section_t *section_params = dbfile_find(file, id);
+	dbfile_section_t *section_offsets = dbfile_find(file, id + 1);
+	dbfile_section_t *section_links = dbfile_find(file, id + 2);
+	dbfile_section_t *section_upper = dbfile_find(file, id + 3);
+
+	if ( section_params == NULL ) {
+		return NULL;
+	}
+
+	const int32_t *params = (const int32_t *)dbfile_data(file, section_params);
+
+	if ( section_params->type != DBFILE_INT32
+	  || section_params->size != 5 * sizeof(int32_t)
+	  || params[0] < 1 || params[4] < 0
+	  || section_offsets == NULL || section_offsets->type != DBFILE_INT32
+	  || section_offsets->size != (uint64_t)(params[4] + 1) * sizeof(int32_t)
+	  || section_links == NULL || section_links->type != DBFILE_INT32
+	  || section_links->size != (uint64_t)2 * params[0] * params[4] * sizeof(int32_t)
+	  || section_upper == NULL || section_upper->type != DBFILE_INT32
+	  || section_upper->size != ((const int32_t *)dbfile_data(file, section_offsets))[params[4]] * sizeof(int32_t) ) {
+		fprintf(stderr, "error: invalid HNSW graph section %d in database file\n", id);
+		exit(1);
+	}
+
+	hnsw_t *H = (hnsw_t *)malloc(sizeof(hnsw_t));
+	H->M = params[0];
+	H->ef_construction = params[1];
+	H->entry = params[2];
+	H->max_level = params[3];
+	H->num_nodes = params[4];
+	H->capacity = H->num_nodes;
+	H->offsets = (int32_t *)dbfile_data(file, section_offsets);
+	H->links = (int32_t *)dbfile_data(file, section_links);
+	H->upper = (int32_t *)dbfile_data(file, section_upper);
+	H->upper_capacity = H->offsets[H->num_nodes];
+
+	if ( !hnsw_validate(H) ) {
+		fprintf(stderr, "error: inconsistent HNSW graph section %d in database file\n", id);
+		exit(1);
+	}
+
+	return H;
+}
+
+/**
+ * Get whether a pointer refers to the memory mapping of
+ * a database file.
+ *
+ * @param file  pointer to database file, or NULL
+ * @param ptr   pointer
+ * @return 1 if ptr is inside the mapping, 0 otherwise
+ */
+int dbfile_contains(dbfile_t *file, const void *ptr)
+{
+	return file != NULL
+		&& (const char *)ptr >= (const char *)file->data
+		&& (const char *)ptr < (const char *)file->data + file->size;
+}
@@ -0,0 +1,99 @@
+/**
+ * @file dbfile.h
+ *
+ * Interface definitions for the database file format.
+ *
+ * A database file consists of a fixed-size header, a sequence
+ * of section payloads, and a section table which describes the
+ * type, shape and location of each payload. Every payload is
+ * aligned to DBFILE_ALIGN bytes so that a matrix can be used
+ * directly from a memory mapping of the file.
+ *
+ * All values are stored in the byte order of the host. Matrices
+ * may be stored in single or double precision; a matrix whose
+ * precision differs from precision_t is converted when it is read.
+ */
+#ifndef DBFILE_H
+#define DBFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "hnsw.h"
+#include "matrix.h"
+#include "quantize.h"
+
+#define DBFILE_MAGIC "FACEDB\r\n"
+#define DBFILE_VERSION 1
+#define DBFILE_ALIGN 64
+#define DBFILE_MAX_SECTIONS 64
+
+typedef enum {
+	DBFILE_BYTES = 1,
+	DBFILE_INT32 = 2,
+	DBFILE_FLOAT64 = 3,
+	DBFILE_FLOAT32 = 4,
+	DBFILE_INT8 = 5
+} dbfile_type_t;
+
+#ifdef PRECISION_FLOAT
+#define DBFILE_PRECISION DBFILE_FLOAT32
+#else
+#define DBFILE_PRECISION DBFILE_FLOAT64
+#endif
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_sections;
+	uint64_t table_offset;
+	int32_t num_classes;
+	int32_t num_images;
+	int32_t num_dimensions;
+	int32_t precision;
+	int32_t image_width;
+	int32_t image_height;
+	int32_t image_channels;
+	int32_t reserved[3];
+} dbfile_header_t;
+
+typedef struct {
+	uint32_t id;
+	uint32_t type;
+	int32_t rows;
+	int32_t cols;
+	uint64_t offset;
+	uint64_t size;
+} dbfile_section_t;
+
+typedef struct {
+	FILE *stream;
+	dbfile_header_t header;
+	dbfile_section_t sections[DBFILE_MAX_SECTIONS];
+} dbfile_writer_t;
+
+typedef struct {
+	void *data;
+	size_t size;
+	dbfile_header_t *header;
+	dbfile_section_t *sections;
+} dbfile_t;
+
+void dbfile_create(dbfile_writer_t *writer, const char *path, dbfile_header_t *header);
+void dbfile_write(dbfile_writer_t *writer, int id, dbfile_type_t type, int rows, int cols, const void *data, size_t size);
+void dbfile_write_matrix(dbfile_writer_t *writer, int id, matrix_t *M);
+void dbfile_write_qmatrix(dbfile_writer_t *writer, int id, qmatrix_t *Q);
+void dbfile_write_hnsw(dbfile_writer_t *writer, int id, hnsw_t *H);
+void dbfile_close_writer(dbfile_writer_t *writer);
+
+dbfile_t * dbfile_open(const char *path);
+void dbfile_close(dbfile_t *file);
+dbfile_section_t * dbfile_find(dbfile_t *file, int id);
+const void * dbfile_data(dbfile_t *file, dbfile_section_t *section);
+matrix_t * dbfile_read_matrix(dbfile_t *file, int id);
+qmatrix_t * dbfile_read_qmatrix(dbfile_t *file, int id);
+hnsw_t * dbfile_read_hnsw(dbfile_t *file, int id);
+int dbfile_contains(dbfile_t *file, const void *ptr);
+size_t dbfile_type_size(dbfile_type_t type);
+
+#endif
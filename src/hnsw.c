@@ -0,0 +1,779 @@
+/**
+ * @file hnsw.c
+ *
+ * Implementation of the HNSW graph.
+ *
+ * Nodes are added with the neighbor selection heuristic of
+ * Malkov and Yashunin (2016), keeping pruned candidates when a
+ * node would otherwise have fewer than the maximum number of
+ * links. Distances are always computed from the columns of P, so
+ * a search returns the exact nearest neighbor among the nodes
+ * that it visits, and ties are broken by the lowest index.
+ */
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hnsw.h"
+
+/**
+ * Maximum level of a node.
+ */
+#define HNSW_MAX_LEVEL 16
+
+typedef struct {
+	precision_t dist;
+	int index;
+} hnsw_pair_t;
+
+/**
+ * Visited marks of the searches of a thread. A node is visited
+ * in the current search if its mark is the epoch of the search,
+ * so that a search clears the marks of the previous search by
+ * incrementing the epoch.
+ */
+typedef struct {
+	uint32_t *marks;
+	int size;
+	uint32_t epoch;
+} hnsw_marks_t;
+
+static pthread_key_t hnsw_marks_key;
+static pthread_once_t hnsw_marks_once = PTHREAD_ONCE_INIT;
+
+typedef struct {
+	hnsw_t *H;
+	matrix_t *P;
+	matrix_t *P_norm;
+	dist_t dist_type;
+
+	// query vector
+	matrix_t *X;
+	int i;
+	precision_t x_norm;
+
+	// visited nodes
+	hnsw_marks_t *visited;
+
+	// min-heap of candidates and max-heap of results
+	hnsw_pair_t *candidates;
+	int num_candidates;
+	int candidates_size;
+	hnsw_pair_t *results;
+	int num_results;
+} hnsw_search_t;
+
+/**
+ * Get whether a pair precedes another pair, by distance and
+ * then by index.
+ *
+ * @param a
+ * @param b
+ * @return 1 if a precedes b, 0 otherwise
+ */
+static int hnsw_less(hnsw_pair_t a, hnsw_pair_t b)
+{
+	return a.dist < b.dist || (a.dist == b.dist && a.index < b.index);
+}
+
+/**
+ * Compare two pairs for qsort().
+ */
+static int hnsw_compare(const void *a, const void *b)
+{
+	hnsw_pair_t p = *(const hnsw_pair_t *)a;
+	hnsw_pair_t q = *(const hnsw_pair_t *)b;
+
+	return hnsw_less(p, q) ? -1 : hnsw_less(q, p);
+}
+
+/**
+ * Push a pair onto a binary heap, which is a max-heap if
+ * max is set and a min-heap otherwise.
+ *
+ * @param heap  pointer to heap
+ * @param n     pointer to size of heap
+ * @param p     pair
+ * @param max   whether the heap is a max-heap
+ */
+static void hnsw_heap_push(hnsw_pair_t *heap, int *n, hnsw_pair_t p, int max)
+{
+	int k = (*n)++;
+
+	while ( k > 0 ) {
+		int parent = (k - 1) / 2;
+
+		if ( max ? !hnsw_less(heap[parent], p) : !hnsw_less(p, heap[parent]) ) {
+			break;
+		}
+
+		heap[k] = heap[parent];
+		k = parent;
+	}
+
+	heap[k] = p;
+}
+
+/**
+ * Remove the top pair of a binary heap.
+ *
+ * @param heap  pointer to heap
+ * @param n     pointer to size of heap
+ * @param max   whether the heap is a max-heap
+ * @return top pair
+ */
+static hnsw_pair_t hnsw_heap_pop(hnsw_pair_t *heap, int *n, int max)
+{
+	hnsw_pair_t top = heap[0];
+	hnsw_pair_t p = heap[--(*n)];
+
+	int k = 0;
+	while ( 2 * k + 1 < *n ) {
+		int child = 2 * k + 1;
+
+		if ( child + 1 < *n && (max ? hnsw_less(heap[child], heap[child + 1]) : hnsw_less(heap[child + 1], heap[child])) ) {
+			child++;
+		}
+
+		if ( max ? !hnsw_less(p, heap[child]) : !hnsw_less(heap[child], p) ) {
+			break;
+		}
+
+		heap[k] = heap[child];
+		k = child;
+	}
+
+	if ( *n > 0 ) {
+		heap[k] = p;
+	}
+
+	return top;
+}
+
+/**
+ * Get the level of a node, which is drawn from an exponential
+ * distribution with a hash of the node index, so that the graph
+ * does not depend on the state of a random number generator.
+ *
+ * @param H  pointer to graph
+ * @param j  node index
+ * @return level of node
+ */
+static int hnsw_random_level(hnsw_t *H, int j)
+{
+	uint64_t z = (uint64_t)j + 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	z = z ^ (z >> 31);
+
+	double u = ((z >> 11) + 1) / 9007199254740992.0;
+	int level = (int)(-log(u) / log(H->M));
+
+	return (level < HNSW_MAX_LEVEL) ? level : HNSW_MAX_LEVEL;
+}
+
+/**
+ * Get the links of a node in a layer of a graph.
+ *
+ * @param H    pointer to graph
+ * @param j    node index
+ * @param l    layer
+ * @param max  pointer to store maximum number of links
+ * @return pointer to links, padded with -1
+ */
+static int32_t * hnsw_links(hnsw_t *H, int j, int l, int *max)
+{
+	if ( l == 0 ) {
+		*max = 2 * H->M;
+		return H->links + (size_t)j * 2 * H->M;
+	}
+
+	*max = H->M;
+	return H->upper + H->offsets[j] + (size_t)(l - 1) * H->M;
+}
+
+/**
+ * Compute the distance between a query vector and a node.
+ *
+ * @param s  pointer to search state
+ * @param j  node index
+ * @return distance
+ */
+static precision_t hnsw_distance(hnsw_search_t *s, int j)
+{
+	return (s->dist_type == DIST_COS)
+		? -m_dot(s->X, s->i, s->P, j) / (s->x_norm * elem(s->P_norm, j, 0))
+		: m_dist_L2(s->X, s->i, s->P, j);
+}
+
+/**
+ * Compute the distance between two nodes.
+ *
+ * @param s  pointer to search state
+ * @param j  node index
+ * @param k  node index
+ * @return distance
+ */
+static precision_t hnsw_node_distance(hnsw_search_t *s, int j, int k)
+{
+	return (s->dist_type == DIST_COS)
+		? -m_dot(s->P, j, s->P, k) / (elem(s->P_norm, j, 0) * elem(s->P_norm, k, 0))
+		: m_dist_L2(s->P, j, s->P, k);
+}
+
+/**
+ * Free the visited marks of a thread when it exits.
+ *
+ * @param arg  pointer to visited marks
+ */
+static void hnsw_marks_free(void *arg)
+{
+	hnsw_marks_t *visited = (hnsw_marks_t *)arg;
+
+	free(visited->marks);
+	free(visited);
+}
+
+/**
+ * Create the key of the visited marks of each thread.
+ */
+static void hnsw_marks_init(void)
+{
+	pthread_key_create(&hnsw_marks_key, hnsw_marks_free);
+}
+
+/**
+ * Get the visited marks of the calling thread, which are
+ * allocated once for each thread instead of for each search,
+ * with room for at least n nodes.
+ *
+ * @param n  number of nodes
+ * @return pointer to visited marks
+ */
+static hnsw_marks_t * hnsw_marks_get(int n)
+{
+	pthread_once(&hnsw_marks_once, hnsw_marks_init);
+
+	hnsw_marks_t *visited = (hnsw_marks_t *)pthread_getspecific(hnsw_marks_key);
+
+	if ( visited == NULL ) {
+		visited = (hnsw_marks_t *)calloc(1, sizeof(hnsw_marks_t));
+		pthread_setspecific(hnsw_marks_key, visited);
+	}
+
+	if ( visited->size < n ) {
+		free(visited->marks);
+		visited->marks = (uint32_t *)calloc(n, sizeof(uint32_t));
+		visited->size = n;
+		visited->epoch = 0;
+	}
+
+	return visited;
+}
+
+/**
+ * Initialize the state of a search.
+ *
+ * @param s          pointer to search state
+ * @param H          pointer to graph
+ * @param P          pointer to matrix indexed by graph
+ * @param P_norm     pointer to column norms of P
+ * @param dist_type  distance function
+ * @param ef         maximum number of results of a search
+ */
+static void hnsw_search_init(hnsw_search_t *s, hnsw_t *H, matrix_t *P, matrix_t *P_norm, dist_t dist_type, int ef)
+{
+	s->H = H;
+	s->P = P;
+	s->P_norm = P_norm;
+	s->dist_type = dist_type;
+	s->visited = hnsw_marks_get(P->cols);
+	s->candidates_size = 64;
+	s->candidates = (hnsw_pair_t *)malloc(s->candidates_size * sizeof(hnsw_pair_t));
+	s->results = (hnsw_pair_t *)malloc((ef + 1) * sizeof(hnsw_pair_t));
+}
+
+/**
+ * Free the state of a search. The visited marks are kept
+ * for the next search of the thread.
+ *
+ * @param s  pointer to search state
+ */
+static void hnsw_search_free(hnsw_search_t *s)
+{
+	free(s->candidates);
+	free(s->results);
+}
+
+/**
+ * Set the query vector of a search.
+ *
+ * @param s  pointer to search state
+ * @param X  pointer to matrix of query vectors
+ * @param i  column index of X
+ */
+static void hnsw_search_query(hnsw_search_t *s, matrix_t *X, int i)
+{
+	s->X = X;
+	s->i = i;
+	s->x_norm = sqrt(m_dot(X, i, X, i));
+}
+
+/**
+ * Mark a node as visited.
+ *
+ * @param s  pointer to search state
+ * @param j  node index
+ * @return 1 if the node was not visited before, 0 otherwise
+ */
+static int hnsw_visit(hnsw_search_t *s, int j)
+{
+	hnsw_marks_t *visited = s->visited;
+
+	if ( visited->marks[j] == visited->epoch ) {
+		return 0;
+	}
+
+	visited->marks[j] = visited->epoch;
+
+	return 1;
+}
+
+/**
+ * Search a layer of a graph for the ef nodes nearest to the
+ * query vector, starting from an entry point. The results are
+ * stored in s->results in order of increasing distance.
+ *
+ * @param s      pointer to search state
+ * @param entry  entry point
+ * @param ef     maximum number of results
+ * @param l      layer
+ */
+static void hnsw_search_layer(hnsw_search_t *s, hnsw_pair_t entry, int ef, int l)
+{
+	// clear the visited nodes of the previous search, and every
+	// mark when the epoch wraps around
+	hnsw_marks_t *visited = s->visited;
+
+	visited->epoch++;
+
+	if ( visited->epoch == 0 ) {
+		memset(visited->marks, 0, visited->size * sizeof(uint32_t));
+		visited->epoch = 1;
+	}
+
+	s->num_candidates = 0;
+	s->num_results = 0;
+
+	hnsw_visit(s, entry.index);
+	hnsw_heap_push(s->candidates, &s->num_candidates, entry, 0);
+	hnsw_heap_push(s->results, &s->num_results, entry, 1);
+
+	while ( s->num_candidates > 0 ) {
+		hnsw_pair_t c = hnsw_heap_pop(s->candidates, &s->num_candidates, 0);
+
+		if ( s->num_results == ef && hnsw_less(s->results[0], c) ) {
+			break;
+		}
+
+		int max;
+		int32_t *links = hnsw_links(s->H, c.index, l, &max);
+
+		int k;
+		for ( k = 0; k < max && links[k] != -1; k++ ) {
+			int j = links[k];
+
+			if ( !hnsw_visit(s, j) ) {
+				continue;
+			}
+
+			hnsw_pair_t p = { hnsw_distance(s, j), j };
+
+			if ( s->num_results < ef || hnsw_less(p, s->results[0]) ) {
+				if ( s->num_candidates == s->candidates_size ) {
+					s->candidates_size *= 2;
+					s->candidates = (hnsw_pair_t *)realloc(s->candidates, s->candidates_size * sizeof(hnsw_pair_t));
+				}
+
+				hnsw_heap_push(s->candidates, &s->num_candidates, p, 0);
+				hnsw_heap_push(s->results, &s->num_results, p, 1);
+
+				if ( s->num_results > ef ) {
+					hnsw_heap_pop(s->results, &s->num_results, 1);
+				}
+			}
+		}
+	}
+
+	qsort(s->results, s->num_results, sizeof(hnsw_pair_t), hnsw_compare);
+}
+
+/**
+ * Select at most max links from a list of candidates in order
+ * of increasing distance from a node, with the neighbor selection
+ * heuristic: a candidate is selected if it is nearer to the node
+ * than to every selected candidate. If fewer than max candidates
+ * are selected, the remaining candidates are selected in order.
+ *
+ * @param s           pointer to search state
+ * @param candidates  pointer to sorted list of candidates
+ * @param num         number of candidates
+ * @param links       pointer to store links, padded with -1
+ * @param max         maximum number of links
+ */
+static void hnsw_select(hnsw_search_t *s, hnsw_pair_t *candidates, int num, int32_t *links, int max)
+{
+	uint8_t *selected = (uint8_t *)calloc(num, sizeof(uint8_t));
+	int num_links = 0;
+
+	int j, k;
+	for ( j = 0; j < num && num_links < max; j++ ) {
+		int good = 1;
+
+		for ( k = 0; k < num_links; k++ ) {
+			if ( hnsw_node_distance(s, candidates[j].index, links[k]) < candidates[j].dist ) {
+				good = 0;
+				break;
+			}
+		}
+
+		if ( good ) {
+			links[num_links++] = candidates[j].index;
+			selected[j] = 1;
+		}
+	}
+
+	for ( j = 0; j < num && num_links < max; j++ ) {
+		if ( !selected[j] ) {
+			links[num_links++] = candidates[j].index;
+		}
+	}
+
+	for ( k = num_links; k < max; k++ ) {
+		links[k] = -1;
+	}
+
+	free(selected);
+}
+
+/**
+ * Add a link from a node to a new node in a layer, and select
+ * the links of the node again if it has too many links.
+ *
+ * @param s     pointer to search state
+ * @param j     node index
+ * @param pair  new node and its distance from node j
+ * @param l     layer
+ */
+static void hnsw_connect(hnsw_search_t *s, int j, hnsw_pair_t pair, int l)
+{
+	int max;
+	int32_t *links = hnsw_links(s->H, j, l, &max);
+
+	int k;
+	for ( k = 0; k < max && links[k] != -1; k++ )
+		;
+
+	if ( k < max ) {
+		links[k] = pair.index;
+		return;
+	}
+
+	hnsw_pair_t *candidates = (hnsw_pair_t *)malloc((max + 1) * sizeof(hnsw_pair_t));
+
+	for ( k = 0; k < max; k++ ) {
+		candidates[k].dist = hnsw_node_distance(s, j, links[k]);
+		candidates[k].index = links[k];
+	}
+	candidates[max] = pair;
+
+	qsort(candidates, max + 1, sizeof(hnsw_pair_t), hnsw_compare);
+	hnsw_select(s, candidates, max + 1, links, max);
+
+	free(candidates);
+}
+
+/**
+ * Construct an empty graph.
+ *
+ * @param M                maximum number of links in upper layers
+ * @param ef_construction  number of candidates for the links of each node
+ * @return pointer to new graph
+ */
+hnsw_t * hnsw_construct(int M, int ef_construction)
+{
+	hnsw_t *H = (hnsw_t *)calloc(1, sizeof(hnsw_t));
+	H->M = M;
+	H->ef_construction = ef_construction;
+	H->entry = -1;
+	H->offsets = (int32_t *)calloc(1, sizeof(int32_t));
+
+	return H;
+}
+
+/**
+ * Copy a graph, for example to add nodes to a graph which
+ * was read from a database file.
+ *
+ * @param H  pointer to graph
+ * @return pointer to copy of graph
+ */
+hnsw_t * hnsw_copy(hnsw_t *H)
+{
+	hnsw_t *C = (hnsw_t *)malloc(sizeof(hnsw_t));
+	size_t n = H->num_nodes;
+
+	*C = *H;
+	C->capacity = n;
+	C->upper_capacity = H->offsets[n];
+	C->offsets = (int32_t *)malloc((n + 1) * sizeof(int32_t));
+	C->links = (int32_t *)malloc(n * 2 * H->M * sizeof(int32_t));
+	C->upper = (int32_t *)malloc(C->upper_capacity * sizeof(int32_t));
+
+	memcpy(C->offsets, H->offsets, (n + 1) * sizeof(int32_t));
+	memcpy(C->links, H->links, n * 2 * H->M * sizeof(int32_t));
+	memcpy(C->upper, H->upper, C->upper_capacity * sizeof(int32_t));
+
+	return C;
+}
+
+/**
+ * Get the level of a node from the offsets of its upper links.
+ *
+ * @param H  pointer to graph
+ * @param j  node index
+ * @return level of node
+ */
+static int hnsw_level(hnsw_t *H, int j)
+{
+	return (H->offsets[j + 1] - H->offsets[j]) / H->M;
+}
+
+/**
+ * Check that a graph, for example one which was read from a
+ * database file, is consistent: the offsets of the upper links
+ * increase by a multiple of M up to HNSW_MAX_LEVEL layers, the
+ * entry point is a node of the maximum level, and each link is
+ * -1 or a node which has the layer of the link.
+ *
+ * @param H  pointer to graph
+ * @return 1 if the graph is consistent, 0 otherwise
+ */
+int hnsw_validate(hnsw_t *H)
+{
+	int n = H->num_nodes;
+
+	if ( H->M < 1 || n < 0 || H->offsets[0] != 0 ) {
+		return 0;
+	}
+
+	if ( n == 0 ) {
+		return (H->entry == -1);
+	}
+
+	int j, k, l;
+	for ( j = 0; j < n; j++ ) {
+		int size = H->offsets[j + 1] - H->offsets[j];
+
+		if ( H->offsets[j + 1] < H->offsets[j] || size % H->M != 0 || size / H->M > HNSW_MAX_LEVEL ) {
+			return 0;
+		}
+	}
+
+	if ( H->entry < 0 || H->entry >= n || hnsw_level(H, H->entry) != H->max_level ) {
+		return 0;
+	}
+
+	for ( j = 0; j < n; j++ ) {
+		for ( l = 0; l <= hnsw_level(H, j); l++ ) {
+			int max;
+			int32_t *links = hnsw_links(H, j, l, &max);
+
+			for ( k = 0; k < max; k++ ) {
+				if ( links[k] < -1 || links[k] >= n || (links[k] != -1 && hnsw_level(H, links[k]) < l) ) {
+					return 0;
+				}
+			}
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * Free a graph.
+ *
+ * @param H  pointer to graph
+ */
+void hnsw_free(hnsw_t *H)
+{
+	free(H->offsets);
+	free(H->links);
+	free(H->upper);
+	free(H);
+}
+
+/**
+ * Add the next column of a matrix P to a graph, so that the
+ * graph indexes columns 0, ..., H->num_nodes of P.
+ *
+ * @param H          pointer to graph
+ * @param P          pointer to matrix
+ * @param P_norm     pointer to column norms of P
+ * @param dist_type  distance function
+ */
+void hnsw_add(hnsw_t *H, matrix_t *P, matrix_t *P_norm, dist_t dist_type)
+{
+	int j = H->num_nodes;
+	int level = hnsw_random_level(H, j);
+	int M0 = 2 * H->M;
+
+	// allocate the links of the new node
+	if ( j == H->capacity ) {
+		H->capacity = (H->capacity > 0) ? 2 * H->capacity : 64;
+		H->offsets = (int32_t *)realloc(H->offsets, (H->capacity + 1) * sizeof(int32_t));
+		H->links = (int32_t *)realloc(H->links, (size_t)H->capacity * M0 * sizeof(int32_t));
+	}
+
+	H->offsets[j + 1] = H->offsets[j] + level * H->M;
+
+	if ( H->offsets[j + 1] > H->upper_capacity ) {
+		while ( H->upper_capacity < H->offsets[j + 1] ) {
+			H->upper_capacity = (H->upper_capacity > 0) ? 2 * H->upper_capacity : 256;
+		}
+		H->upper = (int32_t *)realloc(H->upper, H->upper_capacity * sizeof(int32_t));
+	}
+
+	int k;
+	for ( k = 0; k < M0; k++ ) {
+		H->links[(size_t)j * M0 + k] = -1;
+	}
+
+	for ( k = H->offsets[j]; k < H->offsets[j + 1]; k++ ) {
+		H->upper[k] = -1;
+	}
+
+	H->num_nodes++;
+
+	if ( H->entry == -1 ) {
+		H->entry = j;
+		H->max_level = level;
+		return;
+	}
+
+	// descend to the level of the new node
+	hnsw_search_t s;
+	hnsw_search_init(&s, H, P, P_norm, dist_type, H->ef_construction);
+	hnsw_search_query(&s, P, j);
+
+	hnsw_pair_t entry = { hnsw_distance(&s, H->entry), H->entry };
+
+	int l;
+	for ( l = H->max_level; l > level; l-- ) {
+		hnsw_search_layer(&s, entry, 1, l);
+		entry = s.results[0];
+	}
+
+	// link the new node in each layer
+	for ( l = (level < H->max_level) ? level : H->max_level; l >= 0; l-- ) {
+		hnsw_search_layer(&s, entry, H->ef_construction, l);
+
+		int max;
+		int32_t *links = hnsw_links(H, j, l, &max);
+
+		hnsw_select(&s, s.results, s.num_results, links, max);
+
+		for ( k = 0; k < max && links[k] != -1; k++ ) {
+			hnsw_pair_t pair = { hnsw_node_distance(&s, links[k], j), j };
+
+			hnsw_connect(&s, links[k], pair, l);
+		}
+
+		entry = s.results[0];
+	}
+
+	if ( level > H->max_level ) {
+		H->entry = j;
+		H->max_level = level;
+	}
+
+	hnsw_search_free(&s);
+}
+
+/**
+ * Build a graph for the columns of a matrix P.
+ *
+ * @param P                pointer to matrix
+ * @param P_norm           pointer to column norms of P
+ * @param dist_type        distance function
+ * @param M                maximum number of links in upper layers
+ * @param ef_construction  number of candidates for the links of each node
+ * @return pointer to new graph
+ */
+hnsw_t * hnsw_build(matrix_t *P, matrix_t *P_norm, dist_t dist_type, int M, int ef_construction)
+{
+	hnsw_t *H = hnsw_construct(M, ef_construction);
+
+	int j;
+	for ( j = 0; j < P->cols; j++ ) {
+		hnsw_add(H, P, P_norm, dist_type);
+	}
+
+	return H;
+}
+
+/**
+ * Find the k columns of a matrix P nearest to a column of a
+ * matrix X with a graph of P.
+ *
+ * A larger ef visits more nodes, which increases the recall
+ * and the latency of the search. At most ef columns are found.
+ *
+ * @param H          pointer to graph
+ * @param P          pointer to matrix
+ * @param P_norm     pointer to column norms of P
+ * @param dist_type  distance function
+ * @param X          pointer to matrix of query vectors
+ * @param i          column index of X
+ * @param ef         number of candidates in layer 0
+ * @param k          maximum number of columns to find
+ * @param indices    pointer to store indices of columns, nearest first
+ * @param dists      pointer to store distances of columns
+ * @return number of columns found
+ */
+int hnsw_search(hnsw_t *H, matrix_t *P, matrix_t *P_norm, dist_t dist_type, matrix_t *X, int i, int ef, int k, int *indices, precision_t *dists)
+{
+	if ( H->entry == -1 ) {
+		return 0;
+	}
+
+	if ( ef < 1 ) {
+		ef = 1;
+	}
+
+	hnsw_search_t s;
+	hnsw_search_init(&s, H, P, P_norm, dist_type, ef);
+	hnsw_search_query(&s, X, i);
+
+	hnsw_pair_t entry = { hnsw_distance(&s, H->entry), H->entry };
+
+	int l;
+	for ( l = H->max_level; l > 0; l-- ) {
+		hnsw_search_layer(&s, entry, 1, l);
+		entry = s.results[0];
+	}
+
+	hnsw_search_layer(&s, entry, ef, 0);
+
+	int num = (k < s.num_results) ? k : s.num_results;
+
+	int j;
+	for ( j = 0; j < num; j++ ) {
+		indices[j] = s.results[j].index;
+		dists[j] = s.results[j].dist;
+	}
+
+	hnsw_search_free(&s);
+
+	return num;
+}
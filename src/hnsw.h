@@ -0,0 +1,48 @@
+/**
+ * @file hnsw.h
+ *
+ * Interface definitions for approximate nearest-neighbor search
+ * with a hierarchical navigable small world (HNSW) graph.
+ *
+ * The graph indexes the columns of a matrix P, which it does not
+ * copy. Each node j has a level L_j, and is linked to at most
+ * 2 * M nodes in layer 0 and at most M nodes in each of the
+ * layers 1, ..., L_j. The links of layer 0 are stored as a
+ * (2 * M)-by-n matrix of node indices padded with -1, and the
+ * links of the upper layers of node j are stored in upper from
+ * offsets[j] to offsets[j + 1], so that L_j is implied by the
+ * offsets.
+ */
+#ifndef HNSW_H
+#define HNSW_H
+
+#include <stdint.h>
+#include "matrix.h"
+
+#define HNSW_DEFAULT_M 16
+#define HNSW_DEFAULT_EF_CONSTRUCTION 100
+#define HNSW_DEFAULT_EF 64
+
+typedef struct {
+	int M;
+	int ef_construction;
+	int entry;
+	int max_level;
+	int num_nodes;
+	int capacity;
+	size_t upper_capacity;
+	int32_t *offsets;
+	int32_t *links;
+	int32_t *upper;
+} hnsw_t;
+
+hnsw_t * hnsw_construct(int M, int ef_construction);
+hnsw_t * hnsw_copy(hnsw_t *H);
+void hnsw_free(hnsw_t *H);
+int hnsw_validate(hnsw_t *H);
+
+void hnsw_add(hnsw_t *H, matrix_t *P, matrix_t *P_norm, dist_t dist_type);
+hnsw_t * hnsw_build(matrix_t *P, matrix_t *P_norm, dist_t dist_type, int M, int ef_construction);
+int hnsw_search(hnsw_t *H, matrix_t *P, matrix_t *P_norm, dist_t dist_type, matrix_t *X, int i, int ef, int k, int *indices, precision_t *dists);
+
+#endif
@@ -5,8 +5,48 @@
  */
 #include "database.h"
 #include "matrix.h"
+#include "parallel.h"
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Default convergence parameters of FastICA.
+ */
+#define FASTICA_TOLERANCE 1e-6
+#define FASTICA_MAX_ITERATIONS 200
+
+/**
+ * Seed of the shuffle of the training set, so that ICA has
+ * the same result in every run and in concurrent runs.
+ */
+#define ICA_SEED 1
+
+/**
+ * Restarts of Infomax after W diverges: the factor of the learning
+ * rate after each restart, the maximum number of restarts, and
+ * the norm of W above which it has diverged.
+ */
+#define ICA_RESTART_FACTOR 0.5
+#define ICA_MAX_RESTARTS 10
+#define ICA_MAX_NORM 1e8
+
+/**
+ * Number of Infomax sweeps between checkpoints.
+ */
+#define ICA_CHECKPOINT_INTERVAL 10
+
+/**
+ * Section ids of an Infomax checkpoint.
+ */
+typedef enum {
+    CHECKPOINT_W = 1,
+    CHECKPOINT_STATE = 2
+} checkpoint_section_t;
 
 /**
  * Compute the whitening matrix W_z for a matrix X.
@@ -83,6 +123,125 @@ precision_t m_angle(matrix_t *A, matrix_t *B)
     return acos(-a_dot_b / (m_norm(A) * m_norm(B)));
 }
 
+/**
+ * Workspace for sep96, which is allocated once for each
+ * training run so that the learning rule does not allocate
+ * any matrices.
+ */
+struct sep96_workspace {
+    m_arena_t *arena;
+    matrix_t *W0;
+    matrix_t *U;
+    matrix_t *Y_p;
+    matrix_t *Z;
+    matrix_t *dW;
+};
+
+/**
+ * Allocate a workspace for sep96.
+ *
+ * @param n  number of rows of the input matrix
+ * @param B  maximum block size
+ * @return pointer to new workspace
+ */
+sep96_workspace_t * sep96_workspace_alloc(int n, int B)
+{
+    sep96_workspace_t *ws = (sep96_workspace_t *)malloc(sizeof(sep96_workspace_t));
+    ws->arena = m_arena_create(((size_t)2 * n * n + (size_t)3 * n * B) * sizeof(precision_t) + 16 * M_ARENA_ALIGN);
+    ws->W0 = m_arena_initialize(ws->arena, n, n);
+    ws->U = m_arena_initialize(ws->arena, n, B);
+    ws->Y_p = m_arena_initialize(ws->arena, n, B);
+    ws->Z = m_arena_initialize(ws->arena, B, n);
+    ws->dW = m_arena_initialize(ws->arena, n, n);
+
+    return ws;
+}
+
+/**
+ * Free a workspace for sep96.
+ *
+ * @param ws  pointer to workspace
+ */
+void sep96_workspace_free(sep96_workspace_t *ws)
+{
+    m_arena_free(ws->arena);
+    free(ws);
+}
+
+/**
+ * Compute the nonlinearity Y' = 1 - 2 * f(U), f(u) = 1 / (1 + e^(-u))
+ * in a single pass over U.
+ *
+ * @param Y_p  pointer to output matrix
+ * @param U    pointer to input matrix
+ */
+void sep96_nonlinearity(matrix_t *Y_p, matrix_t *U)
+{
+    precision_t *y = Y_p->data;
+    const precision_t *u = U->data;
+    int n = U->rows * U->cols;
+
+    int k;
+    for ( k = 0; k < n; k++ ) {
+        y[k] = 1 - 2 * (1 / (1 + exp(-u[k])));
+    }
+}
+
+/**
+ * Compute the update dW of the learning rule for the block [t, end)
+ * of X, which is stored in ws->dW. W is not modified.
+ *
+ * @param X    "sphered" input matrix
+ * @param W    weight matrix
+ * @param t    first column of the block
+ * @param end  end column of the block
+ * @param B    block size
+ * @param L    learning rate
+ * @param ws   workspace with block size of at least end - t
+ */
+void sep96_gradient(matrix_t *X, matrix_t *W, int t, int end, int B, precision_t L, sep96_workspace_t *ws)
+{
+    // use views of the block of X and the workspace
+    matrix_t X_batch = m_view_columns(X, t, end);
+    matrix_t U = m_view_columns(ws->U, 0, end - t);
+    matrix_t Y_p = m_view_columns(ws->Y_p, 0, end - t);
+
+    // compute U = W0 * X_batch, where W0 = W until W is updated
+    m_product_into(&U, W, 0, &X_batch, 0, 1, 0);
+
+    // compute Y' = 1 - 2 * f(U), f(u) = 1 / (1 + e^(-u))
+    sep96_nonlinearity(&Y_p, &U);
+
+    // compute dW = L * (BI + Y'U') * W0 = L * B * W0 + L * Y' * (U' * W0),
+    // which costs O(B * n^2) instead of O(n^3)
+    matrix_t Z = { ws->Z->data, end - t, ws->Z->cols };
+    matrix_t *dW = ws->dW;
+
+    m_product_into(&Z, &U, 1, W, 0, 1, 0);
+
+    int i;
+    for ( i = 0; i < dW->rows * dW->cols; i++ ) {
+        dW->data[i] = L * B * W->data[i];
+    }
+
+    m_product_into(dW, &Y_p, 0, &Z, 0, L, 1);
+}
+
+/**
+ * Print the training stats of an update of W.
+ *
+ * @param W0  weight matrix before the update
+ * @param W   weight matrix after the update
+ * @param dW  update of W
+ */
+void sep96_print_stats(matrix_t *W0, matrix_t *W, matrix_t *dW)
+{
+    precision_t norm = m_norm(dW);
+    precision_t angle = m_angle(W0, W);
+
+    printf("*** norm(dW) = %.4lf, angle(W0, W) = %.1lf deg\n", norm, 180 * angle / M_PI);
+}
+
 /**
  * Implementation of the learning rule described in Bell & Sejnowski,
  * Vision Research, in press for 1997, that contained the natural
@@ -99,16 +258,16 @@ precision_t m_angle(matrix_t *A, matrix_t *B)
  * 300, at least for 2->2 separation.  When annealing to the right
  * solution for 10->10, however, L < 0.0001 and B = 10 were most successful.
  *
- * @param X  "sphered" input matrix
- * @param W  weight matrix
- * @param B  block size
- * @param L  learning rate
- * @param F  interval to print training stats
+ * @param X   "sphered" input matrix
+ * @param W   weight matrix
+ * @param B   block size
+ * @param L   learning rate
+ * @param F   interval to print training stats, or 0 to print none
+ * @param ws  workspace with block size of at least B
  */
-void sep96(matrix_t *X, matrix_t *W, int B, double L, int F)
+void sep96(matrix_t *X, matrix_t *W, int B, precision_t L, int F, sep96_workspace_t *ws)
 {
-    matrix_t *BI = m_identity(X->rows);
-    m_elem_mult(BI, B);
+    assert(ws->U->cols >= B);
 
     int t;
     for ( t = 0; t < X->cols; t += B ) {
@@ -116,92 +275,687 @@ void sep96(matrix_t *X, matrix_t *W, int B, double L, int F)
             ? t + B
             : X->cols;
 
-        matrix_t *W0 = m_copy(W);
-        matrix_t *X_batch = m_copy_columns(X, t, end);
-        matrix_t *U = m_product(W0, X_batch);
+        sep96_gradient(X, W, t, end, B, L, ws);
 
-        // compute Y' = 1 - 2 * f(U), f(u) = 1 / (1 + e^(-u))
-        matrix_t *Y_p = m_initialize(U->rows, U->cols);
+        // compute W = W0 + dW
+        int print_stats = (F > 0 && t % F == 0);
 
-        int i, j;
-        for ( i = 0; i < Y_p->rows; i++ ) {
-            for ( j = 0; j < Y_p->cols; j++ ) {
-                elem(Y_p, i, j) = 1 - 2 * (1 / (1 + exp(-elem(U, i, j))));
-            }
+        if ( print_stats ) {
+            memcpy(ws->W0->data, W->data, W->rows * W->cols * sizeof(precision_t));
+        }
+
+        m_add(W, ws->dW);
+
+        // print training stats
+        if ( print_stats ) {
+            sep96_print_stats(ws->W0, W, ws->dW);
         }
+    }
+}
 
-        // compute dW = L * (BI + Y'U') * W0
-        matrix_t *U_tr = m_transpose(U);
-        matrix_t *dW_temp1 = m_product(Y_p, U_tr);
-        m_add(dW_temp1, BI);
+typedef struct {
+    matrix_t *X;
+    matrix_t *W;
+    int B;
+    precision_t L;
+    int F;
+    sep96_workspace_t **ws;
+    int num_threads;
+    pthread_barrier_t barrier;
+} sep96_parallel_args_t;
 
-        matrix_t *dW = m_product(dW_temp1, W0);
-        m_elem_mult(dW, L);
+/**
+ * Run one thread of a data-parallel sweep of sep96.
+ *
+ * The sweep goes through X in rounds of num_threads blocks. In
+ * each round, thread k computes the update dW_k of block k of
+ * the round from the same W, and W is updated with the mean of
+ * the updates, which each thread computes for its own range of
+ * the elements of W by adding dW_0, dW_1, ... in thread order,
+ * so that the result does not depend on the timing of the
+ * threads. Each update is scaled by L * B, so the sum of the
+ * updates would take a step num_threads times as large as
+ * sep96, which diverges with the learning rates of infomax.
+ *
+ * @param arg    pointer to sep96_parallel_args_t
+ * @param begin  unused
+ * @param end    unused
+ * @param id     thread index
+ */
+void sep96_parallel_thread(void *arg, int begin, int end, int id)
+{
+    sep96_parallel_args_t *args = (sep96_parallel_args_t *)arg;
+    matrix_t *X = args->X;
+    matrix_t *W = args->W;
+    int B = args->B;
+    int num_threads = args->num_threads;
+    int num_blocks = (X->cols + B - 1) / B;
 
-        // compute W = W0 + dW
-        m_add(W, dW);
+    // determine the range of elements of W which this thread updates
+    int n = W->rows * W->cols;
+    int e_begin = (int)((long)n * id / num_threads);
+    int e_end = (int)((long)n * (id + 1) / num_threads);
 
-        // print training stats
-        if ( t % F == 0 ) {
-            precision_t norm = m_norm(dW);
-            precision_t angle = m_angle(W0, W);
+    (void)begin;
+    (void)end;
+
+    int r;
+    for ( r = 0; r < num_blocks; r += num_threads ) {
+        int num_active = (num_blocks - r < num_threads)
+            ? num_blocks - r
+            : num_threads;
+
+        // compute the update of this thread's block
+        if ( id < num_active ) {
+            int t = (r + id) * B;
+            int t_end = (t + B < X->cols)
+                ? t + B
+                : X->cols;
+
+            sep96_gradient(X, W, t, t_end, B, args->L, args->ws[id]);
+        }
+
+        // print training stats if a block of the round starts every F counts
+        int print_stats = 0;
 
-            printf("*** norm(dW) = %.4lf, angle(W0, W) = %.1lf deg\n", norm, 180 * angle / M_PI);
+        int k;
+        for ( k = 0; k < num_active; k++ ) {
+            print_stats |= (args->F > 0 && (r + k) * B % args->F == 0);
         }
 
-        // cleanup
-        m_free(W0);
-        m_free(X_batch);
-        m_free(U);
-        m_free(Y_p);
-        m_free(U_tr);
-        m_free(dW_temp1);
-        m_free(dW);
+        if ( print_stats && id == 0 ) {
+            memcpy(args->ws[0]->W0->data, W->data, n * sizeof(precision_t));
+        }
+
+        pthread_barrier_wait(&args->barrier);
+
+        // compute W = W0 + (dW_0 + dW_1 + ...) / num_active
+        int i;
+        for ( i = e_begin; i < e_end; i++ ) {
+            precision_t dw = 0;
+
+            for ( k = 0; k < num_active; k++ ) {
+                dw += args->ws[k]->dW->data[i];
+            }
+
+            W->data[i] += dw / num_active;
+        }
+
+        pthread_barrier_wait(&args->barrier);
+
+        // dW_0 is not read again until the next round, so it can
+        // store the update of W for the stats
+        if ( print_stats && id == 0 ) {
+            matrix_t *W0 = args->ws[0]->W0;
+            matrix_t *dW = args->ws[0]->dW;
+
+            for ( i = 0; i < n; i++ ) {
+                dW->data[i] = W->data[i] - W0->data[i];
+            }
+
+            sep96_print_stats(W0, W, dW);
+        }
     }
 }
 
+/**
+ * Run one sweep of sep96 on num_threads threads, which each compute
+ * the update of one block of X at a time (see sep96_parallel_thread()).
+ *
+ * Each round of blocks updates W once with the mean of the updates of
+ * its blocks, so a sweep takes steps of the same size as sep96 but
+ * num_threads times fewer of them, and converges to the same W within
+ * the tolerance of infomax rather than to exactly the same W.
+ *
+ * @param X            "sphered" input matrix
+ * @param W            weight matrix
+ * @param B            block size
+ * @param L            learning rate
+ * @param F            interval to print training stats, or 0 to print none
+ * @param ws           workspaces of the threads, with block size of at least B
+ * @param num_threads  number of threads
+ */
+void sep96_parallel(matrix_t *X, matrix_t *W, int B, precision_t L, int F, sep96_workspace_t **ws, int num_threads)
+{
+    assert(ws[0]->U->cols >= B);
+
+    sep96_parallel_args_t args;
+    args.X = X;
+    args.W = W;
+    args.B = B;
+    args.L = L;
+    args.F = F;
+    args.ws = ws;
+    args.num_threads = num_threads;
+
+    pthread_barrier_init(&args.barrier, NULL, num_threads);
+
+    parallel_for(num_threads, num_threads, sep96_parallel_thread, &args);
+
+    pthread_barrier_destroy(&args.barrier);
+}
+
 typedef struct sep96_params {
     int B;
-    double L;
+    precision_t L;
     int F;
     int N;
 } sep96_params_t;
 
 /**
- * Compute the ICA weight matrix W_I for an input matrix X.
+ * Get the elapsed time since a start time.
  *
- * @param X  mean-subtracted input matrix
- * @return weight matrix W_I
+ * @param start  pointer to start time
+ * @return elapsed time in seconds
  */
-matrix_t * run_ica(matrix_t *X)
+double ica_elapsed(struct timespec *start)
 {
-    // compute whitening matrix W_z
-    matrix_t *W_z = sphere(X);
-    matrix_t *X_sph = m_product(W_z, X);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-    // shuffle the columns of X_sph
-    m_shuffle_columns(X_sph);
+    return (now.tv_sec - start->tv_sec) + 1e-9 * (now.tv_nsec - start->tv_nsec);
+}
 
-    // train the weight matrix W
-    matrix_t *W = m_identity(X->rows);
+/**
+ * Determine whether every element of a matrix is finite.
+ *
+ * @param M  pointer to matrix
+ * @return 1 if M is finite, 0 otherwise
+ */
+int m_is_finite(matrix_t *M)
+{
+    int i;
+    for ( i = 0; i < M->rows * M->cols; i++ ) {
+        if ( !isfinite(M->data[i]) ) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Position of Infomax training, which is saved in a checkpoint
+ * with W: the stage and the sweep within the stage of the next
+ * sweep, the number of sweeps so far, the state of the random
+ * number generator after the shuffle of the training set, and
+ * the number of restarts after W diverged.
+ */
+typedef struct {
+    int32_t stage;
+    int32_t sweep;
+    int32_t num_sweeps;
+    int32_t seed;
+    int32_t num_restarts;
+} infomax_state_t;
 
-    sep96_params_t params[] = {
+/**
+ * Save an Infomax checkpoint. The checkpoint is written to a
+ * temporary file which is then renamed, so that an interrupted
+ * save leaves the previous checkpoint.
+ *
+ * @param path   path of checkpoint
+ * @param W      pointer to weight matrix
+ * @param state  pointer to training position
+ */
+void infomax_save_checkpoint(const char *path, matrix_t *W, infomax_state_t *state)
+{
+    char *path_temp = (char *)malloc(strlen(path) + 5);
+    sprintf(path_temp, "%s.tmp", path);
+
+    dbfile_header_t header = {
+        .num_dimensions = W->rows,
+        .precision = DBFILE_PRECISION
+    };
+
+    dbfile_writer_t writer;
+    dbfile_create(&writer, path_temp, &header);
+
+    dbfile_write_matrix(&writer, CHECKPOINT_W, W);
+    dbfile_write(&writer, CHECKPOINT_STATE, DBFILE_INT32, sizeof(infomax_state_t) / sizeof(int32_t), 1, state, sizeof(infomax_state_t));
+
+    dbfile_close_writer(&writer);
+
+    if ( rename(path_temp, path) != 0 ) {
+        perror("rename");
+        exit(1);
+    }
+
+    free(path_temp);
+}
+
+/**
+ * Load an Infomax checkpoint, if it exists and matches the
+ * training set.
+ *
+ * @param path   path of checkpoint
+ * @param W      pointer to store weight matrix
+ * @param state  pointer to training position, whose seed must match
+ * @return 1 if the checkpoint was loaded, 0 otherwise
+ */
+int infomax_load_checkpoint(const char *path, matrix_t *W, infomax_state_t *state)
+{
+    if ( access(path, R_OK) != 0 ) {
+        return 0;
+    }
+
+    dbfile_t *file = dbfile_open(path);
+    matrix_t *W_file = dbfile_read_matrix(file, CHECKPOINT_W);
+    dbfile_section_t *section = dbfile_find(file, CHECKPOINT_STATE);
+
+    int valid = W_file != NULL
+        && W_file->rows == W->rows && W_file->cols == W->cols
+        && section != NULL && section->type == DBFILE_INT32
+        && section->rows == sizeof(infomax_state_t) / sizeof(int32_t) && section->cols == 1
+        && section->size == sizeof(infomax_state_t);
+
+    if ( valid ) {
+        infomax_state_t saved;
+        memcpy(&saved, dbfile_data(file, section), sizeof(infomax_state_t));
+
+        valid = (saved.seed == state->seed);
+
+        if ( valid ) {
+            memcpy(W->data, W_file->data, W->rows * W->cols * sizeof(precision_t));
+            *state = saved;
+        }
+    }
+
+    if ( !valid ) {
+        fprintf(stderr, "warning: ignoring invalid ICA checkpoint \'%s\'\n", path);
+    }
+
+    if ( W_file != NULL && !dbfile_contains(file, W_file->data) ) {
+        m_free(W_file);
+    }
+    else {
+        free(W_file);
+    }
+
+    dbfile_close(file);
+
+    return valid;
+}
+
+/**
+ * Train the ICA weight matrix W for a sphered input matrix
+ * with the Infomax learning rule (Bell & Sejnowski, 1995).
+ *
+ * The learning rate is annealed through a fixed schedule of
+ * stages. Each stage runs until the relative change in W over
+ * one sweep falls below params->tolerance, up to the number of
+ * sweeps in the schedule, and training stops after
+ * params->max_sweeps sweeps in total.
+ *
+ * If W diverges in a sweep, training restarts from the first stage
+ * with ICA_RESTART_FACTOR times the learning rates of the schedule,
+ * as runica() does in EEGLAB. A training set with about as many
+ * images as PCA components, such as ICA2 with all n - 1 components,
+ * can diverge with the rates of the schedule. After
+ * ICA_MAX_RESTARTS restarts, a diverged sweep is discarded and
+ * training moves on to the next stage.
+ *
+ * If params->num_threads is more than 1, each sweep is
+ * computed with sep96_parallel().
+ *
+ * If params->checkpoint is set, W and the training position are
+ * saved there every ICA_CHECKPOINT_INTERVAL sweeps, at the end
+ * of each stage and at the end of training, and training resumes
+ * from the checkpoint if it exists.
+ *
+ * @param X_sph   sphered input matrix
+ * @param params  pointer to ICA parameters
+ * @param start   pointer to start time of training
+ * @param seed    state of the random number generator after the shuffle of X_sph
+ * @return weight matrix W
+ */
+matrix_t * infomax(matrix_t *X_sph, ica_params_t *params, struct timespec *start, unsigned int seed)
+{
+    matrix_t *W = m_identity(X_sph->rows);
+    matrix_t *W_prev = m_initialize(X_sph->rows, X_sph->rows);
+
+    sep96_params_t schedule[] = {
         { 50, 0.0005, 5000, 1000 },
         { 50, 0.0003, 5000, 200 },
         { 50, 0.0002, 5000, 200 },
         { 50, 0.0001, 5000, 200 }
     };
-    int num_sweeps = sizeof(params) / sizeof(sep96_params_t);
+    int num_stages = sizeof(schedule) / sizeof(sep96_params_t);
+
+    // allocate the workspace for the largest block size
+    int B_max = 0;
 
     int i, j;
-    for ( i = 0; i < num_sweeps; i++ ) {
-        printf("sweep %d: B = %d, L = %lf\n", i + 1, params[i].B, params[i].L);
+    for ( i = 0; i < num_stages; i++ ) {
+        if ( B_max < schedule[i].B ) {
+            B_max = schedule[i].B;
+        }
+    }
+
+    int num_threads = (params->num_threads > 1)
+        ? params->num_threads
+        : 1;
+
+    sep96_workspace_t **ws = (sep96_workspace_t **)malloc(num_threads * sizeof(sep96_workspace_t *));
+
+    for ( i = 0; i < num_threads; i++ ) {
+        ws[i] = sep96_workspace_alloc(X_sph->rows, B_max);
+    }
+
+    // resume from the checkpoint
+    infomax_state_t state = { 0, 0, 0, (int32_t)seed, 0 };
+
+    if ( params->checkpoint != NULL && infomax_load_checkpoint(params->checkpoint, W, &state) ) {
+        printf("Resuming ICA after %d sweeps from \'%s\'...\n", state.num_sweeps, params->checkpoint);
+    }
+
+    int num_sweeps = state.num_sweeps;
+
+    for ( i = state.stage; i < num_stages; i++ ) {
+        if ( params->max_sweeps > 0 && num_sweeps >= params->max_sweeps ) {
+            break;
+        }
+
+        precision_t L = schedule[i].L * pow(ICA_RESTART_FACTOR, state.num_restarts);
+
+        // print the training stats every F counts unless ICA is quiet
+        int F = params->quiet ? 0 : schedule[i].F;
+
+        if ( !params->quiet ) printf("sweep %d: B = %d, L = %lf\n", i + 1, schedule[i].B, L);
+
+        for ( j = (i == state.stage) ? state.sweep : 0; j < schedule[i].N; j++ ) {
+            if ( params->max_sweeps > 0 && num_sweeps >= params->max_sweeps ) {
+                break;
+            }
+
+            memcpy(W_prev->data, W->data, W->rows * W->cols * sizeof(precision_t));
+
+            if ( num_threads > 1 ) {
+                sep96_parallel(X_sph, W, schedule[i].B, L, F, ws, num_threads);
+            }
+            else {
+                sep96(X_sph, W, schedule[i].B, L, F, ws[0]);
+            }
+
+            num_sweeps++;
+
+            // discard the sweep if W has diverged
+            int diverged = !m_is_finite(W) || m_norm(W) > ICA_MAX_NORM;
+
+            if ( diverged ) {
+                memcpy(W->data, W_prev->data, W->rows * W->cols * sizeof(precision_t));
+            }
+
+            // compute the change in W over the sweep
+            precision_t norm_W = m_norm(W_prev);
+            precision_t angle = diverged ? 0 : 180 - 180 * m_angle(W_prev, W) / M_PI;
+
+            m_subtract(W_prev, W);
+
+            precision_t norm_dW = diverged ? NAN : m_norm(W_prev);
+            int converged = !diverged && norm_dW <= params->tolerance * norm_W;
+
+            if ( params->progress != NULL ) {
+                // JSON has no NaN or infinity, so the change of a
+                // diverged sweep is null
+                char norm_dW_str[32] = "null";
+                char angle_str[32] = "null";
+
+                if ( !diverged && isfinite(norm_dW) ) {
+                    snprintf(norm_dW_str, sizeof(norm_dW_str), "%g", norm_dW);
+                }
+                if ( !diverged && isfinite(angle) ) {
+                    snprintf(angle_str, sizeof(angle_str), "%g", angle);
+                }
+
+                fprintf(params->progress,
+                    "{\"stage\": %d, \"sweep\": %d, \"learning_rate\": %g, \"norm_dW\": %s, \"angle\": %s, \"elapsed\": %.3f"
+                    "%s%s}\n",
+                    i + 1, num_sweeps, L, norm_dW_str, angle_str, ica_elapsed(start),
+                    diverged ? ", \"diverged\": true" : "",
+                    converged ? ", \"converged\": true" : "");
+                fflush(params->progress);
+            }
+
+            // restart from the identity with a smaller learning rate
+            // if W has diverged, since W may already be on its way
+            // to diverge in the sweeps before
+            int restart = diverged && state.num_restarts < ICA_MAX_RESTARTS;
+
+            if ( restart ) {
+                m_free(W);
+                W = m_identity(X_sph->rows);
+
+                state.num_restarts++;
+            }
+
+            // save the position of the next sweep
+            int done = diverged || converged || j + 1 == schedule[i].N;
+
+            state.stage = restart ? 0 : done ? i + 1 : i;
+            state.sweep = done ? 0 : j + 1;
+            state.num_sweeps = num_sweeps;
+
+            if ( params->checkpoint != NULL && (done || num_sweeps % ICA_CHECKPOINT_INTERVAL == 0) ) {
+                infomax_save_checkpoint(params->checkpoint, W, &state);
+            }
+
+            if ( restart ) {
+                fprintf(stderr, "warning: ICA diverged in sweep %d with L = %g, restarting with %g times the learning rate\n",
+                    num_sweeps, L, pow(ICA_RESTART_FACTOR, state.num_restarts));
+                i = -1;
+                break;
+            }
+
+            if ( diverged ) {
+                fprintf(stderr, "warning: ICA diverged in sweep %d with L = %g\n", num_sweeps, L);
+                break;
+            }
+
+            if ( converged ) {
+                break;
+            }
+        }
+    }
+
+    if ( params->checkpoint != NULL ) {
+        infomax_save_checkpoint(params->checkpoint, W, &state);
+    }
+
+    m_free(W_prev);
+
+    for ( i = 0; i < num_threads; i++ ) {
+        sep96_workspace_free(ws[i]);
+    }
+    free(ws);
+
+    return W;
+}
+
+/**
+ * Orthonormalize the rows of a matrix symmetrically, so that
+ * W := (W * W')^(-1/2) * W.
+ *
+ * @param W      pointer to matrix
+ * @param arena  pointer to arena for temporary matrices
+ */
+void fastica_decorrelate(matrix_t *W, m_arena_t *arena)
+{
+    matrix_t *S = m_arena_initialize(arena, W->rows, W->rows);
+    matrix_t *W_temp = m_arena_initialize(arena, W->rows, W->cols);
+
+    m_syrk_into(S, W, 0, 1, 0);
+
+    matrix_t *S_sqrt = m_sqrtm(S);
+    matrix_t *S_inv_sqrt = m_inverse(S_sqrt);
+
+    m_product_into(W_temp, S_inv_sqrt, 0, W, 0, 1, 0);
+
+    memcpy(W->data, W_temp->data, (size_t)W->rows * W->cols * sizeof(precision_t));
+
+    m_free(S_sqrt);
+    m_free(S_inv_sqrt);
+    m_arena_reset(arena);
+}
+
+/**
+ * Train the ICA weight matrix W for a whitened input matrix
+ * with symmetric FastICA (Hyvarinen, 1999).
+ *
+ * Each iteration applies the fixed-point update
+ *
+ *   W := E[g(W * Z) * Z'] - diag(E[g'(W * Z)]) * W
+ *
+ * followed by symmetric decorrelation of W, until every row of
+ * W changes direction by less than the tolerance.
+ *
+ * @param Z       whitened input matrix
+ * @param params  pointer to ICA parameters
+ * @param start   pointer to start time of training
+ * @return weight matrix W
+ */
+matrix_t * fastica(matrix_t *Z, ica_params_t *params, struct timespec *start)
+{
+    int n = Z->rows;
+    int N = Z->cols;
+    precision_t tolerance = (params->tolerance > 0)
+        ? params->tolerance
+        : FASTICA_TOLERANCE;
+    int max_iterations = (params->max_sweeps > 0)
+        ? params->max_sweeps
+        : FASTICA_MAX_ITERATIONS;
+
+    m_arena_t *arena = m_arena_create((size_t)2 * n * n * sizeof(precision_t) + 8 * M_ARENA_ALIGN);
+    matrix_t *W = m_identity(n);
+    matrix_t *W_new = m_initialize(n, n);
+    matrix_t *U = m_initialize(n, N);
+    precision_t *beta = (precision_t *)malloc(n * sizeof(precision_t));
+
+    int iter;
+    for ( iter = 1; iter <= max_iterations; iter++ ) {
+        // compute U = g(W * Z) and beta = E[g'(W * Z)]
+        m_product_into(U, W, 0, Z, 0, 1, 0);
+
+        int i, j;
+        for ( i = 0; i < n; i++ ) {
+            beta[i] = 0;
+        }
+
+        for ( j = 0; j < N; j++ ) {
+            for ( i = 0; i < n; i++ ) {
+                precision_t u = elem(U, i, j);
+
+                if ( params->engine == ICA_ENGINE_FASTICA_CUBE ) {
+                    elem(U, i, j) = u * u * u;
+                    beta[i] += 3 * u * u;
+                }
+                else {
+                    precision_t g = tanh(u);
 
-        for ( j = 0; j < params[i].N; j++ ) {
-            sep96(X_sph, W, params[i].B, params[i].L, params[i].F);
+                    elem(U, i, j) = g;
+                    beta[i] += 1 - g * g;
+                }
+            }
+        }
+
+        // compute W_new = U * Z' / N - diag(beta / N) * W
+        m_product_into(W_new, U, 0, Z, 1, 1.0 / N, 0);
+
+        for ( j = 0; j < n; j++ ) {
+            for ( i = 0; i < n; i++ ) {
+                elem(W_new, i, j) -= beta[i] / N * elem(W, i, j);
+            }
+        }
+
+        // stop if W has diverged, for example if Z is rank-deficient
+        if ( !m_is_finite(W_new) ) {
+            fprintf(stderr, "warning: FastICA diverged in iteration %d\n", iter);
+            break;
+        }
+
+        fastica_decorrelate(W_new, arena);
+
+        // compute the change max(1 - |<W_new_i, W_i>|)
+        precision_t change = 0;
+
+        for ( i = 0; i < n; i++ ) {
+            precision_t dot = 0;
+
+            for ( j = 0; j < n; j++ ) {
+                dot += elem(W_new, i, j) * elem(W, i, j);
+            }
+
+            if ( change < 1 - fabs(dot) ) {
+                change = 1 - fabs(dot);
+            }
+        }
+
+        matrix_t *W_temp = W;
+        W = W_new;
+        W_new = W_temp;
+
+        int converged = (change < tolerance);
+
+        if ( params->progress != NULL ) {
+            fprintf(params->progress,
+                "{\"iteration\": %d, \"change\": %g, \"elapsed\": %.3f%s}\n",
+                iter, change, ica_elapsed(start),
+                converged ? ", \"converged\": true" : "");
+            fflush(params->progress);
+        }
+
+        if ( converged ) {
+            break;
         }
     }
 
+    if ( iter == max_iterations + 1 ) {
+        fprintf(stderr, "warning: FastICA did not converge in %d iterations\n", max_iterations);
+    }
+
+    m_free(W_new);
+    m_free(U);
+    m_arena_free(arena);
+    free(beta);
+
+    return W;
+}
+
+/**
+ * Compute the ICA weight matrix W_I for an input matrix X.
+ *
+ * @param X       mean-subtracted input matrix
+ * @param params  pointer to ICA parameters
+ * @return weight matrix W_I
+ */
+matrix_t * run_ica(matrix_t *X, ica_params_t *params)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // compute whitening matrix W_z
+    matrix_t *W_z = sphere(X);
+    matrix_t *X_sph = m_product(W_z, X);
+
+    // shuffle the columns of X_sph
+    unsigned int seed = ICA_SEED;
+
+    m_shuffle_columns(X_sph, &seed);
+
+    // train the weight matrix W
+    matrix_t *W;
+
+    if ( params->engine == ICA_ENGINE_INFOMAX ) {
+        W = infomax(X_sph, params, &start, seed);
+    }
+    else {
+        // scale X_sph and W_z to unit variance for FastICA
+        m_elem_mult(X_sph, 0.5);
+        m_elem_mult(W_z, 0.5);
+
+        W = fastica(X_sph, params, &start);
+    }
+
     // compute W_I = W * W_z
     matrix_t *W_I = m_product(W, W_z);
 
@@ -213,24 +967,102 @@ matrix_t * run_ica(matrix_t *X)
     return W_I;
 }
 
+
 /**
  * Compute the projection matrix of a training set with ICA
  * using Architecture II.
  *
+ * The projected images W_ica' * X can also be computed from
+ * P_pca as W_I * P_pca, without the image matrix X.
+ *
  * @param W_pca_tr  PCA projection matrix
  * @param P_pca     PCA projected images
+ * @param params    pointer to ICA parameters
+ * @param P_ica     pointer to store ICA2 projected images, or NULL
  * @return projection matrix W_ica'
  */
-matrix_t * ICA2(matrix_t *W_pca_tr, matrix_t *P_pca)
+matrix_t * ICA2(matrix_t *W_pca_tr, matrix_t *P_pca, ica_params_t *params, matrix_t **P_ica)
 {
     // compute weight matrix W_I
-    matrix_t *W_I = run_ica(P_pca);
+    matrix_t *W_I = run_ica(P_pca, params);
 
     // compute W_ica' = W_I * W_pca'
     matrix_t *W_ica_tr = m_product(W_I, W_pca_tr);
 
+    // compute P_ica = W_I * P_pca
+    if ( P_ica != NULL ) {
+        *P_ica = m_product(W_I, P_pca);
+    }
+
+    // cleanup
+    m_free(W_I);
+
+    return W_ica_tr;
+}
+
+/**
+ * Compute the projection matrix of a training set with ICA
+ * using Architecture I.
+ *
+ * In Architecture I, the rows of W_pca' are the mixed signals
+ * and the pixels are the observations, so that the rows of
+ * W_I * W_pca' are statistically independent basis images. An
+ * image is represented by its coefficients in this basis, which
+ * are computed from its PCA coefficients as inv(W_I)' * W_pca' * x,
+ * so that W_ica' = inv(W_I)' * W_pca'.
+ *
+ * @param W_pca_tr  PCA projection matrix
+ * @param P_pca     PCA projected images
+ * @param params    pointer to ICA parameters
+ * @param P_ica     pointer to store ICA1 projected images, or NULL
+ * @return projection matrix W_ica'
+ */
+matrix_t * ICA1(matrix_t *W_pca_tr, matrix_t *P_pca, ica_params_t *params, matrix_t **P_ica)
+{
+    // subtract the mean of each eigenface from its pixels
+    matrix_t *X = m_copy(W_pca_tr);
+    matrix_t *mean = m_mean_column(X);
+
+    m_subtract_columns(X, mean);
+
+    // compute weight matrix W_I
+    matrix_t *W_I = run_ica(X, params);
+    matrix_t *W_I_inv = m_inverse(W_I);
+
+    // compute W_ica' = inv(W_I)' * W_pca'
+    matrix_t *W_ica_tr = m_initialize(W_I->rows, W_pca_tr->cols);
+
+    m_product_into(W_ica_tr, W_I_inv, 1, W_pca_tr, 0, 1, 0);
+
+    // compute P_ica = inv(W_I)' * P_pca
+    if ( P_ica != NULL ) {
+        *P_ica = m_initialize(W_I->rows, P_pca->cols);
+
+        m_product_into(*P_ica, W_I_inv, 1, P_pca, 0, 1, 0);
+    }
+
     // cleanup
+    m_free(X);
+    m_free(mean);
     m_free(W_I);
+    m_free(W_I_inv);
 
     return W_ica_tr;
 }
+
+/**
+ * Compute the projection matrix of a training set with ICA
+ * using the architecture in params->architecture.
+ *
+ * @param W_pca_tr  PCA projection matrix
+ * @param P_pca     PCA projected images
+ * @param params    pointer to ICA parameters
+ * @param P_ica     pointer to store ICA projected images, or NULL
+ * @return projection matrix W_ica'
+ */
+matrix_t * ICA(matrix_t *W_pca_tr, matrix_t *P_pca, ica_params_t *params, matrix_t **P_ica)
+{
+    return (params->architecture == 1)
+        ? ICA1(W_pca_tr, P_pca, params, P_ica)
+        : ICA2(W_pca_tr, P_pca, params, P_ica);
+}
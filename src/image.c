@@ -6,12 +6,125 @@
  * The following formats are supported:
  * - binary PGM (P5)
  * - binary PPM (P6)
+ *
+ * Images can be preprocessed after they are read, by converting
+ * them to grayscale, resizing them by area averaging and
+ * equalizing their histograms.
  */
 #include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "image.h"
+#include "profile.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNELS_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define KERNELS_NEON
+#endif
+
+/**
+ * Conversion kernels for grayscale images.
+ *
+ * Each kernel converts n interleaved RGB pixels of x into n gray
+ * pixels of y with the weights of GREY. Each gray pixel y[k] is
+ * written after x[3k .. 3k + 2] is read, so y may be the same
+ * buffer as x.
+ */
+typedef void (*kernel_grey_func_t)(unsigned char *y, const unsigned char *x, int n);
+
+static void kernel_grey_scalar(unsigned char *y, const unsigned char *x, int n)
+{
+	int k;
+	for ( k = 0; k < n; k++ ) {
+		y[k] = (GREY_WEIGHT_R * x[3 * k] + GREY_WEIGHT_G * x[3 * k + 1] + GREY_WEIGHT_B * x[3 * k + 2] + 128) >> 8;
+	}
+}
+
+#ifdef KERNELS_X86
+__attribute__((target("ssse3")))
+static void kernel_grey_ssse3(unsigned char *y, const unsigned char *x, int n)
+{
+	// gather a channel of pixels 0-3 of lo into 16-bit lanes 0-3,
+	// and of pixels 4-7 of hi into 16-bit lanes 4-7
+	const __m128i r_lo = _mm_setr_epi8(0, -1, 3, -1, 6, -1, 9, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	const __m128i g_lo = _mm_setr_epi8(1, -1, 4, -1, 7, -1, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	const __m128i b_lo = _mm_setr_epi8(2, -1, 5, -1, 8, -1, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	const __m128i r_hi = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 0, -1, 3, -1, 6, -1, 9, -1);
+	const __m128i g_hi = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 1, -1, 4, -1, 7, -1, 10, -1);
+	const __m128i b_hi = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 2, -1, 5, -1, 8, -1, 11, -1);
+	const __m128i w_r = _mm_set1_epi16(GREY_WEIGHT_R);
+	const __m128i w_g = _mm_set1_epi16(GREY_WEIGHT_G);
+	const __m128i w_b = _mm_set1_epi16(GREY_WEIGHT_B);
+	const __m128i half = _mm_set1_epi16(128);
+
+	// each iteration reads 28 bytes of the 24 bytes of 8 pixels
+	int k;
+	for ( k = 0; 3 * k + 28 <= 3 * n; k += 8 ) {
+		__m128i lo = _mm_loadu_si128((const __m128i *)(x + 3 * k));
+		__m128i hi = _mm_loadu_si128((const __m128i *)(x + 3 * k + 12));
+
+		__m128i r = _mm_or_si128(_mm_shuffle_epi8(lo, r_lo), _mm_shuffle_epi8(hi, r_hi));
+		__m128i g = _mm_or_si128(_mm_shuffle_epi8(lo, g_lo), _mm_shuffle_epi8(hi, g_hi));
+		__m128i b = _mm_or_si128(_mm_shuffle_epi8(lo, b_lo), _mm_shuffle_epi8(hi, b_hi));
+
+		__m128i sum = _mm_add_epi16(
+			_mm_add_epi16(_mm_mullo_epi16(r, w_r), _mm_mullo_epi16(g, w_g)),
+			_mm_add_epi16(_mm_mullo_epi16(b, w_b), half));
+
+		sum = _mm_srli_epi16(sum, 8);
+
+		_mm_storel_epi64((__m128i *)(y + k), _mm_packus_epi16(sum, sum));
+	}
+
+	kernel_grey_scalar(y + k, x + 3 * k, n - k);
+}
+#endif
+
+#ifdef KERNELS_NEON
+static void kernel_grey_neon(unsigned char *y, const unsigned char *x, int n)
+{
+	int k;
+	for ( k = 0; k + 8 <= n; k += 8 ) {
+		uint8x8x3_t rgb = vld3_u8(x + 3 * k);
+		uint16x8_t sum = vmull_u8(rgb.val[0], vdup_n_u8(GREY_WEIGHT_R));
+
+		sum = vmlal_u8(sum, rgb.val[1], vdup_n_u8(GREY_WEIGHT_G));
+		sum = vmlal_u8(sum, rgb.val[2], vdup_n_u8(GREY_WEIGHT_B));
+
+		vst1_u8(y + k, vrshrn_n_u16(sum, 8));
+	}
+
+	kernel_grey_scalar(y + k, x + 3 * k, n - k);
+}
+#endif
+
+static kernel_grey_func_t kernel_grey = kernel_grey_scalar;
+
+/**
+ * Select the grayscale kernel for the host CPU at startup.
+ */
+__attribute__((constructor))
+static void image_kernels_init(void)
+{
+#if defined(KERNELS_X86)
+	__builtin_cpu_init();
+
+	if ( __builtin_cpu_supports("ssse3") ) {
+		kernel_grey = kernel_grey_ssse3;
+	}
+#elif defined(KERNELS_NEON)
+	kernel_grey = kernel_grey_neon;
+#endif
+}
 
 /**
  * Construct a PPM image.
@@ -42,69 +155,207 @@ void image_destruct(image_t *image)
 }
 
 /**
- * Helper function to skip comments in a PGM/PPM image.
+ * Helper function to skip whitespace and comments in the
+ * header of a PGM/PPM image.
+ *
+ * @param p    pointer to current position
+ * @param end  pointer to end of buffer
+ * @return pointer to next value
  */
-void skip_to_next_value(FILE* in)
+static const unsigned char * skip_to_next_value(const unsigned char *p, const unsigned char *end)
 {
-	char c = fgetc(in);
-	while ( c == '#' || isspace(c) ) {
-		if ( c == '#' ) {
-			while ( c != '\n' ) {
-				c = fgetc(in);
+	while ( p < end && (*p == '#' || isspace(*p)) ) {
+		if ( *p == '#' ) {
+			while ( p < end && *p != '\n' ) {
+				p++;
 			}
 		}
 		else {
-			while ( isspace(c) ) {
-				c = fgetc(in);
-			}
+			p++;
 		}
 	}
 
-	ungetc(c, in);
+	return p;
 }
 
 /**
- * Read an image from a PGM/PPM file.
+ * Helper function to parse a decimal value in the header
+ * of a PGM/PPM image.
+ *
+ * @param p      pointer to current position
+ * @param end    pointer to end of buffer
+ * @param value  pointer to store value
+ * @return pointer to the character after the value, or NULL on error,
+ *         including a value which does not fit in an int
+ */
+static const unsigned char * read_value(const unsigned char *p, const unsigned char *end, int *value)
+{
+	p = skip_to_next_value(p, end);
+
+	if ( p == end || !isdigit(*p) ) {
+		return NULL;
+	}
+
+	*value = 0;
+
+	while ( p < end && isdigit(*p) ) {
+		if ( *value > (INT_MAX - 9) / 10 ) {
+			return NULL;
+		}
+
+		*value = *value * 10 + (*p - '0');
+		p++;
+	}
+
+	return p;
+}
+
+/**
+ * Read the contents of a file with a single buffered read.
+ *
+ * @param path  filename
+ * @param size  pointer to store size of file
+ * @return pointer to new buffer, or NULL on error
+ */
+static unsigned char * read_file(const char *path, size_t *size)
+{
+	int fd = open(path, O_RDONLY);
+
+	if ( fd == -1 ) {
+		return NULL;
+	}
+
+	struct stat st;
+
+	if ( fstat(fd, &st) == -1 ) {
+		close(fd);
+		return NULL;
+	}
+
+	unsigned char *data = (unsigned char *)malloc(st.st_size);
+	size_t num = 0;
+
+	while ( num < (size_t)st.st_size ) {
+		ssize_t n = read(fd, data + num, st.st_size - num);
+
+		if ( n <= 0 ) {
+			break;
+		}
+
+		num += n;
+	}
+
+	close(fd);
+
+	if ( num != (size_t)st.st_size ) {
+		free(data);
+		return NULL;
+	}
+
+	*size = num;
+
+	PROF_COUNT(PROF_BYTES_READ, num);
+
+	return data;
+}
+
+/**
+ * Read an image from a PGM/PPM file, returning an error
+ * code instead of exiting on error.
+ *
+ * The file is read with a single read and the header is
+ * parsed in memory. The pixel buffer of the image is reused
+ * if it has the right size.
  *
  * @param image  pointer to image
  * @param path   image filename
+ * @return 0 on success, or IMAGE_ERROR_READ or IMAGE_ERROR_TRUNCATED
  */
-void image_read(image_t *image, const char *path)
+int image_try_read(image_t *image, const char *path)
 {
-	FILE *in = fopen(path, "r");
+	size_t size;
+	unsigned char *data = read_file(path, &size);
 
-	char header[4];
+	if ( data == NULL ) {
+		return IMAGE_ERROR_READ;
+	}
+
+	const unsigned char *end = data + size;
+	const unsigned char *p = data;
+	int channels = 0;
+	int width, height, max_value;
 
-	fscanf(in, "%s", header);
-	if ( strcmp(header, "P5") == 0 ) {
-		image->channels = 1;
+	if ( size >= 2 && p[0] == 'P' && p[1] == '5' ) {
+		channels = 1;
 	}
-	else if ( strcmp(header, "P6") == 0 ) {
-		image->channels = 3;
+	else if ( size >= 2 && p[0] == 'P' && p[1] == '6' ) {
+		channels = 3;
 	}
-	else {
-		fprintf(stderr, "error: cannot read image \'%s\'\n", path);
-		exit(1);
+
+	p += 2;
+
+	// parse the header, which ends with a single whitespace character
+	if ( channels == 0
+	  || (p = read_value(p, end, &width)) == NULL
+	  || (p = read_value(p, end, &height)) == NULL
+	  || (p = read_value(p, end, &max_value)) == NULL
+	  || p == end || !isspace(*p)
+	  || max_value < 1 || max_value > 255
+	  || width == 0 || height == 0 ) {
+		free(data);
+		return IMAGE_ERROR_READ;
 	}
 
-	skip_to_next_value(in);
-	fscanf(in, "%d", &image->height);
+	p++;
 
-	skip_to_next_value(in);
-	fscanf(in, "%d", &image->width);
+	// the pixel count is computed in size_t, and must fit in an
+	// int, which is the type of the pixel counts of the library
+	size_t num = (size_t)channels * height * width;
 
-	skip_to_next_value(in);
-	fscanf(in, "%d", &image->max_value);
+	if ( num > INT_MAX ) {
+		free(data);
+		return IMAGE_ERROR_READ;
+	}
 
-	int num = image->channels * image->height * image->width;
+	if ( (size_t)(end - p) < num ) {
+		free(data);
+		return IMAGE_ERROR_TRUNCATED;
+	}
 
-	if ( image->pixels == NULL ) {
-		image->pixels = (unsigned char *)malloc(num * sizeof(unsigned char));
+	if ( image->pixels == NULL || (size_t)image->channels * image->height * image->width != num ) {
+		image->pixels = (unsigned char *)realloc(image->pixels, num * sizeof(unsigned char));
 	}
 
-	fread(image->pixels, sizeof(unsigned char), num, in);
+	image->channels = channels;
+	image->height = height;
+	image->width = width;
+	image->max_value = max_value;
 
-	fclose(in);
+	memcpy(image->pixels, p, num);
+
+	free(data);
+
+	return 0;
+}
+
+/**
+ * Read an image from a PGM/PPM file.
+ *
+ * @param image  pointer to image
+ * @param path   image filename
+ */
+void image_read(image_t *image, const char *path)
+{
+	int error = image_try_read(image, path);
+
+	if ( error == IMAGE_ERROR_TRUNCATED ) {
+		fprintf(stderr, "error: image \'%s\' is truncated\n", path);
+		exit(1);
+	}
+	else if ( error != 0 ) {
+		fprintf(stderr, "error: cannot read image \'%s\'\n", path);
+		exit(1);
+	}
 }
 
 /**
@@ -129,10 +380,193 @@ void image_write(image_t *image, const char *path)
 		exit(1);
 	}
 
-	fprintf(out, "%d %d %d\n", image->height, image->width, image->max_value);
+	fprintf(out, "\n%d %d\n%d\n", image->width, image->height, image->max_value);
 
 	// write pixel data
 	fwrite(image->pixels, sizeof(unsigned char), image->channels * image->height * image->width, out);
 
 	fclose(out);
 }
+
+/**
+ * Convert an RGB image to grayscale in place. Grayscale images
+ * are not changed.
+ *
+ * @param image  pointer to image
+ */
+void image_grayscale(image_t *image)
+{
+	if ( image->channels != 3 ) {
+		return;
+	}
+
+	kernel_grey(image->pixels, image->pixels, image->height * image->width);
+
+	image->channels = 1;
+}
+
+/**
+ * Resize a line of n samples to m samples by area averaging.
+ *
+ * Source sample i covers [i * m, (i + 1) * m) and target sample
+ * j covers [j * n, (j + 1) * n), so that both lines have length
+ * n * m. Each target sample is the sum of the source samples
+ * weighted by their overlap, which is n times their average.
+ *
+ * @param src     pointer to source line
+ * @param n       number of source samples
+ * @param dst     pointer to target line
+ * @param m       number of target samples
+ * @param stride  distance between samples of both lines
+ */
+static void resize_line(const uint64_t *src, int n, uint64_t *dst, int m, int stride)
+{
+	int i = 0;
+
+	int j, k;
+	for ( j = 0; j < m; j++ ) {
+		uint64_t begin = (uint64_t)j * n;
+		uint64_t end = begin + n;
+		uint64_t sum = 0;
+
+		while ( (uint64_t)(i + 1) * m <= begin ) {
+			i++;
+		}
+
+		for ( k = i; (uint64_t)k * m < end; k++ ) {
+			uint64_t lo = ((uint64_t)k * m > begin) ? (uint64_t)k * m : begin;
+			uint64_t hi = ((uint64_t)(k + 1) * m < end) ? (uint64_t)(k + 1) * m : end;
+
+			sum += (hi - lo) * src[(size_t)k * stride];
+		}
+
+		dst[(size_t)j * stride] = sum;
+	}
+}
+
+/**
+ * Resize an image by area averaging, so that each target pixel
+ * is the average of the source pixels that it covers. The rows
+ * and then the columns are resized with exact integer weights.
+ *
+ * @param image   pointer to image
+ * @param width   target width
+ * @param height  target height
+ */
+void image_resize(image_t *image, int width, int height)
+{
+	int c = image->channels;
+	int w = image->width;
+	int h = image->height;
+
+	if ( width == w && height == h ) {
+		return;
+	}
+
+	uint64_t *src = (uint64_t *)malloc((size_t)c * h * w * sizeof(uint64_t));
+	uint64_t *rows = (uint64_t *)malloc((size_t)c * h * width * sizeof(uint64_t));
+	uint64_t *dst = (uint64_t *)malloc((size_t)c * height * width * sizeof(uint64_t));
+
+	size_t i;
+	for ( i = 0; i < (size_t)c * h * w; i++ ) {
+		src[i] = image->pixels[i];
+	}
+
+	int x, y, ch;
+	for ( y = 0; y < h; y++ ) {
+		for ( ch = 0; ch < c; ch++ ) {
+			resize_line(src + (size_t)y * w * c + ch, w, rows + (size_t)y * width * c + ch, width, c);
+		}
+	}
+
+	for ( x = 0; x < width; x++ ) {
+		for ( ch = 0; ch < c; ch++ ) {
+			resize_line(rows + (size_t)x * c + ch, h, dst + (size_t)x * c + ch, height, width * c);
+		}
+	}
+
+	// normalize by the area of each target pixel
+	uint64_t area = (uint64_t)w * h;
+
+	image->pixels = (unsigned char *)realloc(image->pixels, (size_t)c * height * width);
+	image->width = width;
+	image->height = height;
+
+	for ( i = 0; i < (size_t)c * height * width; i++ ) {
+		image->pixels[i] = (dst[i] + area / 2) / area;
+	}
+
+	free(src);
+	free(rows);
+	free(dst);
+}
+
+/**
+ * Equalize the histogram of each channel of an image, so that
+ * the values of each channel are spread over [0, max_value].
+ * A channel with a single value is not changed.
+ *
+ * @param image  pointer to image
+ */
+void image_equalize(image_t *image)
+{
+	int c = image->channels;
+	int n = image->height * image->width;
+
+	int ch, k, v;
+	for ( ch = 0; ch < c; ch++ ) {
+		int64_t cdf[256] = { 0 };
+
+		for ( k = 0; k < n; k++ ) {
+			cdf[image->pixels[k * c + ch]]++;
+		}
+
+		for ( v = 1; v < 256; v++ ) {
+			cdf[v] += cdf[v - 1];
+		}
+
+		// find the number of pixels with the smallest value
+		int64_t cdf_min = 0;
+
+		for ( v = 0; v < 256 && cdf_min == 0; v++ ) {
+			cdf_min = cdf[v];
+		}
+
+		if ( cdf_min == n ) {
+			continue;
+		}
+
+		unsigned char lut[256];
+
+		for ( v = 0; v < 256; v++ ) {
+			int64_t num = (cdf[v] > cdf_min) ? cdf[v] - cdf_min : 0;
+
+			lut[v] = (num * image->max_value + (n - cdf_min) / 2) / (n - cdf_min);
+		}
+
+		for ( k = 0; k < n; k++ ) {
+			image->pixels[k * c + ch] = lut[image->pixels[k * c + ch]];
+		}
+	}
+}
+
+/**
+ * Preprocess an image in place.
+ *
+ * @param image  pointer to image
+ * @param prep   pointer to preprocessing parameters
+ */
+void image_preprocess(image_t *image, const image_prep_t *prep)
+{
+	if ( prep->grayscale ) {
+		image_grayscale(image);
+	}
+
+	if ( prep->width > 0 && prep->height > 0 ) {
+		image_resize(image, prep->width, prep->height);
+	}
+
+	if ( prep->equalize ) {
+		image_equalize(image);
+	}
+}
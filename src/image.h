@@ -6,8 +6,18 @@
 #ifndef IMAGE_H
 #define IMAGE_H
 
+#define IMAGE_ERROR_READ      1
+#define IMAGE_ERROR_TRUNCATED 2
+
 #define GREY(p) (0.299 * (p)[0] + 0.587 * (p)[1] + 0.114 * (p)[2])
 
+/**
+ * Fixed-point weights of GREY, which sum to 256.
+ */
+#define GREY_WEIGHT_R  77
+#define GREY_WEIGHT_G 150
+#define GREY_WEIGHT_B  29
+
 typedef struct {
 	int channels;
 	int height;
@@ -16,10 +26,28 @@ typedef struct {
 	unsigned char *pixels;
 } image_t;
 
+/**
+ * Parameters of the preprocessing stage, which are applied to
+ * every image after it is read, in the order of the fields. A
+ * width and height of 0 keeps the size of each image.
+ */
+typedef struct {
+	int grayscale;
+	int width;
+	int height;
+	int equalize;
+} image_prep_t;
+
 image_t * image_construct();
 void image_destruct(image_t *image);
 
+int image_try_read(image_t *image, const char *path);
 void image_read(image_t *image, const char *path);
 void image_write(image_t *image, const char *path);
 
+void image_grayscale(image_t *image);
+void image_resize(image_t *image, int width, int height);
+void image_equalize(image_t *image);
+void image_preprocess(image_t *image, const image_prep_t *prep);
+
 #endif
@@ -5,135 +5,265 @@
  */
 #include "database.h"
 #include "matrix.h"
+#include "parallel.h"
+#include <math.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+/**
+ * Initial ridge, relative to the mean eigenvalue of S_w, which
+ * is added to S_w if it is not numerically positive definite.
+ */
+#define LDA_RIDGE 1e-9
+
+typedef struct {
+    matrix_t *X;
+    matrix_t *X_c;
+    matrix_t *U;
+    int *offsets;
+} scatter_args_t;
+
+/**
+ * Compute the mean u_i of each class in a slice of classes and
+ * subtract it from the images of the class.
+ *
+ * @param arg    pointer to scatter_args_t
+ * @param begin  begin class index
+ * @param end    end class index
+ * @param id     thread index
+ */
+void m_scatter_classes(void *arg, int begin, int end, int id)
+{
+    scatter_args_t *args = (scatter_args_t *)arg;
+    matrix_t *X = args->X;
+    matrix_t *X_c = args->X_c;
+    matrix_t *U = args->U;
+
+    int i, j, k;
+    for ( i = begin; i < end; i++ ) {
+        int j_begin = args->offsets[i];
+        int j_end = args->offsets[i + 1];
+        int n_i = j_end - j_begin;
+
+        // compute u_i
+        for ( k = 0; k < X->rows; k++ ) {
+            elem(U, k, i) = 0;
+        }
+
+        for ( j = j_begin; j < j_end; j++ ) {
+            for ( k = 0; k < X->rows; k++ ) {
+                elem(U, k, i) += elem(X, k, j);
+            }
+        }
+
+        for ( k = 0; k < X->rows; k++ ) {
+            elem(U, k, i) /= n_i;
+        }
+
+        // compute X_c_j = X_j - u_i
+        for ( j = j_begin; j < j_end; j++ ) {
+            for ( k = 0; k < X->rows; k++ ) {
+                elem(X_c, k, j) = elem(X, k, j) - elem(U, k, i);
+            }
+        }
+    }
+}
 
 /**
  * Compute the scatter matrices S_w and S_b for a set of images.
  *
- * @param X        pointer to input matrix
- * @param c        number of classes
- * @param entries  list of entries for each column of X
- * @param S_b      pointer to store between-scatter matrix
- * @param S_w      pointer to store within-scatter matrix
+ * The scatter matrices are computed with one symmetric rank-k
+ * update each:
+ *
+ *   S_w = X_c * X_c', X_c_j = X_j - u_(class j)
+ *   S_b = M_b * M_b', M_b_i = sqrt(n_i) * (u_i - u)
+ *
+ * The images of each class must be contiguous in X.
+ *
+ * @param X            pointer to input matrix
+ * @param c            number of classes
+ * @param entries      list of entries for each column of X
+ * @param S_b          pointer to store between-scatter matrix
+ * @param S_w          pointer to store within-scatter matrix
+ * @param num_threads  number of threads
  */
-void m_scatter(matrix_t *X, int c, database_entry_t *entries, matrix_t *S_b, matrix_t *S_w)
+void m_scatter(matrix_t *X, int c, database_entry_t *entries, matrix_t *S_b, matrix_t *S_w, int num_threads)
 {
-    matrix_t **X_classes = (matrix_t **)malloc(c * sizeof(matrix_t *));
-    matrix_t **U = (matrix_t **)malloc(c * sizeof(matrix_t *));
+    // determine the columns of X in each class
+    int *offsets = (int *)malloc((c + 1) * sizeof(int));
 
-    // compute the mean of each class
-    int i, j;
+    int i, j, k;
     for ( i = 0, j = 0; i < c; i++ ) {
-        // extract the columns of X in class i
-        int k;
+        if ( j == X->cols ) {
+            fprintf(stderr, "error: LDA requires the images of each class to be contiguous\n");
+            exit(1);
+        }
+
+        offsets[i] = j;
+
         for ( k = j; k < X->cols; k++ ) {
             if ( entries[k].class != entries[j].class ) {
                 break;
             }
         }
 
-        X_classes[i] = m_copy_columns(X, j, k);
         j = k;
-
-        // compute the mean of the class
-        U[i] = m_mean_column(X_classes[i]);
     }
+    offsets[c] = j;
+
+    // compute the class means U = [u_1 ... u_c] and center each class
+    m_arena_t *arena = m_arena_create(((size_t)X->rows * (X->cols + c + 1)) * sizeof(precision_t) + 8 * M_ARENA_ALIGN);
+    matrix_t *X_c = m_arena_initialize(arena, X->rows, X->cols);
+    matrix_t *U = m_arena_initialize(arena, X->rows, c);
+
+    scatter_args_t args = {
+        .X = X,
+        .X_c = X_c,
+        .U = U,
+        .offsets = offsets
+    };
 
-    // compute the mean of all classes
-    matrix_t *u = m_initialize(X->rows, 1);  // m_mean_column(U);
+    parallel_for(num_threads, c, m_scatter_classes, &args);
+
+    // compute the mean of all classes u = sum(u_i, i=1:c) / c
+    matrix_t *u = m_arena_zeros(arena, X->rows, 1);
 
     for ( i = 0; i < c; i++ ) {
-        for ( j = 0; j < X->rows; j++ ) {
-            elem(u, j, 0) += elem(U[i], j, 0);
+        for ( k = 0; k < X->rows; k++ ) {
+            elem(u, k, 0) += elem(U, k, i);
         }
     }
-    for ( i = 0; i < X->rows; i++ ) {
-        elem(u, i, 0) /= c;
+    for ( k = 0; k < X->rows; k++ ) {
+        elem(u, k, 0) /= c;
     }
 
-    // compute the between-scatter S_b = sum(S_b_i, i=1:c)
-    // compute the within-scatter S_w = sum(S_w_i, i=1:c)
+    // compute M_b_i = sqrt(n_i) * (u_i - u) in place of U
     for ( i = 0; i < c; i++ ) {
-        matrix_t *X_class = X_classes[i];
-
-        // compute S_b_i = n_i * (u_i - u) * (u_i - u)'
-        matrix_t *u_i = m_copy(U[i]);
-        m_subtract(u_i, u);
-
-        matrix_t *u_i_tr = m_transpose(u_i);
-        matrix_t *S_b_i = m_product(u_i, u_i_tr);
-        m_elem_mult(S_b_i, X_class->cols);
-
-        m_add(S_b, S_b_i);
+        precision_t w_i = sqrt(offsets[i + 1] - offsets[i]);
 
-        // compute S_w_i = X_class * X_class', X_class is mean-subtracted
-        m_subtract_columns(X_class, U[i]);
-
-        matrix_t *X_class_tr = m_transpose(X_class);
-        matrix_t *S_w_i = m_product(X_class, X_class_tr);
-
-        m_add(S_w, S_w_i);
-
-        // cleanup
-        m_free(u_i);
-        m_free(u_i_tr);
-        m_free(S_b_i);
-        m_free(X_class_tr);
-        m_free(S_w_i);
+        for ( k = 0; k < X->rows; k++ ) {
+            elem(U, k, i) = w_i * (elem(U, k, i) - elem(u, k, 0));
+        }
     }
 
+    // compute S_b += M_b * M_b' and S_w += X_c * X_c'
+    m_syrk_into(S_b, U, 0, 1, 1);
+    m_syrk_into(S_w, X_c, 0, 1, 1);
+
     // cleanup
-    for ( i = 0; i < c; i++ ) {
-        m_free(X_classes[i]);
-        m_free(U[i]);
-    }
-    free(X_classes);
-    free(U);
+    m_arena_free(arena);
+    free(offsets);
 }
 
 /**
  * Compute the projection matrix of a training set with LDA.
  *
- * @param W_pca_tr  PCA projection matrix
- * @param P_pca     PCA projected images
- * @param c         number of classes
- * @param entries   list of entries for each image
+ * Following Belhumeur et al., only the first n - c principal
+ * components are used, so that S_w is non-singular, and only
+ * the c - 1 generalized eigenvectors of (S_b, S_w) with the
+ * largest eigenvalues are kept, since S_b has rank at most c - 1.
+ * The generalized eigenproblem is solved directly as a
+ * symmetric-definite problem, without forming S_w^-1 * S_b.
+ *
+ * The projected images W_lda' * X can also be computed from
+ * P_pca as W_fld' * P_pca, without the image matrix X.
+ *
+ * @param W_pca_tr     PCA projection matrix
+ * @param P_pca        PCA projected images
+ * @param c            number of classes
+ * @param entries      list of entries for each image
+ * @param num_threads  number of threads
+ * @param P_lda        pointer to store LDA projected images, or NULL
  * @return projection matrix W_lda'
  */
-matrix_t * LDA(matrix_t *W_pca_tr, matrix_t *P_pca, int c, database_entry_t *entries)
+matrix_t * LDA(matrix_t *W_pca_tr, matrix_t *P_pca, int c, database_entry_t *entries, int num_threads, matrix_t **P_lda)
 {
-    // TODO: take only the first n - c columns of P_pca
+    // take only the first n - c principal components
+    int n = P_pca->cols;
+    int m = (n - c < P_pca->rows) ? n - c : P_pca->rows;
+
+    if ( m < 1 ) {
+        fprintf(stderr, "error: LDA requires more training images than classes\n");
+        exit(1);
+    }
+
+    int num_fld = (c - 1 < m) ? c - 1 : m;
+
+    if ( num_fld < 1 ) {
+        num_fld = 1;
+    }
+
+    // temporaries are allocated from a single arena
+    m_arena_t *arena = m_arena_create(((size_t)m * (n + 2 * m + num_fld) + (size_t)(W_pca_tr->rows + 1) * num_fld) * sizeof(precision_t) + 16 * M_ARENA_ALIGN);
+    matrix_t *P_pca_m = m_arena_initialize(arena, m, n);
+
+    int i, j;
+    for ( j = 0; j < n; j++ ) {
+        memcpy(&elem(P_pca_m, 0, j), &elem(P_pca, 0, j), m * sizeof(precision_t));
+    }
 
     // compute scatter matrices S_b and S_w
-    matrix_t *S_b = m_zeros(P_pca->rows, P_pca->rows);
-    matrix_t *S_w = m_zeros(P_pca->rows, P_pca->rows);
+    matrix_t *S_b = m_arena_zeros(arena, m, m);
+    matrix_t *S_w = m_arena_zeros(arena, m, m);
 
-    m_scatter(P_pca, c, entries, S_b, S_w);
+    m_scatter(P_pca_m, c, entries, S_b, S_w, num_threads);
 
-    // compute W_fld = eigenvectors of S_w^-1 * S_b
-    // TODO: implement with LAPACKE_dggev
-    matrix_t *S_w_inv = m_inverse(S_w);
-    matrix_t *J = m_product(S_w_inv, S_b);
-    matrix_t *J_eval = m_initialize(J->rows, 1);
-    matrix_t *J_evec = m_initialize(J->rows, J->cols);
+    // compute W_fld = eigenvectors of (S_b, S_w) with the c - 1
+    // largest eigenvalues, since S_b has rank at most c - 1
+    matrix_t *J_eval = m_arena_initialize(arena, num_fld, 1);
+    matrix_t *W_fld = m_arena_initialize(arena, m, num_fld);
 
-    m_eigen(J, J_eval, J_evec);
+    // regularize S_w if it is not numerically positive definite
+    precision_t trace = 0;
 
-    // TODO: take only the first c - 1 columns of J_evec
-    matrix_t *W_fld = J_evec;
+    for ( i = 0; i < m; i++ ) {
+        trace += elem(S_w, i, i);
+    }
+
+    precision_t ridge = 0;
 
-    matrix_t *W_fld_tr = m_transpose(W_fld);
+    while ( m_eigen2_sym(S_b, S_w, J_eval, W_fld) != 0 ) {
+        precision_t ridge_next = (ridge == 0)
+            ? LDA_RIDGE * trace / m
+            : 10 * ridge;
 
-    // compute W_lda' = W_fld' * W_pca'
-    matrix_t *W_lda_tr = m_product(W_fld_tr, W_pca_tr);
+        if ( ridge_next > trace / m ) {
+            fprintf(stderr, "error: within-scatter matrix is singular\n");
+            exit(1);
+        }
+
+        for ( i = 0; i < m; i++ ) {
+            elem(S_w, i, i) += ridge_next - ridge;
+        }
+
+        ridge = ridge_next;
+    }
+
+    if ( ridge > 0 ) {
+        fprintf(stderr, "warning: regularized the within-scatter matrix with %g * I\n", ridge);
+    }
+
+    // compute W_lda' = W_fld' * W_pca', padding W_fld with zero rows
+    // for the unused principal components so that W_pca' is not copied
+    matrix_t *W_fld_pad = m_arena_zeros(arena, W_pca_tr->rows, num_fld);
+
+    for ( j = 0; j < num_fld; j++ ) {
+        memcpy(&elem(W_fld_pad, 0, j), &elem(W_fld, 0, j), m * sizeof(precision_t));
+    }
+
+    matrix_t *W_lda_tr = m_initialize(num_fld, W_pca_tr->cols);
+
+    m_product_into(W_lda_tr, W_fld_pad, 1, W_pca_tr, 0, 1, 0);
+
+    // compute P_lda = W_fld' * P_pca
+    if ( P_lda != NULL ) {
+        *P_lda = m_initialize(num_fld, n);
+
+        m_product_into(*P_lda, W_fld_pad, 1, P_pca, 0, 1, 0);
+    }
 
-    m_free(S_b);
-    m_free(S_w);
-    m_free(S_w_inv);
-    m_free(J);
-    m_free(J_eval);
-    m_free(J_evec); // W_fld
-    m_free(W_fld_tr);
+    m_arena_free(arena);
 
     return W_lda_tr;
 }
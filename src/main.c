@@ -4,43 +4,205 @@
  * User interface to the face recognition system.
  */
 #include <getopt.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include "database.h"
+#include "profile.h"
+#include "server.h"
 
 void print_usage()
 {
 	fprintf(stderr,
 		"Usage: ./face-rec [options]\n"
 		"Options:\n"
-		"  --train DIRECTORY  create a database from a training set\n"
-		"  --rec DIRECTORY    test a set of images against a database\n"
-		"  --lda              run PCA, LDA\n"
-		"  --ica              run PCA, ICA2\n"
-		"  --all              run PCA, LDA, ICA2\n"
+		"  --train DIRECTORY    create a database from a training set\n"
+		"  --rec DIRECTORY      test a set of images against a database\n"
+		"  --enroll DIRECTORY   add a set of images to a database without retraining\n"
+		"  --cross-validate K   run K-fold cross-validation on the training set\n"
+		"  --db FILE            store the database in FILE (default ./db_training.dat)\n"
+		"  --shard N            split the database into N shards FILE.0 to FILE.N-1\n"
+		"  --serve ADDRESS      answer requests on ADDRESS (-, unix:PATH, tcp:[HOST:]PORT)\n"
+		"  --shards ADDRESSES   answer requests with the comma-separated shard servers ADDRESSES\n"
+		"  --workers N          answer requests with N worker threads\n"
+		"  --queue-size N       queue at most N requests before blocking clients\n"
+		"  --update-pca         update the mean face and PCA basis when enrolling\n"
+		"  --lda                run PCA, LDA\n"
+		"  --ica                run PCA, ICA2\n"
+		"  --ica1               run PCA, ICA1 (ICA Architecture I), or use ICA1 with --all\n"
+		"  --all                run PCA, LDA, ICA2\n"
+		"  --ica-engine ENGINE  train ICA with ENGINE (infomax, fastica, fastica-cube)\n"
+		"  --ica-tolerance T    stop each ICA stage when W changes by less than T per sweep\n"
+		"  --ica-max-sweeps N   run at most N ICA sweeps, or FastICA iterations\n"
+		"  --ica-progress FILE  write ICA progress to FILE as JSON lines (- for stdout)\n"
+		"  --ica-threads N      run each Infomax sweep on N threads\n"
+		"  --pca-randomized     train PCA with randomized PCA, streaming the images from disk\n"
+		"  --low-memory         train without copies of the image matrix\n"
+		"  --grayscale          convert color images to grayscale before training\n"
+		"  --resize WxH         resize images to W x H pixels by area averaging before training\n"
+		"  --equalize           equalize the histogram of each image before training\n"
+		"  --memory-budget MB   use the low-memory mode if training would exceed MB megabytes\n"
+		"  --cache DIR          reuse the images and PCA of a training set, and ICA checkpoints, from DIR\n"
+		"  --pca-components K   keep at most K principal components\n"
+		"  --pca-energy E       keep components with fraction E of the variance\n"
+		"  --batch N            recognize test images in blocks of N\n"
+		"  --threads N          use N threads for recognition and LDA\n"
+		"  --io-threads N       use N threads for reading images\n"
+		"  --backend NAME       compute matrix products with NAME (cpu, cuda)\n"
+		"  --blas-threads N     use N threads in the BLAS library, if it is OpenBLAS or MKL\n"
+		"  --precision TYPE     store the database in TYPE (float, double)\n"
+		"  --quantize           store a quantized copy of the database\n"
+		"  --rerank R           re-rank R candidates from a quantized database\n"
+		"  --ann                store an approximate nearest-neighbor (HNSW) index\n"
+		"  --ef N               search N candidates with the ANN index\n"
+		"  --exact              search every image instead of the ANN index\n"
+		"  --cascade N          match LDA and ICA against the N nearest images by PCA (approximate)\n"
+		"  --cascade-dims D     select the candidates of --cascade with the first D PCA components\n"
+		"  --top-k K            print the K best matches with their distances\n"
+		"  --aggregate MODE     rank classes by the best or mean distance of their images (best, mean)\n"
+		"  --threshold T[,T,T]  reject matches farther than T (for PCA, LDA, ICA2), as squared L2\n"
+		"                       distance for PCA and LDA and negative cosine similarity for ICA\n"
+		"  --profile FILE       write stage timings, counters and latencies to FILE as JSON (- for stdout)\n"
 	);
 }
 
-int main(int argc, char **argv)
+/**
+ * Parse a comma-separated list of at most three rejection
+ * thresholds for PCA, LDA and ICA2. A single threshold applies
+ * to every algorithm. The thresholds of PCA and LDA compare
+ * squared L2 distances, and the threshold of ICA2 compares
+ * negative cosine similarities.
+ *
+ * @param arg         argument string
+ * @param thresholds  pointer to store three thresholds
+ */
+void parse_thresholds(const char *arg, precision_t *thresholds)
 {
-	const char *DB_ENTRIES = "./db_training_set.dat";
-	const char *DB_DATA = "./db_training_data.dat";
+	int num = 0;
+	const char *s = arg;
+
+	while ( 1 ) {
+		char *end;
+		thresholds[num++] = strtod(s, &end);
 
+		if ( end == s || (*end != ',' && *end != '\0') || (num == 3 && *end != '\0') ) {
+			fprintf(stderr, "error: invalid threshold \'%s\'\n", arg);
+			exit(1);
+		}
+
+		if ( *end == '\0' ) {
+			break;
+		}
+
+		s = end + 1;
+	}
+
+	if ( num == 1 ) {
+		thresholds[1] = thresholds[0];
+		thresholds[2] = thresholds[0];
+	}
+}
+
+int main(int argc, char **argv)
+{
 	int arg_train = 0;
 	int arg_recognize = 0;
+	int arg_enroll = 0;
+	int arg_serve = 0;
+	int arg_num_folds = 0;
+	int arg_num_shards = 0;
+	int arg_workers = 1;
+	int arg_queue_size = DEFAULT_QUEUE_SIZE;
+	int arg_update_pca = 0;
 	int arg_lda = 0;
 	int arg_ica = 0;
+	int arg_ica_architecture = 2;
+	ica_engine_t arg_ica_engine = ICA_ENGINE_INFOMAX;
+	precision_t arg_ica_tolerance = 0;
+	int arg_ica_max_sweeps = 0;
+	const char *arg_ica_progress = NULL;
+	int arg_pca_randomized = 0;
+	int arg_low_memory = 0;
+	const char *arg_cache_dir = NULL;
+	image_prep_t arg_prep = { 0, 0, 0, 0 };
+	precision_t arg_memory_budget = 0;
+	int arg_pca_components = 0;
+	precision_t arg_pca_energy = 0;
+	int arg_batch_size = 1;
+	int arg_num_threads = 1;
+	int arg_ica_threads = 1;
+	int arg_io_threads = 1;
+	const char *arg_backend = "cpu";
+	int arg_blas_threads = 0;
+	int arg_quantize = 0;
+	int arg_rerank = 0;
+	int arg_ann = 0;
+	int arg_ef = 0;
+	int arg_exact = 0;
+	int arg_cascade = 0;
+	int arg_cascade_dims = 0;
+	int arg_top_k = 1;
+	aggregate_t arg_aggregate = AGGREGATE_NONE;
+	precision_t arg_thresholds[] = { INFINITY, INFINITY, INFINITY };
+	dbfile_type_t arg_precision = DBFILE_PRECISION;
+	const char *arg_profile = NULL;
 
 	char *path_train_set = NULL;
 	char *path_test_set = NULL;
+	char *path_enroll_set = NULL;
+	char *serve_address = NULL;
+	char *shard_addresses = NULL;
+	const char *db_path = "./db_training.dat";
 
 	struct option long_options[] = {
 		{ "train", required_argument, 0, 't' },
 		{ "rec", required_argument, 0, 'r' },
+		{ "enroll", required_argument, 0, 'E' },
+		{ "serve", required_argument, 0, 's' },
+		{ "cross-validate", required_argument, 0, 'V' },
+		{ "db", required_argument, 0, 'd' },
+		{ "shard", required_argument, 0, 'j' },
+		{ "shards", required_argument, 0, 'J' },
+		{ "workers", required_argument, 0, 'w' },
+		{ "queue-size", required_argument, 0, 'Q' },
+		{ "update-pca", no_argument, 0, 'u' },
 		{ "lda", no_argument, 0, 'l' },
 		{ "ica", no_argument, 0, 'i' },
+		{ "ica1", no_argument, 0, '1' },
 		{ "all", no_argument, 0, 'a' },
+		{ "ica-engine", required_argument, 0, 'G' },
+		{ "ica-tolerance", required_argument, 0, 'T' },
+		{ "ica-max-sweeps", required_argument, 0, 'S' },
+		{ "ica-progress", required_argument, 0, 'P' },
+		{ "ica-threads", required_argument, 0, 'U' },
+		{ "pca-randomized", no_argument, 0, 'x' },
+		{ "low-memory", no_argument, 0, 'L' },
+		{ "grayscale", no_argument, 0, 'y' },
+		{ "resize", required_argument, 0, 'R' },
+		{ "equalize", no_argument, 0, 'Z' },
+		{ "memory-budget", required_argument, 0, 'M' },
+		{ "cache", required_argument, 0, 'W' },
+		{ "pca-components", required_argument, 0, 'c' },
+		{ "pca-energy", required_argument, 0, 'e' },
+		{ "batch", required_argument, 0, 'b' },
+		{ "threads", required_argument, 0, 'n' },
+		{ "io-threads", required_argument, 0, 'I' },
+		{ "backend", required_argument, 0, 'B' },
+		{ "blas-threads", required_argument, 0, 'N' },
+		{ "precision", required_argument, 0, 'p' },
+		{ "quantize", no_argument, 0, 'q' },
+		{ "rerank", required_argument, 0, 'k' },
+		{ "ann", no_argument, 0, 'A' },
+		{ "ef", required_argument, 0, 'F' },
+		{ "exact", no_argument, 0, 'X' },
+		{ "cascade", required_argument, 0, 'C' },
+		{ "cascade-dims", required_argument, 0, 'D' },
+		{ "top-k", required_argument, 0, 'K' },
+		{ "aggregate", required_argument, 0, 'g' },
+		{ "threshold", required_argument, 0, 'H' },
+		{ "profile", required_argument, 0, 'O' },
 		{ 0, 0, 0, 0 }
 	};
 
@@ -56,16 +218,211 @@ int main(int argc, char **argv)
 			arg_recognize = 1;
 			path_test_set = optarg;
 			break;
+		case 'E':
+			arg_enroll = 1;
+			path_enroll_set = optarg;
+			break;
+		case 's':
+			arg_serve = 1;
+			serve_address = optarg;
+			break;
+		case 'V':
+			arg_num_folds = atoi(optarg);
+			if ( arg_num_folds < 2 ) {
+				fprintf(stderr, "error: number of folds must be at least 2\n");
+				exit(1);
+			}
+			break;
+		case 'd':
+			db_path = optarg;
+			break;
+		case 'j':
+			arg_num_shards = atoi(optarg);
+			if ( arg_num_shards < 1 ) {
+				fprintf(stderr, "error: number of shards must be positive\n");
+				exit(1);
+			}
+			break;
+		case 'J':
+			shard_addresses = optarg;
+			break;
+		case 'w':
+			arg_workers = atoi(optarg);
+			break;
+		case 'Q':
+			arg_queue_size = atoi(optarg);
+			break;
+		case 'u':
+			arg_update_pca = 1;
+			break;
 		case 'l':
 			arg_lda = 1;
 			break;
 		case 'i':
 			arg_ica = 1;
 			break;
+		case '1':
+			arg_ica = 1;
+			arg_ica_architecture = 1;
+			break;
 		case 'a':
 			arg_lda = 1;
 			arg_ica = 1;
 			break;
+		case 'G':
+			if ( strcmp(optarg, "infomax") == 0 ) {
+				arg_ica_engine = ICA_ENGINE_INFOMAX;
+			}
+			else if ( strcmp(optarg, "fastica") == 0 ) {
+				arg_ica_engine = ICA_ENGINE_FASTICA;
+			}
+			else if ( strcmp(optarg, "fastica-cube") == 0 ) {
+				arg_ica_engine = ICA_ENGINE_FASTICA_CUBE;
+			}
+			else {
+				fprintf(stderr, "error: unknown ICA engine \'%s\'\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'T':
+			arg_ica_tolerance = atof(optarg);
+			break;
+		case 'S':
+			arg_ica_max_sweeps = atoi(optarg);
+			break;
+		case 'P':
+			arg_ica_progress = optarg;
+			break;
+		case 'U':
+			arg_ica_threads = atoi(optarg);
+			break;
+		case 'x':
+			arg_pca_randomized = 1;
+			break;
+		case 'L':
+			arg_low_memory = 1;
+			break;
+		case 'y':
+			arg_prep.grayscale = 1;
+			break;
+		case 'R':
+			if ( sscanf(optarg, "%dx%d", &arg_prep.width, &arg_prep.height) != 2 || arg_prep.width < 1 || arg_prep.height < 1 ) {
+				fprintf(stderr, "error: invalid image size '%s'\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'Z':
+			arg_prep.equalize = 1;
+			break;
+		case 'M':
+			arg_memory_budget = atof(optarg);
+			if ( arg_memory_budget <= 0 ) {
+				fprintf(stderr, "error: memory budget must be positive\n");
+				exit(1);
+			}
+			break;
+		case 'W':
+			arg_cache_dir = optarg;
+			break;
+		case 'c':
+			arg_pca_components = atoi(optarg);
+			break;
+		case 'e':
+			arg_pca_energy = atof(optarg);
+			break;
+		case 'b':
+			arg_batch_size = atoi(optarg);
+			break;
+		case 'n':
+			arg_num_threads = atoi(optarg);
+			break;
+		case 'I':
+			arg_io_threads = atoi(optarg);
+			break;
+		case 'B':
+			arg_backend = optarg;
+			break;
+		case 'N':
+			arg_blas_threads = atoi(optarg);
+			if ( arg_blas_threads < 1 ) {
+				fprintf(stderr, "error: number of BLAS threads must be positive\n");
+				exit(1);
+			}
+			break;
+		case 'p':
+			if ( strcmp(optarg, "float") == 0 ) {
+				arg_precision = DBFILE_FLOAT32;
+			}
+			else if ( strcmp(optarg, "double") == 0 ) {
+				arg_precision = DBFILE_FLOAT64;
+			}
+			else {
+				fprintf(stderr, "error: unknown precision \'%s\'\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'q':
+			arg_quantize = 1;
+			break;
+		case 'k':
+			arg_rerank = atoi(optarg);
+			if ( arg_rerank < 1 ) {
+				fprintf(stderr, "error: number of candidates must be positive\n");
+				exit(1);
+			}
+			break;
+		case 'A':
+			arg_ann = 1;
+			break;
+		case 'F':
+			arg_ef = atoi(optarg);
+			if ( arg_ef < 1 ) {
+				fprintf(stderr, "error: number of candidates must be positive\n");
+				exit(1);
+			}
+			break;
+		case 'X':
+			arg_exact = 1;
+			break;
+		case 'C':
+			arg_cascade = atoi(optarg);
+			if ( arg_cascade < 1 ) {
+				fprintf(stderr, "error: number of candidates must be positive\n");
+				exit(1);
+			}
+			break;
+		case 'D':
+			arg_cascade_dims = atoi(optarg);
+			if ( arg_cascade_dims < 1 ) {
+				fprintf(stderr, "error: number of components must be positive\n");
+				exit(1);
+			}
+			break;
+		case 'K':
+			arg_top_k = atoi(optarg);
+			if ( arg_top_k < 1 ) {
+				fprintf(stderr, "error: number of matches must be positive\n");
+				exit(1);
+			}
+			break;
+		case 'g':
+			if ( strcmp(optarg, "best") == 0 ) {
+				arg_aggregate = AGGREGATE_BEST;
+			}
+			else if ( strcmp(optarg, "mean") == 0 ) {
+				arg_aggregate = AGGREGATE_MEAN;
+			}
+			else {
+				fprintf(stderr, "error: unknown aggregation \'%s\'\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'H':
+			parse_thresholds(optarg, arg_thresholds);
+			break;
+		case 'O':
+			arg_profile = optarg;
+			break;
 		case '?':
 			print_usage();
 			exit(1);
@@ -73,28 +430,223 @@ int main(int argc, char **argv)
 	}
 
 	// validate arguments
-	if ( !arg_train && !arg_recognize ) {
+	if ( !arg_train && !arg_recognize && !arg_enroll && !arg_serve && !arg_num_shards ) {
 		print_usage();
 		exit(1);
 	}
 
+	if ( arg_train && arg_enroll ) {
+		fprintf(stderr, "error: --train and --enroll cannot be used together\n");
+		exit(1);
+	}
+
+	if ( arg_pca_components < 0 ) {
+		fprintf(stderr, "error: number of principal components must be positive\n");
+		exit(1);
+	}
+
+	if ( arg_pca_energy < 0 || arg_pca_energy > 1 ) {
+		fprintf(stderr, "error: PCA energy must be between 0 and 1\n");
+		exit(1);
+	}
+
+	if ( arg_ica_tolerance < 0 ) {
+		fprintf(stderr, "error: ICA tolerance must be non-negative\n");
+		exit(1);
+	}
+
+	if ( arg_ica_max_sweeps < 0 ) {
+		fprintf(stderr, "error: number of ICA sweeps must be positive\n");
+		exit(1);
+	}
+
+	if ( arg_batch_size < 1 ) {
+		fprintf(stderr, "error: batch size must be positive\n");
+		exit(1);
+	}
+
+	if ( arg_num_folds > 0 && (!arg_train || arg_recognize || arg_enroll || arg_serve) ) {
+		fprintf(stderr, "error: --cross-validate requires --train and cannot be used with --rec, --enroll or --serve\n");
+		exit(1);
+	}
+
+	if ( (arg_prep.grayscale || arg_prep.width > 0 || arg_prep.equalize) && !arg_train ) {
+		fprintf(stderr, "error: --grayscale, --resize and --equalize require --train, since other modes use the preprocessing of the database\n");
+		exit(1);
+	}
+
+	if ( arg_cache_dir != NULL && (!arg_train || arg_num_folds > 0) ) {
+		fprintf(stderr, "error: --cache requires --train and cannot be used with --cross-validate\n");
+		exit(1);
+	}
+
+	if ( arg_serve && (arg_recognize || arg_enroll) ) {
+		fprintf(stderr, "error: --serve cannot be used with --rec or --enroll\n");
+		exit(1);
+	}
+
+	if ( arg_num_shards > 0 && (arg_recognize || arg_enroll || arg_serve || arg_num_folds > 0) ) {
+		fprintf(stderr, "error: --shard cannot be used with --rec, --enroll, --serve or --cross-validate\n");
+		exit(1);
+	}
+
+	if ( arg_cascade_dims > 0 && arg_cascade == 0 ) {
+		fprintf(stderr, "error: --cascade-dims requires --cascade\n");
+		exit(1);
+	}
+
+	if ( arg_cascade > 0 && arg_cascade < arg_top_k ) {
+		fprintf(stderr, "error: --cascade must select at least --top-k candidates\n");
+		exit(1);
+	}
+
+	if ( shard_addresses != NULL && !arg_serve ) {
+		fprintf(stderr, "error: --shards requires --serve\n");
+		exit(1);
+	}
+
+	if ( arg_queue_size < 1 ) {
+		fprintf(stderr, "error: queue size must be positive\n");
+		exit(1);
+	}
+
+	if ( arg_num_threads < 1 || arg_io_threads < 1 || arg_ica_threads < 1 || arg_workers < 1 ) {
+		fprintf(stderr, "error: number of threads must be positive\n");
+		exit(1);
+	}
+
+	if ( m_backend_select(arg_backend) != 0 ) {
+		fprintf(stderr, "error: backend \'%s\' is not available\n", arg_backend);
+		exit(1);
+	}
+
+	if ( arg_blas_threads > 0 && m_backend_set_threads(arg_blas_threads) != 0 ) {
+		fprintf(stderr, "warning: the BLAS library does not support --blas-threads\n");
+	}
+
+#ifdef NO_PROFILE
+	if ( arg_profile != NULL ) {
+		fprintf(stderr, "error: --profile is not supported by this build\n");
+		exit(1);
+	}
+#endif
+
+	FILE *profile = NULL;
+
+	if ( arg_profile != NULL ) {
+		profile = (strcmp(arg_profile, "-") == 0)
+			? stdout
+			: fopen(arg_profile, "w");
+
+		if ( profile == NULL ) {
+			perror("fopen");
+			exit(1);
+		}
+
+		prof_enable();
+	}
+
 	// run the face recognition system
 	database_t *db = db_construct(arg_lda, arg_ica);
+	db->pca_randomized = arg_pca_randomized;
+	db->low_memory = arg_low_memory;
+	db->prep = arg_prep;
+	db->memory_budget = arg_memory_budget * (1 << 20);
+	db->cache_dir = arg_cache_dir;
+	db->pca_components = arg_pca_components;
+	db->pca_energy = arg_pca_energy;
+	db->batch_size = arg_batch_size;
+	db->num_threads = arg_num_threads;
+	db->io_threads = arg_io_threads;
+	db->precision = arg_precision;
+	db->update_pca = arg_update_pca;
+	db->quantize = arg_quantize;
+	db->ann = arg_ann;
+	db->exact = arg_exact;
+	db->cascade = arg_cascade;
+	db->cascade_dims = arg_cascade_dims;
+	db->top_k = arg_top_k;
+	db->aggregate = arg_aggregate;
+	db->threshold_pca = arg_thresholds[0];
+	db->threshold_lda = arg_thresholds[1];
+	db->threshold_ica = arg_thresholds[2];
+	db->ica_params.architecture = arg_ica_architecture;
+	db->ica_params.engine = arg_ica_engine;
+	db->ica_params.tolerance = arg_ica_tolerance;
+	db->ica_params.max_sweeps = arg_ica_max_sweeps;
+	db->ica_params.num_threads = arg_ica_threads;
+
+	if ( arg_ica_progress != NULL ) {
+		db->ica_params.progress = (strcmp(arg_ica_progress, "-") == 0)
+			? stdout
+			: fopen(arg_ica_progress, "w");
+
+		if ( db->ica_params.progress == NULL ) {
+			perror("fopen");
+			exit(1);
+		}
+	}
+
+	if ( arg_rerank > 0 ) {
+		db->rerank = arg_rerank;
+	}
 
-	if ( arg_train && arg_recognize ) {
+	if ( arg_ef > 0 ) {
+		db->ef = arg_ef;
+	}
+
+	if ( arg_num_folds > 0 ) {
+		db_cross_validate(db, path_train_set, arg_num_folds);
+	}
+	else if ( arg_enroll ) {
+		db_load_all(db, db_path);
+		db_enroll(db, path_enroll_set);
+		db_save(db, db_path);
+
+		if ( arg_recognize ) {
+			db_recognize(db, path_test_set);
+		}
+	}
+	else if ( arg_train && arg_recognize ) {
 		db_train(db, path_train_set);
 		db_recognize(db, path_test_set);
 	}
 	else if ( arg_train ) {
 		db_train(db, path_train_set);
-		db_save(db, DB_ENTRIES, DB_DATA);
+		db_save(db, db_path);
 	}
 	else if ( arg_recognize ) {
-		db_load(db, DB_ENTRIES, DB_DATA);
+		db_load(db, db_path);
 		db_recognize(db, path_test_set);
 	}
+	else if ( arg_serve ) {
+		db_load(db, db_path);
+	}
+
+	if ( arg_num_shards > 0 ) {
+		database_t *db_full = db_construct(0, 0);
+
+		db_split(db_full, db_path, arg_num_shards);
+		db_destruct(db_full);
+	}
+
+	if ( arg_serve ) {
+		db_serve(db, serve_address, shard_addresses, arg_workers, arg_queue_size);
+	}
+
+	if ( db->ica_params.progress != NULL && db->ica_params.progress != stdout ) {
+		fclose(db->ica_params.progress);
+	}
 
 	db_destruct(db);
 
+	if ( profile != NULL ) {
+		prof_write(profile);
+
+		if ( profile != stdout ) {
+			fclose(profile);
+		}
+	}
+
 	return 0;
 }
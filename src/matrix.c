@@ -8,9 +8,388 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include <cblas.h>
 #include <lapacke.h>
+#include "backend.h"
 #include "matrix.h"
+#include "profile.h"
+
+/**
+ * LAPACK routines for the type of precision_t. The BLAS routines
+ * are called through the selected backend.
+ */
+#ifdef PRECISION_FLOAT
+#define LAPACKE_xgeev LAPACKE_sgeev
+#define LAPACKE_xggev LAPACKE_sggev
+#define LAPACKE_xgetrf LAPACKE_sgetrf
+#define LAPACKE_xgetri LAPACKE_sgetri
+#define LAPACKE_xgeqrf LAPACKE_sgeqrf
+#define LAPACKE_xlamch LAPACKE_slamch
+#define LAPACKE_xorgqr LAPACKE_sorgqr
+#define LAPACKE_xsyevr LAPACKE_ssyevr
+#define LAPACKE_xsygvd LAPACKE_ssygvd
+#define PRECISION_SCAN_FORMAT "%f"
+#else
+#define LAPACKE_xgeev LAPACKE_dgeev
+#define LAPACKE_xggev LAPACKE_dggev
+#define LAPACKE_xgetrf LAPACKE_dgetrf
+#define LAPACKE_xgetri LAPACKE_dgetri
+#define LAPACKE_xgeqrf LAPACKE_dgeqrf
+#define LAPACKE_xlamch LAPACKE_dlamch
+#define LAPACKE_xorgqr LAPACKE_dorgqr
+#define LAPACKE_xsyevr LAPACKE_dsyevr
+#define LAPACKE_xsygvd LAPACKE_dsygvd
+#define PRECISION_SCAN_FORMAT "%lf"
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNELS_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define KERNELS_NEON
+#endif
+
+/**
+ * Vector kernels for the distance functions.
+ *
+ * Each kernel operates on two contiguous vectors of length n.
+ * The best implementation for the host CPU is selected the first
+ * time any kernel is called.
+ */
+typedef precision_t (*kernel_func_t)(const precision_t *x, const precision_t *y, int n);
+
+static precision_t kernel_dot_scalar(const precision_t *x, const precision_t *y, int n)
+{
+	precision_t sum = 0;
+
+	int k;
+	for ( k = 0; k < n; k++ ) {
+		sum += x[k] * y[k];
+	}
+
+	return sum;
+}
+
+static precision_t kernel_dist_L2_scalar(const precision_t *x, const precision_t *y, int n)
+{
+	precision_t sum = 0;
+
+	int k;
+	for ( k = 0; k < n; k++ ) {
+		precision_t diff = x[k] - y[k];
+		sum += diff * diff;
+	}
+
+	return sum;
+}
+
+/**
+ * Conversion kernels for image data.
+ *
+ * Each kernel widens a contiguous vector of n 8-bit pixels
+ * into a contiguous vector of precision_t.
+ */
+typedef void (*kernel_widen_func_t)(precision_t *y, const unsigned char *x, int n);
+
+static void kernel_widen_scalar(precision_t *y, const unsigned char *x, int n)
+{
+	int k;
+	for ( k = 0; k < n; k++ ) {
+		y[k] = (precision_t) x[k];
+	}
+}
+
+#ifdef KERNELS_X86
+#ifdef PRECISION_FLOAT
+#define VEC256_LANES 8
+#define vec256_t __m256
+#define vec256_zero _mm256_setzero_ps
+#define vec256_load _mm256_loadu_ps
+#define vec256_store _mm256_storeu_ps
+#define vec256_add _mm256_add_ps
+#define vec256_sub _mm256_sub_ps
+#define vec256_fmadd _mm256_fmadd_ps
+#define VEC512_LANES 16
+#define vec512_t __m512
+#define vec512_zero _mm512_setzero_ps
+#define vec512_load _mm512_loadu_ps
+#define vec512_sub _mm512_sub_ps
+#define vec512_fmadd _mm512_fmadd_ps
+#define vec512_reduce_add _mm512_reduce_add_ps
+#else
+#define VEC256_LANES 4
+#define vec256_t __m256d
+#define vec256_zero _mm256_setzero_pd
+#define vec256_load _mm256_loadu_pd
+#define vec256_store _mm256_storeu_pd
+#define vec256_add _mm256_add_pd
+#define vec256_sub _mm256_sub_pd
+#define vec256_fmadd _mm256_fmadd_pd
+#define VEC512_LANES 8
+#define vec512_t __m512d
+#define vec512_zero _mm512_setzero_pd
+#define vec512_load _mm512_loadu_pd
+#define vec512_sub _mm512_sub_pd
+#define vec512_fmadd _mm512_fmadd_pd
+#define vec512_reduce_add _mm512_reduce_add_pd
+#endif
+
+__attribute__((target("avx2,fma")))
+static precision_t vec256_reduce_add(vec256_t v)
+{
+	precision_t temp[VEC256_LANES];
+	vec256_store(temp, v);
+
+	precision_t sum = 0;
+
+	int k;
+	for ( k = 0; k < VEC256_LANES; k++ ) {
+		sum += temp[k];
+	}
+
+	return sum;
+}
+
+__attribute__((target("avx2,fma")))
+static precision_t kernel_dot_avx2(const precision_t *x, const precision_t *y, int n)
+{
+	vec256_t sum0 = vec256_zero();
+	vec256_t sum1 = vec256_zero();
+
+	int k;
+	for ( k = 0; k + 2 * VEC256_LANES <= n; k += 2 * VEC256_LANES ) {
+		sum0 = vec256_fmadd(vec256_load(x + k), vec256_load(y + k), sum0);
+		sum1 = vec256_fmadd(vec256_load(x + k + VEC256_LANES), vec256_load(y + k + VEC256_LANES), sum1);
+	}
+
+	return vec256_reduce_add(vec256_add(sum0, sum1)) + kernel_dot_scalar(x + k, y + k, n - k);
+}
+
+__attribute__((target("avx2,fma")))
+static precision_t kernel_dist_L2_avx2(const precision_t *x, const precision_t *y, int n)
+{
+	vec256_t sum0 = vec256_zero();
+	vec256_t sum1 = vec256_zero();
+
+	int k;
+	for ( k = 0; k + 2 * VEC256_LANES <= n; k += 2 * VEC256_LANES ) {
+		vec256_t diff0 = vec256_sub(vec256_load(x + k), vec256_load(y + k));
+		vec256_t diff1 = vec256_sub(vec256_load(x + k + VEC256_LANES), vec256_load(y + k + VEC256_LANES));
+
+		sum0 = vec256_fmadd(diff0, diff0, sum0);
+		sum1 = vec256_fmadd(diff1, diff1, sum1);
+	}
+
+	return vec256_reduce_add(vec256_add(sum0, sum1)) + kernel_dist_L2_scalar(x + k, y + k, n - k);
+}
+
+__attribute__((target("avx512f")))
+static precision_t kernel_dot_avx512(const precision_t *x, const precision_t *y, int n)
+{
+	vec512_t sum = vec512_zero();
+
+	int k;
+	for ( k = 0; k + VEC512_LANES <= n; k += VEC512_LANES ) {
+		sum = vec512_fmadd(vec512_load(x + k), vec512_load(y + k), sum);
+	}
+
+	return vec512_reduce_add(sum) + kernel_dot_scalar(x + k, y + k, n - k);
+}
+
+__attribute__((target("avx512f")))
+static precision_t kernel_dist_L2_avx512(const precision_t *x, const precision_t *y, int n)
+{
+	vec512_t sum = vec512_zero();
+
+	int k;
+	for ( k = 0; k + VEC512_LANES <= n; k += VEC512_LANES ) {
+		vec512_t diff = vec512_sub(vec512_load(x + k), vec512_load(y + k));
+
+		sum = vec512_fmadd(diff, diff, sum);
+	}
+
+	return vec512_reduce_add(sum) + kernel_dist_L2_scalar(x + k, y + k, n - k);
+}
+
+__attribute__((target("avx2,fma")))
+static void kernel_widen_avx2(precision_t *y, const unsigned char *x, int n)
+{
+	int k;
+	for ( k = 0; k + 8 <= n; k += 8 ) {
+		__m256i x_k = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(x + k)));
+
+#ifdef PRECISION_FLOAT
+		_mm256_storeu_ps(y + k, _mm256_cvtepi32_ps(x_k));
+#else
+		_mm256_storeu_pd(y + k, _mm256_cvtepi32_pd(_mm256_castsi256_si128(x_k)));
+		_mm256_storeu_pd(y + k + 4, _mm256_cvtepi32_pd(_mm256_extracti128_si256(x_k, 1)));
+#endif
+	}
+
+	kernel_widen_scalar(y + k, x + k, n - k);
+}
+
+__attribute__((target("avx512f")))
+static void kernel_widen_avx512(precision_t *y, const unsigned char *x, int n)
+{
+	int k;
+	for ( k = 0; k + 16 <= n; k += 16 ) {
+		__m512i x_k = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(x + k)));
+
+#ifdef PRECISION_FLOAT
+		_mm512_storeu_ps(y + k, _mm512_cvtepi32_ps(x_k));
+#else
+		_mm512_storeu_pd(y + k, _mm512_cvtepi32_pd(_mm512_castsi512_si256(x_k)));
+		_mm512_storeu_pd(y + k + 8, _mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(x_k, 1)));
+#endif
+	}
+
+	kernel_widen_scalar(y + k, x + k, n - k);
+}
+#endif
+
+#ifdef KERNELS_NEON
+#ifdef PRECISION_FLOAT
+#define VEC128_LANES 4
+#define vec128_t float32x4_t
+#define vec128_zero() vdupq_n_f32(0)
+#define vec128_load vld1q_f32
+#define vec128_add vaddq_f32
+#define vec128_sub vsubq_f32
+#define vec128_fmadd(a, b, c) vfmaq_f32(c, a, b)
+#define vec128_reduce_add vaddvq_f32
+#else
+#define VEC128_LANES 2
+#define vec128_t float64x2_t
+#define vec128_zero() vdupq_n_f64(0)
+#define vec128_load vld1q_f64
+#define vec128_add vaddq_f64
+#define vec128_sub vsubq_f64
+#define vec128_fmadd(a, b, c) vfmaq_f64(c, a, b)
+#define vec128_reduce_add vaddvq_f64
+#endif
+
+static precision_t kernel_dot_neon(const precision_t *x, const precision_t *y, int n)
+{
+	vec128_t sum0 = vec128_zero();
+	vec128_t sum1 = vec128_zero();
+
+	int k;
+	for ( k = 0; k + 2 * VEC128_LANES <= n; k += 2 * VEC128_LANES ) {
+		sum0 = vec128_fmadd(vec128_load(x + k), vec128_load(y + k), sum0);
+		sum1 = vec128_fmadd(vec128_load(x + k + VEC128_LANES), vec128_load(y + k + VEC128_LANES), sum1);
+	}
+
+	return vec128_reduce_add(vec128_add(sum0, sum1)) + kernel_dot_scalar(x + k, y + k, n - k);
+}
+
+static precision_t kernel_dist_L2_neon(const precision_t *x, const precision_t *y, int n)
+{
+	vec128_t sum0 = vec128_zero();
+	vec128_t sum1 = vec128_zero();
+
+	int k;
+	for ( k = 0; k + 2 * VEC128_LANES <= n; k += 2 * VEC128_LANES ) {
+		vec128_t diff0 = vec128_sub(vec128_load(x + k), vec128_load(y + k));
+		vec128_t diff1 = vec128_sub(vec128_load(x + k + VEC128_LANES), vec128_load(y + k + VEC128_LANES));
+
+		sum0 = vec128_fmadd(diff0, diff0, sum0);
+		sum1 = vec128_fmadd(diff1, diff1, sum1);
+	}
+
+	return vec128_reduce_add(vec128_add(sum0, sum1)) + kernel_dist_L2_scalar(x + k, y + k, n - k);
+}
+
+static void kernel_widen_neon(precision_t *y, const unsigned char *x, int n)
+{
+	int k;
+	for ( k = 0; k + 8 <= n; k += 8 ) {
+		uint16x8_t x_k = vmovl_u8(vld1_u8(x + k));
+		uint32x4_t x_lo = vmovl_u16(vget_low_u16(x_k));
+		uint32x4_t x_hi = vmovl_u16(vget_high_u16(x_k));
+
+#ifdef PRECISION_FLOAT
+		vst1q_f32(y + k, vcvtq_f32_u32(x_lo));
+		vst1q_f32(y + k + 4, vcvtq_f32_u32(x_hi));
+#else
+		vst1q_f64(y + k, vcvtq_f64_u64(vmovl_u32(vget_low_u32(x_lo))));
+		vst1q_f64(y + k + 2, vcvtq_f64_u64(vmovl_u32(vget_high_u32(x_lo))));
+		vst1q_f64(y + k + 4, vcvtq_f64_u64(vmovl_u32(vget_low_u32(x_hi))));
+		vst1q_f64(y + k + 6, vcvtq_f64_u64(vmovl_u32(vget_high_u32(x_hi))));
+#endif
+	}
+
+	kernel_widen_scalar(y + k, x + k, n - k);
+}
+#endif
+
+static precision_t kernel_dot_init(const precision_t *x, const precision_t *y, int n);
+static precision_t kernel_dist_L2_init(const precision_t *x, const precision_t *y, int n);
+static void kernel_widen_init(precision_t *y, const unsigned char *x, int n);
+
+static kernel_func_t kernel_dot = kernel_dot_init;
+static kernel_func_t kernel_dist_L2 = kernel_dist_L2_init;
+static kernel_widen_func_t kernel_widen = kernel_widen_init;
+
+/**
+ * Select the vector kernels for the host CPU.
+ *
+ * The kernels are selected at startup, before any threads are
+ * created, so that the kernel pointers are never written while
+ * other threads call them.
+ */
+__attribute__((constructor))
+static void kernels_init(void)
+{
+#if defined(KERNELS_X86)
+	__builtin_cpu_init();
+
+	if ( __builtin_cpu_supports("avx512f") ) {
+		kernel_dot = kernel_dot_avx512;
+		kernel_dist_L2 = kernel_dist_L2_avx512;
+		kernel_widen = kernel_widen_avx512;
+	}
+	else if ( __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ) {
+		kernel_dot = kernel_dot_avx2;
+		kernel_dist_L2 = kernel_dist_L2_avx2;
+		kernel_widen = kernel_widen_avx2;
+	}
+	else {
+		kernel_dot = kernel_dot_scalar;
+		kernel_dist_L2 = kernel_dist_L2_scalar;
+		kernel_widen = kernel_widen_scalar;
+	}
+#elif defined(KERNELS_NEON)
+	kernel_dot = kernel_dot_neon;
+	kernel_dist_L2 = kernel_dist_L2_neon;
+	kernel_widen = kernel_widen_neon;
+#else
+	kernel_dot = kernel_dot_scalar;
+	kernel_dist_L2 = kernel_dist_L2_scalar;
+	kernel_widen = kernel_widen_scalar;
+#endif
+}
+
+static precision_t kernel_dot_init(const precision_t *x, const precision_t *y, int n)
+{
+	kernels_init();
+
+	return kernel_dot(x, y, n);
+}
+
+static precision_t kernel_dist_L2_init(const precision_t *x, const precision_t *y, int n)
+{
+	kernels_init();
+
+	return kernel_dist_L2(x, y, n);
+}
+
+static void kernel_widen_init(precision_t *y, const unsigned char *x, int n)
+{
+	kernels_init();
+
+	kernel_widen(y, x, n);
+}
 
 /**
  * Construct a matrix.
@@ -24,7 +403,10 @@ matrix_t * m_initialize (int rows, int cols)
 	matrix_t *M = (matrix_t *)malloc(sizeof(matrix_t));
 	M->rows = rows;
 	M->cols = cols;
-	M->data = (precision_t *) malloc(rows * cols * sizeof(precision_t));
+	M->data = (precision_t *) malloc((size_t)rows * cols * sizeof(precision_t));
+
+	PROF_COUNT(PROF_ALLOCATIONS, 1);
+	PROF_COUNT(PROF_ALLOCATED_BYTES, (size_t)rows * cols * sizeof(precision_t));
 
 	return M;
 }
@@ -40,7 +422,10 @@ matrix_t * m_identity (int rows)
 	matrix_t *M = (matrix_t *)malloc(sizeof(matrix_t));
 	M->rows = rows;
 	M->cols = rows;
-	M->data = (precision_t *) calloc(rows * rows, sizeof(precision_t));
+	M->data = (precision_t *) calloc((size_t)rows * rows, sizeof(precision_t));
+
+	PROF_COUNT(PROF_ALLOCATIONS, 1);
+	PROF_COUNT(PROF_ALLOCATED_BYTES, (size_t)rows * rows * sizeof(precision_t));
 
 	int i;
 	for ( i = 0; i < rows; i++ ) {
@@ -62,7 +447,10 @@ matrix_t * m_zeros (int rows, int cols)
 	matrix_t *M = (matrix_t *)malloc(sizeof(matrix_t));
 	M->rows = rows;
 	M->cols = cols;
-	M->data = (precision_t *) calloc(rows * cols, sizeof(precision_t));
+	M->data = (precision_t *) calloc((size_t)rows * cols, sizeof(precision_t));
+
+	PROF_COUNT(PROF_ALLOCATIONS, 1);
+	PROF_COUNT(PROF_ALLOCATED_BYTES, (size_t)rows * cols * sizeof(precision_t));
 
 	return M;
 }
@@ -92,7 +480,29 @@ matrix_t * m_copy_columns (matrix_t *M, int begin, int end)
 
 	matrix_t *C = m_initialize(M->rows, end - begin);
 
-	memcpy(C->data, &elem(M, 0, begin), C->rows * C->cols * sizeof(precision_t));
+	memcpy(C->data, &elem(M, 0, begin), (size_t)C->rows * C->cols * sizeof(precision_t));
+
+	return C;
+}
+
+/**
+ * Copy a range of rows in a matrix.
+ *
+ * @param M      pointer to matrix
+ * @param begin  begin index
+ * @param end    end index
+ * @return pointer to copy of rows [begin, end) of M
+ */
+matrix_t * m_copy_rows (matrix_t *M, int begin, int end)
+{
+	assert(0 <= begin && begin < end && end <= M->rows);
+
+	matrix_t *C = m_initialize(end - begin, M->cols);
+
+	int j;
+	for ( j = 0; j < M->cols; j++ ) {
+		memcpy(&elem(C, 0, j), &elem(M, begin, j), C->rows * sizeof(precision_t));
+	}
 
 	return C;
 }
@@ -108,6 +518,166 @@ void m_free (matrix_t *M)
 	free(M);
 }
 
+/**
+ * Get a view of a range of columns in a matrix.
+ *
+ * The view shares the data of M, so it must not be freed, and
+ * it is valid only as long as M.
+ *
+ * @param M      pointer to matrix
+ * @param begin  begin index
+ * @param end    end index
+ * @return view of columns [begin, end) of M
+ */
+matrix_t m_view_columns (matrix_t *M, int begin, int end)
+{
+	assert(0 <= begin && begin <= end && end <= M->cols);
+
+	matrix_t V = {
+		.data = &elem(M, 0, begin),
+		.rows = M->rows,
+		.cols = end - begin
+	};
+
+	return V;
+}
+
+/**
+ * Construct an arena for temporary matrices.
+ *
+ * Matrices are allocated from blocks of at least the given size,
+ * and are freed all at once by m_arena_reset() or m_arena_free().
+ *
+ * @param size  size of each block in bytes
+ * @return pointer to new arena
+ */
+m_arena_t * m_arena_create (size_t size)
+{
+	m_arena_t *arena = (m_arena_t *)malloc(sizeof(m_arena_t));
+	arena->blocks = NULL;
+	arena->block_size = size;
+
+	return arena;
+}
+
+/**
+ * Allocate memory from an arena.
+ *
+ * @param arena  pointer to arena
+ * @param size   number of bytes
+ * @return pointer to memory aligned to M_ARENA_ALIGN bytes
+ */
+static void * m_arena_alloc (m_arena_t *arena, size_t size)
+{
+	size = (size + M_ARENA_ALIGN - 1) / M_ARENA_ALIGN * M_ARENA_ALIGN;
+
+	// find a block with enough space
+	m_arena_block_t *block = arena->blocks;
+
+	while ( block != NULL && block->used + size > block->size ) {
+		block = block->next;
+	}
+
+	// or else allocate a new block
+	if ( block == NULL ) {
+		size_t block_size = (size > arena->block_size) ? size : arena->block_size;
+
+		block_size = (block_size + M_ARENA_ALIGN - 1) / M_ARENA_ALIGN * M_ARENA_ALIGN;
+
+		block = (m_arena_block_t *)malloc(sizeof(m_arena_block_t));
+		block->data = (char *)aligned_alloc(M_ARENA_ALIGN, block_size);
+		block->size = block_size;
+		block->used = 0;
+		block->next = arena->blocks;
+
+		if ( block->data == NULL ) {
+			perror("aligned_alloc");
+			exit(1);
+		}
+
+		PROF_COUNT(PROF_ALLOCATIONS, 1);
+		PROF_COUNT(PROF_ALLOCATED_BYTES, block_size);
+
+		arena->blocks = block;
+	}
+
+	void *ptr = block->data + block->used;
+	block->used += size;
+
+	return ptr;
+}
+
+/**
+ * Construct a temporary matrix in an arena.
+ *
+ * The matrix must not be freed with m_free().
+ *
+ * @param arena  pointer to arena
+ * @param rows
+ * @param cols
+ * @return pointer to a new matrix
+ */
+matrix_t * m_arena_initialize (m_arena_t *arena, int rows, int cols)
+{
+	matrix_t *M = (matrix_t *)m_arena_alloc(arena, sizeof(matrix_t));
+	M->rows = rows;
+	M->cols = cols;
+	M->data = (precision_t *)m_arena_alloc(arena, (size_t)rows * cols * sizeof(precision_t));
+
+	return M;
+}
+
+/**
+ * Construct a temporary zero matrix in an arena.
+ *
+ * @param arena  pointer to arena
+ * @param rows
+ * @param cols
+ * @return pointer to a new zero matrix
+ */
+matrix_t * m_arena_zeros (m_arena_t *arena, int rows, int cols)
+{
+	matrix_t *M = m_arena_initialize(arena, rows, cols);
+
+	memset(M->data, 0, (size_t)rows * cols * sizeof(precision_t));
+
+	return M;
+}
+
+/**
+ * Free every matrix in an arena, keeping its memory for reuse.
+ *
+ * @param arena  pointer to arena
+ */
+void m_arena_reset (m_arena_t *arena)
+{
+	m_arena_block_t *block;
+	for ( block = arena->blocks; block != NULL; block = block->next ) {
+		block->used = 0;
+	}
+}
+
+/**
+ * Destruct an arena and every matrix in it.
+ *
+ * @param arena  pointer to arena
+ */
+void m_arena_free (m_arena_t *arena)
+{
+	m_arena_block_t *block = arena->blocks;
+
+	while ( block != NULL ) {
+		m_arena_block_t *next = block->next;
+
+		free(block->data);
+		free(block);
+
+		block = next;
+	}
+
+	free(arena);
+}
+
 /**
  * Write a matrix in text format to a stream.
  *
@@ -137,7 +707,7 @@ void m_fwrite (FILE *stream, matrix_t *M)
 {
 	fwrite(&M->rows, sizeof(int), 1, stream);
 	fwrite(&M->cols, sizeof(int), 1, stream);
-	fwrite(M->data, sizeof(precision_t), M->rows * M->cols, stream);
+	fwrite(M->data, sizeof(precision_t), (size_t)M->rows * M->cols, stream);
 }
 
 /**
@@ -155,7 +725,7 @@ matrix_t * m_fscan (FILE *stream)
 	int i, j;
 	for ( i = 0; i < rows; i++ ) {
 		for ( j = 0; j < cols; j++ ) {
-			fscanf(stream, "%lf", &(elem(M, i, j)));
+			fscanf(stream, PRECISION_SCAN_FORMAT, &(elem(M, i, j)));
 		}
 	}
 
@@ -175,7 +745,7 @@ matrix_t * m_fread (FILE *stream)
 	fread(&cols, sizeof(int), 1, stream);
 
 	matrix_t *M = m_initialize(rows, cols);
-	fread(M->data, sizeof(precision_t), M->rows * M->cols, stream);
+	fread(M->data, sizeof(precision_t), (size_t)M->rows * M->cols, stream);
 
 	return M;
 }
@@ -191,10 +761,7 @@ void m_image_read (matrix_t *M, int col, image_t *image)
 {
 	assert(M->rows == image->channels * image->height * image->width);
 
-	int i;
-	for ( i = 0; i < M->rows; i++ ) {
-		elem(M, i, col) = (precision_t) image->pixels[i];
-	}
+	kernel_widen(&elem(M, 0, col), image->pixels, M->rows);
 }
 
 /**
@@ -217,25 +784,21 @@ void m_image_write (matrix_t *M, int col, image_t *image)
 /**
  * Compute the covariance matrix of a matrix.
  *
+ * The covariance is computed as (M * M' - n * mean * mean') / (n - 1),
+ * so that M is not copied.
+ *
  * @param M  pointer to matrix
  * @param pointer to covariance matrix of M
  */
 matrix_t * m_covariance (matrix_t *M)
 {
-	// compute the mean-subtracted matrix A
-	matrix_t *A = m_copy(M);
-	matrix_t *mean = m_mean_column(A);
+	matrix_t *mean = m_mean_column(M);
 
-	m_subtract_columns(A, mean);
+	// compute C = M * M' - n * mean * mean'
+	matrix_t *C = m_initialize(M->rows, M->rows);
 
-	// compute C = A * A'
-	matrix_t *C = m_zeros(A->rows, A->rows);
-
-	// C := alpha * A * A_tr + beta * C, alpha = 1, beta = 0
-	cblas_dgemm(CblasColMajor, CblasNoTrans, CblasTrans,
-		A->rows, A->rows, A->cols,
-		1, A->data, A->rows, A->data, A->rows,
-		0, C->data, C->rows);
+	m_syrk_into(C, M, 0, 1, 0);
+	m_syrk_into(C, mean, 0, -M->cols, 1);
 
 	// normalize C
 	precision_t c = (M->cols > 1)
@@ -243,7 +806,6 @@ matrix_t * m_covariance (matrix_t *M)
 		: 1;
 	m_elem_mult(C, 1 / c);
 
-	m_free(A);
 	m_free(mean);
 
 	return C;
@@ -265,22 +827,10 @@ precision_t m_dist_COS (matrix_t *A, int i, matrix_t *B, int j)
 {
 	assert(A->rows == B->rows);
 
-	// compute x * y
-	precision_t x_dot_y = 0;
-
-	int k;
-	for ( k = 0; k < A->rows; k++ ) {
-		x_dot_y += elem(A, k, i) * elem(B, k, j);
-	}
-
-	// compute ||x|| and ||y||
-	precision_t abs_x = 0;
-	precision_t abs_y = 0;
-
-	for ( k = 0; k < A->rows; k++ ) {
-		abs_x += elem(A, k, i) * elem(A, k, i);
-		abs_y += elem(B, k, j) * elem(B, k, j);
-	}
+	// compute x * y, ||x|| and ||y||
+	precision_t x_dot_y = kernel_dot(&elem(A, 0, i), &elem(B, 0, j), A->rows);
+	precision_t abs_x = kernel_dot(&elem(A, 0, i), &elem(A, 0, i), A->rows);
+	precision_t abs_y = kernel_dot(&elem(B, 0, j), &elem(B, 0, j), B->rows);
 
 	return -x_dot_y / sqrt(abs_x * abs_y);
 }
@@ -291,6 +841,10 @@ precision_t m_dist_COS (matrix_t *A, int i, matrix_t *B, int j)
  * L1 is the Euclidean distance:
  * d_L1(x, y) = ||x - y||
  *
+ * This is the original meaning of L1 in this library, not the
+ * sum of absolute differences. It is the square root of L2, so
+ * it uses the vector kernel of L2.
+ *
  * @param A  pointer to matrix
  * @param i  column index of A
  * @param B  pointer to matrix
@@ -318,15 +872,146 @@ precision_t m_dist_L2 (matrix_t *A, int i, matrix_t *B, int j)
 {
 	assert(A->rows == B->rows);
 
-	precision_t dist = 0;
+	return kernel_dist_L2(&elem(A, 0, i), &elem(B, 0, j), A->rows);
+}
+
+/**
+ * Compute the L2 distance between the first n rows of two column
+ * vectors, and stop early once the distance exceeds a bound.
+ *
+ * The rows are summed in blocks of DIST_BLOCK_SIZE, and the partial
+ * sum is compared with the bound after each block. Since the partial
+ * sums never decrease, a result greater than the bound means that
+ * the distance is also greater than the bound.
+ *
+ * @param A      pointer to matrix
+ * @param i      column index of A
+ * @param B      pointer to matrix
+ * @param j      column index of B
+ * @param n      number of rows
+ * @param bound  bound of the distance
+ * @return L2 distance between rows [0, n) of A_i and B_j, or a
+ *         partial distance greater than bound
+ */
+precision_t m_dist_L2_bounded (matrix_t *A, int i, matrix_t *B, int j, int n, precision_t bound)
+{
+	assert(n <= A->rows && n <= B->rows);
+
+	const precision_t *x = &elem(A, 0, i);
+	const precision_t *y = &elem(B, 0, j);
+	precision_t sum = 0;
 
 	int k;
-	for ( k = 0; k < A->rows; k++ ) {
-		precision_t diff = elem(A, k, i) - elem(B, k, j);
-		dist += diff * diff;
+	for ( k = 0; k < n && sum <= bound; k += DIST_BLOCK_SIZE ) {
+		int len = (n - k < DIST_BLOCK_SIZE)
+			? n - k
+			: DIST_BLOCK_SIZE;
+
+		sum += kernel_dist_L2(x + k, y + k, len);
 	}
 
-	return dist;
+	return sum;
+}
+
+/**
+ * Compute the dot product of two column vectors.
+ *
+ * @param A  pointer to matrix
+ * @param i  column index of A
+ * @param B  pointer to matrix
+ * @param j  column index of B
+ * @return dot product of A_i and B_j
+ */
+precision_t m_dot (matrix_t *A, int i, matrix_t *B, int j)
+{
+	assert(A->rows == B->rows);
+
+	return kernel_dot(&elem(A, 0, i), &elem(B, 0, j), A->rows);
+}
+
+/**
+ * Compute the COS distance between each column vector in A
+ * and each column vector in B.
+ *
+ * The dot products are computed with a single matrix product:
+ * D = -A' * B ./ (||A_i|| * ||B_j||)
+ *
+ * @param A       pointer to matrix, m-by-p
+ * @param A_norm  pointer to column norms of A, p-by-1
+ * @param B       pointer to matrix, m-by-q
+ * @param B_norm  pointer to column norms of B, q-by-1
+ * @return pointer to distance matrix D, p-by-q, where D_ij = d_cos(A_i, B_j)
+ */
+matrix_t * m_dist_COS_matrix (matrix_t *A, matrix_t *A_norm, matrix_t *B, matrix_t *B_norm)
+{
+	assert(A->rows == B->rows);
+	assert(A_norm->rows == A->cols && B_norm->rows == B->cols);
+
+	matrix_t *D = m_initialize(A->cols, B->cols);
+
+	// D := alpha * A' * B + beta * D, alpha = -1, beta = 0
+	backend_gemm(1, 0,
+		A->cols, B->cols, A->rows,
+		-1, A->data, A->rows, B->data, B->rows,
+		0, D->data, D->rows);
+
+	PROF_COUNT(PROF_GEMM_FLOPS, 2 * (uint64_t)A->cols * B->cols * A->rows);
+
+	// normalize D by the norms of A_i and B_j
+	int i, j;
+	for ( j = 0; j < D->cols; j++ ) {
+		for ( i = 0; i < D->rows; i++ ) {
+			elem(D, i, j) /= elem(A_norm, i, 0) * elem(B_norm, j, 0);
+		}
+	}
+
+	return D;
+}
+
+/**
+ * Compute the L2 distance between each column vector in A
+ * and each column vector in B.
+ *
+ * The distances are computed with a single matrix product
+ * by expanding the square:
+ * d_L2(x, y) = ||x||^2 - 2 * x * y + ||y||^2
+ *
+ * @param A       pointer to matrix, m-by-p
+ * @param A_norm  pointer to column norms of A, p-by-1
+ * @param B       pointer to matrix, m-by-q
+ * @param B_norm  pointer to column norms of B, q-by-1
+ * @return pointer to distance matrix D, p-by-q, where D_ij = d_L2(A_i, B_j)
+ */
+matrix_t * m_dist_L2_matrix (matrix_t *A, matrix_t *A_norm, matrix_t *B, matrix_t *B_norm)
+{
+	assert(A->rows == B->rows);
+	assert(A_norm->rows == A->cols && B_norm->rows == B->cols);
+
+	matrix_t *D = m_initialize(A->cols, B->cols);
+
+	// D := alpha * A' * B + beta * D, alpha = -2, beta = 0
+	backend_gemm(1, 0,
+		A->cols, B->cols, A->rows,
+		-2, A->data, A->rows, B->data, B->rows,
+		0, D->data, D->rows);
+
+	PROF_COUNT(PROF_GEMM_FLOPS, 2 * (uint64_t)A->cols * B->cols * A->rows);
+
+	// add ||A_i||^2 + ||B_j||^2, clamping negative values
+	// caused by rounding error to zero
+	int i, j;
+	for ( j = 0; j < D->cols; j++ ) {
+		precision_t b = elem(B_norm, j, 0) * elem(B_norm, j, 0);
+
+		for ( i = 0; i < D->rows; i++ ) {
+			precision_t a = elem(A_norm, i, 0) * elem(A_norm, i, 0);
+			precision_t dist = elem(D, i, j) + a + b;
+
+			elem(D, i, j) = (dist > 0) ? dist : 0;
+		}
+	}
+
+	return D;
 }
 
 /**
@@ -348,7 +1033,7 @@ void m_eigen (matrix_t *M, matrix_t *M_eval, matrix_t *M_evec)
 	matrix_t *M_work = m_copy(M);
 	precision_t *wi = (precision_t *)malloc(M->rows * sizeof(precision_t));
 
-	LAPACKE_dgeev(LAPACK_COL_MAJOR, 'N', 'V',
+	LAPACKE_xgeev(LAPACK_COL_MAJOR, 'N', 'V',
 		M->cols, M_work->data, M->rows,  // input matrix
 		M_eval->data, wi,                // real, imag eigenvalues
 		NULL, M->rows,                   // left eigenvectors
@@ -358,6 +1043,64 @@ void m_eigen (matrix_t *M, matrix_t *M_eval, matrix_t *M_evec)
 	free(wi);
 }
 
+/**
+ * Compute the largest eigenvalues and the corresponding
+ * eigenvectors of a symmetric matrix.
+ *
+ * The number of eigenvalues to compute is the number of rows of
+ * M_eval. The eigenvalues are returned in descending order as a
+ * column vector, and the eigenvectors are returned as column
+ * vectors. The i-th eigenvalue corresponds to the i-th column
+ * vector. Only the lower triangle of M is referenced.
+ *
+ * @param M	      pointer to symmetric matrix, n-by-n
+ * @param M_eval  pointer to eigenvalues matrix, k-by-1
+ * @param M_evec  pointer to eigenvectors matrix, n-by-k,
+ *                or NULL to compute only the eigenvalues
+ */
+void m_eigen_sym (matrix_t *M, matrix_t *M_eval, matrix_t *M_evec)
+{
+	assert(M->rows == M->cols);
+	assert(0 < M_eval->rows && M_eval->rows <= M->rows && M_eval->cols == 1);
+	assert(M_evec == NULL || (M_evec->rows == M->rows && M_evec->cols == M_eval->rows));
+
+	int n = M->rows;
+	int k = M_eval->rows;
+
+	matrix_t *M_work = m_copy(M);
+	precision_t *w = (precision_t *)malloc(n * sizeof(precision_t));
+	precision_t *z = (M_evec != NULL)
+		? (precision_t *)malloc((size_t)n * k * sizeof(precision_t))
+		: NULL;
+	int *isuppz = (int *)malloc(2 * k * sizeof(int));
+
+	// compute the eigenvalues il, ..., iu in ascending order
+	int num_eval;
+
+	LAPACKE_xsyevr(LAPACK_COL_MAJOR, (M_evec != NULL) ? 'V' : 'N', 'I', 'L',
+		n, M_work->data, n,
+		0, 0, n - k + 1, n, LAPACKE_xlamch('S'),
+		&num_eval, w, z, n,
+		isuppz);
+
+	assert(num_eval == k);
+
+	// reverse the order of the eigenvalues and eigenvectors
+	int i;
+	for ( i = 0; i < k; i++ ) {
+		elem(M_eval, i, 0) = w[k - 1 - i];
+
+		if ( M_evec != NULL ) {
+			memcpy(&elem(M_evec, 0, i), &z[(size_t)(k - 1 - i) * n], n * sizeof(precision_t));
+		}
+	}
+
+	m_free(M_work);
+	free(w);
+	free(z);
+	free(isuppz);
+}
+
 /**
  * Compute the generalized eigenvalues and right eigenvectors of two
  * square matrices.
@@ -383,7 +1126,7 @@ void m_eigen2 (matrix_t *A, matrix_t *B, matrix_t *J_eval, matrix_t *J_evec)
 	precision_t *alphai = (precision_t *)malloc(A->rows * sizeof(precision_t));
 	precision_t *beta = (precision_t *)malloc(A->rows * sizeof(precision_t));
 
-	LAPACKE_dggev(LAPACK_COL_MAJOR, 'N', 'V',
+	LAPACKE_xggev(LAPACK_COL_MAJOR, 'N', 'V',
 		A->cols, A_work->data, A->rows, B_work->data, B->rows,
 		J_eval->data, alphai, beta,      // eigenvalues (lambda = (alphar + i * alphai) / beta)
 		NULL, A->rows,                   // left eigenvectors
@@ -400,6 +1143,56 @@ void m_eigen2 (matrix_t *A, matrix_t *B, matrix_t *J_eval, matrix_t *J_evec)
 	free(beta);
 }
 
+/**
+ * Compute the largest eigenvalues and eigenvectors of a symmetric-
+ * definite generalized eigenproblem A * v = lambda * B * v, where A
+ * is symmetric and B is symmetric positive definite.
+ *
+ * The top k = J_eval->rows eigenvalues are returned in descending
+ * order, and the i-th column of J_evec is the eigenvector of the
+ * i-th eigenvalue, normalized so that v' * B * v = 1.
+ *
+ * @param A       pointer to symmetric matrix
+ * @param B       pointer to symmetric positive definite matrix
+ * @param J_eval  pointer to store eigenvalues
+ * @param J_evec  pointer to store eigenvectors
+ * @return 0 on success, or nonzero if B is not positive definite
+ */
+int m_eigen2_sym (matrix_t *A, matrix_t *B, matrix_t *J_eval, matrix_t *J_evec)
+{
+	assert(A->rows == A->cols && B->rows == B->cols);
+	assert(A->rows == B->rows);
+	assert(0 < J_eval->rows && J_eval->rows <= A->rows && J_eval->cols == 1);
+	assert(J_evec->rows == A->rows && J_evec->cols == J_eval->rows);
+
+	int n = A->rows;
+	int k = J_eval->rows;
+
+	matrix_t *A_work = m_copy(A);
+	matrix_t *B_work = m_copy(B);
+	precision_t *w = (precision_t *)malloc(n * sizeof(precision_t));
+
+	// compute all eigenvalues in ascending order
+	int info = LAPACKE_xsygvd(LAPACK_COL_MAJOR, 1, 'V', 'L',
+		n, A_work->data, n, B_work->data, n,
+		w);
+
+	// reverse the order of the top k eigenvalues and eigenvectors
+	if ( info == 0 ) {
+		int i;
+		for ( i = 0; i < k; i++ ) {
+			elem(J_eval, i, 0) = w[n - 1 - i];
+			memcpy(&elem(J_evec, 0, i), &elem(A_work, 0, n - 1 - i), n * sizeof(precision_t));
+		}
+	}
+
+	m_free(A_work);
+	m_free(B_work);
+	free(w);
+
+	return info;
+}
+
 /**
  * Compute the inverse of a square matrix.
  *
@@ -413,11 +1206,11 @@ matrix_t * m_inverse (matrix_t *M)
 	matrix_t *M_inv = m_copy(M);
 	int *ipiv = malloc(M->rows * sizeof(int));
 
-	LAPACKE_dgetrf(LAPACK_COL_MAJOR,
+	LAPACKE_xgetrf(LAPACK_COL_MAJOR,
 		M->rows, M->cols, M_inv->data, M->rows,
 		ipiv);
 
-	LAPACKE_dgetri(LAPACK_COL_MAJOR,
+	LAPACKE_xgetri(LAPACK_COL_MAJOR,
 		M->cols, M_inv->data, M->rows,
 		ipiv);
 
@@ -450,6 +1243,24 @@ matrix_t * m_mean_column (matrix_t *M)
 	return a;
 }
 
+/**
+ * Get the 2-norm of each column of a matrix.
+ *
+ * @param M  pointer to matrix
+ * @return pointer to column vector of norms
+ */
+matrix_t * m_norm_columns (matrix_t *M)
+{
+	matrix_t *a = m_initialize(M->cols, 1);
+
+	int i;
+	for ( i = 0; i < M->cols; i++ ) {
+		elem(a, i, 0) = sqrt(m_dot(M, i, M, i));
+	}
+
+	return a;
+}
+
 /**
  * Get the product of two matrices.
  *
@@ -459,19 +1270,112 @@ matrix_t * m_mean_column (matrix_t *M)
  */
 matrix_t * m_product (matrix_t *A, matrix_t *B)
 {
+	matrix_t *C = m_zeros(A->rows, B->cols);
+
+	m_product_into(C, A, 0, B, 0, 1, 0);
+
+	return C;
+}
+
+/**
+ * Compute the product of two matrices into an existing matrix:
+ *
+ *   C := alpha * op(A) * op(B) + beta * C
+ *
+ * where op(M) is M' if the transpose flag for M is set and M
+ * otherwise, so that neither operand has to be transposed.
+ *
+ * @param C        pointer to result matrix
+ * @param A        pointer to left matrix
+ * @param trans_A  whether to use the transpose of A
+ * @param B        pointer to right matrix
+ * @param trans_B  whether to use the transpose of B
+ * @param alpha    scale of the product
+ * @param beta     scale of C
+ */
+void m_product_into (matrix_t *C, matrix_t *A, int trans_A, matrix_t *B, int trans_B, precision_t alpha, precision_t beta)
+{
+	int m = trans_A ? A->cols : A->rows;
+	int k = trans_A ? A->rows : A->cols;
+	int n = trans_B ? B->rows : B->cols;
+
+	assert(k == (trans_B ? B->cols : B->rows));
+	assert(C->rows == m && C->cols == n);
+
+	backend_gemm(trans_A, trans_B,
+		m, n, k,
+		alpha, A->data, A->rows, B->data, B->rows,
+		beta, C->data, C->rows);
+
+	PROF_COUNT(PROF_GEMM_FLOPS, 2 * (uint64_t)m * n * k);
+}
+
+/**
+ * Get the product of a range of rows of a matrix and another
+ * matrix. The rows are read in place, so that a matrix which
+ * stacks several matrices can be multiplied one stacked matrix
+ * at a time without copying it.
+ *
+ * @param A      pointer to left matrix
+ * @param begin  begin row of A
+ * @param end    end row of A
+ * @param B      pointer to right matrix
+ * @return pointer to new matrix equal to A(begin:end, :) * B
+ */
+matrix_t * m_product_rows (matrix_t *A, int begin, int end, matrix_t *B)
+{
+	assert(0 <= begin && begin < end && end <= A->rows);
 	assert(A->cols == B->rows);
 
-	matrix_t *C = m_zeros(A->rows, B->cols);
+	matrix_t *C = m_initialize(end - begin, B->cols);
 
-	// C := alpha * op(A) * op(B) + beta * C, alpha = 1, beta = 0
-	cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans,
-		A->rows, B->cols, A->cols,
-		1, A->data, A->rows, B->data, B->rows,
+	backend_gemm(0, 0,
+		C->rows, C->cols, A->cols,
+		1, &elem(A, begin, 0), A->rows, B->data, B->rows,
 		0, C->data, C->rows);
 
+	PROF_COUNT(PROF_GEMM_FLOPS, 2 * (uint64_t)C->rows * C->cols * A->cols);
+
 	return C;
 }
 
+/**
+ * Compute the product of a matrix and its transpose into an
+ * existing symmetric matrix:
+ *
+ *   C := alpha * op(A) * op(A)' + beta * C
+ *
+ * where op(A) is A' if trans_A is set and A otherwise. Only one
+ * triangle is computed by the backend, which is then copied to the other.
+ *
+ * @param C        pointer to symmetric result matrix
+ * @param A        pointer to matrix
+ * @param trans_A  whether to use the transpose of A
+ * @param alpha    scale of the product
+ * @param beta     scale of C
+ */
+void m_syrk_into (matrix_t *C, matrix_t *A, int trans_A, precision_t alpha, precision_t beta)
+{
+	int n = trans_A ? A->cols : A->rows;
+	int k = trans_A ? A->rows : A->cols;
+
+	assert(C->rows == n && C->cols == n);
+
+	backend_syrk(trans_A,
+		n, k,
+		alpha, A->data, A->rows,
+		beta, C->data, C->rows);
+
+	PROF_COUNT(PROF_GEMM_FLOPS, (uint64_t)n * (n + 1) * k);
+
+	int i, j;
+	for ( j = 0; j < n; j++ ) {
+		for ( i = 0; i < j; i++ ) {
+			elem(C, i, j) = elem(C, j, i);
+		}
+	}
+}
+
 /**
  * Compute the principal square root of a symmetric matrix. That
  * is, compute X such that X * X = M and X is the unique square root
@@ -492,9 +1396,9 @@ matrix_t * m_sqrtm (matrix_t *M)
 	int num_eval;
 	int *ISUPPZ = (int *)malloc(2 * M->rows * sizeof(int));
 
-	LAPACKE_dsyevr(LAPACK_COL_MAJOR, 'V', 'A', 'L',
+	LAPACKE_xsyevr(LAPACK_COL_MAJOR, 'V', 'A', 'L',
 		M->cols, M_work->data, M->rows,
-		0, 0, 0, 0, LAPACKE_dlamch('S'),
+		0, 0, 0, 0, LAPACKE_xlamch('S'),
 		&num_eval, M_eval->data, M_evec->data, M_evec->rows,
 		ISUPPZ);
 
@@ -522,7 +1426,7 @@ matrix_t * m_sqrtm (matrix_t *M)
 	// X := alpha * B * M_evec' + beta * X, alpha = 1, beta = 0
 	matrix_t *X = m_initialize(B->rows, M_evec->rows);
 
-	cblas_dgemm(CblasColMajor, CblasNoTrans, CblasTrans,
+	backend_gemm(0, 1,
 		B->rows, M_evec->rows, B->cols,
 		1, B->data, B->rows, M_evec->data, M_evec->rows,
 		0, X->data, X->rows);
@@ -543,14 +1447,27 @@ matrix_t * m_transpose (matrix_t *M)
 {
 	matrix_t *T = m_initialize(M->cols, M->rows);
 
+	m_transpose_into(T, M);
+
+	return T;
+}
+
+/**
+ * Transpose a matrix into an existing matrix.
+ *
+ * @param T  pointer to result matrix
+ * @param M  pointer to matrix
+ */
+void m_transpose_into (matrix_t *T, matrix_t *M)
+{
+	assert(T->rows == M->cols && T->cols == M->rows);
+
 	int i, j;
 	for ( i = 0; i < T->rows; i++ ) {
 		for ( j = 0; j < T->cols; j++ ) {
 			elem(T, i, j) = elem(M, j, i);
 		}
 	}
-
-	return T;
 }
 
 /**
@@ -606,18 +1523,46 @@ void m_elem_mult (matrix_t *M, precision_t c)
 }
 
 /**
- * Shuffle the columns of a matrix.
+ * Orthonormalize the columns of a matrix in place.
  *
- * @param M  pointer to matrix
+ * M is replaced by the matrix Q of its QR decomposition M = Q * R,
+ * which spans the same column space as M.
+ *
+ * @param M  pointer to matrix, m-by-n, m >= n
+ */
+void m_orthonormalize (matrix_t *M)
+{
+	assert(M->rows >= M->cols);
+
+	precision_t *tau = (precision_t *)malloc(M->cols * sizeof(precision_t));
+
+	LAPACKE_xgeqrf(LAPACK_COL_MAJOR,
+		M->rows, M->cols, M->data, M->rows,
+		tau);
+
+	LAPACKE_xorgqr(LAPACK_COL_MAJOR,
+		M->rows, M->cols, M->cols, M->data, M->rows,
+		tau);
+
+	free(tau);
+}
+
+/**
+ * Shuffle the columns of a matrix. The random numbers are
+ * generated with rand_r() from the caller's seed, so that
+ * threads can shuffle matrices concurrently and reproducibly.
+ *
+ * @param M     pointer to matrix
+ * @param seed  pointer to seed, which is updated
  */
-void m_shuffle_columns (matrix_t *M)
+void m_shuffle_columns (matrix_t *M, unsigned int *seed)
 {
 	precision_t *temp = (precision_t *)malloc(M->rows * sizeof(precision_t));
 
 	int i, j;
 	for ( i = 0; i < M->cols - 1; i++ ) {
 		// generate j such that i <= j < M->cols
-		j = rand() % (M->cols - i) + i;
+		j = rand_r(seed) % (M->cols - i) + i;
 
 		// swap columns i and j
 		if ( i != j ) {
@@ -645,3 +1590,48 @@ void m_subtract_columns (matrix_t *M, matrix_t *a)
 		}
 	}
 }
+
+/**
+ * Transpose a matrix in place.
+ *
+ * The elements are permuted by following the cycles of the
+ * transpose permutation, which requires one bit of memory per
+ * element instead of a copy of the matrix.
+ *
+ * @param M  pointer to matrix
+ */
+void m_transpose_in_place (matrix_t *M)
+{
+	size_t N = (size_t)M->rows * M->cols;
+
+	if ( M->rows > 1 && M->cols > 1 ) {
+		// element p = i + j * rows moves to p * cols mod (N - 1)
+		unsigned char *visited = (unsigned char *)calloc((N + 7) / 8, 1);
+
+		size_t s;
+		for ( s = 1; s < N - 1; s++ ) {
+			if ( visited[s / 8] & (1 << (s % 8)) ) {
+				continue;
+			}
+
+			precision_t value = M->data[s];
+			size_t p = s;
+
+			do {
+				size_t q = (size_t)((unsigned long long)p * M->cols % (N - 1));
+				precision_t temp = M->data[q];
+
+				M->data[q] = value;
+				value = temp;
+				visited[p / 8] |= 1 << (p % 8);
+				p = q;
+			} while ( p != s );
+		}
+
+		free(visited);
+	}
+
+	int temp = M->rows;
+	M->rows = M->cols;
+	M->cols = temp;
+}
@@ -9,10 +9,15 @@
 #ifndef MATRIX_H
 #define MATRIX_H
 
+#include <stddef.h>
 #include <stdio.h>
 #include "image.h"
 
+#ifdef PRECISION_FLOAT
+typedef float precision_t;
+#else
 typedef double precision_t;
+#endif
 
 typedef struct {
 	precision_t *data;
@@ -20,7 +25,39 @@ typedef struct {
 	int cols;
 } matrix_t;
 
-#define elem(M, i, j) (M)->data[(j) * (M)->rows + (i)]
+#define elem(M, i, j) (M)->data[(size_t)(j) * (M)->rows + (i)]
+
+typedef enum {
+	DIST_COS,
+	DIST_L2
+} dist_t;
+
+/**
+ * Number of rows of each block of m_dist_L2_bounded().
+ */
+#define DIST_BLOCK_SIZE 32
+
+/**
+ * An arena holds temporary matrices which are freed in bulk.
+ */
+#define M_ARENA_ALIGN 64
+
+typedef struct m_arena_block {
+	char *data;
+	size_t size;
+	size_t used;
+	struct m_arena_block *next;
+} m_arena_block_t;
+
+typedef struct {
+	m_arena_block_t *blocks;
+	size_t block_size;
+} m_arena_t;
+
+// backend functions
+int m_backend_select (const char *name);
+const char * m_backend_name (void);
+int m_backend_set_threads (int num_threads);
 
 // constructor, destructor functions
 matrix_t * m_initialize (int rows, int cols);
@@ -28,7 +65,16 @@ matrix_t * m_identity (int rows);
 matrix_t * m_zeros (int rows, int cols);
 matrix_t * m_copy (matrix_t *M);
 matrix_t * m_copy_columns (matrix_t *M, int begin, int end);
+matrix_t * m_copy_rows (matrix_t *M, int begin, int end);
 void m_free (matrix_t *M);
+matrix_t m_view_columns (matrix_t *M, int begin, int end);
+
+// arena functions
+m_arena_t * m_arena_create (size_t size);
+matrix_t * m_arena_initialize (m_arena_t *arena, int rows, int cols);
+matrix_t * m_arena_zeros (m_arena_t *arena, int rows, int cols);
+void m_arena_reset (m_arena_t *arena);
+void m_arena_free (m_arena_t *arena);
 
 // I/O functions
 void m_fprint (FILE *stream, matrix_t *M);
@@ -43,19 +89,32 @@ matrix_t * m_covariance (matrix_t *M);
 precision_t m_dist_COS (matrix_t *A, int i, matrix_t *B, int j);
 precision_t m_dist_L1 (matrix_t *A, int i, matrix_t *B, int j);
 precision_t m_dist_L2 (matrix_t *A, int i, matrix_t *B, int j);
+precision_t m_dist_L2_bounded (matrix_t *A, int i, matrix_t *B, int j, int n, precision_t bound);
+matrix_t * m_dist_COS_matrix (matrix_t *A, matrix_t *A_norm, matrix_t *B, matrix_t *B_norm);
+matrix_t * m_dist_L2_matrix (matrix_t *A, matrix_t *A_norm, matrix_t *B, matrix_t *B_norm);
+precision_t m_dot (matrix_t *A, int i, matrix_t *B, int j);
 void m_eigen (matrix_t *M, matrix_t *M_eval, matrix_t *M_evec);
+void m_eigen_sym (matrix_t *M, matrix_t *M_eval, matrix_t *M_evec);
 void m_eigen2 (matrix_t *A, matrix_t *B, matrix_t *J_eval, matrix_t *J_evec);
+int m_eigen2_sym (matrix_t *A, matrix_t *B, matrix_t *J_eval, matrix_t *J_evec);
 matrix_t * m_inverse (matrix_t *M);
 matrix_t * m_mean_column (matrix_t *M);
+matrix_t * m_norm_columns (matrix_t *M);
 matrix_t * m_product (matrix_t *A, matrix_t *B);
+void m_product_into (matrix_t *C, matrix_t *A, int trans_A, matrix_t *B, int trans_B, precision_t alpha, precision_t beta);
+matrix_t * m_product_rows (matrix_t *A, int begin, int end, matrix_t *B);
+void m_syrk_into (matrix_t *C, matrix_t *A, int trans_A, precision_t alpha, precision_t beta);
 matrix_t * m_sqrtm (matrix_t *M);
 matrix_t * m_transpose (matrix_t *M);
+void m_transpose_into (matrix_t *T, matrix_t *M);
 
 // mutator functions
 void m_add (matrix_t *A, matrix_t *B);
-void m_shuffle_columns (matrix_t *M);
+void m_shuffle_columns (matrix_t *M, unsigned int *seed);
 void m_elem_mult (matrix_t *M, precision_t c);
+void m_orthonormalize (matrix_t *M);
 void m_subtract (matrix_t *A, matrix_t *B);
 void m_subtract_columns (matrix_t *M, matrix_t *a);
+void m_transpose_in_place (matrix_t *M);
 
 #endif
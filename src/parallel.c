@@ -0,0 +1,242 @@
+/**
+ * @file parallel.c
+ *
+ * Implementation of parallel loops, and of a bounded queue
+ * with a pool of worker threads.
+ *
+ * A parallel loop splits the range [0, n) into contiguous
+ * chunks, one for each thread, so that chunk i always covers
+ * lower indices than chunk i + 1. Callers can therefore merge
+ * per-thread results in thread order to get the same result
+ * as a serial loop.
+ *
+ * A bounded queue passes items from producers, such as the
+ * connections of the recognition server, to a pool of workers.
+ * A producer blocks while the queue is full, so that producers
+ * which are faster than the workers are slowed down instead of
+ * growing the queue, and a worker takes up to a given number of
+ * items at once, so that it can process them as a block.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "parallel.h"
+
+typedef struct {
+	parallel_func_t func;
+	void *arg;
+	int begin;
+	int end;
+	int id;
+} parallel_task_t;
+
+/**
+ * Run a single chunk of a parallel loop.
+ *
+ * @param arg  pointer to task
+ * @return NULL
+ */
+void * parallel_task(void *arg)
+{
+	parallel_task_t *task = (parallel_task_t *)arg;
+
+	task->func(task->arg, task->begin, task->end, task->id);
+
+	return NULL;
+}
+
+/**
+ * Run a loop over the range [0, n) with a number of threads.
+ *
+ * The calling thread runs the first chunk. If there are
+ * fewer elements than threads, the extra threads are not
+ * created.
+ *
+ * @param num_threads  number of threads
+ * @param n            number of loop iterations
+ * @param func         function to run on each chunk
+ * @param arg          pointer to function argument
+ */
+void parallel_for(int num_threads, int n, parallel_func_t func, void *arg)
+{
+	if ( num_threads > n ) {
+		num_threads = n;
+	}
+
+	if ( num_threads <= 1 ) {
+		if ( n > 0 ) {
+			func(arg, 0, n, 0);
+		}
+		return;
+	}
+
+	pthread_t *threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+	parallel_task_t *tasks = (parallel_task_t *)malloc(num_threads * sizeof(parallel_task_t));
+
+	int i;
+	for ( i = 0; i < num_threads; i++ ) {
+		tasks[i] = (parallel_task_t) {
+			.func = func,
+			.arg = arg,
+			.begin = (int)((long)n * i / num_threads),
+			.end = (int)((long)n * (i + 1) / num_threads),
+			.id = i
+		};
+	}
+
+	for ( i = 1; i < num_threads; i++ ) {
+		if ( pthread_create(&threads[i], NULL, parallel_task, &tasks[i]) != 0 ) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+
+	parallel_task(&tasks[0]);
+
+	for ( i = 1; i < num_threads; i++ ) {
+		pthread_join(threads[i], NULL);
+	}
+
+	free(threads);
+	free(tasks);
+}
+
+/**
+ * Initialize a bounded queue.
+ *
+ * @param queue  pointer to queue
+ * @param size   maximum number of items
+ */
+void queue_init(queue_t *queue, int size)
+{
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+
+	queue->items = (void **)malloc(size * sizeof(void *));
+	queue->size = size;
+	queue->begin = 0;
+	queue->count = 0;
+	queue->closed = 0;
+}
+
+/**
+ * Add an item to a queue, waiting while the queue is full.
+ *
+ * @param queue  pointer to queue
+ * @param item   pointer to item
+ */
+void queue_push(queue_t *queue, void *item)
+{
+	pthread_mutex_lock(&queue->lock);
+
+	while ( queue->count == queue->size ) {
+		pthread_cond_wait(&queue->not_full, &queue->lock);
+	}
+
+	queue->items[(queue->begin + queue->count) % queue->size] = item;
+	queue->count++;
+
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Remove up to max items from a queue, waiting while the queue
+ * is empty.
+ *
+ * @param queue  pointer to queue
+ * @param items  pointer to store items
+ * @param max    maximum number of items
+ * @return number of items, or 0 if the queue is closed and empty
+ */
+int queue_pop(queue_t *queue, void **items, int max)
+{
+	pthread_mutex_lock(&queue->lock);
+
+	while ( queue->count == 0 && !queue->closed ) {
+		pthread_cond_wait(&queue->not_empty, &queue->lock);
+	}
+
+	int num = (queue->count < max)
+		? queue->count
+		: max;
+
+	int i;
+	for ( i = 0; i < num; i++ ) {
+		items[i] = queue->items[queue->begin];
+		queue->begin = (queue->begin + 1) % queue->size;
+	}
+
+	queue->count -= num;
+
+	pthread_cond_broadcast(&queue->not_full);
+	pthread_mutex_unlock(&queue->lock);
+
+	return num;
+}
+
+/**
+ * Close a queue, so that the workers return once the items in
+ * the queue are taken.
+ *
+ * @param queue  pointer to queue
+ */
+void queue_close(queue_t *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	queue->closed = 1;
+	pthread_cond_broadcast(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Destroy a queue.
+ *
+ * @param queue  pointer to queue
+ */
+void queue_destroy(queue_t *queue)
+{
+	pthread_mutex_destroy(&queue->lock);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_cond_destroy(&queue->not_full);
+
+	free(queue->items);
+}
+
+/**
+ * Start a pool of worker threads, which each run func(arg).
+ *
+ * @param pool         pointer to pool
+ * @param num_threads  number of threads
+ * @param func         function of each thread
+ * @param arg          pointer to function argument
+ */
+void worker_pool_start(worker_pool_t *pool, int num_threads, void * (*func)(void *), void *arg)
+{
+	pool->threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+	pool->num_threads = num_threads;
+
+	int i;
+	for ( i = 0; i < num_threads; i++ ) {
+		if ( pthread_create(&pool->threads[i], NULL, func, arg) != 0 ) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+}
+
+/**
+ * Wait for the threads of a pool to return, and free the pool.
+ *
+ * @param pool  pointer to pool
+ */
+void worker_pool_join(worker_pool_t *pool)
+{
+	int i;
+	for ( i = 0; i < pool->num_threads; i++ ) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	free(pool->threads);
+}
@@ -0,0 +1,41 @@
+/**
+ * @file parallel.h
+ *
+ * Interface definitions for parallel loops, and for the bounded
+ * queue and worker pool of the recognition server and pipeline.
+ */
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <pthread.h>
+
+typedef void (*parallel_func_t)(void *arg, int begin, int end, int id);
+
+void parallel_for(int num_threads, int n, parallel_func_t func, void *arg);
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	void **items;
+	int size;
+	int begin;
+	int count;
+	int closed;
+} queue_t;
+
+void queue_init(queue_t *queue, int size);
+void queue_push(queue_t *queue, void *item);
+int queue_pop(queue_t *queue, void **items, int max);
+void queue_close(queue_t *queue);
+void queue_destroy(queue_t *queue);
+
+typedef struct {
+	pthread_t *threads;
+	int num_threads;
+} worker_pool_t;
+
+void worker_pool_start(worker_pool_t *pool, int num_threads, void * (*func)(void *), void *arg);
+void worker_pool_join(worker_pool_t *pool);
+
+#endif
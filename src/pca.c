@@ -3,40 +3,577 @@
  *
  * Implementation of PCA (Turk and Pentland, 1991).
  */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "database.h"
 #include "matrix.h"
 
 /**
- * Compute the principal components of a training set.
+ * Default number of components of randomized PCA.
+ */
+#define RPCA_COMPONENTS 100
+
+/**
+ * Number of additional columns in the randomized sketch.
+ */
+#define RPCA_OVERSAMPLING 10
+
+/**
+ * Number of power iterations of randomized PCA.
+ */
+#define RPCA_POWER_ITERATIONS 2
+
+/**
+ * Number of rows of X in each block of in-place PCA.
+ */
+#define PCA_BLOCK_ROWS 256
+
+/**
+ * Get the number of eigenvalues, taken in descending order,
+ * whose sum is at least a fraction of the total energy.
  *
- * Currently, this function returns all of the n computed
- * eigenvectors, where n is the number of training images.
+ * @param L_eval  pointer to eigenvalues in descending order
+ * @param total   total energy (sum of all eigenvalues)
+ * @param energy  fraction of total energy, in (0, 1]
+ * @return number of eigenvalues
+ */
+int pca_num_components(matrix_t *L_eval, precision_t total, precision_t energy)
+{
+	precision_t sum = 0;
+
+	int i;
+	for ( i = 0; i < L_eval->rows; i++ ) {
+		sum += elem(L_eval, i, 0);
+
+		if ( sum >= energy * total ) {
+			break;
+		}
+	}
+
+	return (i < L_eval->rows) ? i + 1 : L_eval->rows;
+}
+
+/**
+ * Compute the leading eigenvectors of the surrogate matrix L = X' * X.
  *
- * @param X  mean-subtracted image matrix
- * @return projection matrix W_pca'
+ * @param X               mean-subtracted image matrix
+ * @param num_components  maximum number of components, or 0 for n - 1
+ * @param energy          fraction of the total variance to retain,
+ *                        or 0 to retain num_components components
+ * @param L_eval          pointer to store eigenvalues
+ * @param L_evec          pointer to store eigenvectors
  */
-matrix_t * PCA(matrix_t *X)
+void pca_surrogate_eigen(matrix_t *X, int num_components, precision_t energy, matrix_t **L_eval, matrix_t **L_evec)
 {
 	// compute the surrogate matrix L = X' * X
-	matrix_t *X_tr = m_transpose(X);
-	matrix_t *L = m_product(X_tr, X);
+	int n = X->cols;
+	matrix_t *L = m_initialize(n, n);
 
-	m_free(X_tr);
+	m_syrk_into(L, X, 1, 1, 0);
 
-	// compute eigenvectors for L
-	matrix_t *L_eval = m_initialize(L->rows, 1);
-	matrix_t *L_evec = m_initialize(L->rows, L->cols);
+	// determine the number of components
+	int k = (n > 1) ? n - 1 : n;
 
-	m_eigen(L, L_eval, L_evec);
+	if ( 0 < num_components && num_components < k ) {
+		k = num_components;
+	}
 
-	// compute eigenfaces W_pca = X * L_evec
-	matrix_t *W_pca = m_product(X, L_evec);
-	matrix_t *W_pca_tr = m_transpose(W_pca);
+	if ( energy > 0 ) {
+		matrix_t *L_eval_all = m_initialize(n, 1);
+
+		m_eigen_sym(L, L_eval_all, NULL);
+
+		precision_t total = 0;
+
+		int i;
+		for ( i = 0; i < n; i++ ) {
+			total += elem(L, i, i);
+		}
+
+		int k_energy = pca_num_components(L_eval_all, total, energy);
+
+		if ( k_energy < k ) {
+			k = k_energy;
+		}
+
+		m_free(L_eval_all);
+	}
+
+	// compute the k leading eigenvectors of L
+	*L_eval = m_initialize(k, 1);
+	*L_evec = m_initialize(n, k);
+
+	m_eigen_sym(L, *L_eval, *L_evec);
 
 	m_free(L);
+}
+
+/**
+ * Compute the principal components of a training set.
+ *
+ * The eigenvectors of the surrogate matrix L = X' * X are computed
+ * with a symmetric solver, and only the leading eigenvectors are
+ * returned, in order of decreasing eigenvalue. Since X is
+ * mean-subtracted, it has rank at most n - 1, where n is the number
+ * of training images, so by default the first n - 1 eigenvectors
+ * are returned.
+ *
+ * @param X               mean-subtracted image matrix
+ * @param num_components  maximum number of components, or 0 for n - 1
+ * @param energy          fraction of the total variance to retain,
+ *                        or 0 to retain num_components components
+ * @return projection matrix W_pca'
+ */
+matrix_t * PCA(matrix_t *X, int num_components, precision_t energy)
+{
+	matrix_t *L_eval;
+	matrix_t *L_evec;
+
+	pca_surrogate_eigen(X, num_components, energy, &L_eval, &L_evec);
+
+	// compute eigenfaces W_pca' = (X * L_evec)' = L_evec' * X'
+	matrix_t *W_pca_tr = m_initialize(L_evec->cols, X->rows);
+
+	m_product_into(W_pca_tr, L_evec, 1, X, 1, 1, 0);
+
+	m_free(L_eval);
+	m_free(L_evec);
+
+	return W_pca_tr;
+}
+
+/**
+ * Compute the principal components of a training set in place.
+ *
+ * The eigenfaces W_pca = X * L_evec are computed one block of
+ * rows at a time and overwrite X, which is then transposed in
+ * place, so that the peak memory is about the size of X plus
+ * a few n-by-n matrices. The projected images are computed
+ * without X, since
+ *
+ *   P_pca = W_pca' * X = L_evec' * L = diag(L_eval) * L_evec'
+ *
+ * @param X               mean-subtracted image matrix, which is
+ *                        overwritten with W_pca'
+ * @param num_components  maximum number of components, or 0 for n - 1
+ * @param energy          fraction of the total variance to retain,
+ *                        or 0 to retain num_components components
+ * @param P_pca           pointer to store projected images
+ * @return projection matrix W_pca', which replaces X
+ */
+matrix_t * PCA_in_place(matrix_t *X, int num_components, precision_t energy, matrix_t **P_pca)
+{
+	int m = X->rows;
+	int n = X->cols;
+
+	matrix_t *L_eval;
+	matrix_t *L_evec;
+
+	pca_surrogate_eigen(X, num_components, energy, &L_eval, &L_evec);
+
+	int k = L_evec->cols;
+
+	// compute P_pca = diag(L_eval) * L_evec'
+	*P_pca = m_initialize(k, n);
+
+	int i, j;
+	for ( j = 0; j < n; j++ ) {
+		for ( i = 0; i < k; i++ ) {
+			elem(*P_pca, i, j) = elem(L_eval, i, 0) * elem(L_evec, j, i);
+		}
+	}
+
+	// compute W_pca = X * L_evec, one block of rows at a time
+	matrix_t *X_b = m_initialize(PCA_BLOCK_ROWS, n);
+	matrix_t *W_b = m_initialize(PCA_BLOCK_ROWS, k);
+
+	int r;
+	for ( r = 0; r < m; r += PCA_BLOCK_ROWS ) {
+		int rows = (r + PCA_BLOCK_ROWS < m) ? PCA_BLOCK_ROWS : m - r;
+
+		X_b->rows = rows;
+		W_b->rows = rows;
+
+		for ( j = 0; j < n; j++ ) {
+			memcpy(&elem(X_b, 0, j), &elem(X, r, j), rows * sizeof(precision_t));
+		}
+
+		m_product_into(W_b, X_b, 0, L_evec, 0, 1, 0);
+
+		for ( j = 0; j < k; j++ ) {
+			memcpy(&elem(X, r, j), &elem(W_b, 0, j), rows * sizeof(precision_t));
+		}
+	}
+
+	m_free(X_b);
+	m_free(W_b);
 	m_free(L_eval);
 	m_free(L_evec);
-	m_free(W_pca);
+
+	// transpose W_pca in place and release the unused columns of X
+	matrix_t *W_pca_tr = X;
+
+	W_pca_tr->cols = k;
+	m_transpose_in_place(W_pca_tr);
+
+	W_pca_tr->data = (precision_t *)realloc(W_pca_tr->data, (size_t)k * m * sizeof(precision_t));
+
+	return W_pca_tr;
+}
+
+/**
+ * Read a block of training images and subtract the mean face.
+ *
+ * @param entries      pointer to list of image entries
+ * @param begin        begin index
+ * @param end          end index
+ * @param mean_face    pointer to mean face
+ * @param prep         pointer to preprocessing parameters
+ * @param num_threads  number of threads for reading images
+ * @return pointer to mean-subtracted image matrix of images [begin, end)
+ */
+matrix_t * rpca_read_block(database_entry_t *entries, int begin, int end, matrix_t *mean_face, const image_prep_t *prep, int num_threads)
+{
+	matrix_t *X_b = get_image_matrix(entries + begin, end - begin, prep, num_threads);
+
+	if ( X_b->rows != mean_face->rows ) {
+		fprintf(stderr, "error: training images must all have the same size\n");
+		exit(1);
+	}
+
+	m_subtract_columns(X_b, mean_face);
+
+	return X_b;
+}
+
+/**
+ * Get a block of rows [begin, end) of the Gaussian test matrix
+ * Omega of randomized PCA.
+ *
+ * Each row is generated from its own seed, so that Omega does
+ * not depend on the block size.
+ *
+ * @param arena  pointer to arena for the block
+ * @param begin  begin index
+ * @param end    end index
+ * @param l      number of columns
+ * @return pointer to rows [begin, end) of Omega
+ */
+matrix_t * rpca_omega(m_arena_t *arena, int begin, int end, int l)
+{
+	matrix_t *Omega_b = m_arena_initialize(arena, end - begin, l);
+
+	int i, j;
+	for ( i = begin; i < end; i++ ) {
+		unsigned int seed = i + 1;
+
+		for ( j = 0; j < l; j++ ) {
+			precision_t u1 = (rand_r(&seed) + 1.0) / (RAND_MAX + 2.0);
+			precision_t u2 = (rand_r(&seed) + 1.0) / (RAND_MAX + 2.0);
+
+			elem(Omega_b, i - begin, j) = sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+		}
+	}
+
+	return Omega_b;
+}
+
+/**
+ * Compute the principal components of a training set with
+ * randomized PCA (Halko et al., 2011), reading the training
+ * images from disk in blocks.
+ *
+ * The image matrix X is never stored; instead, a sketch
+ * Y = (X * X')^q * X * Omega of the range of X is accumulated
+ * over a few passes, where Omega is a random n-by-l matrix.
+ * With Q an orthonormal basis of Y, the eigenvectors of
+ * Q' * X * X' * Q give the leading eigenfaces. The memory
+ * required is proportional to the number of pixels times l,
+ * independent of the number of images.
+ *
+ * As with PCA(), each eigenface is scaled by the square root of
+ * its eigenvalue, so that the two functions are interchangeable.
+ *
+ * @param entries         pointer to list of image entries
+ * @param num_images      number of images
+ * @param mean_face       pointer to mean face
+ * @param num_components  number of components, or 0 for RPCA_COMPONENTS
+ * @param energy          fraction of the total variance to retain,
+ *                        or 0 to retain num_components components
+ * @param prep            pointer to preprocessing parameters
+ * @param num_threads     number of threads for reading images
+ * @return projection matrix W_pca'
+ */
+matrix_t * PCA_randomized(database_entry_t *entries, int num_images, matrix_t *mean_face, int num_components, precision_t energy, const image_prep_t *prep, int num_threads)
+{
+	int m = mean_face->rows;
+	int n = num_images;
+
+	// determine the size of the sketch
+	int k = (num_components > 0) ? num_components : RPCA_COMPONENTS;
+
+	if ( k > n - 1 ) {
+		k = (n > 1) ? n - 1 : n;
+	}
+	if ( k > m ) {
+		k = m;
+	}
+
+	int l = k + RPCA_OVERSAMPLING;
+
+	if ( l > n ) {
+		l = n;
+	}
+	if ( l > m ) {
+		l = m;
+	}
+
+	// temporaries of each block are allocated from an arena
+	m_arena_t *arena = m_arena_create((size_t)TRAIN_BLOCK_SIZE * l * sizeof(precision_t) + 4 * M_ARENA_ALIGN);
+
+	// compute the sketch Y = X * Omega and the total variance
+	matrix_t *Y = m_zeros(m, l);
+	precision_t total = 0;
+
+	int i, j;
+	for ( i = 0; i < n; i += TRAIN_BLOCK_SIZE ) {
+		int end = (i + TRAIN_BLOCK_SIZE < n) ? i + TRAIN_BLOCK_SIZE : n;
+
+		matrix_t *X_b = rpca_read_block(entries, i, end, mean_face, prep, num_threads);
+		matrix_t *Omega_b = rpca_omega(arena, i, end, l);
+
+		m_product_into(Y, X_b, 0, Omega_b, 0, 1, 1);
+
+		for ( j = 0; j < X_b->cols; j++ ) {
+			total += m_dot(X_b, j, X_b, j);
+		}
+
+		m_free(X_b);
+		m_arena_reset(arena);
+	}
+
+	// refine the sketch with power iterations Y = X * X' * Q
+	matrix_t *Y_next = m_initialize(m, l);
+
+	int q;
+	for ( q = 0; q < RPCA_POWER_ITERATIONS; q++ ) {
+		m_orthonormalize(Y);
+
+		memset(Y_next->data, 0, (size_t)m * l * sizeof(precision_t));
+
+		for ( i = 0; i < n; i += TRAIN_BLOCK_SIZE ) {
+			int end = (i + TRAIN_BLOCK_SIZE < n) ? i + TRAIN_BLOCK_SIZE : n;
+
+			matrix_t *X_b = rpca_read_block(entries, i, end, mean_face, prep, num_threads);
+			matrix_t *Z_b = m_arena_initialize(arena, X_b->cols, l);
+
+			m_product_into(Z_b, X_b, 1, Y, 0, 1, 0);
+			m_product_into(Y_next, X_b, 0, Z_b, 0, 1, 1);
+
+			m_free(X_b);
+			m_arena_reset(arena);
+		}
+
+		matrix_t *Y_temp = Y;
+		Y = Y_next;
+		Y_next = Y_temp;
+	}
+
+	m_free(Y_next);
+
+	// compute G = B * B', B = Q' * X
+	matrix_t *Q = Y;
+	m_orthonormalize(Q);
+
+	matrix_t *G = m_zeros(l, l);
+
+	for ( i = 0; i < n; i += TRAIN_BLOCK_SIZE ) {
+		int end = (i + TRAIN_BLOCK_SIZE < n) ? i + TRAIN_BLOCK_SIZE : n;
+
+		matrix_t *X_b = rpca_read_block(entries, i, end, mean_face, prep, num_threads);
+		matrix_t *B_b = m_arena_initialize(arena, l, X_b->cols);
+
+		m_product_into(B_b, Q, 1, X_b, 0, 1, 0);
+		m_syrk_into(G, B_b, 0, 1, 1);
+
+		m_free(X_b);
+		m_arena_reset(arena);
+	}
+
+	m_arena_free(arena);
+
+	// determine the number of components
+	if ( energy > 0 ) {
+		matrix_t *G_eval = m_initialize(l, 1);
+
+		m_eigen_sym(G, G_eval, NULL);
+
+		int k_energy = pca_num_components(G_eval, total, energy);
+
+		if ( k_energy < k ) {
+			k = k_energy;
+		}
+
+		m_free(G_eval);
+	}
+
+	// compute eigenfaces W_pca' = sqrt(G_eval) * G_evec' * Q'
+	matrix_t *G_eval = m_initialize(k, 1);
+	matrix_t *G_evec = m_initialize(l, k);
+
+	m_eigen_sym(G, G_eval, G_evec);
+
+	matrix_t *W_pca_tr = m_initialize(k, m);
+
+	m_product_into(W_pca_tr, G_evec, 1, Q, 1, 1, 0);
+
+	for ( i = 0; i < k; i++ ) {
+		elem(G_eval, i, 0) = sqrt(fmax(elem(G_eval, i, 0), 0));
+	}
+
+	for ( j = 0; j < m; j++ ) {
+		for ( i = 0; i < k; i++ ) {
+			elem(W_pca_tr, i, j) *= elem(G_eval, i, 0);
+		}
+	}
+
+	m_free(Q);
+	m_free(G);
+	m_free(G_eval);
+	m_free(G_evec);
 
 	return W_pca_tr;
 }
+
+/**
+ * Update the principal components of a training set with a block
+ * of new images, using incremental PCA with a mean update
+ * (Ross et al., 2008).
+ *
+ * Let U * S be the eigenfaces W_pca of the n previous images, where
+ * U is orthonormal and S is diagonal. The new images B are centered
+ * and augmented with a column for the change in the mean, and the
+ * part of B outside the span of U is orthonormalized into Q. The
+ * eigenfaces of the combined set are then given by [U Q] times
+ * the left singular vectors of the small matrix
+ *
+ *   R = [ S  U' * B ]
+ *       [ 0  Q' * B ]
+ *
+ * The number of components is unchanged.
+ *
+ * @param W_pca_tr    PCA projection matrix of the previous images
+ * @param mean_face   mean face of the previous images
+ * @param num_images  number of previous images
+ * @param B           image matrix of new images
+ * @return PCA projection matrix of all images
+ */
+matrix_t * PCA_incremental(matrix_t *W_pca_tr, matrix_t *mean_face, int num_images, matrix_t *B)
+{
+	int m = W_pca_tr->cols;
+	int k = W_pca_tr->rows;
+	int n = num_images;
+	int b = B->cols;
+
+	int r = k + b + 1;
+
+	// temporaries are allocated from a single arena
+	m_arena_t *arena = m_arena_create(((size_t)m * (r + 2 * (b + 1)) + (size_t)r * (3 * r + 1)) * sizeof(precision_t));
+
+	// decompose W_pca = U * S, where U is stored in [U Q]
+	matrix_t *UQ = m_arena_initialize(arena, m, r);
+	matrix_t U = m_view_columns(UQ, 0, k);
+	matrix_t Q = m_view_columns(UQ, k, r);
+
+	m_transpose_into(&U, W_pca_tr);
+
+	matrix_t *S = m_norm_columns(&U);
+
+	int i, j;
+	for ( j = 0; j < k; j++ ) {
+		precision_t s = (elem(S, j, 0) > 0) ? elem(S, j, 0) : 1;
+
+		for ( i = 0; i < m; i++ ) {
+			elem(&U, i, j) /= s;
+		}
+	}
+
+	// compute B_hat = [B - mean_B, sqrt(n * b / (n + b)) * (mean_B - mean_face)]
+	matrix_t *mean_B = m_mean_column(B);
+	matrix_t *B_hat = m_arena_initialize(arena, m, b + 1);
+	precision_t c = sqrt((precision_t)n * b / (n + b));
+
+	for ( j = 0; j < b; j++ ) {
+		for ( i = 0; i < m; i++ ) {
+			elem(B_hat, i, j) = elem(B, i, j) - elem(mean_B, i, 0);
+		}
+	}
+
+	for ( i = 0; i < m; i++ ) {
+		elem(B_hat, i, b) = c * (elem(mean_B, i, 0) - elem(mean_face, i, 0));
+	}
+
+	// compute the projection U' * B_hat and the residual B_hat - U * U' * B_hat
+	matrix_t *B_proj = m_arena_initialize(arena, k, b + 1);
+	matrix_t *B_res = m_arena_initialize(arena, m, b + 1);
+
+	m_product_into(B_proj, &U, 1, B_hat, 0, 1, 0);
+
+	memcpy(B_res->data, B_hat->data, (size_t)m * (b + 1) * sizeof(precision_t));
+	m_product_into(B_res, &U, 0, B_proj, 0, -1, 1);
+
+	memcpy(Q.data, B_res->data, (size_t)m * (b + 1) * sizeof(precision_t));
+	m_orthonormalize(&Q);
+
+	matrix_t *B_res_proj = m_arena_initialize(arena, b + 1, b + 1);
+
+	m_product_into(B_res_proj, &Q, 1, B_res, 0, 1, 0);
+
+	// construct R
+	matrix_t *R = m_arena_zeros(arena, r, r);
+
+	for ( i = 0; i < k; i++ ) {
+		elem(R, i, i) = elem(S, i, 0);
+	}
+
+	for ( j = 0; j < b + 1; j++ ) {
+		for ( i = 0; i < k; i++ ) {
+			elem(R, i, k + j) = elem(B_proj, i, j);
+		}
+		for ( i = 0; i < b + 1; i++ ) {
+			elem(R, k + i, k + j) = elem(B_res_proj, i, j);
+		}
+	}
+
+	// compute the left singular vectors of R from R * R'
+	matrix_t *RR_tr = m_arena_initialize(arena, r, r);
+	matrix_t *R_eval = m_arena_initialize(arena, k, 1);
+	matrix_t *R_evec = m_arena_initialize(arena, r, k);
+
+	m_syrk_into(RR_tr, R, 0, 1, 0);
+	m_eigen_sym(RR_tr, R_eval, R_evec);
+
+	// compute W_pca' = sqrt(R_eval) * R_evec' * [U Q]'
+	matrix_t *W_pca_tr_new = m_initialize(k, m);
+
+	m_product_into(W_pca_tr_new, R_evec, 1, UQ, 1, 1, 0);
+
+	for ( i = 0; i < k; i++ ) {
+		elem(R_eval, i, 0) = sqrt(fmax(elem(R_eval, i, 0), 0));
+	}
+
+	for ( j = 0; j < m; j++ ) {
+		for ( i = 0; i < k; i++ ) {
+			elem(W_pca_tr_new, i, j) *= elem(R_eval, i, 0);
+		}
+	}
+
+	// cleanup
+	m_free(S);
+	m_free(mean_B);
+	m_arena_free(arena);
+
+	return W_pca_tr_new;
+}
@@ -0,0 +1,216 @@
+/**
+ * @file pipeline.c
+ *
+ * Implementation of the recognition stage of a streaming pipeline.
+ *
+ * Each worker takes up to db->batch_size images from the queue
+ * at once, copies them into the columns of a block T and
+ * recognizes the block with db_recognize_block(), as the
+ * recognition server does with its requests. The images are
+ * not written to disk or decoded again. The queue and the pool
+ * of workers are those of the recognition server (see parallel.c).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "database.h"
+#include "parallel.h"
+#include "pipeline.h"
+
+typedef struct {
+	image_t *image;
+	void *tag;
+} pipeline_item_t;
+
+struct pipeline {
+	database_t *db;
+	pipeline_func_t func;
+	void *arg;
+
+	queue_t queue;
+	worker_pool_t workers;
+};
+
+/**
+ * Store the best match of an algorithm in a result.
+ *
+ * @param db      pointer to database
+ * @param result  pointer to result
+ * @param label   label of algorithm
+ * @param match   pointer to best match
+ */
+void pipeline_add_match(database_t *db, pipeline_result_t *result, const char *label, db_match_t *match)
+{
+	int i = result->num_algorithms++;
+
+	result->labels[i] = label;
+	result->classes[i] = match->class;
+	result->names[i] = (match->index != -1)
+		? db->entries[match->index].name
+		: "";
+	result->dists[i] = match->dist;
+}
+
+/**
+ * Recognize images from the queue until the pipeline is closed.
+ *
+ * @param arg  pointer to pipeline
+ * @return NULL
+ */
+void * pipeline_worker(void *arg)
+{
+	pipeline_t *pipeline = (pipeline_t *)arg;
+	database_t *db = pipeline->db;
+	int max = db->batch_size;
+	int k = db->top_k;
+
+	pipeline_item_t **items = (pipeline_item_t **)malloc(max * sizeof(pipeline_item_t *));
+	db_match_t *match_pca = (db_match_t *)malloc(max * k * sizeof(db_match_t));
+	db_match_t *match_lda = (db_match_t *)malloc(max * k * sizeof(db_match_t));
+	db_match_t *match_ica = (db_match_t *)malloc(max * k * sizeof(db_match_t));
+	matrix_t *T = m_initialize(db->num_dimensions, max);
+
+	int num;
+	while ( (num = queue_pop(&pipeline->queue, (void **)items, max)) > 0 ) {
+		int i;
+		for ( i = 0; i < num; i++ ) {
+			m_image_read(T, i, items[i]->image);
+			image_destruct(items[i]->image);
+		}
+
+		T->cols = num;
+
+		db_recognize_block(db, T, match_pca, match_lda, match_ica);
+
+		T->cols = max;
+
+		for ( i = 0; i < num; i++ ) {
+			pipeline_result_t result;
+			result.num_algorithms = 0;
+
+			pipeline_add_match(db, &result, "PCA", &match_pca[i * k]);
+			if ( db->lda ) pipeline_add_match(db, &result, "LDA", &match_lda[i * k]);
+			if ( db->ica ) pipeline_add_match(db, &result, db_ica_label(db), &match_ica[i * k]);
+
+			pipeline->func(pipeline->arg, items[i]->tag, &result);
+			free(items[i]);
+		}
+	}
+
+	free(items);
+	free(match_pca);
+	free(match_lda);
+	free(match_ica);
+	m_free(T);
+
+	return NULL;
+}
+
+/**
+ * Open a pipeline with a database file, and start its workers.
+ *
+ * @param path         path of database file
+ * @param lda          whether to recognize with LDA
+ * @param ica          whether to recognize with ICA, with the
+ *                     architecture of the database
+ * @param num_workers  number of worker threads
+ * @param queue_size   maximum number of queued images
+ * @param batch_size   maximum number of images in a block
+ * @param func         function to call with the result of each image
+ * @param arg          argument of func
+ * @return pointer to new pipeline
+ */
+pipeline_t * pipeline_open(const char *path, int lda, int ica, int num_workers, int queue_size, int batch_size, pipeline_func_t func, void *arg)
+{
+	database_t *db = db_construct(lda, ica);
+	db->batch_size = batch_size;
+
+	if ( ica ) {
+		dbfile_t *file = dbfile_open(path);
+		db->ica_params.architecture = db_read_ica_architecture(file);
+		dbfile_close(file);
+	}
+
+	db_load(db, path);
+
+	if ( db->image_width == 0 ) {
+		fprintf(stderr, "error: \'%s\' does not store the image size, and must be trained again\n", path);
+		exit(1);
+	}
+
+	pipeline_t *pipeline = (pipeline_t *)calloc(1, sizeof(pipeline_t));
+	pipeline->db = db;
+	pipeline->func = func;
+	pipeline->arg = arg;
+
+	queue_init(&pipeline->queue, queue_size);
+	worker_pool_start(&pipeline->workers, num_workers, pipeline_worker, pipeline);
+
+	return pipeline;
+}
+
+/**
+ * Get the size of the images of a pipeline, which is the size
+ * of the preprocessed training images of its database.
+ *
+ * @param pipeline  pointer to pipeline
+ * @param width     pointer to store width
+ * @param height    pointer to store height
+ * @param channels  pointer to store number of channels
+ */
+void pipeline_geometry(pipeline_t *pipeline, int *width, int *height, int *channels)
+{
+	*width = pipeline->db->image_width;
+	*height = pipeline->db->image_height;
+	*channels = pipeline->db->image_channels;
+}
+
+/**
+ * Submit an image to a pipeline, waiting while the queue is
+ * full. The image is preprocessed with the parameters of the
+ * database. The pipeline takes ownership of the image, and calls
+ * the function of the pipeline with the tag and the result of
+ * the image from one of its workers.
+ *
+ * An image which does not have the size of the images of the
+ * database after preprocessing is not submitted, so that one
+ * bad image does not stop a stream, and it remains owned by
+ * the caller.
+ *
+ * @param pipeline  pointer to pipeline
+ * @param image     pointer to image from image_construct()
+ * @param tag       pointer to pass to the function of the pipeline
+ * @return 0 on success, or -1 if the image has the wrong size
+ */
+int pipeline_submit(pipeline_t *pipeline, image_t *image, void *tag)
+{
+	database_t *db = pipeline->db;
+
+	image_preprocess(image, &db->prep);
+
+	if ( image->channels * image->height * image->width != db->num_dimensions ) {
+		return -1;
+	}
+
+	pipeline_item_t *item = (pipeline_item_t *)malloc(sizeof(pipeline_item_t));
+	item->image = image;
+	item->tag = tag;
+
+	queue_push(&pipeline->queue, item);
+
+	return 0;
+}
+
+/**
+ * Close a pipeline after every submitted image is recognized.
+ *
+ * @param pipeline  pointer to pipeline
+ */
+void pipeline_close(pipeline_t *pipeline)
+{
+	queue_close(&pipeline->queue);
+	worker_pool_join(&pipeline->workers);
+	queue_destroy(&pipeline->queue);
+
+	db_destruct(pipeline->db);
+	free(pipeline);
+}
@@ -0,0 +1,47 @@
+/**
+ * @file pipeline.h
+ *
+ * Interface definitions for the recognition stage of a streaming
+ * pipeline.
+ *
+ * A producer, such as a face detector, submits images which are
+ * already in memory instead of image files. The images go through
+ * a bounded queue to a pool of workers, which recognize them in
+ * blocks and pass the result of each image to a callback. A
+ * producer which is faster than the workers is blocked while the
+ * queue is full.
+ *
+ * This interface does not depend on database.h, so that it can
+ * also be used from C++.
+ */
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "image.h"
+
+typedef struct pipeline pipeline_t;
+
+typedef struct {
+	int num_algorithms;
+	const char *labels[3];
+	int classes[3];
+	const char *names[3];
+	double dists[3];
+} pipeline_result_t;
+
+typedef void (*pipeline_func_t)(void *arg, void *tag, const pipeline_result_t *result);
+
+pipeline_t * pipeline_open(const char *path, int lda, int ica, int num_workers, int queue_size, int batch_size, pipeline_func_t func, void *arg);
+void pipeline_geometry(pipeline_t *pipeline, int *width, int *height, int *channels);
+int pipeline_submit(pipeline_t *pipeline, image_t *image, void *tag);
+void pipeline_close(pipeline_t *pipeline);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
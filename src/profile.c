@@ -0,0 +1,208 @@
+/**
+ * @file profile.c
+ *
+ * Implementation of the profiler.
+ */
+#include <time.h>
+#include "profile.h"
+
+int prof_enabled = 0;
+
+static const char *TIMER_NAMES[] = {
+	"train_load",
+	"train_pca",
+	"train_lda",
+	"train_ica",
+	"train_project",
+	"train_index",
+	"rec_decode",
+	"rec_subtract",
+	"rec_project",
+	"rec_search"
+};
+
+static const char *COUNTER_NAMES[] = {
+	"gemm_flops",
+	"bytes_read",
+	"allocations",
+	"allocated_bytes"
+};
+
+static uint64_t prof_start;
+static uint64_t prof_time[PROF_NUM_TIMERS];
+static uint64_t prof_calls[PROF_NUM_TIMERS];
+static uint64_t prof_counters[PROF_NUM_COUNTERS];
+static uint64_t prof_buckets[PROF_NUM_BUCKETS];
+static uint64_t prof_latency_sum;
+static uint64_t prof_latency_max;
+
+/**
+ * Enable the profiler.
+ */
+void prof_enable(void)
+{
+	prof_enabled = 1;
+	prof_start = prof_clock();
+}
+
+/**
+ * Get the time of the monotonic clock.
+ *
+ * @return time in nanoseconds
+ */
+uint64_t prof_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Add the time since begin to a timer.
+ *
+ * @param timer  timer
+ * @param begin  time at which the stage began
+ */
+void prof_add_time(prof_timer_t timer, uint64_t begin)
+{
+	__atomic_fetch_add(&prof_time[timer], prof_clock() - begin, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&prof_calls[timer], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Add to a counter.
+ *
+ * @param counter  counter
+ * @param n        amount to add
+ */
+void prof_add_count(prof_counter_t counter, uint64_t n)
+{
+	__atomic_fetch_add(&prof_counters[counter], n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Add the time since begin to the latency histogram, once for
+ * each of num test images which were processed together.
+ *
+ * @param begin  time at which the test images were submitted
+ * @param num    number of test images
+ */
+void prof_add_latency(uint64_t begin, int num)
+{
+	uint64_t latency = prof_clock() - begin;
+	uint64_t us = latency / 1000;
+
+	int b = 0;
+	while ( b < PROF_NUM_BUCKETS - 1 && (us >> b) != 0 ) {
+		b++;
+	}
+
+	__atomic_fetch_add(&prof_buckets[b], num, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&prof_latency_sum, num * latency, __ATOMIC_RELAXED);
+
+	uint64_t max = __atomic_load_n(&prof_latency_max, __ATOMIC_RELAXED);
+
+	while ( latency > max && !__atomic_compare_exchange_n(&prof_latency_max, &max, latency, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) {
+	}
+}
+
+/**
+ * Get a percentile of the latency histogram, as the upper
+ * bound of the bucket which contains it.
+ *
+ * @param count  number of latencies
+ * @param p      percentile between 0 and 100
+ * @return percentile in milliseconds
+ */
+static double prof_percentile(uint64_t count, double p)
+{
+	uint64_t rank = (uint64_t)(p / 100 * count + 0.5);
+	uint64_t num = 0;
+
+	if ( rank < 1 ) {
+		rank = 1;
+	}
+
+	int b;
+	for ( b = 0; b < PROF_NUM_BUCKETS - 1; b++ ) {
+		num += prof_buckets[b];
+
+		if ( num >= rank ) {
+			break;
+		}
+	}
+
+	double upper = (uint64_t)1 << b;
+	double max = prof_latency_max * 1e-3;
+
+	return 1e-3 * ((upper < max) ? upper : max);
+}
+
+/**
+ * Write the timers, counters and latency histogram of the
+ * profiler as a JSON object.
+ *
+ * @param stream  output stream
+ */
+void prof_write(FILE *stream)
+{
+	fprintf(stream, "{\n");
+	fprintf(stream, "  \"wall_seconds\": %.6f,\n", (prof_clock() - prof_start) * 1e-9);
+
+	// write timers
+	fprintf(stream, "  \"timers\": {\n");
+
+	int i;
+	for ( i = 0; i < PROF_NUM_TIMERS; i++ ) {
+		fprintf(stream, "    \"%s\": { \"seconds\": %.6f, \"calls\": %llu }%s\n",
+			TIMER_NAMES[i],
+			prof_time[i] * 1e-9,
+			(unsigned long long) prof_calls[i],
+			(i < PROF_NUM_TIMERS - 1) ? "," : "");
+	}
+	fprintf(stream, "  },\n");
+
+	// write counters
+	fprintf(stream, "  \"counters\": {\n");
+
+	for ( i = 0; i < PROF_NUM_COUNTERS; i++ ) {
+		fprintf(stream, "    \"%s\": %llu%s\n",
+			COUNTER_NAMES[i],
+			(unsigned long long) prof_counters[i],
+			(i < PROF_NUM_COUNTERS - 1) ? "," : "");
+	}
+	fprintf(stream, "  },\n");
+
+	// write latency histogram
+	uint64_t count = 0;
+	int last = 0;
+
+	for ( i = 0; i < PROF_NUM_BUCKETS; i++ ) {
+		count += prof_buckets[i];
+
+		if ( prof_buckets[i] > 0 ) {
+			last = i;
+		}
+	}
+
+	fprintf(stream, "  \"latency\": {\n");
+	fprintf(stream, "    \"count\": %llu,\n", (unsigned long long) count);
+
+	if ( count > 0 ) {
+		fprintf(stream, "    \"mean_ms\": %.6f,\n", prof_latency_sum * 1e-6 / count);
+		fprintf(stream, "    \"max_ms\": %.6f,\n", prof_latency_max * 1e-6);
+		fprintf(stream, "    \"p50_ms\": %.6f,\n", prof_percentile(count, 50));
+		fprintf(stream, "    \"p90_ms\": %.6f,\n", prof_percentile(count, 90));
+		fprintf(stream, "    \"p99_ms\": %.6f,\n", prof_percentile(count, 99));
+	}
+
+	fprintf(stream, "    \"buckets_us\": [");
+
+	for ( i = 0; count > 0 && i <= last; i++ ) {
+		fprintf(stream, "%s%llu", (i > 0) ? ", " : "", (unsigned long long) prof_buckets[i]);
+	}
+	fprintf(stream, "]\n");
+	fprintf(stream, "  }\n");
+	fprintf(stream, "}\n");
+}
@@ -0,0 +1,77 @@
+/**
+ * @file profile.h
+ *
+ * Interface definitions for the profiler.
+ *
+ * The profiler accumulates the time spent in each stage of
+ * training and recognition, counters of GEMM FLOPs, bytes read
+ * and allocations, and a histogram of the latency of each test
+ * image, and writes them as JSON. It is enabled at run time with
+ * prof_enable(). Building with -DNO_PROFILE reduces every
+ * PROF_* macro to nothing.
+ *
+ * The timers and counters are updated atomically, so a stage
+ * which runs on several threads accumulates the time of every
+ * thread.
+ */
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum {
+	PROF_TRAIN_LOAD,
+	PROF_TRAIN_PCA,
+	PROF_TRAIN_LDA,
+	PROF_TRAIN_ICA,
+	PROF_TRAIN_PROJECT,
+	PROF_TRAIN_INDEX,
+	PROF_REC_DECODE,
+	PROF_REC_SUBTRACT,
+	PROF_REC_PROJECT,
+	PROF_REC_SEARCH,
+	PROF_NUM_TIMERS
+} prof_timer_t;
+
+typedef enum {
+	PROF_GEMM_FLOPS,
+	PROF_BYTES_READ,
+	PROF_ALLOCATIONS,
+	PROF_ALLOCATED_BYTES,
+	PROF_NUM_COUNTERS
+} prof_counter_t;
+
+/**
+ * Number of buckets of the latency histogram. Bucket b counts
+ * latencies below 2^b microseconds which are not counted by
+ * bucket b - 1, and the last bucket counts the rest.
+ */
+#define PROF_NUM_BUCKETS 32
+
+extern int prof_enabled;
+
+void prof_enable(void);
+uint64_t prof_clock(void);
+void prof_add_time(prof_timer_t timer, uint64_t begin);
+void prof_add_count(prof_counter_t counter, uint64_t n);
+void prof_add_latency(uint64_t begin, int num);
+void prof_write(FILE *stream);
+
+#ifndef NO_PROFILE
+
+#define PROF_BEGIN(name) uint64_t prof_begin_##name = prof_enabled ? prof_clock() : 0
+#define PROF_END(name, timer) do { if ( prof_enabled ) prof_add_time(timer, prof_begin_##name); } while (0)
+#define PROF_COUNT(counter, n) do { if ( prof_enabled ) prof_add_count(counter, n); } while (0)
+#define PROF_LATENCY(name, num) do { if ( prof_enabled ) prof_add_latency(prof_begin_##name, num); } while (0)
+
+#else
+
+#define PROF_BEGIN(name)
+#define PROF_END(name, timer) do { } while (0)
+#define PROF_COUNT(counter, n) do { } while (0)
+#define PROF_LATENCY(name, num) do { } while (0)
+
+#endif
+
+#endif
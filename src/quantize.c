@@ -0,0 +1,272 @@
+/**
+ * @file quantize.c
+ *
+ * Implementation of quantized matrices.
+ */
+#include <math.h>
+#include <stdlib.h>
+#include "quantize.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNELS_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define KERNELS_NEON
+#endif
+
+/**
+ * Integer dot product kernels.
+ *
+ * Each kernel computes the dot product of two contiguous 8-bit
+ * vectors of length n with 32-bit accumulation, which is exact for
+ * any n < 2^17. The best implementation for the host CPU is selected
+ * the first time q_dot() is called.
+ */
+typedef int32_t (*q_kernel_func_t)(const int8_t *x, const int8_t *y, int n);
+
+static int32_t q_kernel_dot_scalar(const int8_t *x, const int8_t *y, int n)
+{
+	int32_t sum = 0;
+
+	int k;
+	for ( k = 0; k < n; k++ ) {
+		sum += x[k] * y[k];
+	}
+
+	return sum;
+}
+
+#ifdef KERNELS_X86
+__attribute__((target("avx2")))
+static int32_t q_kernel_dot_avx2(const int8_t *x, const int8_t *y, int n)
+{
+	__m256i sum = _mm256_setzero_si256();
+
+	int k;
+	for ( k = 0; k + 32 <= n; k += 32 ) {
+		__m256i x_k = _mm256_loadu_si256((const __m256i *)(x + k));
+		__m256i y_k = _mm256_loadu_si256((const __m256i *)(y + k));
+
+		__m256i x_lo = _mm256_cvtepi8_epi16(_mm256_castsi256_si128(x_k));
+		__m256i y_lo = _mm256_cvtepi8_epi16(_mm256_castsi256_si128(y_k));
+		__m256i x_hi = _mm256_cvtepi8_epi16(_mm256_extracti128_si256(x_k, 1));
+		__m256i y_hi = _mm256_cvtepi8_epi16(_mm256_extracti128_si256(y_k, 1));
+
+		sum = _mm256_add_epi32(sum, _mm256_madd_epi16(x_lo, y_lo));
+		sum = _mm256_add_epi32(sum, _mm256_madd_epi16(x_hi, y_hi));
+	}
+
+	int32_t temp[8];
+	_mm256_storeu_si256((__m256i *)temp, sum);
+
+	return temp[0] + temp[1] + temp[2] + temp[3]
+		+ temp[4] + temp[5] + temp[6] + temp[7]
+		+ q_kernel_dot_scalar(x + k, y + k, n - k);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int32_t q_kernel_dot_avx512(const int8_t *x, const int8_t *y, int n)
+{
+	__m512i sum = _mm512_setzero_si512();
+
+	int k;
+	for ( k = 0; k + 32 <= n; k += 32 ) {
+		__m512i x_k = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i *)(x + k)));
+		__m512i y_k = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i *)(y + k)));
+
+		sum = _mm512_add_epi32(sum, _mm512_madd_epi16(x_k, y_k));
+	}
+
+	return _mm512_reduce_add_epi32(sum) + q_kernel_dot_scalar(x + k, y + k, n - k);
+}
+#endif
+
+#ifdef KERNELS_NEON
+static int32_t q_kernel_dot_neon(const int8_t *x, const int8_t *y, int n)
+{
+	int32x4_t sum = vdupq_n_s32(0);
+
+	int k;
+	for ( k = 0; k + 16 <= n; k += 16 ) {
+		int8x16_t x_k = vld1q_s8(x + k);
+		int8x16_t y_k = vld1q_s8(y + k);
+
+		sum = vpadalq_s16(sum, vmull_s8(vget_low_s8(x_k), vget_low_s8(y_k)));
+		sum = vpadalq_s16(sum, vmull_high_s8(x_k, y_k));
+	}
+
+	return vaddvq_s32(sum) + q_kernel_dot_scalar(x + k, y + k, n - k);
+}
+#endif
+
+static int32_t q_kernel_dot_init(const int8_t *x, const int8_t *y, int n);
+
+static q_kernel_func_t q_kernel_dot = q_kernel_dot_init;
+
+/**
+ * Select the integer kernel for the host CPU.
+ *
+ * This runs at startup, as in the matrix library, so that
+ * q_kernel_dot is not written while other threads use it.
+ */
+__attribute__((constructor))
+static void q_kernels_init(void)
+{
+#if defined(KERNELS_X86)
+	__builtin_cpu_init();
+
+	if ( __builtin_cpu_supports("avx512bw") ) {
+		q_kernel_dot = q_kernel_dot_avx512;
+	}
+	else if ( __builtin_cpu_supports("avx2") ) {
+		q_kernel_dot = q_kernel_dot_avx2;
+	}
+	else {
+		q_kernel_dot = q_kernel_dot_scalar;
+	}
+#elif defined(KERNELS_NEON)
+	q_kernel_dot = q_kernel_dot_neon;
+#else
+	q_kernel_dot = q_kernel_dot_scalar;
+#endif
+}
+
+static int32_t q_kernel_dot_init(const int8_t *x, const int8_t *y, int n)
+{
+	q_kernels_init();
+
+	return q_kernel_dot(x, y, n);
+}
+
+/**
+ * Round a value to the nearest 8-bit integer.
+ *
+ * @param x
+ * @return nearest integer in [-128, 127]
+ */
+static int8_t q_round(precision_t x)
+{
+	long q = lround(x);
+
+	return (q < INT8_MIN) ? INT8_MIN
+		: (q > INT8_MAX) ? INT8_MAX
+		: q;
+}
+
+/**
+ * Quantize a matrix.
+ *
+ * The range of each row of M is mapped onto [-128, 127].
+ *
+ * @param M  pointer to matrix
+ * @return pointer to new quantized matrix
+ */
+qmatrix_t * q_quantize(matrix_t *M)
+{
+	qmatrix_t *Q = (qmatrix_t *)malloc(sizeof(qmatrix_t));
+	Q->data = (int8_t *)malloc((size_t)M->rows * M->cols * sizeof(int8_t));
+	Q->scale = (float *)malloc(M->rows * sizeof(float));
+	Q->zero = (int32_t *)malloc(M->rows * sizeof(int32_t));
+	Q->rows = M->rows;
+	Q->cols = M->cols;
+
+	int i, j;
+	for ( i = 0; i < M->rows; i++ ) {
+		// determine the range of row i
+		precision_t min = elem(M, i, 0);
+		precision_t max = elem(M, i, 0);
+
+		for ( j = 1; j < M->cols; j++ ) {
+			if ( elem(M, i, j) < min ) {
+				min = elem(M, i, j);
+			}
+			if ( elem(M, i, j) > max ) {
+				max = elem(M, i, j);
+			}
+		}
+
+		precision_t scale = (max - min) / 255;
+
+		if ( scale == 0 ) {
+			scale = (min != 0) ? fabs(min) / INT8_MAX : 1;
+		}
+
+		Q->scale[i] = scale;
+		Q->zero[i] = lround(INT8_MIN - min / Q->scale[i]);
+
+		// quantize row i
+		for ( j = 0; j < M->cols; j++ ) {
+			q_column(Q, j)[i] = q_round(elem(M, i, j) / Q->scale[i] + Q->zero[i]);
+		}
+	}
+
+	return Q;
+}
+
+/**
+ * Destruct a quantized matrix.
+ *
+ * @param Q  pointer to quantized matrix
+ */
+void q_free(qmatrix_t *Q)
+{
+	free(Q->data);
+	free(Q->scale);
+	free(Q->zero);
+	free(Q);
+}
+
+/**
+ * Quantize a column vector of a matrix M for comparison with
+ * the columns of a quantized matrix Q, so that
+ *
+ *   dot(M_col, dequantize(Q_j)) ~= t * (q_dot(x, Q_j) - offset)
+ *
+ * where t is a single scale for the vector.
+ *
+ * @param Q       pointer to quantized matrix
+ * @param M       pointer to matrix
+ * @param col     column index of M
+ * @param x       pointer to store Q->rows quantized elements
+ * @param offset  pointer to store dot product of x and Q->zero
+ * @return scale t of the quantized vector
+ */
+precision_t q_quantize_vector(qmatrix_t *Q, matrix_t *M, int col, int8_t *x, int32_t *offset)
+{
+	// fold the row scales of Q into the vector
+	precision_t max = 0;
+
+	int i;
+	for ( i = 0; i < Q->rows; i++ ) {
+		precision_t u = elem(M, i, col) * Q->scale[i];
+
+		if ( fabs(u) > max ) {
+			max = fabs(u);
+		}
+	}
+
+	precision_t t = (max > 0) ? max / INT8_MAX : 1;
+
+	*offset = 0;
+
+	for ( i = 0; i < Q->rows; i++ ) {
+		x[i] = q_round(elem(M, i, col) * Q->scale[i] / t);
+		*offset += x[i] * Q->zero[i];
+	}
+
+	return t;
+}
+
+/**
+ * Compute the dot product of two 8-bit vectors.
+ *
+ * @param x
+ * @param y
+ * @param n  length of x and y
+ * @return dot product of x and y
+ */
+int32_t q_dot(const int8_t *x, const int8_t *y, int n)
+{
+	return q_kernel_dot(x, y, n);
+}
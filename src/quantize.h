@@ -0,0 +1,36 @@
+/**
+ * @file quantize.h
+ *
+ * Interface definitions for quantized matrices.
+ *
+ * A quantized matrix stores each element of a matrix M as an
+ * 8-bit integer with a scale and zero point for each row:
+ *
+ *   M_ij ~= scale_i * (Q_ij - zero_i)
+ *
+ * Like matrix_t, a quantized matrix is stored in column-major
+ * order.
+ */
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include <stdint.h>
+#include "matrix.h"
+
+typedef struct {
+	int8_t *data;
+	float *scale;
+	int32_t *zero;
+	int rows;
+	int cols;
+} qmatrix_t;
+
+#define q_column(Q, j) ((Q)->data + (size_t)(j) * (Q)->rows)
+
+qmatrix_t * q_quantize(matrix_t *M);
+void q_free(qmatrix_t *Q);
+
+precision_t q_quantize_vector(qmatrix_t *Q, matrix_t *M, int col, int8_t *x, int32_t *offset);
+int32_t q_dot(const int8_t *x, const int8_t *y, int n);
+
+#endif
@@ -0,0 +1,1327 @@
+/**
+ * @file server.c
+ *
+ * Implementation of the recognition server.
+ *
+ * The server loads a database once and answers recognition
+ * requests on standard input and output, a Unix socket or a TCP
+ * socket, with the same line protocol on each. A request is a
+ * single line, either
+ *
+ *   PATH                       recognize the image file PATH
+ *   raw WIDTH HEIGHT CHANNELS  recognize the WIDTH * HEIGHT * CHANNELS
+ *                              bytes of pixels which follow the line
+ *
+ * and the response to each request is a single line of
+ * tab-separated fields, either
+ *
+ *   match PCA CLASS NAME [LDA CLASS NAME] [ICA2 CLASS NAME]
+ *   error MESSAGE
+ *
+ * where the ICA label is ICA1 for a database which was trained
+ * with ICA Architecture I.
+ *
+ * A coordinator of a sharded database (see shard.c) sends each
+ * shard server a block of test images which are already projected,
+ * as a request line
+ *
+ *   project NUM N_PCA N_LDA N_ICA
+ *
+ * followed by the NUM columns of each projection, as native
+ * doubles, with 0 rows for each algorithm which is not used. The
+ * response is either an error line or NUM lines, one for each
+ * test image, of the db->top_k best matches of the shard for
+ * each algorithm with their distances:
+ *
+ *   topk PCA N CLASS NAME DIST ... [LDA N ...] [ICA2 N ...]
+ *
+ * Responses are written in the order of the requests on each
+ * connection, by a writer thread of the connection.
+ *
+ * Requests from every connection go through one bounded queue
+ * (see parallel.c). A connection blocks when the queue is full, so that clients
+ * which send faster than the workers can recognize are slowed
+ * down instead of growing the queue. Each worker takes up to
+ * db->batch_size requests from the queue at once and recognizes
+ * them as a single block, so that a loaded server uses the batched
+ * matrix products.
+ *
+ * With a list of shard servers, the server is the coordinator of a
+ * sharded database: each worker projects its block of test images
+ * once, sends the projections to every shard, and merges the best
+ * matches of the shards by distance.
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "image.h"
+#include "parallel.h"
+#include "profile.h"
+#include "server.h"
+
+/**
+ * Maximum size of the pixels of a raw request.
+ */
+#define SERVER_MAX_RAW_SIZE (1 << 28)
+
+/**
+ * Get the label of an algorithm in responses.
+ *
+ * @param db  pointer to database
+ * @param a   index of algorithm (PCA, LDA, ICA)
+ * @return label of algorithm
+ */
+static const char * server_label(database_t *db, int a)
+{
+	const char *LABELS[] = { "PCA", "LDA", db_ica_label(db) };
+
+	return LABELS[a];
+}
+
+typedef struct server server_t;
+typedef struct server_conn server_conn_t;
+
+typedef struct server_request {
+	server_conn_t *conn;
+	char *path;
+	image_t image;
+	int num_projected;
+	matrix_t *projections[3];
+	char *response;
+	int done;
+	struct server_request *next;
+} server_request_t;
+
+struct server_conn {
+	server_t *server;
+	FILE *in;
+	int out_fd;
+	int owns_fd;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	pthread_cond_t not_full;
+	server_request_t *head;
+	server_request_t *tail;
+	int num_pending;
+	int closed;
+};
+
+struct server {
+	database_t *db;
+	char **shards;
+	int num_shards;
+
+	queue_t queue;
+
+	pthread_mutex_t lock;
+	pthread_cond_t no_conns;
+	int num_conns;
+};
+
+/**
+ * Format the response of a request.
+ *
+ * @param format  printf format string
+ * @return pointer to new response string
+ */
+static char * server_format(const char *format, ...)
+	__attribute__((format(printf, 1, 2)));
+
+static char * server_format(const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	int size = vsnprintf(NULL, 0, format, ap);
+	va_end(ap);
+
+	char *str = (char *)malloc(size + 1);
+
+	va_start(ap, format);
+	vsnprintf(str, size + 1, format, ap);
+	va_end(ap);
+
+	return str;
+}
+
+/**
+ * Write a buffer to a file descriptor.
+ *
+ * @param fd    file descriptor
+ * @param buf   pointer to buffer
+ * @param size  size of buffer
+ * @return 0 on success, -1 on error
+ */
+static int write_all(int fd, const char *buf, size_t size)
+{
+	while ( size > 0 ) {
+		ssize_t n = write(fd, buf, size);
+
+		if ( n < 0 && errno == EINTR ) {
+			continue;
+		}
+		if ( n <= 0 ) {
+			return -1;
+		}
+
+		buf += n;
+		size -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * Parse a socket address.
+ *
+ * @param address  "unix:PATH", "tcp:PORT" or "tcp:HOST:PORT"
+ * @param addr     pointer to store socket address
+ * @return size of socket address
+ */
+socklen_t server_parse_address(const char *address, struct sockaddr_storage *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+
+	if ( strncmp(address, "unix:", 5) == 0 ) {
+		struct sockaddr_un *addr_un = (struct sockaddr_un *)addr;
+		const char *path = address + 5;
+
+		if ( strlen(path) >= sizeof(addr_un->sun_path) ) {
+			fprintf(stderr, "error: socket path \'%s\' is too long\n", path);
+			exit(1);
+		}
+
+		addr_un->sun_family = AF_UNIX;
+		strcpy(addr_un->sun_path, path);
+
+		return sizeof(struct sockaddr_un);
+	}
+	else if ( strncmp(address, "tcp:", 4) == 0 ) {
+		struct sockaddr_in *addr_in = (struct sockaddr_in *)addr;
+		const char *host = "127.0.0.1";
+		const char *port = address + 4;
+		char host_buf[INET_ADDRSTRLEN];
+		const char *sep = strrchr(port, ':');
+
+		if ( sep != NULL ) {
+			size_t len = sep - port;
+
+			if ( len >= sizeof(host_buf) ) {
+				fprintf(stderr, "error: invalid address \'%s\'\n", address);
+				exit(1);
+			}
+
+			memcpy(host_buf, port, len);
+			host_buf[len] = '\0';
+			host = host_buf;
+			port = sep + 1;
+		}
+
+		addr_in->sin_family = AF_INET;
+		addr_in->sin_port = htons(atoi(port));
+
+		if ( atoi(port) <= 0 || inet_pton(AF_INET, host, &addr_in->sin_addr) != 1 ) {
+			fprintf(stderr, "error: invalid address \'%s\'\n", address);
+			exit(1);
+		}
+
+		return sizeof(struct sockaddr_in);
+	}
+
+	fprintf(stderr, "error: invalid address \'%s\'\n", address);
+	exit(1);
+}
+
+/**
+ * Create a listening socket for an address.
+ *
+ * @param address  "unix:PATH", "tcp:PORT" or "tcp:HOST:PORT"
+ * @return socket file descriptor
+ */
+int server_listen(const char *address)
+{
+	struct sockaddr_storage addr;
+	socklen_t addr_size = server_parse_address(address, &addr);
+
+	if ( addr.ss_family == AF_UNIX ) {
+		unlink(((struct sockaddr_un *)&addr)->sun_path);
+	}
+
+	int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+	int reuse = 1;
+
+	if ( fd == -1
+	  || (addr.ss_family == AF_INET && setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1)
+	  || bind(fd, (struct sockaddr *)&addr, addr_size) == -1 ) {
+		perror("bind");
+		exit(1);
+	}
+
+	if ( listen(fd, SOMAXCONN) == -1 ) {
+		perror("listen");
+		exit(1);
+	}
+
+	return fd;
+}
+
+/**
+ * Connect to a server at an address.
+ *
+ * @param address  "unix:PATH", "tcp:PORT" or "tcp:HOST:PORT"
+ * @return socket file descriptor, or -1 if the server cannot be reached
+ */
+int server_connect(const char *address)
+{
+	struct sockaddr_storage addr;
+	socklen_t addr_size = server_parse_address(address, &addr);
+
+	int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+
+	if ( fd == -1 ) {
+		return -1;
+	}
+
+	if ( connect(fd, (struct sockaddr *)&addr, addr_size) == -1 ) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * Destruct a connection after its reader has finished and
+ * every response is written.
+ *
+ * @param conn  pointer to connection
+ */
+void server_conn_destruct(server_conn_t *conn)
+{
+	server_t *server = conn->server;
+
+	if ( conn->owns_fd ) {
+		fclose(conn->in);
+	}
+
+	pthread_mutex_destroy(&conn->lock);
+	pthread_cond_destroy(&conn->ready);
+	pthread_cond_destroy(&conn->not_full);
+	free(conn);
+
+	pthread_mutex_lock(&server->lock);
+	server->num_conns--;
+	pthread_cond_broadcast(&server->no_conns);
+	pthread_mutex_unlock(&server->lock);
+}
+
+/**
+ * Free a request.
+ *
+ * @param req  pointer to request
+ */
+void server_request_free(server_request_t *req)
+{
+	int i;
+	for ( i = 0; i < 3; i++ ) {
+		if ( req->projections[i] != NULL ) {
+			m_free(req->projections[i]);
+		}
+	}
+
+	free(req->path);
+	free(req->image.pixels);
+	free(req->response);
+	free(req);
+}
+
+/**
+ * Write the responses of a connection in the order of its
+ * requests, until its reader has finished and every response
+ * is written.
+ *
+ * Each connection has its own writer, so that a client which
+ * reads its responses slowly, such as a coordinator which is
+ * still sending a block to its other shards, blocks only its
+ * own writer and not the workers of the server.
+ *
+ * @param arg  pointer to connection
+ * @return NULL
+ */
+void * server_writer(void *arg)
+{
+	server_conn_t *conn = (server_conn_t *)arg;
+
+	pthread_mutex_lock(&conn->lock);
+
+	while ( 1 ) {
+		while ( (conn->head == NULL || !conn->head->done) && !(conn->head == NULL && conn->closed) ) {
+			pthread_cond_wait(&conn->ready, &conn->lock);
+		}
+
+		server_request_t *head = conn->head;
+
+		if ( head == NULL ) {
+			break;
+		}
+
+		conn->head = head->next;
+		if ( conn->head == NULL ) {
+			conn->tail = NULL;
+		}
+
+		pthread_mutex_unlock(&conn->lock);
+
+		// a client which has gone away is not an error of the server
+		write_all(conn->out_fd, head->response, strlen(head->response));
+		server_request_free(head);
+
+		pthread_mutex_lock(&conn->lock);
+
+		conn->num_pending--;
+		pthread_cond_signal(&conn->not_full);
+	}
+
+	pthread_mutex_unlock(&conn->lock);
+
+	server_conn_destruct(conn);
+
+	return NULL;
+}
+
+/**
+ * Construct a connection, and start its writer.
+ *
+ * @param server   pointer to server
+ * @param in       input stream
+ * @param out_fd   output file descriptor
+ * @param owns_fd  whether to close the input stream with the connection
+ * @return pointer to new connection
+ */
+server_conn_t * server_conn_construct(server_t *server, FILE *in, int out_fd, int owns_fd)
+{
+	server_conn_t *conn = (server_conn_t *)calloc(1, sizeof(server_conn_t));
+	conn->server = server;
+	conn->in = in;
+	conn->out_fd = out_fd;
+	conn->owns_fd = owns_fd;
+
+	pthread_mutex_init(&conn->lock, NULL);
+	pthread_cond_init(&conn->ready, NULL);
+	pthread_cond_init(&conn->not_full, NULL);
+
+	pthread_mutex_lock(&server->lock);
+	server->num_conns++;
+	pthread_mutex_unlock(&server->lock);
+
+	pthread_t thread;
+
+	if ( pthread_create(&thread, NULL, server_writer, conn) != 0 ) {
+		perror("pthread_create");
+		exit(1);
+	}
+
+	pthread_detach(thread);
+
+	return conn;
+}
+
+/**
+ * Close the input of a connection after its reader has
+ * finished, so that its writer destructs the connection
+ * once every response is written.
+ *
+ * @param conn  pointer to connection
+ */
+void server_conn_close(server_conn_t *conn)
+{
+	pthread_mutex_lock(&conn->lock);
+
+	conn->closed = 1;
+	pthread_cond_signal(&conn->ready);
+
+	pthread_mutex_unlock(&conn->lock);
+}
+
+/**
+ * Complete a request, so that the writer of its connection
+ * writes its response after the responses of the previous
+ * requests of the connection.
+ *
+ * @param req  pointer to request with a response
+ */
+void server_complete(server_request_t *req)
+{
+	server_conn_t *conn = req->conn;
+
+	pthread_mutex_lock(&conn->lock);
+
+	req->done = 1;
+
+	if ( req == conn->head ) {
+		pthread_cond_signal(&conn->ready);
+	}
+
+	pthread_mutex_unlock(&conn->lock);
+}
+
+/**
+ * Add a request to the pending responses of its connection,
+ * waiting while the connection has as many pending responses
+ * as the queue of the server can hold, so that a client which
+ * does not read its responses cannot grow them without bound.
+ *
+ * @param req  pointer to request
+ */
+void server_conn_append(server_request_t *req)
+{
+	server_conn_t *conn = req->conn;
+
+	pthread_mutex_lock(&conn->lock);
+
+	while ( conn->num_pending >= conn->server->queue.size ) {
+		pthread_cond_wait(&conn->not_full, &conn->lock);
+	}
+
+	if ( conn->tail != NULL ) {
+		conn->tail->next = req;
+	}
+	else {
+		conn->head = req;
+	}
+
+	conn->tail = req;
+	conn->num_pending++;
+
+	pthread_mutex_unlock(&conn->lock);
+}
+
+/**
+ * Get the image name of the best match of a request, which
+ * is empty if the request was rejected.
+ *
+ * @param db     pointer to database
+ * @param match  pointer to match
+ * @return image name
+ */
+const char * server_match_name(database_t *db, db_match_t *match)
+{
+	return (match->index != -1)
+		? db->entries[match->index].name
+		: "";
+}
+
+/**
+ * Append a formatted string to a response.
+ *
+ * @param str     pointer to response string, which is reallocated
+ * @param format  printf format string
+ * @return pointer to response string
+ */
+static char * server_append(char *str, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static char * server_append(char *str, const char *format, ...)
+{
+	va_list ap;
+	size_t len = strlen(str);
+
+	va_start(ap, format);
+	int size = vsnprintf(NULL, 0, format, ap);
+	va_end(ap);
+
+	str = (char *)realloc(str, len + size + 1);
+
+	va_start(ap, format);
+	vsnprintf(str + len, size + 1, format, ap);
+	va_end(ap);
+
+	return str;
+}
+
+/**
+ * Set the response of each request of a block to its best
+ * match with each algorithm.
+ *
+ * @param db         pointer to database
+ * @param reqs       pointer to requests
+ * @param num        number of requests
+ * @param match_pca  pointer to db->top_k PCA matches for each request
+ * @param match_lda  pointer to LDA matches, if db->lda
+ * @param match_ica  pointer to ICA2 matches, if db->ica
+ */
+void server_respond_matches(database_t *db, server_request_t **reqs, int num, db_match_t *match_pca, db_match_t *match_lda, db_match_t *match_ica)
+{
+	int k = db->top_k;
+
+	int i;
+	for ( i = 0; i < num; i++ ) {
+		db_match_t *pca = &match_pca[i * k];
+		db_match_t *lda = &match_lda[i * k];
+		db_match_t *ica = &match_ica[i * k];
+
+		char *result_lda = db->lda
+			? server_format("\tLDA\t%d\t%s", lda->class, server_match_name(db, lda))
+			: strdup("");
+		char *result_ica = db->ica
+			? server_format("\t%s\t%d\t%s", db_ica_label(db), ica->class, server_match_name(db, ica))
+			: strdup("");
+
+		reqs[i]->response = server_format("match\tPCA\t%d\t%s%s%s\n", pca->class, server_match_name(db, pca), result_lda, result_ica);
+
+		free(result_lda);
+		free(result_ica);
+	}
+}
+
+/**
+ * Search the projected test images of a project request, and
+ * set its response to the best matches of each test image.
+ *
+ * @param db   pointer to database
+ * @param req  pointer to project request
+ */
+void server_search_projected(database_t *db, server_request_t *req)
+{
+	int num = req->num_projected;
+	int k = db->top_k;
+	db_match_t *matches[3];
+
+	int a;
+	for ( a = 0; a < 3; a++ ) {
+		matches[a] = (db_match_t *)malloc(num * k * sizeof(db_match_t));
+	}
+
+	db_search_block(db, req->projections[0], req->projections[1], req->projections[2], matches[0], matches[1], matches[2]);
+
+	char *response = strdup("");
+
+	int i, j;
+	for ( j = 0; j < num; j++ ) {
+		response = server_append(response, "topk");
+
+		for ( a = 0; a < 3; a++ ) {
+			if ( req->projections[a] == NULL ) {
+				continue;
+			}
+
+			db_match_t *m = &matches[a][j * k];
+			int n = 0;
+
+			while ( n < k && m[n].index != -1 ) {
+				n++;
+			}
+
+			response = server_append(response, "\t%s\t%d", server_label(db, a), n);
+
+			for ( i = 0; i < n; i++ ) {
+				response = server_append(response, "\t%d\t%s\t%.17g", m[i].class, db->entries[m[i].index].name, (double)m[i].dist);
+			}
+		}
+
+		response = server_append(response, "\n");
+	}
+
+	req->response = response;
+
+	for ( a = 0; a < 3; a++ ) {
+		free(matches[a]);
+	}
+}
+
+typedef struct {
+	const char *address;
+	int fd;
+	FILE *in;
+} server_shard_t;
+
+typedef struct {
+	int class;
+	const char *name;
+	double dist;
+	int shard;
+	int rank;
+} server_shard_match_t;
+
+/**
+ * Connect to a shard server, unless it is connected.
+ *
+ * @param shard  pointer to shard
+ */
+void server_shard_open(server_shard_t *shard)
+{
+	if ( shard->fd != -1 ) {
+		return;
+	}
+
+	shard->fd = server_connect(shard->address);
+
+	if ( shard->fd != -1 ) {
+		shard->in = fdopen(shard->fd, "r");
+
+		if ( shard->in == NULL ) {
+			close(shard->fd);
+			shard->fd = -1;
+		}
+	}
+}
+
+/**
+ * Close the connection to a shard server, which is opened
+ * again for the next block.
+ *
+ * @param shard  pointer to shard
+ */
+void server_shard_close(server_shard_t *shard)
+{
+	if ( shard->fd != -1 ) {
+		fclose(shard->in);
+		shard->fd = -1;
+		shard->in = NULL;
+	}
+}
+
+/**
+ * Compare two matches of shards by distance, and then by shard
+ * and rank, so that the merged order of the matches of a shard
+ * is the order of the shard.
+ *
+ * @param a  pointer to match
+ * @param b  pointer to match
+ * @return negative, zero or positive
+ */
+int server_shard_match_compare(const void *a, const void *b)
+{
+	const server_shard_match_t *m_a = (const server_shard_match_t *)a;
+	const server_shard_match_t *m_b = (const server_shard_match_t *)b;
+
+	if ( m_a->dist != m_b->dist ) {
+		return (m_a->dist < m_b->dist) ? -1 : 1;
+	}
+	if ( m_a->shard != m_b->shard ) {
+		return m_a->shard - m_b->shard;
+	}
+
+	return m_a->rank - m_b->rank;
+}
+
+/**
+ * Merge the responses of every shard for a test image into
+ * the response of the test image. The line of each shard is
+ * split into fields in place.
+ *
+ * @param db          pointer to database
+ * @param lines       pointer to response line of each shard
+ * @param num_shards  number of shards
+ * @return pointer to response, or NULL if a line is invalid
+ */
+char * server_shard_merge(database_t *db, char **lines, int num_shards)
+{
+	int k = db->top_k;
+	int uses[] = { 1, db->lda, db->ica };
+	server_shard_match_t *matches[3];
+	int num_matches[3] = { 0, 0, 0 };
+	int valid = 1;
+
+	int a, i, s;
+	for ( a = 0; a < 3; a++ ) {
+		matches[a] = (server_shard_match_t *)malloc(num_shards * k * sizeof(server_shard_match_t));
+	}
+
+	// collect the matches of each shard
+	for ( s = 0; s < num_shards && valid; s++ ) {
+		char *line = lines[s];
+		char *field = strsep(&line, "\t\n");
+
+		valid = (field != NULL && strcmp(field, "topk") == 0);
+
+		for ( a = 0; a < 3 && valid; a++ ) {
+			if ( !uses[a] ) {
+				continue;
+			}
+
+			field = strsep(&line, "\t\n");
+
+			if ( field == NULL || strcmp(field, server_label(db, a)) != 0 ) {
+				valid = 0;
+				break;
+			}
+
+			field = strsep(&line, "\t\n");
+
+			int n = (field != NULL) ? atoi(field) : -1;
+
+			if ( n < 0 || n > k ) {
+				valid = 0;
+				break;
+			}
+
+			for ( i = 0; i < n; i++ ) {
+				char *class = strsep(&line, "\t\n");
+				char *name = strsep(&line, "\t\n");
+				char *dist = strsep(&line, "\t\n");
+
+				if ( class == NULL || name == NULL || dist == NULL ) {
+					valid = 0;
+					break;
+				}
+
+				server_shard_match_t *m = &matches[a][num_matches[a]++];
+				m->class = atoi(class);
+				m->name = name;
+				m->dist = strtod(dist, NULL);
+				m->shard = s;
+				m->rank = i;
+			}
+		}
+	}
+
+	char *response = NULL;
+
+	// merge the matches of the shards, and respond with the best match
+	if ( valid ) {
+		response = strdup("match");
+
+		for ( a = 0; a < 3; a++ ) {
+			if ( !uses[a] ) {
+				continue;
+			}
+
+			qsort(matches[a], num_matches[a], sizeof(server_shard_match_t), server_shard_match_compare);
+
+			response = (num_matches[a] > 0)
+				? server_append(response, "\t%s\t%d\t%s", server_label(db, a), matches[a][0].class, matches[a][0].name)
+				: server_append(response, "\t%s\t%d\t", server_label(db, a), -1);
+		}
+
+		response = server_append(response, "\n");
+	}
+
+	for ( a = 0; a < 3; a++ ) {
+		free(matches[a]);
+	}
+
+	return response;
+}
+
+/**
+ * Recognize a block of test images with the shards of a
+ * sharded database. The block is projected once, and the
+ * projections are sent to every shard as a project request
+ * before the responses are read, so that the shards search
+ * concurrently.
+ *
+ * @param server  pointer to server
+ * @param shards  pointer to connection of each shard
+ * @param T       pointer to block of test images
+ * @param reqs    pointer to request of each test image
+ */
+void server_search_shards(server_t *server, server_shard_t *shards, matrix_t *T, server_request_t **reqs)
+{
+	database_t *db = server->db;
+	int num_shards = server->num_shards;
+	int num = T->cols;
+	matrix_t *P[3];
+
+	db_project_block(db, T, &P[0], &P[1], &P[2]);
+
+	// serialize the projections
+	int rows[3];
+	size_t size = 0;
+
+	int a, i, j, s;
+	for ( a = 0; a < 3; a++ ) {
+		rows[a] = (P[a] != NULL) ? P[a]->rows : 0;
+		size += (size_t)rows[a] * num;
+	}
+
+	char *header = server_format("project %d %d %d %d\n", num, rows[0], rows[1], rows[2]);
+	double *data = (double *)malloc(size * sizeof(double));
+	double *p = data;
+
+	for ( a = 0; a < 3; a++ ) {
+		for ( i = 0; i < rows[a] * num; i++ ) {
+			*p++ = P[a]->data[i];
+		}
+
+		if ( P[a] != NULL ) {
+			m_free(P[a]);
+		}
+	}
+
+	// send the request to every shard
+	int *sent = (int *)calloc(num_shards, sizeof(int));
+
+	for ( s = 0; s < num_shards; s++ ) {
+		server_shard_open(&shards[s]);
+
+		if ( shards[s].fd == -1 ) {
+			continue;
+		}
+
+		if ( write_all(shards[s].fd, header, strlen(header)) != 0
+		  || write_all(shards[s].fd, (const char *)data, size * sizeof(double)) != 0 ) {
+			server_shard_close(&shards[s]);
+			continue;
+		}
+
+		sent[s] = 1;
+	}
+
+	// read the response line of each shard for each test image
+	char **lines = (char **)calloc(num * num_shards, sizeof(char *));
+	char *error = NULL;
+
+	for ( s = 0; s < num_shards; s++ ) {
+		if ( !sent[s] ) {
+			if ( error == NULL ) {
+				error = server_format("error\tshard %s is unavailable\n", shards[s].address);
+			}
+			continue;
+		}
+
+		for ( j = 0; j < num; j++ ) {
+			char **line = &lines[j * num_shards + s];
+			size_t line_size = 0;
+
+			if ( getline(line, &line_size, shards[s].in) <= 0 ) {
+				server_shard_close(&shards[s]);
+
+				if ( error == NULL ) {
+					error = server_format("error\tshard %s is unavailable\n", shards[s].address);
+				}
+				break;
+			}
+
+			// an error is the only response line of the request
+			if ( strncmp(*line, "error\t", 6) == 0 ) {
+				if ( error == NULL ) {
+					error = server_format("error\tshard %s: %s", shards[s].address, *line + 6);
+				}
+				break;
+			}
+		}
+	}
+
+	// merge the responses of the shards for each test image
+	for ( j = 0; j < num; j++ ) {
+		if ( error == NULL ) {
+			reqs[j]->response = server_shard_merge(db, &lines[j * num_shards], num_shards);
+		}
+
+		if ( reqs[j]->response == NULL ) {
+			reqs[j]->response = strdup((error != NULL)
+				? error
+				: "error\tshard sent an invalid response\n");
+		}
+	}
+
+	for ( i = 0; i < num * num_shards; i++ ) {
+		free(lines[i]);
+	}
+
+	free(header);
+	free(data);
+	free(sent);
+	free(lines);
+	free(error);
+}
+
+/**
+ * Recognize requests from the queue until the server shuts down.
+ *
+ * @param arg  pointer to server
+ * @return NULL
+ */
+void * server_worker(void *arg)
+{
+	server_t *server = (server_t *)arg;
+	database_t *db = server->db;
+	int max = db->batch_size;
+
+	server_request_t **reqs = (server_request_t **)malloc(max * sizeof(server_request_t *));
+	server_request_t **valid = (server_request_t **)malloc(max * sizeof(server_request_t *));
+	int k = db->top_k;
+	db_match_t *match_pca = (db_match_t *)malloc(max * k * sizeof(db_match_t));
+	db_match_t *match_lda = (db_match_t *)malloc(max * k * sizeof(db_match_t));
+	db_match_t *match_ica = (db_match_t *)malloc(max * k * sizeof(db_match_t));
+	matrix_t *T = m_initialize(db->num_dimensions, max);
+	image_t *image = image_construct();
+
+	// each worker of a coordinator has its own connection to each shard
+	server_shard_t *shards = (server_shard_t *)malloc(server->num_shards * sizeof(server_shard_t));
+
+	int i;
+	for ( i = 0; i < server->num_shards; i++ ) {
+		shards[i].address = server->shards[i];
+		shards[i].fd = -1;
+		shards[i].in = NULL;
+	}
+
+	int num;
+	while ( (num = queue_pop(&server->queue, (void **)reqs, max)) > 0 ) {
+		PROF_BEGIN(probe);
+
+		// read the images of the block into T
+		PROF_BEGIN(decode);
+
+		int num_valid = 0;
+
+		for ( i = 0; i < num; i++ ) {
+			server_request_t *req = reqs[i];
+			image_t *src = &req->image;
+
+			// a block of projected test images is searched on its own
+			if ( req->num_projected > 0 ) {
+				server_search_projected(db, req);
+				continue;
+			}
+
+			if ( req->path != NULL ) {
+				int error = image_try_read(image, req->path);
+
+				if ( error != 0 ) {
+					req->response = server_format("error\t%s\n", (error == IMAGE_ERROR_TRUNCATED)
+						? "image is truncated"
+						: "cannot read image");
+					continue;
+				}
+
+				src = image;
+			}
+
+			image_preprocess(src, &db->prep);
+
+			if ( src->channels * src->height * src->width != db->num_dimensions ) {
+				req->response = server_format("error\timage has %d x %d x %d pixels, expected %d\n",
+					src->width, src->height, src->channels, db->num_dimensions);
+				continue;
+			}
+
+			m_image_read(T, num_valid, src);
+			valid[num_valid++] = req;
+		}
+
+		PROF_END(decode, PROF_REC_DECODE);
+
+		// recognize the block
+		if ( num_valid > 0 ) {
+			T->cols = num_valid;
+
+			if ( server->num_shards > 0 ) {
+				server_search_shards(server, shards, T, valid);
+			}
+			else {
+				db_recognize_block(db, T, match_pca, match_lda, match_ica);
+				server_respond_matches(db, valid, num_valid, match_pca, match_lda, match_ica);
+			}
+
+			T->cols = max;
+		}
+
+		PROF_LATENCY(probe, num);
+
+		for ( i = 0; i < num; i++ ) {
+			server_complete(reqs[i]);
+		}
+	}
+
+	for ( i = 0; i < server->num_shards; i++ ) {
+		server_shard_close(&shards[i]);
+	}
+
+	free(reqs);
+	free(valid);
+	free(match_pca);
+	free(match_lda);
+	free(match_ica);
+	free(shards);
+	m_free(T);
+	image_destruct(image);
+
+	return NULL;
+}
+
+/**
+ * Read the projections of a project request, which must have
+ * the dimensions of the projection matrices of the database.
+ * Otherwise the response of the request is set to an error.
+ *
+ * @param conn  pointer to connection
+ * @param req   pointer to request
+ * @param num   number of test images
+ * @param rows  number of rows of each projection
+ * @return 0 on success, -1 if the input ends
+ */
+int server_read_projections(server_conn_t *conn, server_request_t *req, int num, const int *rows)
+{
+	database_t *db = conn->server->db;
+	matrix_t *W_tr[] = {
+		db->W_pca_tr,
+		db->lda ? db->W_lda_tr : NULL,
+		db->ica ? db->W_ica_tr : NULL
+	};
+
+	double *data = (double *)malloc((size_t)num * (rows[0] + rows[1] + rows[2]) * sizeof(double));
+	double *p = data;
+
+	req->num_projected = num;
+
+	int a, i;
+	for ( a = 0; a < 3; a++ ) {
+		size_t size = (size_t)num * rows[a];
+
+		if ( fread(p, sizeof(double), size, conn->in) != size ) {
+			free(data);
+			return -1;
+		}
+
+		if ( rows[a] != ((W_tr[a] != NULL) ? W_tr[a]->rows : 0) ) {
+			if ( req->response == NULL ) {
+				req->response = server_format("error\t%s projection has %d rows, expected %d\n",
+					server_label(db, a), rows[a], (W_tr[a] != NULL) ? W_tr[a]->rows : 0);
+			}
+		}
+		else if ( rows[a] > 0 ) {
+			req->projections[a] = m_initialize(rows[a], num);
+
+			for ( i = 0; i < rows[a] * num; i++ ) {
+				req->projections[a]->data[i] = p[i];
+			}
+		}
+
+		p += size;
+	}
+
+	free(data);
+
+	return 0;
+}
+
+/**
+ * Read the requests of a connection until the end of its input.
+ *
+ * @param arg  pointer to connection
+ * @return NULL
+ */
+void * server_reader(void *arg)
+{
+	server_conn_t *conn = (server_conn_t *)arg;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+
+	while ( (len = getline(&line, &line_size, conn->in)) > 0 ) {
+		// strip the line ending
+		while ( len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r') ) {
+			line[--len] = '\0';
+		}
+
+		if ( len == 0 ) {
+			continue;
+		}
+
+		server_request_t *req = (server_request_t *)calloc(1, sizeof(server_request_t));
+		req->conn = conn;
+
+		if ( strncmp(line, "raw ", 4) == 0 ) {
+			int width, height, channels;
+
+			if ( sscanf(line + 4, "%d %d %d", &width, &height, &channels) != 3
+			  || width < 1 || height < 1 || (channels != 1 && channels != 3)
+			  || (size_t)width * height * channels > SERVER_MAX_RAW_SIZE ) {
+				// the size of the pixels is unknown, so the rest of
+				// the input cannot be parsed
+				req->response = server_format("error\tinvalid raw request\n");
+				server_conn_append(req);
+				server_complete(req);
+				break;
+			}
+
+			size_t size = (size_t)width * height * channels;
+
+			req->image.channels = channels;
+			req->image.height = height;
+			req->image.width = width;
+			req->image.max_value = 255;
+			req->image.pixels = (unsigned char *)malloc(size);
+
+			if ( fread(req->image.pixels, 1, size, conn->in) != size ) {
+				free(req->image.pixels);
+				free(req);
+				break;
+			}
+		}
+		else if ( strncmp(line, "project ", 8) == 0 ) {
+			int num;
+			int rows[3];
+
+			if ( sscanf(line + 8, "%d %d %d %d", &num, &rows[0], &rows[1], &rows[2]) != 4
+			  || num < 1 || rows[0] < 0 || rows[1] < 0 || rows[2] < 0
+			  || (size_t)num * (rows[0] + rows[1] + rows[2]) * sizeof(double) > SERVER_MAX_RAW_SIZE ) {
+				req->response = server_format("error\tinvalid project request\n");
+				server_conn_append(req);
+				server_complete(req);
+				break;
+			}
+
+			if ( server_read_projections(conn, req, num, rows) != 0 ) {
+				server_request_free(req);
+				break;
+			}
+
+			// a request with a different basis is answered without
+			// being searched
+			if ( req->response != NULL ) {
+				server_conn_append(req);
+				server_complete(req);
+				continue;
+			}
+		}
+		else {
+			req->path = strdup(line);
+		}
+
+		server_conn_append(req);
+		queue_push(&conn->server->queue, req);
+	}
+
+	free(line);
+
+	server_conn_close(conn);
+
+	return NULL;
+}
+
+/**
+ * Serve recognition requests for a database.
+ *
+ * If the address is "-", requests are read from standard input
+ * and responses are written to standard output until the end of
+ * the input. Otherwise, connections are accepted on a socket
+ * until the process is terminated.
+ *
+ * If a list of shard servers is given, the database only
+ * provides the mean face and projection matrices, and the test
+ * images are searched by the shards.
+ *
+ * @param db           pointer to database
+ * @param address      "-", "unix:PATH", "tcp:PORT" or "tcp:HOST:PORT"
+ * @param shards       comma-separated addresses of shard servers, or NULL
+ * @param num_workers  number of worker threads
+ * @param queue_size   maximum number of queued requests
+ */
+void db_serve(database_t *db, const char *address, const char *shards, int num_workers, int queue_size)
+{
+	server_t server = {
+		.db = db,
+		.shards = NULL,
+		.num_shards = 0,
+		.num_conns = 0
+	};
+
+	queue_init(&server.queue, queue_size);
+	pthread_mutex_init(&server.lock, NULL);
+	pthread_cond_init(&server.no_conns, NULL);
+
+	// a client which disconnects must not terminate the server
+	signal(SIGPIPE, SIG_IGN);
+
+	// parse the addresses of the shards, which must be reachable
+	char *shard_list = (shards != NULL) ? strdup(shards) : NULL;
+
+	if ( shard_list != NULL ) {
+		char *rest = shard_list;
+		char *shard;
+
+		while ( (shard = strsep(&rest, ",")) != NULL ) {
+			int fd = server_connect(shard);
+
+			if ( fd == -1 ) {
+				fprintf(stderr, "error: cannot connect to shard \'%s\'\n", shard);
+				exit(1);
+			}
+
+			close(fd);
+
+			server.shards = (char **)realloc(server.shards, (server.num_shards + 1) * sizeof(char *));
+			server.shards[server.num_shards++] = shard;
+		}
+	}
+
+	fflush(stdout);
+
+	// start the workers
+	worker_pool_t workers;
+
+	worker_pool_start(&workers, num_workers, server_worker, &server);
+
+	if ( strcmp(address, "-") == 0 ) {
+		// serve standard input until every response is written
+		server_conn_t *conn = server_conn_construct(&server, stdin, STDOUT_FILENO, 0);
+
+		server_reader(conn);
+
+		pthread_mutex_lock(&server.lock);
+		while ( server.num_conns > 0 ) {
+			pthread_cond_wait(&server.no_conns, &server.lock);
+		}
+		pthread_mutex_unlock(&server.lock);
+	}
+	else {
+		int fd = server_listen(address);
+
+		fprintf(stderr, "listening on %s\n", address);
+
+		while ( 1 ) {
+			int client = accept(fd, NULL, NULL);
+
+			if ( client == -1 ) {
+				if ( errno == EINTR || errno == ECONNABORTED ) {
+					continue;
+				}
+
+				perror("accept");
+				exit(1);
+			}
+
+			FILE *in = fdopen(client, "r");
+
+			if ( in == NULL ) {
+				close(client);
+				continue;
+			}
+
+			server_conn_t *conn = server_conn_construct(&server, in, client, 1);
+			pthread_t thread;
+
+			if ( pthread_create(&thread, NULL, server_reader, conn) != 0 ) {
+				perror("pthread_create");
+				exit(1);
+			}
+
+			pthread_detach(thread);
+		}
+	}
+
+	// stop the workers
+	queue_close(&server.queue);
+	worker_pool_join(&workers);
+	queue_destroy(&server.queue);
+
+	free(server.shards);
+	free(shard_list);
+
+	pthread_mutex_destroy(&server.lock);
+	pthread_cond_destroy(&server.no_conns);
+}
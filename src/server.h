@@ -0,0 +1,19 @@
+/**
+ * @file server.h
+ *
+ * Interface definitions for the recognition server.
+ */
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "database.h"
+
+/**
+ * Default number of requests which can wait in the queue.
+ */
+#define DEFAULT_QUEUE_SIZE 64
+
+int server_connect(const char *address);
+void db_serve(database_t *db, const char *address, const char *shards, int num_workers, int queue_size);
+
+#endif
@@ -0,0 +1,203 @@
+/**
+ * @file shard.c
+ *
+ * Implementation of database sharding.
+ *
+ * A trained database is split into shard files which share the
+ * mean face and projection matrices of the database, and each
+ * of which has a subset of the projected images and their
+ * entries. Each shard is served by its own recognition server,
+ * and a coordinator with the same basis projects each test image
+ * once and merges the best matches of every shard (see server.c).
+ *
+ * The images of a class are kept together in one shard, so that
+ * the matches of every shard, which are aggregated by class and
+ * filtered with the rejection thresholds independently, merge
+ * into the same matches as a search of the whole database. The
+ * entries of each shard keep the class indices of the database.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "database.h"
+
+typedef struct {
+	int class;
+	int count;
+} shard_class_t;
+
+/**
+ * Compare two classes by decreasing size, and then by index.
+ *
+ * @param a  pointer to class
+ * @param b  pointer to class
+ * @return negative, zero or positive
+ */
+int shard_class_compare(const void *a, const void *b)
+{
+	const shard_class_t *c_a = (const shard_class_t *)a;
+	const shard_class_t *c_b = (const shard_class_t *)b;
+
+	if ( c_a->count != c_b->count ) {
+		return c_b->count - c_a->count;
+	}
+
+	return c_a->class - c_b->class;
+}
+
+/**
+ * Assign each class of a database to a shard. The classes are
+ * sorted once by decreasing size, and each is assigned in turn
+ * to the shard with the fewest images.
+ *
+ * @param db          pointer to database
+ * @param num_shards  number of shards
+ * @param shards      pointer to store shard index of each class
+ */
+void shard_assign_classes(database_t *db, int num_shards, int *shards)
+{
+	shard_class_t *classes = (shard_class_t *)malloc(db->num_classes * sizeof(shard_class_t));
+	int *loads = (int *)calloc(num_shards, sizeof(int));
+
+	int i, j;
+	for ( i = 0; i < db->num_classes; i++ ) {
+		classes[i].class = i;
+		classes[i].count = 0;
+		shards[i] = -1;
+	}
+
+	for ( i = 0; i < db->num_images; i++ ) {
+		classes[db->entries[i].class].count++;
+	}
+
+	qsort(classes, db->num_classes, sizeof(shard_class_t), shard_class_compare);
+
+	// assign each class with images to the shard with the fewest images
+	for ( i = 0; i < db->num_classes && classes[i].count > 0; i++ ) {
+		int s = 0;
+
+		for ( j = 1; j < num_shards; j++ ) {
+			if ( loads[j] < loads[s] ) {
+				s = j;
+			}
+		}
+
+		shards[classes[i].class] = s;
+		loads[s] += classes[i].count;
+	}
+
+	free(classes);
+	free(loads);
+}
+
+/**
+ * Copy the columns of a projected image matrix which belong
+ * to a shard.
+ *
+ * @param P        pointer to projected image matrix
+ * @param columns  pointer to column indices of the shard
+ * @param num      number of columns
+ * @return pointer to new matrix
+ */
+matrix_t * shard_copy_columns(matrix_t *P, int *columns, int num)
+{
+	matrix_t *P_shard = m_initialize(P->rows, num);
+
+	int i, j;
+	for ( j = 0; j < num; j++ ) {
+		for ( i = 0; i < P->rows; i++ ) {
+			elem(P_shard, i, j) = elem(P, i, columns[j]);
+		}
+	}
+
+	return P_shard;
+}
+
+/**
+ * Split a database file into num_shards shard files, which
+ * are saved as PATH.0, PATH.1, and so on.
+ *
+ * Each shard has the same representations as the database:
+ * a quantized matrix or an ANN index is rebuilt for the images
+ * of the shard if the database has one.
+ *
+ * @param db          pointer to empty database
+ * @param path        path of database file
+ * @param num_shards  number of shards
+ */
+void db_split(database_t *db, const char *path, int num_shards)
+{
+	db_load_all(db, path);
+
+	if ( num_shards < 1 || num_shards > db->num_classes ) {
+		fprintf(stderr, "error: number of shards must be between 1 and the number of classes (%d)\n", db->num_classes);
+		exit(1);
+	}
+
+	int *shards = (int *)malloc(db->num_classes * sizeof(int));
+	int *columns = (int *)malloc(db->num_images * sizeof(int));
+	char *path_shard = (char *)malloc(strlen(path) + 16);
+
+	shard_assign_classes(db, num_shards, shards);
+
+	int s;
+	for ( s = 0; s < num_shards; s++ ) {
+		// find the images of the shard
+		int num = 0;
+
+		int i;
+		for ( i = 0; i < db->num_images; i++ ) {
+			if ( shards[db->entries[i].class] == s ) {
+				columns[num++] = i;
+			}
+		}
+
+		// construct the shard with the basis of the database
+		database_t *shard = db_construct(db->lda, db->ica);
+		shard->num_classes = db->num_classes;
+		shard->num_images = num;
+		shard->num_dimensions = db->num_dimensions;
+		shard->image_width = db->image_width;
+		shard->image_height = db->image_height;
+		shard->image_channels = db->image_channels;
+		shard->prep = db->prep;
+		shard->ica_params.architecture = db->ica_params.architecture;
+		shard->precision = db->file->header->precision;
+		shard->quantize = (db->Q_pca != NULL);
+		shard->ann = (db->H_pca != NULL);
+
+		shard->entries = (database_entry_t *)malloc(num * sizeof(database_entry_t));
+
+		for ( i = 0; i < num; i++ ) {
+			shard->entries[i].class = db->entries[columns[i]].class;
+			shard->entries[i].name = strdup(db->entries[columns[i]].name);
+		}
+
+		shard->mean_face = m_copy(db->mean_face);
+		shard->W_pca_tr = m_copy(db->W_pca_tr);
+		shard->P_pca = shard_copy_columns(db->P_pca, columns, num);
+
+		if ( db->lda ) {
+			shard->W_lda_tr = m_copy(db->W_lda_tr);
+			shard->P_lda = shard_copy_columns(db->P_lda, columns, num);
+		}
+
+		if ( db->ica ) {
+			shard->W_ica_tr = m_copy(db->W_ica_tr);
+			shard->P_ica = shard_copy_columns(db->P_ica, columns, num);
+		}
+
+		db_train_index(shard);
+
+		sprintf(path_shard, "%s.%d", path, s);
+		db_save(shard, path_shard);
+
+		printf("%s: %d images\n", path_shard, num);
+
+		db_destruct(shard);
+	}
+
+	free(shards);
+	free(columns);
+	free(path_shard);
+}
@@ -0,0 +1,878 @@
+/**
+ * @file test_database.c
+ *
+ * Test suite for the training and search algorithms of the
+ * face database.
+ *
+ * Each test prints its result and whether it passed, and the
+ * suite exits with a nonzero status if any test failed.
+ */
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "database.h"
+#include "pipeline.h"
+#include "server.h"
+
+typedef int (*test_func_t)(void);
+
+/**
+ * Helper function to fill a matrix with samples of a Laplace
+ * distribution, which are non-Gaussian sources for ICA.
+ */
+void fill_laplace(matrix_t *M, unsigned int *seed)
+{
+	int i;
+	for ( i = 0; i < M->rows * M->cols; i++ ) {
+		double u = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+
+		M->data[i] = (u < 0.5)
+			? log(2 * u)
+			: -log(2 - 2 * u);
+	}
+}
+
+/**
+ * Helper function to fill a matrix with uniform samples in [-1, 1].
+ */
+void fill_uniform(matrix_t *M, unsigned int *seed)
+{
+	int i;
+	for ( i = 0; i < M->rows * M->cols; i++ ) {
+		M->data[i] = 2.0 * rand_r(seed) / RAND_MAX - 1;
+	}
+}
+
+/**
+ * Helper function to print whether a test passed.
+ */
+int check(const char *name, int passed)
+{
+	printf("%s: %s\n", name, passed ? "PASS" : "FAIL");
+
+	return passed;
+}
+
+/**
+ * Get the relative difference norm(A - B) / norm(A) of two matrices.
+ */
+precision_t relative_difference(matrix_t *A, matrix_t *B)
+{
+	precision_t norm_A = 0;
+	precision_t norm_dA = 0;
+
+	int i;
+	for ( i = 0; i < A->rows * A->cols; i++ ) {
+		norm_A += A->data[i] * A->data[i];
+		norm_dA += (A->data[i] - B->data[i]) * (A->data[i] - B->data[i]);
+	}
+
+	return sqrt(norm_dA / norm_A);
+}
+
+/**
+ * Helper function to check that every element of a matrix is finite.
+ */
+int is_finite(matrix_t *M)
+{
+	int i;
+	for ( i = 0; i < M->rows * M->cols; i++ ) {
+		if ( !isfinite(M->data[i]) ) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * Helper function to mix independent sources into an
+ * observation matrix with a random mixing matrix.
+ */
+matrix_t * mixed_sources(int n, int num_samples, unsigned int *seed)
+{
+	matrix_t *S = m_initialize(n, num_samples);
+	matrix_t *A = m_initialize(n, n);
+
+	fill_laplace(S, seed);
+	fill_uniform(A, seed);
+
+	matrix_t *X = m_product(A, S);
+	matrix_t *mean = m_mean_column(X);
+
+	m_subtract_columns(X, mean);
+
+	m_free(S);
+	m_free(A);
+	m_free(mean);
+
+	return X;
+}
+
+/**
+ * Helper function to create an image of a class, which is the
+ * center of the class plus uniform noise.
+ */
+image_t * class_image(int class, int width, int height, unsigned int *seed)
+{
+	image_t *image = image_construct();
+	image->channels = 1;
+	image->height = height;
+	image->width = width;
+	image->max_value = 255;
+	image->pixels = (unsigned char *)malloc(width * height);
+
+	unsigned int class_seed = class + 1;
+
+	int i;
+	for ( i = 0; i < width * height; i++ ) {
+		int center = 32 + rand_r(&class_seed) % 192;
+		int noise = rand_r(seed) % 33 - 16;
+
+		image->pixels[i] = center + noise;
+	}
+
+	return image;
+}
+
+/**
+ * Helper function to train a PCA database with synthetic images
+ * of several classes and save it to a temporary file.
+ *
+ * @param path         buffer of at least 32 bytes to store the path
+ * @param num_classes  number of classes
+ * @param num_images   number of images per class
+ * @param width        image width
+ * @param height       image height
+ * @param ann          whether to store an HNSW index
+ */
+void synthetic_database(char *path, int num_classes, int num_images, int width, int height, int ann)
+{
+	unsigned int seed = 1;
+
+	database_t *db = db_construct(0, 0);
+	db->ann = ann;
+	db->num_classes = num_classes;
+	db->num_images = num_classes * num_images;
+	db->entries = (database_entry_t *)malloc(db->num_images * sizeof(database_entry_t));
+	db->image_width = width;
+	db->image_height = height;
+	db->image_channels = 1;
+
+	matrix_t *X = m_initialize(width * height, db->num_images);
+
+	int i;
+	for ( i = 0; i < db->num_images; i++ ) {
+		image_t *image = class_image(i / num_images, width, height, &seed);
+
+		db->entries[i].class = i / num_images;
+		db->entries[i].name = (char *)malloc(32);
+		sprintf(db->entries[i].name, "s%02d/%d.pgm", i / num_images + 1, i % num_images + 1);
+
+		m_image_read(X, i, image);
+		image_destruct(image);
+	}
+
+	db_train_matrix(db, X);
+
+	strcpy(path, "/tmp/test-database-XXXXXX");
+	close(mkstemp(path));
+
+	db_save(db, path);
+	db_destruct(db);
+}
+
+/**
+ * Test that Infomax on several threads converges to the weights
+ * of Infomax on one thread.
+ */
+int test_infomax_threads()
+{
+	const int N = 10;
+	const int NUM_THREADS = 8;
+	const precision_t TOLERANCE = 0.05;
+
+	unsigned int seed = 1;
+	matrix_t *X = mixed_sources(N, 4000, &seed);
+	matrix_t *W_pca_tr = m_identity(N);
+
+	ica_params_t params = {
+		.architecture = 2,
+		.engine = ICA_ENGINE_INFOMAX,
+		.tolerance = 1e-6,
+		.num_threads = 1
+	};
+
+	matrix_t *W_1 = ICA2(W_pca_tr, X, &params, NULL);
+
+	params.num_threads = NUM_THREADS;
+
+	matrix_t *W_n = ICA2(W_pca_tr, X, &params, NULL);
+
+	precision_t diff = relative_difference(W_1, W_n);
+
+	printf("norm(W_1 - W_%d) / norm(W_1) = %g\n", NUM_THREADS, diff);
+
+	m_free(X);
+	m_free(W_pca_tr);
+	m_free(W_1);
+	m_free(W_n);
+
+	return check("infomax threads", isfinite(diff) && diff < TOLERANCE);
+}
+
+/**
+ * Test that Infomax converges for ICA2 with all n - 1 PCA
+ * components of n images, whose sphered images are nearly
+ * orthogonal, instead of diverging in every stage.
+ */
+int test_infomax_components()
+{
+	const int NUM_PIXELS = 200;
+	const int NUM_IMAGES = 101;
+
+	unsigned int seed = 1;
+	matrix_t *X = m_initialize(NUM_PIXELS, NUM_IMAGES);
+
+	// use heavy-tailed pixels, which make Infomax diverge sooner
+	fill_laplace(X, &seed);
+
+	int i;
+	for ( i = 0; i < X->rows * X->cols; i++ ) {
+		X->data[i] = X->data[i] * X->data[i] * X->data[i];
+	}
+
+	matrix_t *mean = m_mean_column(X);
+	m_subtract_columns(X, mean);
+
+	matrix_t *W_pca_tr = PCA(X, 0, 0);
+	matrix_t *P_pca = m_product(W_pca_tr, X);
+
+	FILE *progress = tmpfile();
+	ica_params_t params = {
+		.architecture = 2,
+		.engine = ICA_ENGINE_INFOMAX,
+		.tolerance = 1e-6,
+		.num_threads = 1,
+		.progress = progress
+	};
+
+	matrix_t *P_ica;
+	matrix_t *W_ica_tr = ICA2(W_pca_tr, P_pca, &params, &P_ica);
+
+	// read the progress of the last sweep
+	char line[256] = "";
+
+	rewind(progress);
+	while ( fgets(line, sizeof(line), progress) != NULL );
+	fclose(progress);
+
+	int diverged = (strstr(line, "\"diverged\"") != NULL);
+
+	printf("%d components, last sweep: %s", W_pca_tr->rows, line);
+
+	int passed = W_pca_tr->rows == NUM_IMAGES - 1 && !diverged && is_finite(P_ica);
+
+	m_free(X);
+	m_free(mean);
+	m_free(W_pca_tr);
+	m_free(P_pca);
+	m_free(P_ica);
+	m_free(W_ica_tr);
+
+	return check("infomax components", passed);
+}
+
+/**
+ * Test that the HNSW index finds most of the exact nearest
+ * neighbors of a search with --exact.
+ */
+int test_ann_recall()
+{
+	const int NUM_TESTS = 100;
+	const int K = 10;
+	const int EF = 16;
+	const precision_t MIN_RECALL = 0.9;
+
+	char path[32];
+	synthetic_database(path, 50, 20, 8, 8, 1);
+
+	database_t *db = db_construct(0, 0);
+	db_load(db, path);
+	db->top_k = K;
+	db->ef = EF;
+
+	// project the test images
+	matrix_t *T = m_initialize(db->num_dimensions, NUM_TESTS);
+	unsigned int seed = 4;
+
+	int i, j, l;
+	for ( i = 0; i < NUM_TESTS; i++ ) {
+		image_t *image = class_image(i % 50, 8, 8, &seed);
+
+		m_image_read(T, i, image);
+		image_destruct(image);
+	}
+
+	matrix_t *P_pca, *P_lda, *P_ica;
+	db_project_block(db, T, &P_pca, &P_lda, &P_ica);
+
+	// search with the index and with every image
+	db_match_t *match_ann = (db_match_t *)malloc(NUM_TESTS * K * sizeof(db_match_t));
+	db_match_t *match_exact = (db_match_t *)malloc(NUM_TESTS * K * sizeof(db_match_t));
+
+	db_search_block(db, P_pca, NULL, NULL, match_ann, NULL, NULL);
+
+	db->exact = 1;
+	db_search_block(db, P_pca, NULL, NULL, match_exact, NULL, NULL);
+
+	// count the exact matches which the index found
+	int num_found = 0;
+
+	for ( i = 0; i < NUM_TESTS; i++ ) {
+		for ( j = 0; j < K; j++ ) {
+			for ( l = 0; l < K; l++ ) {
+				if ( match_ann[i * K + l].index == match_exact[i * K + j].index ) {
+					num_found++;
+					break;
+				}
+			}
+		}
+	}
+
+	precision_t recall = (precision_t) num_found / (NUM_TESTS * K);
+
+	printf("HNSW index: %s, recall@%d with ef = %d: %g\n", (db->H_pca != NULL) ? "yes" : "no", K, EF, recall);
+
+	int passed = (db->H_pca != NULL && recall >= MIN_RECALL);
+
+	free(match_ann);
+	free(match_exact);
+	m_free(T);
+	m_free(P_pca);
+	db_destruct(db);
+	remove(path);
+
+	return check("ann recall", passed);
+}
+
+/**
+ * Test that a search of the int8-quantized gallery, re-ranked
+ * with exact distances, finds the same best match as a search
+ * of every image with exact distances.
+ */
+int test_quantized_rerank()
+{
+	const int NUM_TESTS = 100;
+
+	char path[32];
+	synthetic_database(path, 50, 20, 8, 8, 0);
+
+	database_t *db = db_construct(0, 0);
+	db_load(db, path);
+
+	// project the test images
+	matrix_t *T = m_initialize(db->num_dimensions, NUM_TESTS);
+	unsigned int seed = 5;
+
+	int i;
+	for ( i = 0; i < NUM_TESTS; i++ ) {
+		image_t *image = class_image(i % 50, 8, 8, &seed);
+
+		m_image_read(T, i, image);
+		image_destruct(image);
+	}
+
+	matrix_t *P_pca, *P_lda, *P_ica;
+	db_project_block(db, T, &P_pca, &P_lda, &P_ica);
+
+	// search every image, and then the quantized gallery
+	db_match_t match_exact[NUM_TESTS];
+	db_match_t match_quantized[NUM_TESTS];
+
+	db_search_block(db, P_pca, NULL, NULL, match_exact, NULL, NULL);
+
+	db->Q_pca = q_quantize(db->P_pca);
+	db_search_block(db, P_pca, NULL, NULL, match_quantized, NULL, NULL);
+
+	int num_equal = 0;
+
+	for ( i = 0; i < NUM_TESTS; i++ ) {
+		num_equal += (match_quantized[i].index == match_exact[i].index
+			&& match_quantized[i].dist == match_exact[i].dist);
+	}
+
+	printf("%d of %d best matches of the quantized gallery with rerank = %d are exact\n", num_equal, NUM_TESTS, db->rerank);
+
+	m_free(T);
+	m_free(P_pca);
+	db_destruct(db);
+	remove(path);
+
+	return check("quantized rerank", num_equal == NUM_TESTS);
+}
+
+/**
+ * Helper function to search a gallery for one test vector and
+ * store the index and class of each of the top_k matches.
+ */
+void search_gallery(database_t *db, matrix_t *P_test, int *indices, int *classes)
+{
+	db_match_t *matches = (db_match_t *)malloc(db->top_k * sizeof(db_match_t));
+
+	db_search_block(db, P_test, NULL, NULL, matches, NULL, NULL);
+
+	int j;
+	for ( j = 0; j < db->top_k; j++ ) {
+		indices[j] = matches[j].index;
+		classes[j] = matches[j].class;
+	}
+
+	free(matches);
+}
+
+/**
+ * Test top-k matches, class aggregation and the rejection
+ * threshold on a gallery whose best image belongs to a class
+ * which is farther on average than another class.
+ */
+int test_match_options()
+{
+	// 1-D gallery: class 0 has one close image and two far
+	// images, class 1 has three images at the same distance
+	precision_t gallery[] = { 1, 9, 9, 2.5, 2.5, 2.5 };
+	int gallery_classes[] = { 0, 0, 0, 1, 1, 1 };
+
+	database_t *db = db_construct(0, 0);
+	db->num_classes = 2;
+	db->num_images = 6;
+	db->entries = (database_entry_t *)calloc(db->num_images, sizeof(database_entry_t));
+	db->P_pca = m_initialize(1, db->num_images);
+
+	int i;
+	for ( i = 0; i < db->num_images; i++ ) {
+		db->entries[i].class = gallery_classes[i];
+		elem(db->P_pca, 0, i) = gallery[i];
+	}
+
+	db->P_pca_norm = m_norm_columns(db->P_pca);
+
+	matrix_t *P_test = m_zeros(1, 1);
+	int indices[2];
+	int classes[2];
+	int passed = 1;
+
+	// the best image, and the two best images
+	search_gallery(db, P_test, indices, classes);
+	printf("best image: %d (class %d)\n", indices[0], classes[0]);
+	passed &= (indices[0] == 0);
+
+	db->top_k = 2;
+	search_gallery(db, P_test, indices, classes);
+	printf("top 2 images: %d, %d\n", indices[0], indices[1]);
+	passed &= (indices[0] == 0 && indices[1] == 3);
+
+	// the best class by its best image, and by its mean distance
+	db->top_k = 1;
+	db->aggregate = AGGREGATE_BEST;
+	search_gallery(db, P_test, indices, classes);
+	printf("best class by best image: %d\n", classes[0]);
+	passed &= (classes[0] == 0);
+
+	db->aggregate = AGGREGATE_MEAN;
+	search_gallery(db, P_test, indices, classes);
+	printf("best class by mean distance: %d\n", classes[0]);
+	passed &= (classes[0] == 1);
+
+	// the threshold compares squared L2 distances, which are
+	// 1 for image 0 and 6.25 for images 3 to 5
+	db->aggregate = AGGREGATE_NONE;
+	db->top_k = 2;
+	db->threshold_pca = 4;
+	search_gallery(db, P_test, indices, classes);
+	printf("top 2 images within 4: %d, %d\n", indices[0], indices[1]);
+	passed &= (indices[0] == 0 && indices[1] == -1);
+
+	db->threshold_pca = 0.5;
+	search_gallery(db, P_test, indices, classes);
+	printf("top 2 images within 0.5: %d, %d\n", indices[0], indices[1]);
+	passed &= (indices[0] == -1 && indices[1] == -1);
+
+	m_free(P_test);
+	db_destruct(db);
+
+	return check("match options", passed);
+}
+
+/**
+ * Helper function to store the class of a pipeline result.
+ */
+void store_class(void *arg, void *tag, const pipeline_result_t *result)
+{
+	int *classes = (int *)arg;
+
+	classes[(long)tag] = result->classes[0];
+}
+
+/**
+ * Test that a pipeline recognizes each submitted image, and
+ * rejects an image with the wrong size without stopping.
+ */
+int test_pipeline()
+{
+	const int NUM_CLASSES = 5;
+	const int NUM_IMAGES = 20;
+
+	char path[32];
+	synthetic_database(path, NUM_CLASSES, 4, 8, 8, 0);
+
+	int classes[NUM_IMAGES];
+	pipeline_t *pipeline = pipeline_open(path, 0, 0, 2, 4, 3, store_class, classes);
+	unsigned int seed = 2;
+	int num_rejected = 0;
+
+	long i;
+	for ( i = 0; i < NUM_IMAGES; i++ ) {
+		image_t *image = class_image(i % NUM_CLASSES, 8, 8, &seed);
+
+		classes[i] = -1;
+		pipeline_submit(pipeline, image, (void *)i);
+
+		if ( i % 7 == 0 ) {
+			image_t *bad_image = class_image(0, 4, 4, &seed);
+
+			num_rejected += (pipeline_submit(pipeline, bad_image, NULL) == -1);
+			image_destruct(bad_image);
+		}
+	}
+
+	pipeline_close(pipeline);
+	remove(path);
+
+	int num_correct = 0;
+
+	for ( i = 0; i < NUM_IMAGES; i++ ) {
+		num_correct += (classes[i] == i % NUM_CLASSES);
+	}
+
+	printf("%d of %d images correct, %d of 3 bad images rejected\n", num_correct, NUM_IMAGES, num_rejected);
+
+	return check("pipeline", num_correct == NUM_IMAGES && num_rejected == 3);
+}
+
+/**
+ * Helper function to start a recognition server for a database
+ * file in a child process, which returns the 3 best matches of
+ * each request.
+ *
+ * @param path     path of database file
+ * @param address  address of server
+ * @param shards   comma-separated addresses of shard servers, or NULL
+ * @param pid      pointer to store process id of server
+ * @return socket connected to the server, or -1 on failure
+ */
+int start_server(const char *path, const char *address, const char *shards, pid_t *pid)
+{
+	fflush(stdout);
+
+	*pid = fork();
+
+	if ( *pid == 0 ) {
+		database_t *db = db_construct(0, 0);
+		db->batch_size = 3;
+		db->top_k = 3;
+
+		db_load(db, path);
+		db_serve(db, address, shards, 2, 4);
+		exit(0);
+	}
+
+	int fd;
+	int i;
+	for ( i = 0; (fd = server_connect(address)) == -1 && i < 500; i++ ) {
+		usleep(10000);
+	}
+
+	return fd;
+}
+
+/**
+ * Helper function to stop a recognition server.
+ */
+void stop_server(pid_t pid, const char *address)
+{
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	remove(address + strlen("unix:"));
+}
+
+typedef struct {
+	int fd;
+	int num_requests;
+} server_client_t;
+
+/**
+ * Helper function to send raw requests of class images to a
+ * server, followed by a request for a missing image.
+ */
+void * send_requests(void *arg)
+{
+	server_client_t *client = (server_client_t *)arg;
+	unsigned int seed = 3;
+
+	int i;
+	for ( i = 0; i < client->num_requests; i++ ) {
+		image_t *image = class_image(i % 5, 8, 8, &seed);
+		const char *header = "raw 8 8 1\n";
+
+		if ( write(client->fd, header, strlen(header)) == -1
+		  || write(client->fd, image->pixels, 64) == -1 ) {
+			perror("write");
+		}
+
+		image_destruct(image);
+	}
+
+	const char *missing = "/nonexistent/image.pgm\n";
+
+	if ( write(client->fd, missing, strlen(missing)) == -1 ) {
+		perror("write");
+	}
+
+	shutdown(client->fd, SHUT_WR);
+
+	return NULL;
+}
+
+/**
+ * Helper function to send the requests of send_requests() to a
+ * server, which sends every request before it reads a response,
+ * and read the responses until the server closes the connection.
+ *
+ * @param fd            socket connected to the server
+ * @param num_requests  number of raw requests
+ * @param responses     pointer to store num_requests + 1 response lines
+ * @return number of response lines
+ */
+int query_server(int fd, int num_requests, char **responses)
+{
+	server_client_t client = { fd, num_requests };
+	pthread_t thread;
+
+	pthread_create(&thread, NULL, send_requests, &client);
+
+	FILE *in = fdopen(fd, "r");
+	char *line = NULL;
+	size_t line_size = 0;
+	int num_lines = 0;
+
+	while ( getline(&line, &line_size, in) > 0 ) {
+		if ( num_lines < num_requests + 1 ) {
+			responses[num_lines] = strdup(line);
+		}
+
+		num_lines++;
+	}
+
+	pthread_join(thread, NULL);
+	fclose(in);
+	free(line);
+
+	return num_lines;
+}
+
+/**
+ * Test that a recognition server on a Unix socket answers each
+ * request of a client, which sends every request before it reads
+ * a response, in order.
+ */
+int test_server()
+{
+	const int NUM_REQUESTS = 200;
+
+	char path[32];
+	synthetic_database(path, 5, 4, 8, 8, 0);
+
+	char address[64];
+	sprintf(address, "unix:/tmp/test-database-%d.sock", getpid());
+
+	pid_t pid;
+	int fd = start_server(path, address, NULL, &pid);
+	char *responses[NUM_REQUESTS + 1];
+	int num_lines = 0;
+
+	if ( fd != -1 ) {
+		num_lines = query_server(fd, NUM_REQUESTS, responses);
+	}
+
+	stop_server(pid, address);
+	remove(path);
+
+	int num_correct = 0;
+	int error_last = 0;
+
+	int i;
+	for ( i = 0; i < num_lines && i < NUM_REQUESTS + 1; i++ ) {
+		int class;
+
+		if ( i < NUM_REQUESTS ) {
+			num_correct += (sscanf(responses[i], "match\tPCA\t%d\t", &class) == 1 && class == i % 5);
+		}
+		else {
+			error_last = (strncmp(responses[i], "error\t", 6) == 0);
+		}
+
+		free(responses[i]);
+	}
+
+	printf("%d responses, %d of %d correct, error last: %d\n", num_lines, num_correct, NUM_REQUESTS, error_last);
+
+	return check("server", num_lines == NUM_REQUESTS + 1 && num_correct == NUM_REQUESTS && error_last);
+}
+
+/**
+ * Test that db_split() splits a database into shards with
+ * disjoint classes of about the same size, and that a coordinator
+ * of the shards answers each request as a server of the whole
+ * database.
+ */
+int test_shards()
+{
+	const int NUM_SHARDS = 2;
+	const int NUM_REQUESTS = 30;
+
+	char path[32];
+	synthetic_database(path, 5, 4, 8, 8, 0);
+
+	database_t *db = db_construct(0, 0);
+	db_split(db, path, NUM_SHARDS);
+	db_destruct(db);
+
+	// check that the classes of the shards are disjoint
+	char path_shard[NUM_SHARDS][48];
+	char address_shard[NUM_SHARDS][64];
+	int shard_of_class[5] = { -1, -1, -1, -1, -1 };
+	int num_images[NUM_SHARDS];
+	int disjoint = 1;
+
+	int i, s;
+	for ( s = 0; s < NUM_SHARDS; s++ ) {
+		sprintf(path_shard[s], "%s.%d", path, s);
+		sprintf(address_shard[s], "unix:/tmp/test-database-%d.%d.sock", getpid(), s);
+
+		database_t *shard = db_construct(0, 0);
+		db_load(shard, path_shard[s]);
+
+		num_images[s] = shard->num_images;
+
+		for ( i = 0; i < shard->num_images; i++ ) {
+			int c = shard->entries[i].class;
+
+			disjoint = disjoint && (shard_of_class[c] == -1 || shard_of_class[c] == s);
+			shard_of_class[c] = s;
+		}
+
+		db_destruct(shard);
+	}
+
+	printf("shards have %d and %d images, disjoint classes: %d\n", num_images[0], num_images[1], disjoint);
+
+	// start a server of the database and a coordinator of the shards
+	char address[64];
+	char address_coord[64];
+	char shards[128];
+	pid_t pid, pid_coord, pid_shard[NUM_SHARDS];
+
+	sprintf(address, "unix:/tmp/test-database-%d.sock", getpid());
+	sprintf(address_coord, "unix:/tmp/test-database-%d.coord.sock", getpid());
+	sprintf(shards, "%s,%s", address_shard[0], address_shard[1]);
+
+	for ( s = 0; s < NUM_SHARDS; s++ ) {
+		close(start_server(path_shard[s], address_shard[s], NULL, &pid_shard[s]));
+	}
+
+	int fd = start_server(path, address, NULL, &pid);
+	int fd_coord = start_server(path, address_coord, shards, &pid_coord);
+
+	char *responses[NUM_REQUESTS + 1];
+	char *responses_coord[NUM_REQUESTS + 1];
+	int num_lines = 0;
+	int num_lines_coord = 0;
+
+	if ( fd != -1 && fd_coord != -1 ) {
+		num_lines = query_server(fd, NUM_REQUESTS, responses);
+		num_lines_coord = query_server(fd_coord, NUM_REQUESTS, responses_coord);
+	}
+
+	stop_server(pid_coord, address_coord);
+	stop_server(pid, address);
+
+	for ( s = 0; s < NUM_SHARDS; s++ ) {
+		stop_server(pid_shard[s], address_shard[s]);
+		remove(path_shard[s]);
+	}
+
+	remove(path);
+
+	// compare the responses
+	int num_equal = 0;
+
+	for ( i = 0; i < num_lines && i < num_lines_coord && i < NUM_REQUESTS + 1; i++ ) {
+		if ( strcmp(responses[i], responses_coord[i]) == 0 ) {
+			num_equal++;
+		}
+		else {
+			printf("server:      %scoordinator: %s", responses[i], responses_coord[i]);
+		}
+	}
+
+	for ( i = 0; i < num_lines && i < NUM_REQUESTS + 1; i++ ) {
+		free(responses[i]);
+	}
+
+	for ( i = 0; i < num_lines_coord && i < NUM_REQUESTS + 1; i++ ) {
+		free(responses_coord[i]);
+	}
+
+	printf("%d of %d responses of the coordinator are equal\n", num_equal, NUM_REQUESTS + 1);
+
+	return check("shards", disjoint
+		&& num_images[0] == 12 && num_images[1] == 8
+		&& num_lines == NUM_REQUESTS + 1 && num_equal == NUM_REQUESTS + 1);
+}
+
+int main (int argc, char **argv)
+{
+	test_func_t tests[] = {
+		test_infomax_threads,
+		test_infomax_components,
+		test_ann_recall,
+		test_quantized_rerank,
+		test_match_options,
+		test_pipeline,
+		test_server,
+		test_shards
+	};
+	int num_tests = sizeof(tests) / sizeof(test_func_t);
+	int num_failed = 0;
+
+	int i;
+	for ( i = 0; i < num_tests; i++ ) {
+		test_func_t test = tests[i];
+
+		printf("TEST %d\n\n", i + 1);
+
+		num_failed += !test();
+		putchar('\n');
+	}
+
+	printf("%d of %d tests passed\n", num_tests - num_failed, num_tests);
+
+	return (num_failed > 0);
+}
@@ -16,6 +16,7 @@ int main(int argc, char **argv)
 
 	const char *FILENAME_IN = argv[1];
 	const char *FILENAME_OUT = "wahaha.ppm";
+	const char *FILENAME_PREP = "wahaha-prep.pgm";
 
 	// map an image to a column vector
 	image_t *image = image_construct();
@@ -28,6 +29,13 @@ int main(int argc, char **argv)
 	m_image_write(x, 0, image);
 	image_write(image, FILENAME_OUT);
 
+	// convert the image to grayscale, resize it to half size
+	// and equalize its histogram
+	image_prep_t prep = { 1, image->width / 2, image->height / 2, 1 };
+
+	image_preprocess(image, &prep);
+	image_write(image, FILENAME_PREP);
+
 	image_destruct(image);
 	m_free(x);
 
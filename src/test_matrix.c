@@ -6,6 +6,7 @@
  * Tests are based on examples in the MATLAB documentation
  * where appropriate.
  */
+#include <math.h>
 #include <stdio.h>
 #include "matrix.h"
 
@@ -131,8 +132,63 @@ void test_m_distance()
 	printf("d_COS(M[0], M[1]) = % 8.4lf\n", m_dist_COS(M, 0, M, 1));
 	printf("d_L1(M[0], M[1])  = % 8.4lf\n", m_dist_L1(M, 0, M, 1));
 	printf("d_L2(M[0], B[1])  = % 8.4lf\n", m_dist_L2(M, 0, M, 1));
+	printf("d_L2(M[0], M[1]) over 1 row = % 8.4lf\n", m_dist_L2_bounded(M, 0, M, 1, 1, INFINITY));
+
+	// the bound is checked after each block of rows, so the
+	// vectors must have more than one block
+	int n = 2 * DIST_BLOCK_SIZE;
+	matrix_t *V = m_zeros(n, 2);
+
+	int i;
+	for ( i = 0; i < n; i++ ) {
+		elem(V, i, 0) = 1;
+	}
+
+	printf("d_L2(V[0], V[1]) over %d rows = % 8.4lf\n", n, m_dist_L2_bounded(V, 0, V, 1, n, INFINITY));
+	printf("d_L2(V[0], V[1]) over %d rows with bound 0.5 = % 8.4lf (expected %d)\n", n, m_dist_L2_bounded(V, 0, V, 1, n, 0.5), DIST_BLOCK_SIZE);
+
+	// compute distance matrices between the columns of A and B
+	precision_t data_A[][3] = {
+		{ 1, 0, 2 },
+		{ 0, 1, 2 },
+		{ 0, 0, 1 }
+	};
+	precision_t data_B[][2] = {
+		{ 1, -1 },
+		{ 1, 0 },
+		{ 0, 3 }
+	};
+
+	matrix_t *A = m_initialize(3, 3);
+	matrix_t *B = m_initialize(3, 2);
+
+	fill_matrix_data(A, data_A);
+	fill_matrix_data(B, data_B);
+
+	matrix_t *A_norm = m_norm_columns(A);
+	matrix_t *B_norm = m_norm_columns(B);
+	matrix_t *D_COS = m_dist_COS_matrix(A, A_norm, B, B_norm);
+	matrix_t *D_L2 = m_dist_L2_matrix(A, A_norm, B, B_norm);
+
+	printf("A = \n");
+	m_fprint(stdout, A);
+	printf("B = \n");
+	m_fprint(stdout, B);
+	printf("norm(A) = \n");
+	m_fprint(stdout, A_norm);
+	printf("d_COS(A, B) = \n");
+	m_fprint(stdout, D_COS);
+	printf("d_L2(A, B) = \n");
+	m_fprint(stdout, D_L2);
 
 	m_free(M);
+	m_free(V);
+	m_free(A);
+	m_free(B);
+	m_free(A_norm);
+	m_free(B_norm);
+	m_free(D_COS);
+	m_free(D_L2);
 }
 
 /**
@@ -169,6 +225,40 @@ void test_m_eigen()
 	m_free(M_evec);
 }
 
+/**
+ * Test eigenvalues, eigenvectors for a symmetric matrix.
+ */
+void test_m_eigen_sym()
+{
+	precision_t data[][4] = {
+		{ 1.0000, 0.5000, 0.3333, 0.2500 },
+		{ 0.5000, 1.0000, 0.6667, 0.5000 },
+		{ 0.3333, 0.6667, 1.0000, 0.7500 },
+		{ 0.2500, 0.5000, 0.7500, 1.0000 }
+	};
+
+	matrix_t *M = m_initialize(4, 4);
+	matrix_t *M_eval = m_initialize(2, 1);
+	matrix_t *M_evec = m_initialize(M->rows, M_eval->rows);
+
+	fill_matrix_data(M, data);
+
+	m_eigen_sym(M, M_eval, M_evec);
+
+	printf("M = \n");
+	m_fprint(stdout, M);
+
+	printf("largest 2 eigenvalues of M = \n");
+	m_fprint(stdout, M_eval);
+
+	printf("eigenvectors of M = \n");
+	m_fprint(stdout, M_evec);
+
+	m_free(M);
+	m_free(M_eval);
+	m_free(M_evec);
+}
+
 // TODO: find more examples, check this example against MATLAB
 /**
  * Test generalized eigenvalues, eigenvectors for two matrices.
@@ -215,6 +305,53 @@ void test_m_eigen2()
 	m_free(J_evec);
 }
 
+/**
+ * Test symmetric-definite generalized eigenvalues, eigenvectors.
+ */
+void test_m_eigen2_sym()
+{
+	precision_t data_A[][3] = {
+		{ 2, 1, 0 },
+		{ 1, 2, 1 },
+		{ 0, 1, 2 }
+	};
+
+	precision_t data_B[][3] = {
+		{ 1.0, 0.1, 0.1 },
+		{ 0.1, 2.0, 0.1 },
+		{ 0.1, 0.1, 3.0 }
+	};
+
+	matrix_t *A = m_initialize(3, 3);
+	matrix_t *B = m_initialize(3, 3);
+	matrix_t *J_eval = m_initialize(2, 1);
+	matrix_t *J_evec = m_initialize(A->rows, 2);
+
+	fill_matrix_data(A, data_A);
+	fill_matrix_data(B, data_B);
+
+	int info = m_eigen2_sym(A, B, J_eval, J_evec);
+
+	printf("A = \n");
+	m_fprint(stdout, A);
+
+	printf("B = \n");
+	m_fprint(stdout, B);
+
+	printf("info = %d\n", info);
+
+	printf("largest 2 eigenvalues of (A, B) = \n");
+	m_fprint(stdout, J_eval);
+
+	printf("eigenvectors of (A, B) = \n");
+	m_fprint(stdout, J_evec);
+
+	m_free(A);
+	m_free(B);
+	m_free(J_eval);
+	m_free(J_evec);
+}
+
 /**
  * Test matrix inverse.
  */
@@ -345,6 +482,124 @@ void test_m_product()
 	m_free(C);
 }
 
+/**
+ * Test matrix product with transposed operands.
+ */
+void test_m_product_into()
+{
+	precision_t data_A[][3] = {
+		{ 1, 3, 5 },
+		{ 2, 4, 7 }
+	};
+	precision_t data_B[][3] = {
+		{ -5, 8, 11 },
+		{  3, 9, 21 }
+	};
+
+	matrix_t *A = m_initialize(2, 3);
+	matrix_t *B = m_initialize(2, 3);
+
+	fill_matrix_data(A, data_A);
+	fill_matrix_data(B, data_B);
+
+	printf("A = \n");
+	m_fprint(stdout, A);
+	printf("B = \n");
+	m_fprint(stdout, B);
+
+	// C := A' * B
+	matrix_t *C = m_zeros(3, 3);
+	m_product_into(C, A, 1, B, 0, 1, 0);
+
+	printf("A' * B = \n");
+	m_fprint(stdout, C);
+	m_free(C);
+
+	// C := 2 * A * B' + C, C = I
+	C = m_identity(2);
+	m_product_into(C, A, 0, B, 1, 2, 1);
+
+	printf("2 * A * B' + I = \n");
+	m_fprint(stdout, C);
+	m_free(C);
+
+	m_free(A);
+	m_free(B);
+}
+
+/**
+ * Test matrix product of a range of rows.
+ */
+void test_m_product_rows()
+{
+	precision_t data_A[][3] = {
+		{ 1, 3, 5 },
+		{ 2, 4, 7 },
+		{ 0, 1, 2 }
+	};
+	precision_t data_B[][2] = {
+		{ -5, 8 },
+		{  3, 9 },
+		{  1, 2 }
+	};
+
+	matrix_t *A = m_initialize(3, 3);
+	matrix_t *B = m_initialize(3, 2);
+
+	fill_matrix_data(A, data_A);
+	fill_matrix_data(B, data_B);
+
+	printf("A = \n");
+	m_fprint(stdout, A);
+	printf("B = \n");
+	m_fprint(stdout, B);
+
+	matrix_t *C = m_product_rows(A, 1, 3, B);
+
+	printf("A(1:3, :) * B = \n");
+	m_fprint(stdout, C);
+
+	m_free(A);
+	m_free(B);
+	m_free(C);
+}
+
+/**
+ * Test symmetric rank-k update.
+ */
+void test_m_syrk_into()
+{
+	precision_t data_A[][3] = {
+		{ 1, 3, 5 },
+		{ 2, 4, 7 }
+	};
+
+	matrix_t *A = m_initialize(2, 3);
+
+	fill_matrix_data(A, data_A);
+
+	printf("A = \n");
+	m_fprint(stdout, A);
+
+	// C := A * A'
+	matrix_t *C = m_zeros(2, 2);
+	m_syrk_into(C, A, 0, 1, 0);
+
+	printf("A * A' = \n");
+	m_fprint(stdout, C);
+	m_free(C);
+
+	// C := A' * A + I
+	C = m_identity(3);
+	m_syrk_into(C, A, 1, 1, 1);
+
+	printf("A' * A + I = \n");
+	m_fprint(stdout, C);
+	m_free(C);
+
+	m_free(A);
+}
+
 /**
  * Test matrix square root.
  */
@@ -401,6 +656,65 @@ void test_m_transpose()
 
 	m_free(A);
 	m_free(B);
+
+	// transpose a non-square matrix in place
+	precision_t data_C[][3] = {
+		{ 1, 2, 3 },
+		{ 4, 5, 6 }
+	};
+
+	matrix_t *C = m_initialize(2, 3);
+	fill_matrix_data(C, data_C);
+
+	printf("C = \n");
+	m_fprint(stdout, C);
+
+	m_transpose_in_place(C);
+
+	printf("C := C' = \n");
+	m_fprint(stdout, C);
+
+	m_free(C);
+}
+
+/**
+ * Test column views and transpose into an arena matrix.
+ */
+void test_m_view_columns()
+{
+	precision_t data[][4] = {
+		{ 16,  2,  3, 13 },
+		{  5, 11, 10,  8 },
+		{  9,  7,  6, 12 }
+	};
+
+	matrix_t *A = m_initialize(3, 4);
+	fill_matrix_data(A, data);
+
+	printf("A = \n");
+	m_fprint(stdout, A);
+
+	matrix_t A_view = m_view_columns(A, 1, 3);
+
+	printf("A(:, 2:3) = \n");
+	m_fprint(stdout, &A_view);
+
+	m_arena_t *arena = m_arena_create(64);
+	matrix_t *B = m_arena_initialize(arena, 2, 3);
+	matrix_t *C = m_arena_zeros(arena, 2, 2);
+
+	m_transpose_into(B, &A_view);
+
+	printf("B = A(:, 2:3)' = \n");
+	m_fprint(stdout, B);
+
+	m_product_into(C, B, 0, &A_view, 0, 1, 0);
+
+	printf("B * A(:, 2:3) = \n");
+	m_fprint(stdout, C);
+
+	m_arena_free(arena);
+	m_free(A);
 }
 
 /**
@@ -499,6 +813,39 @@ void test_m_elem_mult()
 	m_free(A);
 }
 
+/**
+ * Test matrix orthonormalization.
+ */
+void test_m_orthonormalize()
+{
+	precision_t data[][2] = {
+		{ 1, 2 },
+		{ 3, 4 },
+		{ 5, 7 }
+	};
+
+	matrix_t *A = m_initialize(3, 2);
+	fill_matrix_data(A, data);
+
+	printf("A = \n");
+	m_fprint(stdout, A);
+
+	m_orthonormalize(A);
+
+	printf("m_orthonormalize (A) = \n");
+	m_fprint(stdout, A);
+
+	matrix_t *A_tr = m_transpose(A);
+	matrix_t *I = m_product(A_tr, A);
+
+	printf("A' * A = \n");
+	m_fprint(stdout, I);
+
+	m_free(A);
+	m_free(A_tr);
+	m_free(I);
+}
+
 /**
  * Test matrix column shuffling.
  */
@@ -515,7 +862,9 @@ void test_m_shuffle_columns()
 	printf("A = \n");
 	m_fprint(stdout, A);
 
-	m_shuffle_columns(A);
+	unsigned int seed = 1;
+
+	m_shuffle_columns(A, &seed);
 
 	printf("m_shuffle_columns (A) = \n");
 	m_fprint(stdout, A);
@@ -560,15 +909,22 @@ int main (int argc, char **argv)
 		test_m_covariance,
 		test_m_distance,
 		test_m_eigen,
+		test_m_eigen_sym,
 		test_m_eigen2,
+		test_m_eigen2_sym,
 		test_m_inverse,
 		test_m_mean_column,
 		test_m_product,
+		test_m_product_into,
+		test_m_product_rows,
+		test_m_syrk_into,
 		test_m_sqrtm,
 		test_m_transpose,
+		test_m_view_columns,
 		test_m_add,
 		test_m_subtract,
 		test_m_elem_mult,
+		test_m_orthonormalize,
 		test_m_shuffle_columns,
 		test_m_subtract_columns
 	};
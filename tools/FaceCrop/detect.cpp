@@ -2,150 +2,338 @@
 #include "opencv2/highgui/highgui.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
 
-#include <iostream>
+#include <dirent.h>
+#include <getopt.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
 
 using namespace std;
 using namespace cv;
 
-// Function Headers
-void detectAndDisplay(Mat frame);
-
-// Global variables
 // Copy this file from opencv/data/haarscascades to target folder
-string face_cascade_name = "./haarcascade_frontalface_alt.xml";
-CascadeClassifier face_cascade;
-string window_name = "Capture - Face detection";
-int filenumber; // Number of file to be saved
-string filename;
-
-// Function main
-int main(void)
+static const string DEFAULT_CASCADE = "./haarcascade_frontalface_alt.xml";
+
+struct Options
 {
-    // Load the cascade
-    if (!face_cascade.load(face_cascade_name)){
-        printf("--(!)Error loading\n");
-        return (-1);
+    string cascade_path = DEFAULT_CASCADE;
+    string input;
+    string output;
+    int width = 92;
+    int height = 112;
+    int threads = 1;
+    int min_size = 120;
+    bool all_faces = false;
+};
+
+// Image of the input tree, which is cropped to output/class/index.pgm
+struct Task
+{
+    string path;
+    string output_dir;
+    int index;
+};
+
+// Detect the faces in a grayscale image
+static void detectFaces(CascadeClassifier &cascade, const Mat &gray, int min_size, vector<Rect> &faces)
+{
+    Mat equalized;
+
+    equalizeHist(gray, equalized);
+    cascade.detectMultiScale(equalized, faces, 1.1, 2, 0 | CASCADE_SCALE_IMAGE, Size(min_size, min_size));
+}
+
+// Get the index of the largest face
+static size_t largestFace(const vector<Rect> &faces)
+{
+    size_t ib = 0;
+
+    for (size_t ic = 1; ic < faces.size(); ic++) {
+        if (faces[ic].area() > faces[ib].area())
+            ib = ic;
     }
 
-    // Read the image file
-    Mat frame = imread("./media/people.jpg");
+    return ib;
+}
+
+static bool isDirectory(const string &path)
+{
+    struct stat st;
+
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Get the sorted names of the entries of a directory
+static vector<string> listDirectory(const string &path)
+{
+    vector<string> names;
+    DIR *dir = opendir(path.c_str());
 
-    // Apply the classifier to the frame
-    if (!frame.empty()){
-        detectAndDisplay(frame);
+    if (dir == NULL) {
+        perror(path.c_str());
+        exit(1);
     }
-    else{
-        printf(" --(!) No captured frame -- Break!");
-        return 1;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            names.push_back(entry->d_name);
     }
 
-    int c = waitKey(0);
+    closedir(dir);
+    sort(names.begin(), names.end());
 
-    if (27 == char(c)){
-        return 0;
+    return names;
+}
+
+// Find the images of each class directory of the input tree, and
+// create the class directories of the output tree. The i-th image of
+// a class, in sorted order, is cropped to i.pgm, so that the output
+// is the same with any number of threads.
+static vector<Task> findTasks(const Options &options)
+{
+    vector<Task> tasks;
+
+    if (mkdir(options.output.c_str(), 0755) != 0 && !isDirectory(options.output)) {
+        perror(options.output.c_str());
+        exit(1);
     }
 
-    return 0;
+    vector<string> classes = listDirectory(options.input);
+
+    for (size_t i = 0; i < classes.size(); i++) {
+        string class_dir = options.input + "/" + classes[i];
+        string output_dir = options.output + "/" + classes[i];
+
+        if (!isDirectory(class_dir))
+            continue;
+
+        if (mkdir(output_dir.c_str(), 0755) != 0 && !isDirectory(output_dir)) {
+            perror(output_dir.c_str());
+            exit(1);
+        }
+
+        vector<string> images = listDirectory(class_dir);
+
+        for (size_t j = 0; j < images.size(); j++)
+            tasks.push_back(Task{ class_dir + "/" + images[j], output_dir, (int)j + 1 });
+    }
+
+    return tasks;
 }
 
-// Function detectAndDisplay
-void detectAndDisplay(Mat frame)
+struct Stats
 {
-    std::vector<Rect> faces;
-    Mat frame_gray;
-    Mat crop;
-    Mat res;
+    atomic<long> images{0};
+    atomic<long> unreadable{0};
+    atomic<long> no_face{0};
+    atomic<long> crops{0};
+};
+
+// Crop the images of the tasks; each worker takes the next task
+// and has its own classifier, since CascadeClassifier is not
+// thread-safe
+static void cropWorker(const Options &options, const vector<Task> &tasks, atomic<size_t> &next, Stats &stats)
+{
+    CascadeClassifier cascade;
+
+    if (!cascade.load(options.cascade_path)) {
+        fprintf(stderr, "error: cannot load cascade \'%s\'\n", options.cascade_path.c_str());
+        exit(1);
+    }
+
+    vector<Rect> faces;
     Mat gray;
-    string text;
-    stringstream sstm;
+    Mat crop;
+    Size size(options.width, options.height);
 
-    cvtColor(frame, frame_gray, COLOR_BGR2GRAY);
-    equalizeHist(frame_gray, frame_gray);
+    for (size_t i = next++; i < tasks.size(); i = next++) {
+        const Task &task = tasks[i];
+        Mat frame = imread(task.path, IMREAD_COLOR);
 
-    // Detect faces
-    face_cascade.detectMultiScale(frame_gray, faces, 1.1, 2, 0 | CASCADE_SCALE_IMAGE, Size(120, 120));
+        stats.images++;
 
-    // Set Region of Interest
-    cv::Rect roi_b;
-    cv::Rect roi_c;
+        if (frame.empty()) {
+            stats.unreadable++;
+            continue;
+        }
 
-    size_t ic = 0; // ic is index of current element
-    int ac = 0; // ac is area of current element
+        cvtColor(frame, gray, COLOR_BGR2GRAY);
+        detectFaces(cascade, gray, options.min_size, faces);
 
-    size_t ib = 0; // ib is index of biggest element
-    int ab = 0; // ab is area of biggest element
+        if (faces.empty()) {
+            stats.no_face++;
+            continue;
+        }
 
-    for (ic = 0; ic < faces.size(); ic++) // Iterate through all current elements (detected faces)
+        size_t begin = options.all_faces ? 0 : largestFace(faces);
+        size_t end = options.all_faces ? faces.size() : begin + 1;
 
-    {
-        roi_c.x = faces[ic].x;
-        roi_c.y = faces[ic].y;
-        roi_c.width = (faces[ic].width);
-        roi_c.height = (faces[ic].height);
+        for (size_t ic = begin; ic < end; ic++) {
+            resize(gray(faces[ic]), crop, size, 0, 0, INTER_AREA);
 
-        ac = roi_c.width * roi_c.height; // Get the area of current element (detected face)
+            stringstream ssfn;
+            ssfn << task.output_dir << "/" << task.index;
+            if (options.all_faces && ic > 0)
+                ssfn << "_" << ic;
+            ssfn << ".pgm";
 
-        roi_b.x = faces[ib].x;
-        roi_b.y = faces[ib].y;
-        roi_b.width = (faces[ib].width);
-        roi_b.height = (faces[ib].height);
+            if (!imwrite(ssfn.str(), crop)) {
+                fprintf(stderr, "error: cannot write \'%s\'\n", ssfn.str().c_str());
+                exit(1);
+            }
 
-        ab = roi_b.width * roi_b.height; // Get the area of biggest element, at beginning it is same as "current" element
+            stats.crops++;
+        }
 
-        if (ac > ab)
-        {
-            ib = ic;
-            roi_b.x = faces[ib].x;
-            roi_b.y = faces[ib].y;
-            roi_b.width = (faces[ib].width);
-            roi_b.height = (faces[ib].height);
+        if ((i + 1) % 1000 == 0) {
+            fprintf(stderr, "%zu / %zu images\n", i + 1, tasks.size());
         }
+    }
+}
 
-        crop = frame(roi_c);
-        resize(crop, res, Size(256, 256), 0, 0, INTER_LINEAR); // This will be needed later while saving images
-        cvtColor(crop, gray, CV_BGR2GRAY); // Convert cropped image to Grayscale
+// Crop every image of the input tree with a pool of workers
+static int cropTree(const Options &options)
+{
+    vector<Task> tasks = findTasks(options);
+    atomic<size_t> next(0);
+    Stats stats;
+    vector<thread> workers;
 
-        // Form a filename
-        filename = "";
-        stringstream ssfn;
-        ssfn << filenumber << ".png";
-        filename = ssfn.str();
-        filenumber++;
+    auto start = chrono::steady_clock::now();
 
-        imwrite(filename, gray);
+    for (int i = 0; i < options.threads; i++)
+        workers.emplace_back(cropWorker, cref(options), cref(tasks), ref(next), ref(stats));
 
-        Point pt1(faces[ic].x, faces[ic].y); // Display detected faces on main window - live stream from camera
-        Point pt2((faces[ic].x + faces[ic].height), (faces[ic].y + faces[ic].width));
-        rectangle(frame, pt1, pt2, Scalar(0, 255, 0), 2, 8, 0);
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
 
-        // Show image
-        sstm << "Crop area size: " << roi_b.width << "x" << roi_b.height << " Filename: " << filename;
-        text = sstm.str();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
 
-        putText(frame, text, cvPoint(30, 30), FONT_HERSHEY_COMPLEX_SMALL, 0.8, cvScalar(0, 0, 255), 1, CV_AA);
-        imshow("original", frame);
+    fprintf(stderr, "%ld images, %ld crops, %ld without a face, %ld unreadable in %.3f s: %.1f images/s with %d threads\n",
+        stats.images.load(), stats.crops.load(), stats.no_face.load(), stats.unreadable.load(),
+        seconds, stats.images / seconds, options.threads);
 
-        if (!crop.empty())
-        {
-            imshow("detected", crop);
-            waitKey(1000);
-        }
-        else
-            destroyWindow("detected");
+    return 0;
+}
+
+// Show the faces of a single image, as the first version of FaceCrop did
+static int showImage(const Options &options, const string &path)
+{
+    CascadeClassifier cascade;
+
+    if (!cascade.load(options.cascade_path)) {
+        printf("--(!)Error loading\n");
+        return -1;
+    }
+
+    Mat frame = imread(path);
+
+    if (frame.empty()) {
+        printf(" --(!) No captured frame -- Break!");
+        return 1;
     }
 
-    // Show image
-    sstm << "Crop area size: " << roi_b.width << "x" << roi_b.height << " Filename: " << filename;
-    text = sstm.str();
+    Mat gray;
+    vector<Rect> faces;
+
+    cvtColor(frame, gray, COLOR_BGR2GRAY);
+    detectFaces(cascade, gray, options.min_size, faces);
+
+    for (size_t ic = 0; ic < faces.size(); ic++)
+        rectangle(frame, faces[ic], Scalar(0, 255, 0), 2, 8, 0);
+
+    if (!faces.empty()) {
+        Rect roi_b = faces[largestFace(faces)];
+        stringstream sstm;
+
+        sstm << faces.size() << " faces, largest " << roi_b.width << "x" << roi_b.height;
+        putText(frame, sstm.str(), Point(30, 30), FONT_HERSHEY_COMPLEX_SMALL, 0.8, Scalar(0, 0, 255), 1, LINE_AA);
+        imshow("detected", frame(roi_b));
+    }
 
-    putText(frame, text, cvPoint(30, 30), FONT_HERSHEY_COMPLEX_SMALL, 0.8, cvScalar(0, 0, 255), 1, CV_AA);
     imshow("original", frame);
+    waitKey(0);
+
+    return 0;
+}
+
+static void printUsage()
+{
+    fprintf(stderr,
+        "Usage: ./detect [options] [IMAGE]\n"
+        "Show the faces in IMAGE (default ./media/people.jpg), or with --input\n"
+        "and --output, crop the faces of a tree of class directories.\n"
+        "Options:\n"
+        "  --input DIRECTORY   crop the images of each class directory of DIRECTORY\n"
+        "  --output DIRECTORY  write the crops to DIRECTORY/CLASS/N.pgm\n"
+        "  --size WxH          size of the crops (default 92x112)\n"
+        "  --threads N         crop with N threads\n"
+        "  --cascade FILE      detect faces with the cascade FILE\n"
+        "  --min-size N        detect faces of at least N x N pixels (default 120)\n"
+        "  --all-faces         crop every face instead of the largest face of each image\n"
+    );
+}
 
-    if (!crop.empty())
-    {
-        imshow("detected", crop);
+int main(int argc, char **argv)
+{
+    Options options;
+
+    struct option long_options[] = {
+        { "input", required_argument, 0, 'i' },
+        { "output", required_argument, 0, 'o' },
+        { "size", required_argument, 0, 's' },
+        { "threads", required_argument, 0, 't' },
+        { "cascade", required_argument, 0, 'c' },
+        { "min-size", required_argument, 0, 'm' },
+        { "all-faces", no_argument, 0, 'a' },
+        { 0, 0, 0, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long_only(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'i': options.input = optarg; break;
+        case 'o': options.output = optarg; break;
+        case 's':
+            if (sscanf(optarg, "%dx%d", &options.width, &options.height) != 2) {
+                fprintf(stderr, "error: invalid size \'%s\'\n", optarg);
+                return 1;
+            }
+            break;
+        case 't': options.threads = atoi(optarg); break;
+        case 'c': options.cascade_path = optarg; break;
+        case 'm': options.min_size = atoi(optarg); break;
+        case 'a': options.all_faces = true; break;
+        default:
+            printUsage();
+            return 1;
+        }
+    }
+
+    if (options.width < 1 || options.height < 1 || options.threads < 1) {
+        fprintf(stderr, "error: size and number of threads must be positive\n");
+        return 1;
     }
-    else
-        destroyWindow("detected");
+
+    if (!options.input.empty() || !options.output.empty()) {
+        if (options.input.empty() || options.output.empty()) {
+            fprintf(stderr, "error: --input and --output must be used together\n");
+            return 1;
+        }
+
+        return cropTree(options);
+    }
+
+    return showImage(options, (optind < argc) ? argv[optind] : "./media/people.jpg");
 }
@@ -0,0 +1,347 @@
+// Streaming face recognition: frames from a video file or a camera
+// are detected, cropped and recognized without writing any images
+// to disk. Each stage runs on its own threads, with bounded queues
+// between the stages:
+//
+//   capture -> frame queue -> detectors -> recognition pipeline -> output
+//
+// Each crop is converted to the geometry of the training images of
+// the database and resized directly into the pixel buffer of an
+// image_t, which is submitted to the recognition pipeline of the
+// face recognition system (src/pipeline.h).
+#include "opencv2/objdetect/objdetect.hpp"
+#include "opencv2/highgui/highgui.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/videoio/videoio.hpp"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pipeline.h"
+
+using namespace std;
+using namespace cv;
+
+// Bounded queue between two stages
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity), closed(false) {}
+
+    // Add an item, waiting while the queue is full
+    void push(T item)
+    {
+        unique_lock<mutex> guard(lock);
+        not_full.wait(guard, [this] { return items.size() < capacity; });
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+    }
+
+    // Add an item unless the queue is full
+    bool try_push(T item)
+    {
+        lock_guard<mutex> guard(lock);
+        if (items.size() >= capacity)
+            return false;
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    // Remove an item, waiting while the queue is empty; returns
+    // false when the queue is closed and empty
+    bool pop(T &item)
+    {
+        unique_lock<mutex> guard(lock);
+        not_empty.wait(guard, [this] { return !items.empty() || closed; });
+        if (items.empty())
+            return false;
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        lock_guard<mutex> guard(lock);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    bool closed;
+    deque<T> items;
+    mutex lock;
+    condition_variable not_empty;
+    condition_variable not_full;
+};
+
+struct Frame
+{
+    long index;
+    Mat image;
+};
+
+// Location of a crop, passed through the recognition pipeline as its tag
+struct Crop
+{
+    long frame;
+    Rect rect;
+};
+
+struct Options
+{
+    string db_path = "./db_training.dat";
+    string cascade_path = "./haarcascade_frontalface_alt.xml";
+    string video;
+    int camera = 0;
+    int lda = 0;
+    int ica = 0;
+    int detectors = 1;
+    int workers = 1;
+    int queue_size = 16;
+    int batch_size = 1;
+    int min_size = 80;
+};
+
+struct Stats
+{
+    mutex lock;
+    long frames = 0;
+    long dropped = 0;
+    long faces = 0;
+};
+
+static mutex output_lock;
+
+// Print the result of a crop; called by the workers of the pipeline
+static void print_result(void *arg, void *tag, const pipeline_result_t *result)
+{
+    Crop *crop = (Crop *)tag;
+
+    {
+        lock_guard<mutex> guard(output_lock);
+
+        printf("frame %ld\t%d %d %d %d", crop->frame, crop->rect.x, crop->rect.y, crop->rect.width, crop->rect.height);
+        for (int i = 0; i < result->num_algorithms; i++)
+            printf("\t%s\t%d\t%s", result->labels[i], result->classes[i], result->names[i]);
+        printf("\n");
+        fflush(stdout);
+    }
+
+    delete crop;
+}
+
+// Convert a crop to the geometry of the database, writing the
+// pixels directly into a new image_t
+static image_t * make_image(const Mat &frame, const Mat &gray, const Rect &rect, int width, int height, int channels)
+{
+    image_t *image = image_construct();
+    image->width = width;
+    image->height = height;
+    image->channels = channels;
+    image->max_value = 255;
+    image->pixels = (unsigned char *)malloc((size_t)width * height * channels);
+
+    Mat dst(height, width, (channels == 3) ? CV_8UC3 : CV_8UC1, image->pixels);
+
+    if (channels == 3) {
+        Mat rgb;
+        cvtColor(frame(rect), rgb, COLOR_BGR2RGB);
+        resize(rgb, dst, dst.size(), 0, 0, INTER_AREA);
+    }
+    else {
+        resize(gray(rect), dst, dst.size(), 0, 0, INTER_AREA);
+    }
+
+    return image;
+}
+
+// Detect the faces of each frame and submit them to the pipeline
+static void detect_faces(const Options &options, BoundedQueue<Frame> &frames, pipeline_t *pipeline, Stats &stats)
+{
+    // CascadeClassifier is not thread-safe, so each detector has its own
+    CascadeClassifier cascade;
+
+    if (!cascade.load(options.cascade_path)) {
+        fprintf(stderr, "error: cannot load cascade \'%s\'\n", options.cascade_path.c_str());
+        exit(1);
+    }
+
+    int width, height, channels;
+    pipeline_geometry(pipeline, &width, &height, &channels);
+
+    Frame frame;
+    Mat gray;
+    Mat equalized;
+    vector<Rect> faces;
+
+    while (frames.pop(frame)) {
+        if (frame.image.channels() == 1)
+            gray = frame.image;
+        else
+            cvtColor(frame.image, gray, COLOR_BGR2GRAY);
+
+        equalizeHist(gray, equalized);
+
+        cascade.detectMultiScale(equalized, faces, 1.1, 2, 0 | CASCADE_SCALE_IMAGE, Size(options.min_size, options.min_size));
+
+        for (size_t i = 0; i < faces.size(); i++) {
+            image_t *image = make_image(frame.image, gray, faces[i], width, height, channels);
+
+            Crop *crop = new Crop{ frame.index, faces[i] };
+
+            // a crop which does not fit the database is skipped, not fatal
+            if (pipeline_submit(pipeline, image, crop) != 0) {
+                fprintf(stderr, "warning: skipping a face of frame %ld which does not match the database\n", frame.index);
+                image_destruct(image);
+                delete crop;
+            }
+        }
+
+        lock_guard<mutex> guard(stats.lock);
+        stats.faces += faces.size();
+    }
+}
+
+static void print_usage()
+{
+    fprintf(stderr,
+        "Usage: ./stream [options]\n"
+        "Options:\n"
+        "  --video FILE         read frames from a video file\n"
+        "  --camera N           read frames from camera N (default 0)\n"
+        "  --db FILE            recognize with the database FILE (default ./db_training.dat)\n"
+        "  --cascade FILE       detect faces with the cascade FILE\n"
+        "  --lda                run PCA, LDA\n"
+        "  --ica                run PCA, ICA (ICA1 or ICA2, as trained)\n"
+        "  --all                run PCA, LDA, ICA\n"
+        "  --detectors N        detect faces with N threads\n"
+        "  --workers N          recognize faces with N threads\n"
+        "  --queue-size N       queue at most N frames and N faces between stages\n"
+        "  --batch N            recognize faces in blocks of N\n"
+        "  --min-size N         detect faces of at least N x N pixels (default 80)\n"
+    );
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+
+    struct option long_options[] = {
+        { "video", required_argument, 0, 'v' },
+        { "camera", required_argument, 0, 'c' },
+        { "db", required_argument, 0, 'd' },
+        { "cascade", required_argument, 0, 'C' },
+        { "lda", no_argument, 0, 'l' },
+        { "ica", no_argument, 0, 'i' },
+        { "all", no_argument, 0, 'a' },
+        { "detectors", required_argument, 0, 'D' },
+        { "workers", required_argument, 0, 'w' },
+        { "queue-size", required_argument, 0, 'Q' },
+        { "batch", required_argument, 0, 'b' },
+        { "min-size", required_argument, 0, 'm' },
+        { 0, 0, 0, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long_only(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'v': options.video = optarg; break;
+        case 'c': options.camera = atoi(optarg); break;
+        case 'd': options.db_path = optarg; break;
+        case 'C': options.cascade_path = optarg; break;
+        case 'l': options.lda = 1; break;
+        case 'i': options.ica = 1; break;
+        case 'a': options.lda = 1; options.ica = 1; break;
+        case 'D': options.detectors = atoi(optarg); break;
+        case 'w': options.workers = atoi(optarg); break;
+        case 'Q': options.queue_size = atoi(optarg); break;
+        case 'b': options.batch_size = atoi(optarg); break;
+        case 'm': options.min_size = atoi(optarg); break;
+        default:
+            print_usage();
+            return 1;
+        }
+    }
+
+    if (options.detectors < 1 || options.workers < 1 || options.queue_size < 1 || options.batch_size < 1) {
+        fprintf(stderr, "error: numbers of threads, queue size and batch size must be positive\n");
+        return 1;
+    }
+
+    // open the video
+    bool live = options.video.empty();
+    VideoCapture capture;
+
+    if (live)
+        capture.open(options.camera);
+    else
+        capture.open(options.video);
+
+    if (!capture.isOpened()) {
+        fprintf(stderr, "error: cannot open %s\n", live ? "camera" : options.video.c_str());
+        return 1;
+    }
+
+    // start the recognition pipeline and the detectors
+    pipeline_t *pipeline = pipeline_open(options.db_path.c_str(), options.lda, options.ica,
+        options.workers, options.queue_size, options.batch_size, print_result, NULL);
+
+    BoundedQueue<Frame> frames(options.queue_size);
+    Stats stats;
+    vector<thread> detectors;
+
+    for (int i = 0; i < options.detectors; i++)
+        detectors.emplace_back(detect_faces, cref(options), ref(frames), pipeline, ref(stats));
+
+    // capture frames until the end of the video; frames from a camera
+    // are dropped while the detectors are busy, so that the output
+    // stays current
+    auto start = chrono::steady_clock::now();
+
+    for (long index = 0; ; index++) {
+        Frame frame;
+        frame.index = index;
+
+        if (!capture.read(frame.image) || frame.image.empty())
+            break;
+
+        stats.frames++;
+
+        if (live) {
+            if (!frames.try_push(std::move(frame)))
+                stats.dropped++;
+        }
+        else {
+            frames.push(std::move(frame));
+        }
+    }
+
+    frames.close();
+
+    for (size_t i = 0; i < detectors.size(); i++)
+        detectors[i].join();
+
+    pipeline_close(pipeline);
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    fprintf(stderr, "%ld frames (%ld dropped), %ld faces in %.3f s: %.1f frames/s, %.1f faces/s\n",
+        stats.frames, stats.dropped, stats.faces, seconds,
+        stats.frames / seconds, stats.faces / seconds);
+
+    return 0;
+}